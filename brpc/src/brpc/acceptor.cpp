@@ -17,10 +17,12 @@
 
 
 #include <inttypes.h>
+#include <algorithm>
 #include <gflags/gflags.h>
 #include "butil/fd_guard.h"                 // fd_guard 
 #include "butil/fd_utility.h"               // make_close_on_exec
 #include "butil/time.h"                     // gettimeofday_us
+#include "butil/memory/scope_guard.h"       // MakeScopeGuard
 #include "brpc/rdma/rdma_endpoint.h"
 #include "brpc/acceptor.h"
 
@@ -36,11 +38,12 @@ Acceptor::Acceptor(bthread_keytable_pool_t* pool)
     , _idle_timeout_sec(-1)
     , _close_idle_tid(INVALID_BTHREAD)
     , _listened_fd(-1)
-    , _acception_id(0)
+    , _nacception(0)
     , _empty_cond(&_map_mutex)
     , _force_ssl(false)
     , _ssl_ctx(NULL) 
     , _use_rdma(false)
+    , _zerocopy_threshold(-1)
     , _bthread_tag(BTHREAD_TAG_DEFAULT) {
 }
 
@@ -52,10 +55,33 @@ Acceptor::~Acceptor() {
 int Acceptor::StartAccept(int listened_fd, int idle_timeout_sec,
                           const std::shared_ptr<SocketSSLContext>& ssl_ctx,
                           bool force_ssl) {
-    if (listened_fd < 0) {
-        LOG(FATAL) << "Invalid listened_fd=" << listened_fd;
+    return StartAccept(std::vector<int>(1, listened_fd), idle_timeout_sec,
+                       ssl_ctx, force_ssl);
+}
+
+int Acceptor::StartAccept(const std::vector<int>& listened_fds,
+                          int idle_timeout_sec,
+                          const std::shared_ptr<SocketSSLContext>& ssl_ctx,
+                          bool force_ssl) {
+    // Close the fds whose ownership are not transferred to Sockets yet.
+    size_t ntransferred = 0;
+    auto close_fds_guard = butil::MakeScopeGuard([&listened_fds, &ntransferred] {
+        for (size_t i = ntransferred; i < listened_fds.size(); ++i) {
+            if (listened_fds[i] >= 0) {
+                close(listened_fds[i]);
+            }
+        }
+    });
+    if (listened_fds.empty()) {
+        LOG(FATAL) << "No listened_fd";
         return -1;
     }
+    for (size_t i = 0; i < listened_fds.size(); ++i) {
+        if (listened_fds[i] < 0) {
+            LOG(FATAL) << "Invalid listened_fd=" << listened_fds[i];
+            return -1;
+        }
+    }
 
     if (!ssl_ctx && force_ssl) {
         LOG(ERROR) << "Fail to force SSL for all connections "
@@ -87,20 +113,43 @@ int Acceptor::StartAccept(int listened_fd, int idle_timeout_sec,
     _force_ssl = force_ssl;
     _ssl_ctx = ssl_ctx;
     
-    // Creation of _acception_id is inside lock so that OnNewConnections
+    // Creation of _acception_ids is inside lock so that OnNewConnections
     // (which may run immediately) should see sane fields set below.
-    SocketOptions options;
-    options.fd = listened_fd;
-    options.user = this;
-    options.bthread_tag = _bthread_tag;
-    options.on_edge_triggered_events = OnNewConnections;
-    if (Socket::Create(options, &_acception_id) != 0) {
-        // Close-idle-socket thread will be stopped inside destructor
-        LOG(FATAL) << "Fail to create _acception_id";
+    _acception_ids.clear();
+    _nacception = 0;
+    for (; ntransferred < listened_fds.size(); ++ntransferred) {
+        SocketOptions options;
+        options.fd = listened_fds[ntransferred];
+        options.user = this;
+        options.bthread_tag = _bthread_tag;
+        options.on_edge_triggered_events = OnNewConnections;
+        if (listened_fds.size() > 1) {
+            options.event_dispatcher_index = ntransferred;
+        }
+        SocketId acception_id;
+        if (Socket::Create(options, &acception_id) != 0) {
+            // Close-idle-socket thread will be stopped inside destructor
+            LOG(FATAL) << "Fail to create acception of fd="
+                       << listened_fds[ntransferred];
+            break;
+        }
+        _acception_ids.push_back(acception_id);
+        ++_nacception;
+    }
+
+    _listened_fd = listened_fds[0];
+    if (ntransferred != listened_fds.size()) {
+        // Stop created acceptions, which will be recycled before Join()
+        // returns.
+        _status = STOPPING;
+        for (size_t i = 0; i < _acception_ids.size(); ++i) {
+            Socket::SetFailed(_acception_ids[i]);
+        }
+        if (_acception_ids.empty()) {
+            _listened_fd = -1;
+        }
         return -1;
     }
-    
-    _listened_fd = listened_fd;
     _status = RUNNING;
     return 0;
 }
@@ -135,8 +184,10 @@ void Acceptor::StopAccept(int /*closewait_ms*/) {
         _status = STOPPING;
     }
 
-    // Don't set _acception_id to 0 because BeforeRecycle needs it.
-    Socket::SetFailed(_acception_id);
+    // Don't clear _acception_ids because BeforeRecycle needs it.
+    for (size_t i = 0; i < _acception_ids.size(); ++i) {
+        Socket::SetFailed(_acception_ids[i]);
+    }
 
     // SetFailed all existing connections. Connections added after this piece
     // of code will be SetFailed directly in OnNewConnectionsUntilEAGAIN
@@ -293,6 +344,7 @@ void Acceptor::OnNewConnectionsUntilEAGAIN(Socket* acception) {
             options.on_edge_triggered_events = InputMessenger::OnNewMessages;
         }
         options.use_rdma = am->_use_rdma;
+        options.zerocopy_threshold = am->_zerocopy_threshold;
         options.bthread_tag = am->_bthread_tag;
         LOG(INFO) << "OnNewConnectionsUntilEAGAIN socket create start";
         if (Socket::Create(options, &socket_id) != 0) {
@@ -347,12 +399,15 @@ void Acceptor::OnNewConnections(Socket* acception) {
 
 void Acceptor::BeforeRecycle(Socket* sock) {
     BAIDU_SCOPED_LOCK(_map_mutex);
-    if (sock->id() == _acception_id) {
-        // Set _listened_fd to -1 when acception socket has been recycled
-        // so that we are ensured no more events will arrive (and `Join'
-        // will return to its caller)
-        _listened_fd = -1;
-        _empty_cond.Broadcast();
+    if (std::find(_acception_ids.begin(), _acception_ids.end(), sock->id())
+        != _acception_ids.end()) {
+        // Set _listened_fd to -1 when all acception sockets have been
+        // recycled so that we are ensured no more events will arrive (and
+        // `Join' will return to its caller)
+        if (--_nacception == 0) {
+            _listened_fd = -1;
+            _empty_cond.Broadcast();
+        }
         return;
     }
     // If a Socket could not be addressed shortly after its creation, it
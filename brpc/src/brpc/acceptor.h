@@ -48,16 +48,25 @@ public:
     ~Acceptor();
 
     // [thread-safe] Accept connections from `listened_fd'. Ownership of
-    // `listened_fd' is also transferred to `Acceptor'. Can be called
-    // multiple times if the last `StartAccept' has been completely stopped
-    // by calling `StopAccept' and `Join'. Connections that has no data
-    // transmission for `idle_timeout_sec' will be closed automatically iff
-    // `idle_timeout_sec' > 0
+    // `listened_fd' is also transferred to `Acceptor' even if this function
+    // fails. Can be called multiple times if the last `StartAccept' has been
+    // completely stopped by calling `StopAccept' and `Join'. Connections that
+    // has no data transmission for `idle_timeout_sec' will be closed
+    // automatically iff `idle_timeout_sec' > 0
     // Return 0 on success, -1 otherwise.
     int StartAccept(int listened_fd, int idle_timeout_sec,
                     const std::shared_ptr<SocketSSLContext>& ssl_ctx,
                     bool force_ssl);
 
+    // [thread-safe] Accept connections from all `listened_fds' which are
+    // generally bound to the same port with SO_REUSEPORT. The i-th fd is
+    // watched by the i-th(modulo -event_dispatcher_num) EventDispatcher so
+    // that connections are accepted in parallel. Other semantics are same
+    // with the above one.
+    int StartAccept(const std::vector<int>& listened_fds, int idle_timeout_sec,
+                    const std::shared_ptr<SocketSSLContext>& ssl_ctx,
+                    bool force_ssl);
+
     // [thread-safe] Stop accepting connections.
     // `closewait_ms' is not used anymore.
     void StopAccept(int /*closewait_ms*/);
@@ -65,9 +74,12 @@ public:
     // Wait until all existing Sockets(defined in socket.h) are recycled.
     void Join();
 
-    // The parameter to StartAccept. Negative when acceptor is stopped.
+    // The (first) parameter to StartAccept. Negative when acceptor is stopped.
     int listened_fd() const { return _listened_fd; }
 
+    // Number of fds that connections are accepted from.
+    size_t listened_fd_count() const { return _acception_ids.size(); }
+
     // Get number of existing connections.
     size_t ConnectionCount() const;
 
@@ -98,8 +110,10 @@ private:
     bthread_t _close_idle_tid;
 
     int _listened_fd;
-    // The Socket tso accept connections.
-    SocketId _acception_id;
+    // The Sockets to accept connections, one for each listened fd.
+    std::vector<SocketId> _acception_ids;
+    // Number of Sockets in `_acception_ids' that are not recycled yet.
+    size_t _nacception;
 
     butil::Mutex _map_mutex;
     butil::ConditionVariable _empty_cond;
@@ -113,6 +127,9 @@ private:
     // Whether to use rdma or not
     bool _use_rdma;
 
+    // SocketOptions.zerocopy_threshold of accepted sockets
+    int64_t _zerocopy_threshold;
+
     // Acceptor belongs to this tag
     bthread_tag_t _bthread_tag;
 };
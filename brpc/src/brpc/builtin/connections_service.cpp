@@ -16,6 +16,7 @@
 // under the License.
 
 
+#include <inttypes.h>                     // PRId64
 #include <ostream>
 #include <iomanip>
 #include <netinet/tcp.h>
@@ -135,6 +136,8 @@ void ConnectionsService::PrintConnections(
             "<th>OutBytes/m</th>"
             "<th>Out/m</th>"
             "<th>Rtt/Var(ms)</th>"
+            "<th>ReadBuf</th>"
+            "<th>Unwritten</th>"
             "<th>SocketId</th>"
             "</tr>\n";
     } else {
@@ -145,7 +148,7 @@ void ConnectionsService::PrintConnections(
         os << "SSL|Protocol    |fd   |"
             "InBytes/s|In/s  |InBytes/m |In/m    |"
             "OutBytes/s|Out/s |OutBytes/m|Out/m   |"
-            "Rtt/Var(ms)|SocketId\n";
+            "Rtt/Var(ms)|ReadBuf  |Unwritten|SocketId\n";
     }
 
     const char* const bar = (use_html ? "</td><td>" : "|");
@@ -191,7 +194,9 @@ void ConnectionsService::PrintConnections(
                << min_width("-", 6) << bar
                << min_width("-", 10) << bar
                << min_width("-", 8) << bar
-               << min_width("-", 11) << bar;
+               << min_width("-", 11) << bar
+               << min_width("-", 9) << bar
+               << min_width("-", 9) << bar;
         } else {
             {
                 SocketUniquePtr agent_sock;
@@ -309,6 +314,13 @@ void ConnectionsService::PrintConnections(
                << min_width(stat.out_size_m, 10) << bar
                << min_width(stat.out_num_messages_m, 8) << bar
                << min_width(rtt_display, 11) << bar;
+            // Reading of the socket is stopped due to memory pressure if the
+            // size of unparsed input is followed by `*'.
+            char read_buf_display[32];
+            snprintf(read_buf_display, sizeof(read_buf_display), "%" PRId64 "%s",
+                     ptr->read_buf_bytes(), ptr->is_read_throttled() ? "*" : "");
+            os << min_width(read_buf_display, 9) << bar
+               << min_width(ptr->unwritten_bytes(), 9) << bar;
         }
 
         if (use_html) {
@@ -16,9 +16,12 @@
 // under the License.
 
 
+#include <ctype.h>
 #include <vector>
-#include <iomanip>
-#include <map>
+#include <gflags/gflags.h>
+#include "butil/containers/flat_map.h"
+#include "butil/memory/singleton_on_pthread_once.h"
+#include "butil/synchronization/lock.h"
 #include "brpc/controller.h"                // Controller
 #include "brpc/server.h"                    // Server
 #include "brpc/closure_guard.h"             // ClosureGuard
@@ -35,25 +38,89 @@ DECLARE_int32(bvar_max_dump_multi_dimension_metric_number);
 
 namespace brpc {
 
+DEFINE_bool(prometheus_histogram_collapse_buckets, false,
+            "Skip buckets of bvar::Histogram in runs of unchanged cumulative "
+            "counts. Output is smaller, but the set of `le' differs between "
+            "instances and scrapes, which can't be aggregated by `le'");
+
 // Defined in server.cpp
 extern const char* const g_server_info_prefix;
 
+// Prometheus requires metric names to match [a-zA-Z_:][a-zA-Z0-9_:]*.
+static bool IsValidMetricName(const butil::StringPiece& name) {
+    if (name.empty() || isdigit(name[0])) {
+        return false;
+    }
+    for (size_t i = 0; i < name.size(); ++i) {
+        const char c = name[i];
+        if (!isalnum(c) && c != '_' && c != ':') {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Names of bvar are underscored when being exposed and valid in most cases,
+// the invalid ones are normalized once and cached for following scrapes.
+class MetricNameCache {
+public:
+    static const size_t MAX_SIZE = 65536;
+
+    MetricNameCache() {
+        CHECK_EQ(0, _map.init(64));
+    }
+
+    void Normalize(const butil::StringPiece& name, std::string* out) {
+        BAIDU_SCOPED_LOCK(_mutex);
+        const std::string* cached = _map.seek(name);
+        if (cached != NULL) {
+            out->assign(*cached);
+            return;
+        }
+        out->assign(name.data(), name.size());
+        for (size_t i = 0; i < out->size(); ++i) {
+            char& c = (*out)[i];
+            if (!isalnum(c) && c != ':') {
+                c = '_';
+            }
+        }
+        if (out->empty() || isdigit((*out)[0])) {
+            out->insert(0, 1, '_');
+        }
+        if (_map.size() >= MAX_SIZE) {
+            // Names come and go, don't let the cache grow unlimitedly.
+            _map.clear();
+        }
+        _map[name.as_string()] = *out;
+    }
+
+private:
+    butil::Mutex _mutex;
+    butil::FlatMap<std::string, std::string> _map;
+};
+
 // This is a class that convert bvar result to prometheus output.
-// Currently the output only includes gauge and summary for two
-// reasons:
+// Currently the output includes gauge, summary and histogram:
 // 1) We cannot tell gauge and counter just from name and what's
 // more counter is just another gauge.
-// 2) Histogram and summary is equivalent except that histogram
-// calculates quantiles in the server side.
+// 2) LatencyRecorder is output as summary, bvar::Histogram is output as
+// histogram with fixed buckets, which are all output so that histograms of
+// different instances can be merged. If -prometheus_histogram_collapse_buckets
+// is on, a bucket is skipped if its cumulative count equals the ones of both
+// neighbours. The last bucket clamps larger values, so it's only output as
+// `+Inf'.
+// The output is streamed into an IOBufAppender. Nothing is allocated for
+// each variable except that names of metric families are recorded and
+// buffers of in-flight summaries are resized.
 class PrometheusMetricsDumper : public bvar::Dumper {
 public:
-    explicit PrometheusMetricsDumper(butil::IOBufBuilder* os,
-                                     const std::string& server_prefix)
-        : _os(os)
-        , _server_prefix(server_prefix) {
-    }
+    PrometheusMetricsDumper(butil::IOBufAppender* os,
+                            const std::string& server_prefix,
+                            bool openmetrics);
 
     bool dump(const std::string& name, const butil::StringPiece& desc) override;
+    // Called by MultiDimension before dumping variables of a metric.
+    bool dump_comment(const std::string& name, const std::string& type) override;
 
 private:
     DISALLOW_COPY_AND_ASSIGN(PrometheusMetricsDumper);
@@ -62,6 +129,18 @@ private:
     bool DumpLatencyRecorderSuffix(const butil::StringPiece& name,
                                    const butil::StringPiece& desc);
 
+    // Return true iff desc is output by bvar::Histogram.
+    bool DumpHistogram(const butil::StringPiece& name,
+                       const butil::StringPiece& desc);
+
+    // Split `name' into the normalized metric name and labels.
+    butil::StringPiece SplitName(const butil::StringPiece& name,
+                                 butil::StringPiece* labels);
+
+    // Write HELP and TYPE of `metric_name' unless they were written.
+    void DumpHeader(const butil::StringPiece& metric_name,
+                    const butil::StringPiece& type);
+
     // 6 is the number of bvars in LatencyRecorder that indicating percentiles
     static const int NPERCENTILES = 6;
 
@@ -70,16 +149,27 @@ private:
         int64_t latency_avg;
         int64_t count;
         std::string metric_name;
-
-        bool IsComplete() const { return !metric_name.empty(); }
     };
-    const SummaryItems* ProcessLatencyRecorderSuffix(const butil::StringPiece& name,
-                                                     const butil::StringPiece& desc);
+    // Variables are dumped in sorted order, so variables of a
+    // LatencyRecorder are adjacent except the ones sharing the prefix.
+    // Only summaries whose variables may still come are kept.
+    SummaryItems* FindOrAddSummaryItems(const butil::StringPiece& metric_name);
+    void RemoveSummaryItems(SummaryItems* si);
+    void RemoveStaleSummaryItems(const butil::StringPiece& name);
+
+    void DumpSummary(const SummaryItems& si);
 
 private:
-    butil::IOBufBuilder* _os;
+    butil::IOBufAppender* _os;
     const std::string _server_prefix;
-    std::map<std::string, SummaryItems> _m;
+    const bool _openmetrics;
+    std::string _latency_names[NPERCENTILES];
+    std::string _quantiles[3];
+    std::string _last_metric_name;
+    butil::FlatSet<std::string> _dumped_families;
+    std::string _normalized_name;
+    std::vector<SummaryItems> _summaries;
+    size_t _nsummary;
 };
 
 butil::StringPiece GetMetricsName(const std::string& name) {
@@ -88,6 +178,99 @@ butil::StringPiece GetMetricsName(const std::string& name) {
     return butil::StringPiece(name.data(), size);
 }
 
+static bool ParseInt64(const butil::StringPiece& str, int64_t* value) {
+    char buf[32];
+    if (str.size() >= sizeof(buf)) {
+        return false;
+    }
+    memcpy(buf, str.data(), str.size());
+    buf[str.size()] = '\0';
+    *value = strtoll(buf, NULL, 10);
+    return true;
+}
+
+PrometheusMetricsDumper::PrometheusMetricsDumper(
+    butil::IOBufAppender* os, const std::string& server_prefix,
+    bool openmetrics)
+    : _os(os)
+    , _server_prefix(server_prefix)
+    , _openmetrics(openmetrics)
+    , _nsummary(0) {
+    _latency_names[0] = butil::string_printf(
+        "_latency_%d", (int)bvar::FLAGS_bvar_latency_p1);
+    _latency_names[1] = butil::string_printf(
+        "_latency_%d", (int)bvar::FLAGS_bvar_latency_p2);
+    _latency_names[2] = butil::string_printf(
+        "_latency_%d", (int)bvar::FLAGS_bvar_latency_p3);
+    _latency_names[3] = "_latency_999";
+    _latency_names[4] = "_latency_9999";
+    _latency_names[5] = "_max_latency";
+    const int32_t percentiles[3] = { bvar::FLAGS_bvar_latency_p1,
+                                     bvar::FLAGS_bvar_latency_p2,
+                                     bvar::FLAGS_bvar_latency_p3 };
+    for (int i = 0; i < 3; ++i) {
+        _quantiles[i] = butil::string_printf(
+            "{quantile=\"%g\"} ", (double)percentiles[i] / 100);
+    }
+}
+
+butil::StringPiece PrometheusMetricsDumper::SplitName(
+    const butil::StringPiece& name, butil::StringPiece* labels) {
+    butil::StringPiece metric_name = name;
+    const size_t pos = name.find('{');
+    if (pos != butil::StringPiece::npos) {
+        metric_name = name.substr(0, pos);
+        *labels = name.substr(pos);
+    } else {
+        labels->clear();
+    }
+    if (IsValidMetricName(metric_name)) {
+        return metric_name;
+    }
+    butil::get_leaky_singleton<MetricNameCache>()->Normalize(
+        metric_name, &_normalized_name);
+    return _normalized_name;
+}
+
+void PrometheusMetricsDumper::DumpHeader(const butil::StringPiece& metric_name,
+                                         const butil::StringPiece& type) {
+    if (metric_name == _last_metric_name) {
+        return;
+    }
+    _last_metric_name.assign(metric_name.data(), metric_name.size());
+    // Samples of a family may be separated by other families, e.g. the
+    // ones of MultiDimension. A family must be described only once.
+    if (_dumped_families.seek(metric_name) != NULL) {
+        return;
+    }
+    _dumped_families.insert(_last_metric_name);
+    if (!_openmetrics) {
+        // HELP is optional and must not be empty in OpenMetrics.
+        _os->append("# HELP ");
+        _os->append(metric_name);
+        _os->push_back('\n');
+    }
+    _os->append("# TYPE ");
+    _os->append(metric_name);
+    _os->push_back(' ');
+    _os->append(type);
+    _os->push_back('\n');
+}
+
+bool PrometheusMetricsDumper::dump_comment(const std::string& name,
+                                           const std::string& type) {
+    butil::StringPiece labels;
+    const butil::StringPiece metric_name = SplitName(name, &labels);
+    if (_openmetrics && type == "counter") {
+        // Samples of counters must be suffixed with _total in OpenMetrics,
+        // which is not the case of bvar.
+        DumpHeader(metric_name, "unknown");
+    } else {
+        DumpHeader(metric_name, type);
+    }
+    return true;
+}
+
 bool PrometheusMetricsDumper::dump(const std::string& name,
                                    const butil::StringPiece& desc) {
     if (!desc.empty() && desc[0] == '"') {
@@ -99,95 +282,203 @@ bool PrometheusMetricsDumper::dump(const std::string& name,
         // Leave it to DumpLatencyRecorderSuffix to output Summary.
         return true;
     }
+    if (DumpHistogram(name, desc)) {
+        return true;
+    }
 
-    auto metrics_name = GetMetricsName(name);
-
-    *_os << "# HELP " << metrics_name << '\n'
-         << "# TYPE " << metrics_name << " gauge" << '\n'
-         << name << " " << desc << '\n';
+    butil::StringPiece labels;
+    const butil::StringPiece metrics_name = SplitName(name, &labels);
+    DumpHeader(metrics_name, "gauge");
+    _os->append(metrics_name);
+    _os->append(labels);
+    _os->push_back(' ');
+    _os->append(desc);
+    _os->push_back('\n');
     return true;
 }
 
-const PrometheusMetricsDumper::SummaryItems*
-PrometheusMetricsDumper::ProcessLatencyRecorderSuffix(const butil::StringPiece& name,
-                                                      const butil::StringPiece& desc) {
-    static std::string latency_names[] = {
-        butil::string_printf("_latency_%d", (int)bvar::FLAGS_bvar_latency_p1),
-        butil::string_printf("_latency_%d", (int)bvar::FLAGS_bvar_latency_p2),
-        butil::string_printf("_latency_%d", (int)bvar::FLAGS_bvar_latency_p3),
-        "_latency_999", "_latency_9999", "_max_latency"
-    };
-    CHECK(NPERCENTILES == arraysize(latency_names));
-    const std::string desc_str = desc.as_string();
+PrometheusMetricsDumper::SummaryItems*
+PrometheusMetricsDumper::FindOrAddSummaryItems(
+    const butil::StringPiece& metric_name) {
+    for (size_t i = 0; i < _nsummary; ++i) {
+        if (_summaries[i].metric_name == metric_name) {
+            return &_summaries[i];
+        }
+    }
+    if (_nsummary == _summaries.size()) {
+        _summaries.resize(_nsummary + 1);
+    }
+    SummaryItems* si = &_summaries[_nsummary++];
+    for (int i = 0; i < NPERCENTILES; ++i) {
+        si->latency_percentiles[i].clear();
+    }
+    si->latency_avg = 0;
+    si->count = 0;
+    si->metric_name.assign(metric_name.data(), metric_name.size());
+    return si;
+}
+
+void PrometheusMetricsDumper::RemoveSummaryItems(SummaryItems* si) {
+    // Swap with the last one to keep buffers of strings for reusing.
+    SummaryItems* last = &_summaries[--_nsummary];
+    if (si != last) {
+        std::swap(*si, *last);
+    }
+}
+
+void PrometheusMetricsDumper::RemoveStaleSummaryItems(
+    const butil::StringPiece& name) {
+    for (size_t i = 0; i < _nsummary;) {
+        const std::string& prefix = _summaries[i].metric_name;
+        // Variables named with `prefix' are all dumped.
+        if (!name.starts_with(prefix) && name > prefix) {
+            RemoveSummaryItems(&_summaries[i]);
+        } else {
+            ++i;
+        }
+    }
+}
+
+bool PrometheusMetricsDumper::DumpLatencyRecorderSuffix(
+    const butil::StringPiece& name,
+    const butil::StringPiece& desc) {
+    if (!name.starts_with(_server_prefix)) {
+        return false;
+    }
+    RemoveStaleSummaryItems(name);
     butil::StringPiece metric_name(name);
     for (int i = 0; i < NPERCENTILES; ++i) {
-        if (!metric_name.ends_with(latency_names[i])) {
+        if (!metric_name.ends_with(_latency_names[i])) {
             continue;
         }
-        metric_name.remove_suffix(latency_names[i].size());
-        SummaryItems* si = &_m[metric_name.as_string()];
-        si->latency_percentiles[i] = desc_str;
+        metric_name.remove_suffix(_latency_names[i].size());
+        SummaryItems* si = FindOrAddSummaryItems(metric_name);
+        si->latency_percentiles[i].assign(desc.data(), desc.size());
         if (i == NPERCENTILES - 1) {
             // '_max_latency' is the last suffix name that appear in the sorted bvar
             // list, which means all related percentiles have been gathered and we are
             // ready to output a Summary.
-            si->metric_name = metric_name.as_string();
+            DumpSummary(*si);
+            RemoveSummaryItems(si);
         }
-        return si;
+        return true;
     }
     // Get the average of latency in recent window size
     if (metric_name.ends_with("_latency")) {
         metric_name.remove_suffix(8);
-        SummaryItems* si = &_m[metric_name.as_string()];
-        si->latency_avg = strtoll(desc_str.data(), NULL, 10);
-        return si;
+        SummaryItems* si = FindOrAddSummaryItems(metric_name);
+        ParseInt64(desc, &si->latency_avg);
+        return true;
     }
     if (metric_name.ends_with("_count")) {
         metric_name.remove_suffix(6);
-        SummaryItems* si = &_m[metric_name.as_string()];
-        si->count = strtoll(desc_str.data(), NULL, 10);
-        return si;
+        SummaryItems* si = FindOrAddSummaryItems(metric_name);
+        ParseInt64(desc, &si->count);
+        return true;
     }
-    return NULL;
+    return false;
 }
 
-bool PrometheusMetricsDumper::DumpLatencyRecorderSuffix(
-    const butil::StringPiece& name,
-    const butil::StringPiece& desc) {
-    if (!name.starts_with(_server_prefix)) {
+void PrometheusMetricsDumper::DumpSummary(const SummaryItems& si) {
+    butil::StringPiece labels;
+    const butil::StringPiece metric_name = SplitName(si.metric_name, &labels);
+    DumpHeader(metric_name, "summary");
+    for (int i = 0; i < 3; ++i) {
+        _os->append(metric_name);
+        _os->append(_quantiles[i]);
+        _os->append(si.latency_percentiles[i]);
+        _os->push_back('\n');
+    }
+    _os->append(metric_name);
+    _os->append("{quantile=\"0.999\"} ");
+    _os->append(si.latency_percentiles[3]);
+    _os->push_back('\n');
+    _os->append(metric_name);
+    _os->append("{quantile=\"0.9999\"} ");
+    _os->append(si.latency_percentiles[4]);
+    _os->push_back('\n');
+    _os->append(metric_name);
+    _os->append("{quantile=\"1\"} ");
+    _os->append(si.latency_percentiles[5]);
+    _os->push_back('\n');
+    if (!_openmetrics) {
+        // quantile must be a number in OpenMetrics.
+        _os->append(metric_name);
+        _os->append("{quantile=\"avg\"} ");
+        _os->append_decimal(si.latency_avg);
+        _os->push_back('\n');
+    }
+    // There is no sum of latency in bvar output, just use
+    // average * count as approximation
+    _os->append(metric_name);
+    _os->append("_sum ");
+    _os->append_decimal(si.latency_avg * si.count);
+    _os->push_back('\n');
+    _os->append(metric_name);
+    _os->append("_count ");
+    _os->append_decimal(si.count);
+    _os->push_back('\n');
+}
+
+bool PrometheusMetricsDumper::DumpHistogram(const butil::StringPiece& name,
+                                           const butil::StringPiece& desc) {
+    if (!desc.starts_with("{\"count\":")) {
         return false;
     }
-    const SummaryItems* si = ProcessLatencyRecorderSuffix(name, desc);
-    if (!si) {
+    bvar::detail::HistogramSamples s;
+    if (s.parse(desc) != 0) {
         return false;
     }
-    if (!si->IsComplete()) {
-        return true;
+    // Labels of MultiDimension, e.g. `{method="echo"}'.
+    butil::StringPiece labels;
+    const butil::StringPiece metrics_name = SplitName(name, &labels);
+    butil::StringPiece bucket_labels = labels;
+    if (!bucket_labels.empty()) {
+        bucket_labels.remove_suffix(1);  // Remove '}'
+    }
+    const bool has_labels = (bucket_labels.size() > 1);
+    if (bucket_labels.empty()) {
+        bucket_labels = "{";
     }
-    *_os << "# HELP " << si->metric_name << '\n'
-         << "# TYPE " << si->metric_name << " summary\n"
-         << si->metric_name << "{quantile=\""
-         << (double)(bvar::FLAGS_bvar_latency_p1) / 100 << "\"} "
-         << si->latency_percentiles[0] << '\n'
-         << si->metric_name << "{quantile=\""
-         << (double)(bvar::FLAGS_bvar_latency_p2) / 100 << "\"} "
-         << si->latency_percentiles[1] << '\n'
-         << si->metric_name << "{quantile=\""
-         << (double)(bvar::FLAGS_bvar_latency_p3) / 100 << "\"} "
-         << si->latency_percentiles[2] << '\n'
-         << si->metric_name << "{quantile=\"0.999\"} "
-         << si->latency_percentiles[3] << '\n'
-         << si->metric_name << "{quantile=\"0.9999\"} "
-         << si->latency_percentiles[4] << '\n'
-         << si->metric_name << "{quantile=\"1\"} "
-         << si->latency_percentiles[5] << '\n'
-         << si->metric_name << "{quantile=\"avg\"} "
-         << si->latency_avg << '\n'
-         << si->metric_name << "_sum "
-         // There is no sum of latency in bvar output, just use
-         // average * count as approximation
-         << si->latency_avg * si->count << '\n'
-         << si->metric_name << "_count " << si->count << '\n';
+
+    DumpHeader(metrics_name, "histogram");
+    const bool collapse = FLAGS_prometheus_histogram_collapse_buckets;
+    uint64_t cumulative = 0;
+    for (size_t i = 0; i + 1 < bvar::detail::HISTOGRAM_NUM_BUCKETS; ++i) {
+        cumulative += s.bucket_count(i);
+        // Keep the empty bucket right before a non-empty one so that the
+        // lower bound of the latter is still known.
+        if (collapse && s.bucket_count(i) == 0 &&
+            s.bucket_count(i + 1) == 0) {
+            continue;
+        }
+        _os->append(metrics_name);
+        _os->append("_bucket");
+        _os->append(bucket_labels);
+        _os->append(has_labels ? ",le=\"" : "le=\"");
+        _os->append_decimal(bvar::detail::histogram_bucket_upper_bound(i));
+        _os->append("\"} ");
+        _os->append_decimal(cumulative);
+        _os->push_back('\n');
+    }
+    _os->append(metrics_name);
+    _os->append("_bucket");
+    _os->append(bucket_labels);
+    _os->append(has_labels ? ",le=\"+Inf\"} " : "le=\"+Inf\"} ");
+    _os->append_decimal(s.count());
+    _os->push_back('\n');
+    _os->append(metrics_name);
+    _os->append("_sum");
+    _os->append(labels);
+    _os->push_back(' ');
+    _os->append_decimal(s.sum());
+    _os->push_back('\n');
+    _os->append(metrics_name);
+    _os->append("_count");
+    _os->append(labels);
+    _os->push_back(' ');
+    _os->append_decimal(s.count());
+    _os->push_back('\n');
     return true;
 }
 
@@ -197,30 +488,43 @@ void PrometheusMetricsService::default_method(::google::protobuf::RpcController*
                                               ::google::protobuf::Closure* done) {
     ClosureGuard done_guard(done);
     Controller *cntl = static_cast<Controller*>(cntl_base);
-    cntl->http_response().set_content_type("text/plain");
-    if (DumpPrometheusMetricsToIOBuf(&cntl->response_attachment()) != 0) {
+    const std::string* accept = cntl->http_request().GetHeader("Accept");
+    const bool openmetrics = (accept != NULL &&
+        accept->find("application/openmetrics-text") != std::string::npos);
+    if (openmetrics) {
+        cntl->http_response().set_content_type(
+            "application/openmetrics-text; version=1.0.0; charset=utf-8");
+    } else {
+        cntl->http_response().set_content_type("text/plain");
+    }
+    if (DumpPrometheusMetricsToIOBuf(&cntl->response_attachment(),
+                                     openmetrics) != 0) {
         cntl->SetFailed("Fail to dump metrics");
         return;
     }
+    // Compressed only when the client accepts gzip.
+    cntl->set_response_compress_type(COMPRESS_TYPE_GZIP);
 }
 
-int DumpPrometheusMetricsToIOBuf(butil::IOBuf* output) {
-    butil::IOBufBuilder os;
-    PrometheusMetricsDumper dumper(&os, g_server_info_prefix);
+int DumpPrometheusMetricsToIOBuf(butil::IOBuf* output, bool openmetrics) {
+    butil::IOBufAppender os;
+    PrometheusMetricsDumper dumper(&os, g_server_info_prefix, openmetrics);
     const int ndump = bvar::Variable::dump_exposed(&dumper, NULL);
     if (ndump < 0) {
         return -1;
     }
-    os.move_to(*output);
 
     if (bvar::FLAGS_bvar_max_dump_multi_dimension_metric_number > 0) {
-        PrometheusMetricsDumper dumper_md(&os, g_server_info_prefix);
+        PrometheusMetricsDumper dumper_md(&os, g_server_info_prefix, openmetrics);
         const int ndump_md = bvar::MVariable::dump_exposed(&dumper_md, NULL);
         if (ndump_md < 0) {
             return -1;
         }
-        output->append(butil::IOBuf::Movable(os.buf()));
     }
+    if (openmetrics) {
+        os.append("# EOF\n");
+    }
+    os.move_to(*output);
     return 0;
 }
 
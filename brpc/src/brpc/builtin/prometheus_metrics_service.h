@@ -32,7 +32,9 @@ public:
 };
 
 butil::StringPiece GetMetricsName(const std::string& name);
-int DumpPrometheusMetricsToIOBuf(butil::IOBuf* output);
+// Dump exposed bvars into `output' in prometheus text format, or in
+// OpenMetrics text format when `openmetrics' is true.
+int DumpPrometheusMetricsToIOBuf(butil::IOBuf* output, bool openmetrics = false);
 
 } // namepace brpc
 
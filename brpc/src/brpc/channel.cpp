@@ -58,6 +58,7 @@ ChannelOptions::ChannelOptions()
     , backup_request_policy(NULL)
     , retry_policy(NULL)
     , ns_filter(NULL)
+    , write_coalesce_delay_us(0)
 {}
 
 ChannelSSLOptions* ChannelOptions::mutable_ssl_options() {
@@ -103,6 +104,14 @@ static ChannelSignature ComputeChannelSignature(const ChannelOptions& opt) {
             buf.append((char*)&verify.verify_depth, sizeof(verify.verify_depth));
             buf.push_back('|');
             buf.append(verify.ca_file_path);
+            if (ssl.enable_ktls) {
+                buf.append("|ktls");
+            }
+            if (ssl.session_cache_size > 0) {
+                buf.append("|sesscache=");
+                buf.append((char*)&ssl.session_cache_size,
+                           sizeof(ssl.session_cache_size));
+            }
         } else {
             // All disabled ChannelSSLOptions are the same
         }
@@ -496,6 +505,7 @@ void Channel::CallMethod(const google::protobuf::MethodDescriptor* method,
     // overriding connect_timeout_ms does not make sense, just use the
     // one in ChannelOptions
     cntl->_connect_timeout_ms = _options.connect_timeout_ms;
+    cntl->_write_coalesce_delay_us = _options.write_coalesce_delay_us;
     if (cntl->backup_request_ms() == UNSET_MAGIC_NUM &&
         NULL == cntl->_backup_request_policy) {
         cntl->set_backup_request_ms(_options.backup_request_ms);
@@ -518,6 +528,12 @@ void Channel::CallMethod(const google::protobuf::MethodDescriptor* method,
     // Share the lb with controller.
     cntl->_lb = _lb;
 
+    if (cntl->has_progressive_writer() &&
+        _options.protocol != brpc::PROTOCOL_H2) {
+        cntl->SetFailed(EINVAL, "Only h2 supports writing requests progressively");
+        return cntl->HandleSendFailed();
+    }
+
     // Ensure that serialize_request is done before pack_request in all
     // possible executions, including:
     //   HandleSendFailed => OnVersionedRPCReturned => IssueRPC(pack_request)
@@ -535,7 +551,7 @@ void Channel::CallMethod(const google::protobuf::MethodDescriptor* method,
         return cntl->HandleSendFailed();
     }
 
-    if (!cntl->_request_streams.empty()) {
+    if (!cntl->_request_streams.empty() || cntl->has_progressive_writer()) {
         // Currently we cannot handle retry and backup request correctly
         cntl->set_max_retry(0);
         cntl->set_backup_request_ms(-1);
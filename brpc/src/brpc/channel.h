@@ -143,6 +143,14 @@ struct ChannelOptions {
     // Default: ""
     std::string connection_group;
 
+    // If positive, a request which gets the right to write an idle
+    // connection is written by the KeepWrite bthread after waiting for at
+    // most so many microseconds, so that requests issued during the wait
+    // are coalesced into fewer writev. Trades latency for throughput,
+    // suitable for channels sending lots of small asynchronous requests.
+    // Default: 0 (write in the calling thread at once)
+    int32_t write_coalesce_delay_us;
+
 private:
     // SSLOptions is large and not often used, allocate it on heap to
     // prevent ChannelOptions from being bloated in most cases.
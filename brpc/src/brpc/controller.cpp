@@ -41,6 +41,7 @@
 #include "brpc/retry_policy.h"
 #include "brpc/stream_impl.h"
 #include "brpc/policy/streaming_rpc_protocol.h" // FIXME
+#include "brpc/policy/http2_rpc_protocol.h"     // H2ProgressiveAttachment
 #include "brpc/rpc_dump.h"
 #include "brpc/details/usercode_backup_pool.h"  // RunUserCode
 #include "brpc/mongo_service_adaptor.h"
@@ -260,6 +261,7 @@ void Controller::ResetPods() {
     _backup_request_ms = UNSET_MAGIC_NUM;
     _backup_request_policy = NULL;
     _connect_timeout_ms = UNSET_MAGIC_NUM;
+    _write_coalesce_delay_us = 0;
     _real_timeout_ms = UNSET_MAGIC_NUM;
     _deadline_us = -1;
     _timeout_id = 0;
@@ -1227,6 +1229,7 @@ void Controller::IssueRPC(int64_t start_realtime_us) {
     wopt.auth_flags = _auth_flags;
     wopt.ignore_eovercrowded = has_flag(FLAGS_IGNORE_EOVERCROWDED);
     wopt.write_in_background = write_to_socket_in_background();
+    wopt.coalesce_delay_us = _write_coalesce_delay_us;
     int rc;
     size_t packet_size = 0;
     if (user_packet_guard) {
@@ -1495,8 +1498,28 @@ Controller::CreateProgressiveAttachment(StopStyle stop_style) {
         LOG(ERROR) << "One controller can only have one ProgressiveAttachment";
         return NULL;
     }
+    if (_server == NULL) {
+        // Writing the request at client-side, which is checked to be h2
+        // when the RPC is issued.
+        SocketUniquePtr no_sock;
+        _wpa.reset(new policy::H2ProgressiveAttachment(no_sock));
+        return _wpa;
+    }
+    if (_request_protocol == PROTOCOL_H2) {
+        if (_current_call.sending_sock == NULL) {
+            LOG(ERROR) << "sending_sock is NULL";
+            return NULL;
+        }
+        SocketUniquePtr h2sock;
+        _current_call.sending_sock->ReAddress(&h2sock);
+        if (stop_style == FORCE_STOP) {
+            h2sock->fail_me_at_server_stop();
+        }
+        _wpa.reset(new policy::H2ProgressiveAttachment(h2sock));
+        return _wpa;
+    }
     if (_request_protocol != PROTOCOL_HTTP) {
-        LOG(ERROR) << "Only http supports ProgressiveAttachment now";
+        LOG(ERROR) << "Only http and h2 support ProgressiveAttachment now";
         return NULL;
     }
     if (_current_call.sending_sock == NULL) {
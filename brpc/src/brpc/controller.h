@@ -457,6 +457,9 @@ public:
     // If `stop_style' is FORCE_STOP, the underlying socket will be failed
     // immediately when the socket becomes idle or server is stopped.
     // Default value of `stop_style' is WAIT_FOR_STOP.
+    // At client-side, call this before issuing a h2 RPC to write the request
+    // progressively (e.g. streaming requests of gRPC), the request ends when
+    // the returned attachment is released. Such RPCs are not retried.
     butil::intrusive_ptr<ProgressiveAttachment>
     CreateProgressiveAttachment(StopStyle stop_style = WAIT_FOR_STOP);
 
@@ -798,6 +801,8 @@ private:
     int _fail_limit;
     
     uint32_t _pipelined_count;
+    // Copied from ChannelOptions.write_coalesce_delay_us
+    int32_t _write_coalesce_delay_us;
 
     // [Timeout related]
     int32_t _timeout_ms;
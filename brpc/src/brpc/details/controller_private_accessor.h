@@ -128,6 +128,13 @@ public:
     void set_readable_progressive_attachment(ReadableProgressiveAttachment* s)
     { _cntl->_rpa.reset(s); }
 
+    ProgressiveAttachment* progressive_attachment()
+    { return _cntl->_wpa.get(); }
+
+    // Caller owns the ref of the returned attachment.
+    ProgressiveAttachment* release_progressive_attachment()
+    { return _cntl->_wpa.detach(); }
+
     void set_auth_flags(uint32_t auth_flags) {
         _cntl->_auth_flags = auth_flags;
     }
@@ -76,6 +76,7 @@ public:
     IndexTable()
         : _start_index(0)
         , _add_times(0)
+        , _version(0)
         , _size(0)
     {}
     ~IndexTable() {}
@@ -113,6 +114,7 @@ public:
     bool empty() const { return _size == 0; }
     int start_index() const { return _start_index; }
     int end_index() const { return start_index() + _header_queue.size(); }
+    uint64_t version() const { return _version; }
 
     static inline size_t HeaderSize(const Header& h) {
         // https://tools.ietf.org/html/rfc7541#section-4.1
@@ -130,6 +132,7 @@ public:
         }
         _size -= entry_size;
         _header_queue.pop();
+        ++_version;
     }
 
     void RemoveHeaderFromIndexes(const Header& h, uint64_t expected_id) {
@@ -167,6 +170,7 @@ public:
         _header_queue.push(h);
 
         const int id = _add_times++;
+        ++_version;
         if (_need_indexes) {
             // Overwrite existance value.
             if (!h.value.empty()) {
@@ -201,6 +205,9 @@ private:
     int _start_index;
     bool _need_indexes;
     uint64_t _add_times;  // Increase when adding a new entry.
+    // Increase when adding or removing an entry, which changes indexes
+    // of the entries.
+    uint64_t _version;
     size_t _max_size;
     size_t _size;
     butil::BoundedQueue<Header> _header_queue;
@@ -327,6 +334,8 @@ public:
         return &_node_memory[id - 1];
     }
 
+    size_t node_count() const { return _node_memory.size(); }
+
 private:
 
     HuffmanNode& node(NodeId id) {
@@ -349,43 +358,35 @@ public:
     HuffmanEncoder(butil::IOBufAppender* out, const HuffmanCode* table)
         : _out(out)
         , _table(table)
-        , _partial_byte(0)
-        , _remain_bit(8)
+        , _bits(0)
+        , _bit_len(0)
         , _out_bytes(0)
     {}
 
     void Encode(unsigned char byte) {
         const HuffmanCode code = _table[byte];
-        uint16_t bits_left = code.bit_len;
-        while (bits_left) {
-            const uint16_t adding_bits_len = std::min(_remain_bit, bits_left);
-            const uint8_t adding_bits = static_cast<uint8_t>(
-                    (code.code & ((1u << bits_left) - 1))   // clear leading bits
-                            >> (bits_left - adding_bits_len));  // align to LSB
-            _partial_byte |= adding_bits << (_remain_bit - adding_bits_len);
-            _remain_bit -= adding_bits_len;
-            bits_left -= adding_bits_len;
-            if (!_remain_bit) {
-                ++_out_bytes;
-                _out->push_back(_partial_byte);
-                _remain_bit = 8;
-                _partial_byte = 0;
-            }
+        // Codes are at most 30 bits and less than 8 bits are pending, the
+        // valid bits always fit in _bits. Bits shifted out have been written.
+        _bits = (_bits << code.bit_len) | code.code;
+        _bit_len += code.bit_len;
+        while (_bit_len >= 8) {
+            _bit_len -= 8;
+            _out->push_back(static_cast<uint8_t>(_bits >> _bit_len));
+            ++_out_bytes;
         }
     }
 
     void EndStream() {
-        if (_remain_bit == 8u) {
+        if (_bit_len == 0) {
             return;
         }
-        DCHECK_LT(_remain_bit, 8u);
+        DCHECK_LT(_bit_len, 8u);
         // Add padding `1's to lsb to make _out aligned
-        _partial_byte |= (1 << _remain_bit) - 1;
-        // TODO: push_back is probably costly since it acquires tls everytime it
-        // is invoked.
-        _out->push_back(_partial_byte);
-        _partial_byte = 0;
-        _remain_bit = 0;
+        const uint32_t padding_len = 8 - _bit_len;
+        _out->push_back(static_cast<uint8_t>(
+                (_bits << padding_len) | ((1u << padding_len) - 1)));
+        _bits = 0;
+        _bit_len = 0;
         _out = NULL;
         ++_out_bytes;
     }
@@ -395,82 +396,128 @@ public:
 private:
     butil::IOBufAppender* _out;
     const HuffmanCode* _table;
-    uint8_t  _partial_byte;
-    uint16_t _remain_bit;
+    uint64_t _bits;
+    uint32_t _bit_len;
     uint32_t _out_bytes;
 };
 
+// The huffman decoder is a state machine consuming 4 bits at a time. States
+// are the internal nodes of the huffman tree and the root is state 0. Since
+// the shortest code has 5 bits, at most one symbol is emitted per 4 bits.
+enum HuffmanTransitionFlags {
+    HUFFMAN_EMIT = 1,
+    // The bits consumed since the last emitted symbol are a valid padding,
+    // which is shorter than 8 bits and corresponds to the MSB of EOS.
+    // https://tools.ietf.org/html/rfc7541#section-5.2
+    HUFFMAN_ACCEPTED = 2,
+    HUFFMAN_FAIL = 4,
+};
+
+struct HuffmanTransition {
+    uint16_t next_state;
+    uint8_t flags;
+    uint8_t symbol;
+};
+
+typedef HuffmanTransition HuffmanTransitions[16];
+
+static HuffmanTransitions* BuildHuffmanTransitions(const HuffmanTree& tree) {
+    typedef HuffmanTree::NodeId NodeId;
+    // Map internal nodes to states, the root is visited first.
+    std::vector<int> states(tree.node_count() + 1, -1);
+    std::vector<NodeId> nodes;
+    // Depth of each node if the path from root consists of `1's, -1 otherwise.
+    std::vector<int> ones_depth(tree.node_count() + 1, -1);
+    ones_depth[HuffmanTree::ROOT_NODE] = 0;
+    nodes.push_back(HuffmanTree::ROOT_NODE);
+    for (size_t i = 0; i < nodes.size(); ++i) {
+        const NodeId id = nodes[i];
+        const HuffmanNode* n = tree.node(id);
+        states[id] = i;
+        const NodeId children[2] = { n->left_child, n->right_child };
+        for (int bit = 0; bit < 2; ++bit) {
+            const HuffmanNode* child = tree.node(children[bit]);
+            if (child != NULL && child->value == HuffmanTree::INVALID_VALUE) {
+                if (bit == 1 && ones_depth[id] >= 0) {
+                    ones_depth[children[bit]] = ones_depth[id] + 1;
+                }
+                nodes.push_back(children[bit]);
+            }
+        }
+    }
+    HuffmanTransitions* transitions = new HuffmanTransitions[nodes.size()];
+    for (size_t i = 0; i < nodes.size(); ++i) {
+        for (int nibble = 0; nibble < 16; ++nibble) {
+            HuffmanTransition& t = transitions[i][nibble];
+            t.next_state = 0;
+            t.flags = 0;
+            t.symbol = 0;
+            NodeId cur = nodes[i];
+            for (int bit = 3; bit >= 0; --bit) {
+                const HuffmanNode* n = tree.node(cur);
+                cur = (nibble & (1 << bit)) ? n->right_child : n->left_child;
+                const HuffmanNode* child = tree.node(cur);
+                if (child == NULL || child->value == HPACK_HUFFMAN_EOS) {
+                    t.flags = HUFFMAN_FAIL;
+                    break;
+                }
+                if (child->value != HuffmanTree::INVALID_VALUE) {
+                    t.flags |= HUFFMAN_EMIT;
+                    t.symbol = static_cast<uint8_t>(child->value);
+                    cur = HuffmanTree::ROOT_NODE;
+                }
+            }
+            if (t.flags & HUFFMAN_FAIL) {
+                continue;
+            }
+            t.next_state = states[cur];
+            if (ones_depth[cur] >= 0 && ones_depth[cur] <= 7) {
+                t.flags |= HUFFMAN_ACCEPTED;
+            }
+        }
+    }
+    return transitions;
+}
+
 class HuffmanDecoder {
 DISALLOW_COPY_AND_ASSIGN(HuffmanDecoder);
 public:
-    HuffmanDecoder(std::string* out, const HuffmanTree* tree)
-        // FIXME: resizing of out is costly
+    HuffmanDecoder(std::string* out, const HuffmanTransitions* transitions)
         : _out(out)
-        , _tree(tree)
-        , _cur_node(tree->node(HuffmanTree::ROOT_NODE))
-        , _cur_depth(0)  // Depth of root node is 0
-        , _padding(true)
+        , _transitions(transitions)
+        , _state(0)
+        , _accepted(true)
     {}
     int Decode(uint8_t byte) {
-        for (int i = 7; i >= 0; --i) {
-            if (byte & (1u << i)) {
-                _cur_node = _tree->node(_cur_node->right_child);
-                if (BAIDU_UNLIKELY(!_cur_node)) {
-                    LOG(ERROR) << "Decoder stream reaches NULL_NODE";
-                    return -1;
-                }
-                if (_cur_node->value != HuffmanTree::INVALID_VALUE) {
-                    if (BAIDU_UNLIKELY(_cur_node->value == HPACK_HUFFMAN_EOS)) {
-                        LOG(ERROR) << "Decoder stream reaches EOS";
-                        return -1;
-                    }
-                    _out->push_back(static_cast<uint8_t>(_cur_node->value));
-                    _cur_node = _tree->node(HuffmanTree::ROOT_NODE);
-                    _cur_depth = 0;
-                    _padding = true;
-                    continue;
-                }
-                _padding &= 1;
-            } else {
-                _cur_node = _tree->node(_cur_node->left_child);
-                if (BAIDU_UNLIKELY(!_cur_node)) {
-                    LOG(ERROR) << "Decoder stream reaches NULL_NODE";
-                    return -1;
-                }
-                if (_cur_node->value != HuffmanTree::INVALID_VALUE) {
-                    if (BAIDU_UNLIKELY(_cur_node->value == HPACK_HUFFMAN_EOS)) {
-                        LOG(ERROR) << "Decoder stream reaches EOS";
-                        return -1;
-                    }
-                    _out->push_back(static_cast<uint8_t>(_cur_node->value));
-                    _cur_node = _tree->node(HuffmanTree::ROOT_NODE);
-                    _cur_depth = 0;
-                    _padding = true;
-                    continue;
-                }
-                _padding &= 0;
-            }
-            ++_cur_depth;
+        if (DecodeNibble(byte >> 4) != 0 || DecodeNibble(byte & 0xF) != 0) {
+            LOG(ERROR) << "Decoder stream reaches EOS or NULL_NODE";
+            return -1;
         }
         return 0;
     }
     int EndStream() {
-        if (_cur_depth == 0) {
-            return 0;
-        }
-        if (_cur_depth <= 7 && _padding) {
-            return 0;
-        }
-        // Invalid stream, the padding is not corresponding to MSB of EOS
+        // Invalid stream if the padding is not corresponding to MSB of EOS
         // https://tools.ietf.org/html/rfc7541#section-5.2
-        return -1;
+        return _accepted ? 0 : -1;
     }
 private:
+    int DecodeNibble(uint8_t nibble) {
+        const HuffmanTransition& t = _transitions[_state][nibble];
+        if (BAIDU_UNLIKELY(t.flags & HUFFMAN_FAIL)) {
+            return -1;
+        }
+        if (t.flags & HUFFMAN_EMIT) {
+            _out->push_back(t.symbol);
+        }
+        _state = t.next_state;
+        _accepted = (t.flags & HUFFMAN_ACCEPTED);
+        return 0;
+    }
+
     std::string* _out;
-    const HuffmanTree* _tree;
-    const HuffmanNode* _cur_node;
-    uint16_t _cur_depth;
-    bool _padding;
+    const HuffmanTransitions* _transitions;
+    uint16_t _state;
+    bool _accepted;
 };
 
 // Primitive Type Representations
@@ -496,15 +543,16 @@ inline void EncodeInteger(butil::IOBufAppender* out, uint8_t msb,
 }
 
 // Static variables
-static HuffmanTree* s_huffman_tree = NULL;
+static HuffmanTransitions* s_huffman_transitions = NULL;
 static IndexTable* s_static_table = NULL;
 static pthread_once_t s_create_once = PTHREAD_ONCE_INIT;
 
 static void CreateStaticTableOrDie() {
-    s_huffman_tree = new HuffmanTree;
+    HuffmanTree huffman_tree;
     for (size_t i = 0; i < ARRAY_SIZE(s_huffman_table); ++i) {
-        s_huffman_tree->AddLeafNode(i, s_huffman_table[i]);
+        huffman_tree.AddLeafNode(i, s_huffman_table[i]);
     }
+    s_huffman_transitions = BuildHuffmanTransitions(huffman_tree);
     IndexTableOptions options;
     options.max_size = UINT_MAX;
     options.static_table = s_static_headers;
@@ -622,7 +670,9 @@ inline ssize_t DecodeString(butil::IOBufBytesIterator& iter, std::string* out) {
         iter.copy_and_forward(out, length);
         return in_bytes;
     }
-    HuffmanDecoder d(out, s_huffman_tree);
+    // The shortest code has 5 bits.
+    out->reserve(length * 8 / 5);
+    HuffmanDecoder d(out, s_huffman_transitions);
     for (; iter != NULL && length; ++iter, --length) {
         if (d.Decode(*iter) != 0) {
             return -1;
@@ -725,6 +775,52 @@ void HPacker::Encode(butil::IOBufAppender* out, const Header& header,
     EncodeString<false>(out, header.value, options.encode_value);
 }
 
+void HPacker::EncodeBlock(butil::IOBuf* out, const HeaderRef* headers,
+                          size_t n, const HPackOptions& options,
+                          HPackBlockCache* cache) {
+    const int options_key = (options.index_policy << 2)
+        | (options.encode_name << 1) | options.encode_value;
+    const uint64_t table_version = _encode_table->version();
+    if (cache->_options_key == options_key &&
+        cache->_table_version == table_version &&
+        cache->_headers.size() == n) {
+        size_t i = 0;
+        for (; i < n; ++i) {
+            const Header& h = cache->_headers[i];
+            if (h.name != *headers[i].name || h.value != *headers[i].value) {
+                break;
+            }
+        }
+        if (i == n) {
+            out->append(cache->_block);
+            return;
+        }
+    }
+    // Headers are copied into the cache to be compared next time.
+    cache->_headers.resize(n);
+    butil::IOBufAppender appender;
+    for (size_t i = 0; i < n; ++i) {
+        Header& h = cache->_headers[i];
+        h.name = *headers[i].name;
+        h.value = *headers[i].value;
+        Encode(&appender, h, options);
+    }
+    cache->_block.clear();
+    appender.move_to(cache->_block);
+    out->append(cache->_block);
+    if (_encode_table->version() == table_version) {
+        // All headers were found in the index tables or not indexed, the
+        // same headers are encoded into the same block until the dynamic
+        // table is modified.
+        cache->_options_key = options_key;
+        cache->_table_version = table_version;
+    } else {
+        // Indexes of headers added just now are not known before encoding,
+        // cache the block next time.
+        cache->_options_key = -1;
+    }
+}
+
 inline const HPacker::Header* HPacker::HeaderAt(int index) const {
     return (index >= _decode_table->start_index())
             ? _decode_table->HeaderAt(index) : s_static_table->HeaderAt(index);
@@ -19,6 +19,7 @@
 #ifndef  BRPC_HPACK_H
 #define  BRPC_HPACK_H
 
+#include <vector>
 #include "butil/iobuf.h"                             // butil::IOBuf
 #include "butil/strings/string_piece.h"              // butil::StringPiece
 #include "brpc/http2.h"
@@ -70,6 +71,7 @@ inline HPackOptions::HPackOptions()
 {}
 
 class IndexTable;
+class HPackBlockCache;
 
 // HPACK - Header compression algorithm for http2 (rfc7541)
 // http://httpwg.org/specs/rfc7541.html
@@ -94,6 +96,12 @@ public:
             : name(name2), value(value2) {}
     };
 
+    // Reference to a header owned by others.
+    struct HeaderRef {
+        const std::string* name;
+        const std::string* value;
+    };
+
     HPacker();
     ~HPacker();
 
@@ -108,6 +116,14 @@ public:
     void Encode(butil::IOBufAppender* out, const Header& header)
     { return Encode(out, header, HPackOptions()); }
 
+    // Encode |n| headers as a block and append the encoded buffer to |out|.
+    // If the headers and options are the same as the ones last encoded
+    // with |cache| and the dynamic table is not modified since then, the
+    // block in |cache| is appended instead, which is the case for headers
+    // repeated in every response of a connection, e.g. gRPC responses.
+    void EncodeBlock(butil::IOBuf* out, const HeaderRef* headers, size_t n,
+                     const HPackOptions& options, HPackBlockCache* cache);
+
     // Try to decode at most one Header from source and erase corresponding
     // buffer.
     // Returns:
@@ -134,6 +150,21 @@ private:
     IndexTable* _decode_table;
 };
 
+// Encoded block of headers, see HPacker::EncodeBlock().
+// Using a cache with different HPackers is undefined.
+class HPackBlockCache {
+public:
+    HPackBlockCache() : _options_key(-1), _table_version(0) {}
+
+private:
+friend class HPacker;
+    // Packed from HPackOptions, -1 means that nothing is cached.
+    int _options_key;
+    uint64_t _table_version;
+    std::vector<HPacker::Header> _headers;
+    butil::IOBuf _block;
+};
+
 // Lowercase the input string, a fast implementation.
 void tolower(std::string* s);
 
@@ -352,7 +352,7 @@ int HttpMessage::OnMessageComplete() {
         ProgressiveReader* r = _body_reader;
         _body_reader = NULL;
         mu.unlock();
-        r->OnEndOfMessage(butil::Status());
+        r->OnEndOfMessage(_end_status);
     }
     return 0;
 }
@@ -392,7 +392,7 @@ void HttpMessage::SetBodyReader(ProgressiveReader* r) {
                 return;
             } else {  // The body is complete and successfully consumed.
                 mu.unlock();
-                return r->OnEndOfMessage(butil::Status());
+                return r->OnEndOfMessage(_end_status);
             }
         } else if (_stage <= HTTP_ON_BODY && ++ntry >= MAX_TRY) {
             // Stop making _body empty after we've tried several times.
@@ -25,6 +25,7 @@
 #include "butil/iobuf.h"               // butil::IOBuf
 #include "butil/scoped_lock.h"         // butil::unique_lock
 #include "butil/endpoint.h"
+#include "butil/status.h"              // butil::Status
 #include "brpc/details/http_parser.h"  // http_parser
 #include "brpc/http_header.h"          // HttpHeader
 #include "brpc/progressive_reader.h"   // ProgressiveReader
@@ -100,6 +101,9 @@ protected:
     int OnBody(const char* data, size_t size);
     int OnMessageComplete();
     size_t _parsed_length;
+    // Progressive reader is ended with this status when the message is
+    // complete, set by protocols carrying errors after body, e.g. gRPC.
+    butil::Status _end_status;
     
 private:
     DISALLOW_COPY_AND_ASSIGN(HttpMessage);
@@ -28,6 +28,9 @@
 #include <stdlib.h>
 #include <string.h>
 #include <limits.h>
+#if defined(__SSE4_2__)
+#include <nmmintrin.h>
+#endif
 
 #ifndef ULLONG_MAX
 # define ULLONG_MAX ((uint64_t) -1) /* 2^64-1 */
@@ -116,6 +119,19 @@ do {                                                                 \
   }                                                                  \
 } while (0)
 
+/* Skip bytes following the current one until the one found by FIND, the
+ * skipped bytes are counted as headers */
+#define SKIP_PLAIN_CHARS(FIND)                                       \
+do {                                                                 \
+  const char* stop = FIND(p + 1, data + len);                        \
+  parser->nread += stop - p - 1;                                     \
+  if (parser->nread > (BRPC_HTTP_MAX_HEADER_SIZE)) {                 \
+    SET_ERRNO(HPE_HEADER_OVERFLOW);                                  \
+    goto error;                                                      \
+  }                                                                  \
+  p = stop - 1;                                                      \
+} while (0)
+
 
 #define PROXY_CONNECTION "proxy-connection"
 #define CONNECTION "connection"
@@ -509,6 +525,65 @@ bool is_url_char(char c) { return IS_URL_CHAR(c); }
 #define IS_HEADER_CHAR(ch)                                                     \
   (ch == CR || ch == LF || ch == 9 || ((unsigned char)ch > 31 && ch != 127))
 
+/* NOTE: Following functions find the first byte in [p, end) which may
+ * change the state of parser, so that plain characters of urls, header
+ * fields and header values are skipped in bulk instead of going through
+ * the state machine one by one. They may stop earlier at a plain character,
+ * which is handled by the state machine as usual.
+ */
+#if defined(__SSE4_2__)
+/* Stop at the first byte in any of the inclusive ranges of `ranges' which
+ * has `nranges' bytes, or when less than 16 bytes are left. */
+static inline const char* find_char_in_ranges(const char* p, const char* end,
+                                              const char* ranges,
+                                              int nranges) {
+  const __m128i r = _mm_loadu_si128((const __m128i*)ranges);
+  while (end - p >= 16) {
+    const __m128i b = _mm_loadu_si128((const __m128i*)p);
+    const int i = _mm_cmpestri(r, nranges, b, 16,
+                               _SIDD_UBYTE_OPS | _SIDD_CMP_RANGES |
+                               _SIDD_LEAST_SIGNIFICANT);
+    p += i;
+    if (i != 16) {
+      break;
+    }
+  }
+  return p;
+}
+#endif
+
+static inline const char* find_url_delimiter(const char* p, const char* end) {
+#if defined(__SSE4_2__)
+  static const char ranges[16] = "\x00 ##??\x7f\x7f";
+  p = find_char_in_ranges(p, end, ranges, 8);
+#endif
+  /* '\t' and '\f' are rejected by parse_url_char() in strict mode */
+  for (; p != end && (unsigned char)*p > ' ' && IS_URL_CHAR(*p); ++p) {}
+  return p;
+}
+
+static inline const char* find_header_field_delimiter(const char* p,
+                                                      const char* end) {
+#if defined(__SSE4_2__)
+  /* Superset of non-token characters, '*', '+', '|' and '~' are included
+   * to fit in 16 bytes. */
+  static const char ranges[16] = "\x00 \"\"(,//:@[]{\xff";
+  p = find_char_in_ranges(p, end, ranges, 14);
+#endif
+  for (; p != end && tokens[(unsigned char)*p]; ++p) {}
+  return p;
+}
+
+static inline const char* find_header_value_delimiter(const char* p,
+                                                      const char* end) {
+#if defined(__SSE4_2__)
+  static const char ranges[16] = "\x00\x1f\x7f\x7f";
+  p = find_char_in_ranges(p, end, ranges, 4);
+#endif
+  for (; p != end && (unsigned char)*p > 31 && *p != 127; ++p) {}
+  return p;
+}
+
 #if BRPC_HTTP_PARSER_STRICT
 # define STRICT_CHECK(cond)                                          \
 do {                                                                 \
@@ -1229,6 +1304,11 @@ size_t http_parser_execute (http_parser *parser,
               goto error;
             }
             parser->state = new_state;
+            if (new_state == s_req_path ||
+                new_state == s_req_query_string ||
+                new_state == s_req_fragment) {
+              SKIP_PLAIN_CHARS(find_url_delimiter);
+            }
         }
         break;
       }
@@ -1412,6 +1492,7 @@ size_t http_parser_execute (http_parser *parser,
         if (c) {
           switch (parser->header_state) {
             case h_general:
+              SKIP_PLAIN_CHARS(find_header_field_delimiter);
               break;
 
             case h_C:
@@ -1625,6 +1706,7 @@ size_t http_parser_execute (http_parser *parser,
 
         switch (parser->header_state) {
           case h_general:
+            SKIP_PLAIN_CHARS(find_header_value_delimiter);
             break;
 
           case h_connection:
@@ -340,10 +340,24 @@ SSL* CreateSSLSession(SSL_CTX* ctx, SocketId id, int fd, bool server_mode) {
     return ssl;
 }
 
+bool ResumeSSLSession(SSL* ssl) {
+    // Session cache is not supported with MesaLink
+    return false;
+}
+
 void AddBIOBuffer(SSL* ssl, int fd, int bufsize) {
     // MesaLink uses buffered IO internally
 }
 
+bool IsKTLSSendEnabled(SSL* ssl) {
+    // MesaLink does not support kTLS
+    return false;
+}
+
+bool IsKTLSRecvEnabled(SSL* ssl) {
+    return false;
+}
+
 SSLState DetectSSLState(int fd, int* error_code) {
     // Peek the first few bytes inside socket to detect whether
     // it's an SSL connection. If it is, create an SSL session
@@ -25,10 +25,19 @@
 #include <openssl/err.h>
 #include <openssl/x509.h>
 #include <openssl/x509v3.h>
+#include <openssl/rand.h>
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#include <openssl/core_names.h>
+#else
+#include <openssl/hmac.h>
+#endif
 #include "butil/unique_ptr.h"
 #include "butil/logging.h"
 #include "butil/ssl_compat.h"
 #include "butil/string_splitter.h"
+#include "butil/endpoint.h"
+#include "butil/scoped_lock.h"
+#include "butil/containers/mru_cache.h"
 #include "brpc/socket.h"
 #include "brpc/details/ssl_helper.h"
 
@@ -476,6 +485,308 @@ static int SetServerALPNCallback(SSL_CTX* ssl_ctx, const std::string* alpns) {
     return 0;
 }
 
+static void EnableKTLS(SSL_CTX* ctx) {
+#if defined(SSL_OP_ENABLE_KTLS) && !defined(OPENSSL_NO_KTLS)
+    SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);
+#else
+    LOG(WARNING) << "OpenSSL version=" << OPENSSL_VERSION_TEXT
+                 << " does not support kTLS, ignore enable_ktls";
+#endif
+}
+
+bool IsKTLSSendEnabled(SSL* ssl) {
+#if defined(SSL_OP_ENABLE_KTLS) && !defined(OPENSSL_NO_KTLS)
+    return BIO_get_ktls_send(SSL_get_wbio(ssl));
+#else
+    return false;
+#endif
+}
+
+bool IsKTLSRecvEnabled(SSL* ssl) {
+#if defined(SSL_OP_ENABLE_KTLS) && !defined(OPENSSL_NO_KTLS)
+    return BIO_get_ktls_recv(SSL_get_rbio(ssl));
+#else
+    return false;
+#endif
+}
+
+// Sessions of client-side connections indexed by remote endpoint and SNI.
+class SSLSessionCache {
+public:
+    explicit SSLSessionCache(size_t max_size) : _sessions(max_size) {}
+
+    // Set the session of `key' into `ssl', returns true on success.
+    bool Resume(const std::string& key, SSL* ssl) {
+        BAIDU_SCOPED_LOCK(_mutex);
+        SessionMap::iterator it = _sessions.Get(key);
+        if (it == _sessions.end()) {
+            return false;
+        }
+        SSL_SESSION* session = it->second;
+        if (SSL_SESSION_get_time(session) + SSL_SESSION_get_timeout(session)
+            <= time(NULL)) {
+            _sessions.Erase(it);
+            return false;
+        }
+#if OPENSSL_VERSION_NUMBER >= 0x10101000L
+        // OpenSSL marks the session of a connection as not resumable when
+        // the connection is freed without a clean shutdown, which is common
+        // for short connections. Give each connection a copy to keep the
+        // cached one resumable.
+        session = SSL_SESSION_dup(session);
+        if (session == NULL) {
+            return false;
+        }
+        const bool ok = (SSL_set_session(ssl, session) == 1);
+        SSL_SESSION_free(session);
+        return ok;
+#else
+        return SSL_set_session(ssl, session) == 1;
+#endif
+    }
+
+    // Take ownership of `session'.
+    void Put(const std::string& key, SSL_SESSION* session) {
+        BAIDU_SCOPED_LOCK(_mutex);
+        _sessions.Put(key, session);
+    }
+
+private:
+    struct SessionDeletor {
+        void operator()(SSL_SESSION*& session) { SSL_SESSION_free(session); }
+    };
+    typedef butil::MRUCacheBase<std::string, SSL_SESSION*,
+                                SessionDeletor> SessionMap;
+
+    butil::Mutex _mutex;
+    SessionMap _sessions;
+};
+
+static void FreeSSLSessionCache(void*, void* ptr, CRYPTO_EX_DATA*,
+                                int, long, void*) {
+    delete static_cast<SSLSessionCache*>(ptr);
+}
+
+static int SSLSessionCacheIndex() {
+    static int index = SSL_CTX_get_ex_new_index(
+        0, NULL, NULL, NULL, FreeSSLSessionCache);
+    return index;
+}
+
+static bool GetSSLSessionKey(SSL* ssl, std::string* key) {
+    butil::EndPoint remote_side;
+    if (butil::get_remote_side(SSL_get_fd(ssl), &remote_side) != 0) {
+        return false;
+    }
+    key->assign(butil::endpoint2str(remote_side).c_str());
+#ifdef SSL_CTRL_SET_TLSEXT_HOSTNAME
+    const char* sni = SSL_get_servername(ssl, TLSEXT_NAMETYPE_host_name);
+    if (sni) {
+        key->push_back('|');
+        key->append(sni);
+    }
+#endif
+    return true;
+}
+
+// Called when the client receives a new session, which is sent after
+// handshake (as tickets) in TLSv1.3.
+static int OnNewClientSession(SSL* ssl, SSL_SESSION* session) {
+    SSLSessionCache* cache = static_cast<SSLSessionCache*>(
+        SSL_CTX_get_ex_data(SSL_get_SSL_CTX(ssl), SSLSessionCacheIndex()));
+    std::string key;
+    if (cache == NULL || !GetSSLSessionKey(ssl, &key)) {
+        return 0;
+    }
+#if OPENSSL_VERSION_NUMBER >= 0x10101000L
+    if (!SSL_SESSION_is_resumable(session)) {
+        return 0;
+    }
+    // Cache a copy for the same reason as in SSLSessionCache::Resume().
+    SSL_SESSION* copy = SSL_SESSION_dup(session);
+    if (copy == NULL) {
+        return 0;
+    }
+    cache->Put(key, copy);
+    return 0;
+#else
+    cache->Put(key, session);
+    // Own the reference of `session'.
+    return 1;
+#endif
+}
+
+static void EnableSSLSessionCache(SSL_CTX* ctx, int max_size) {
+    SSL_CTX_set_ex_data(ctx, SSLSessionCacheIndex(),
+                        new SSLSessionCache(max_size));
+    // Sessions are cached by us instead of the internal cache of OpenSSL,
+    // which is indexed by session id.
+    SSL_CTX_set_session_cache_mode(
+        ctx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+    SSL_CTX_sess_set_new_cb(ctx, OnNewClientSession);
+}
+
+bool ResumeSSLSession(SSL* ssl) {
+    SSLSessionCache* cache = static_cast<SSLSessionCache*>(
+        SSL_CTX_get_ex_data(SSL_get_SSL_CTX(ssl), SSLSessionCacheIndex()));
+    std::string key;
+    if (cache == NULL || !GetSSLSessionKey(ssl, &key)) {
+        return false;
+    }
+    return cache->Resume(key, ssl);
+}
+
+// Keys to encrypt session tickets, rotated periodically.
+class SessionTicketKeys {
+public:
+    struct Key {
+        unsigned char name[16];
+        unsigned char aes_key[32];
+        unsigned char hmac_key[32];
+    };
+
+    explicit SessionTicketKeys(int rotation_s)
+        : _rotation_s(rotation_s), _rotate_time_s(0), _has_previous(false) {}
+
+    // Get the current key, returns false on failure.
+    bool GetCurrent(Key* key) {
+        BAIDU_SCOPED_LOCK(_mutex);
+        if (!RotateIfNeeded()) {
+            return false;
+        }
+        *key = _current;
+        return true;
+    }
+
+    // Find the key of `name'. Returns 1 if it's the current key, 2 if it's
+    // the previous key(the ticket should be renewed), 0 if not found.
+    int Find(const unsigned char* name, Key* key) {
+        BAIDU_SCOPED_LOCK(_mutex);
+        if (!RotateIfNeeded()) {
+            return 0;
+        }
+        if (memcmp(name, _current.name, sizeof(_current.name)) == 0) {
+            *key = _current;
+            return 1;
+        }
+        if (_has_previous &&
+            memcmp(name, _previous.name, sizeof(_previous.name)) == 0) {
+            *key = _previous;
+            return 2;
+        }
+        return 0;
+    }
+
+private:
+    bool RotateIfNeeded() {
+        const int64_t now = butil::gettimeofday_s();
+        if (now < _rotate_time_s) {
+            return true;
+        }
+        Key key;
+        if (RAND_bytes((unsigned char*)&key, sizeof(key)) != 1) {
+            LOG(ERROR) << "Fail to generate session ticket key: "
+                       << SSLError(ERR_get_error());
+            return _rotate_time_s != 0;
+        }
+        // The current key becomes the previous one unless it has expired
+        // for more than one period, in which case no rotation happened in
+        // the last period.
+        _has_previous = (_rotate_time_s != 0 &&
+                         now < _rotate_time_s + _rotation_s);
+        _previous = _current;
+        _current = key;
+        _rotate_time_s = now + _rotation_s;
+        return true;
+    }
+
+    butil::Mutex _mutex;
+    const int _rotation_s;
+    int64_t _rotate_time_s;
+    bool _has_previous;
+    Key _current;
+    Key _previous;
+};
+
+static void FreeSessionTicketKeys(void*, void* ptr, CRYPTO_EX_DATA*,
+                                  int, long, void*) {
+    delete static_cast<SessionTicketKeys*>(ptr);
+}
+
+static int SessionTicketKeysIndex() {
+    static int index = SSL_CTX_get_ex_new_index(
+        0, NULL, NULL, NULL, FreeSessionTicketKeys);
+    return index;
+}
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+typedef EVP_MAC_CTX TicketMacCtx;
+#else
+typedef HMAC_CTX TicketMacCtx;
+#endif
+
+static int InitTicketMac(TicketMacCtx* hctx,
+                         const SessionTicketKeys::Key& key) {
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+    char digest[] = "sha256";
+    OSSL_PARAM params[] = {
+        OSSL_PARAM_construct_octet_string(
+            OSSL_MAC_PARAM_KEY, (void*)key.hmac_key, sizeof(key.hmac_key)),
+        OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST, digest, 0),
+        OSSL_PARAM_construct_end()
+    };
+    return EVP_MAC_CTX_set_params(hctx, params);
+#else
+    return HMAC_Init_ex(hctx, key.hmac_key, sizeof(key.hmac_key),
+                        EVP_sha256(), NULL);
+#endif
+}
+
+static int SessionTicketKeyCallback(
+        SSL* ssl, unsigned char* key_name, unsigned char* iv,
+        EVP_CIPHER_CTX* cctx, TicketMacCtx* hctx, int enc) {
+    SessionTicketKeys* keys = static_cast<SessionTicketKeys*>(
+        SSL_CTX_get_ex_data(SSL_get_SSL_CTX(ssl), SessionTicketKeysIndex()));
+    if (keys == NULL) {
+        return -1;
+    }
+    SessionTicketKeys::Key key;
+    if (enc) {
+        if (!keys->GetCurrent(&key) ||
+            RAND_bytes(iv, EVP_CIPHER_iv_length(EVP_aes_256_cbc())) != 1) {
+            return -1;
+        }
+        memcpy(key_name, key.name, sizeof(key.name));
+        if (EVP_EncryptInit_ex(cctx, EVP_aes_256_cbc(), NULL,
+                               key.aes_key, iv) != 1 ||
+            InitTicketMac(hctx, key) != 1) {
+            return -1;
+        }
+        return 1;
+    }
+    const int rc = keys->Find(key_name, &key);
+    if (rc == 0) {
+        // Unknown or expired key, do a full handshake.
+        return 0;
+    }
+    if (InitTicketMac(hctx, key) != 1 ||
+        EVP_DecryptInit_ex(cctx, EVP_aes_256_cbc(), NULL,
+                           key.aes_key, iv) != 1) {
+        return -1;
+    }
+    return rc;
+}
+
+static void EnableSessionTicketKeyRotation(SSL_CTX* ctx, int rotation_s) {
+    SSL_CTX_set_ex_data(ctx, SessionTicketKeysIndex(),
+                        new SessionTicketKeys(rotation_s));
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+    SSL_CTX_set_tlsext_ticket_key_evp_cb(ctx, SessionTicketKeyCallback);
+#else
+    SSL_CTX_set_tlsext_ticket_key_cb(ctx, SessionTicketKeyCallback);
+#endif
+}
+
 SSL_CTX* CreateClientSSLContext(const ChannelSSLOptions& options) {
     std::unique_ptr<SSL_CTX, FreeSSLCTX> ssl_ctx(
         SSL_CTX_new(SSLv23_client_method()));
@@ -506,7 +817,14 @@ SSL_CTX* CreateClientSSLContext(const ChannelSSLOptions& options) {
         SSL_CTX_set_alpn_protos(ssl_ctx.get(), alpn_list.data(), alpn_list.size());
     }
 
+    if (options.enable_ktls) {
+        EnableKTLS(ssl_ctx.get());
+    }
+
     SSL_CTX_set_session_cache_mode(ssl_ctx.get(), SSL_SESS_CACHE_CLIENT);
+    if (options.session_cache_size > 0) {
+        EnableSSLSessionCache(ssl_ctx.get(), options.session_cache_size);
+    }
     return ssl_ctx.release();
 }
 
@@ -544,8 +862,16 @@ SSL_CTX* CreateServerSSLContext(const std::string& certificate,
     }
 #endif  // SSL_MODE_RELEASE_BUFFERS
 
+    if (options.enable_ktls) {
+        EnableKTLS(ssl_ctx.get());
+    }
+
     SSL_CTX_set_timeout(ssl_ctx.get(), options.session_lifetime_s);
     SSL_CTX_sess_set_cache_size(ssl_ctx.get(), options.session_cache_size);
+    if (options.session_ticket_key_rotation_s > 0) {
+        EnableSessionTicketKeyRotation(ssl_ctx.get(),
+                                       options.session_ticket_key_rotation_s);
+    }
 
 #ifndef OPENSSL_NO_DH
     SSL_CTX_set_tmp_dh_callback(ssl_ctx.get(), SSLGetDHCallback);
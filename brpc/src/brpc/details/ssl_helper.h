@@ -99,10 +99,23 @@ SSL_CTX* CreateServerSSLContext(const std::string& certificate_file,
 // Set the required `fd' and mode. `id' will be set into SSL as app data.
 SSL* CreateSSLSession(SSL_CTX* ctx, SocketId id, int fd, bool server_mode);
 
+// Set the session cached by a previous connection to the same server
+// (remote endpoint and SNI) into the client-side `ssl' to resume it, if
+// ChannelSSLOptions.session_cache_size of the SSL_CTX is positive.
+// Returns true if a session is set.
+bool ResumeSSLSession(SSL* ssl);
+
 // Add a buffer layer of BIO in front of the socket fd layer,
 // which can reduce the total number of calls to system read/write
 void AddBIOBuffer(SSL* ssl, int fd, int bufsize);
 
+// Whether writes or reads of `ssl' are encrypted/decrypted by the kernel,
+// which is possible after handshake if the SSL_CTX has `enable_ktls'.
+// NOTE: BIOs of `ssl' can't be replaced (e.g. by AddBIOBuffer) once kTLS
+// is enabled.
+bool IsKTLSSendEnabled(SSL* ssl);
+bool IsKTLSRecvEnabled(SSL* ssl);
+
 // Judge whether the underlying channel of `fd' is using SSL
 // If the return value is SSL_UNKNOWN, `error_code' will be
 // set to indicate the reason (0 for EOF)
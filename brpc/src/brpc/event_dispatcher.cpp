@@ -71,6 +71,12 @@ EventDispatcher& GetGlobalEventDispatcher(int fd, bthread_tag_t tag) {
     return g_edisp[tag * FLAGS_event_dispatcher_num + index];
 }
 
+EventDispatcher& GetGlobalEventDispatcherByIndex(int index, bthread_tag_t tag) {
+    pthread_once(&g_edisp_once, InitializeGlobalDispatchers);
+    return g_edisp[tag * FLAGS_event_dispatcher_num +
+                   index % FLAGS_event_dispatcher_num];
+}
+
 int IOEventData::OnCreated(const IOEventDataOptions& options) {
     if (!options.input_cb) {
         LOG(ERROR) << "Invalid input_cb=NULL";
@@ -92,6 +98,7 @@ void IOEventData::BeforeRecycled() {
 } // namespace brpc
 
 #if defined(OS_LINUX)
+    #include "brpc/event_dispatcher_io_uring.cpp"
     #include "brpc/event_dispatcher_epoll.cpp"
 #elif defined(OS_MACOSX)
     #include "brpc/event_dispatcher_kqueue.cpp"
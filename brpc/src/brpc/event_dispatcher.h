@@ -87,6 +87,8 @@ namespace rdma {
 class RdmaEndpoint;
 }
 
+class IoUringPoller;
+
 // Dispatch edge-triggered events of file descriptors to consumers
 // running in separate bthreads.
 class EventDispatcher {
@@ -170,9 +172,14 @@ private:
         return OnEvent<false>(event_data_id, events, thread_attr);
     }
 
-    // The epoll/kqueue fd to watch events.
+    // The epoll/kqueue/io_uring fd to watch events.
     int _event_dispatcher_fd;
 
+    // Non-NULL iff -event_dispatcher_use_io_uring is on and io_uring is
+    // supported, in which case events are polled by io_uring instead of
+    // epoll. Always NULL on platforms other than linux.
+    IoUringPoller* _io_uring;
+
     // false unless Stop() is called.
     volatile bool _stop;
 
@@ -188,6 +195,9 @@ private:
 
 EventDispatcher& GetGlobalEventDispatcher(int fd, bthread_tag_t tag);
 
+// Get the `index'-th(modulo -event_dispatcher_num) dispatcher of `tag'.
+EventDispatcher& GetGlobalEventDispatcherByIndex(int index, bthread_tag_t tag);
+
 // IOEvent class manages the IO events of a file descriptor conveniently.
 template <typename T>
 class IOEvent {
@@ -195,7 +205,8 @@ public:
     IOEvent()
         : _init(false)
         , _event_data_id(INVALID_IO_EVENT_DATA_ID)
-        , _bthread_tag(bthread_self_tag()) {}
+        , _bthread_tag(bthread_self_tag())
+        , _event_dispatcher_index(-1) {}
 
     ~IOEvent() { Reset(); }
 
@@ -228,8 +239,7 @@ public:
             LOG(ERROR) << "IOEvent has not been initialized";
             return -1;
         }
-        return GetGlobalEventDispatcher(fd, _bthread_tag)
-            .AddConsumer(_event_data_id, fd);
+        return GetEventDispatcher(fd).AddConsumer(_event_data_id, fd);
     }
 
     // See comments of `EventDispatcher::RemoveConsumer'.
@@ -238,7 +248,7 @@ public:
             LOG(ERROR) << "IOEvent has not been initialized";
             return -1;
         }
-        return GetGlobalEventDispatcher(fd, _bthread_tag).RemoveConsumer(fd);
+        return GetEventDispatcher(fd).RemoveConsumer(fd);
     }
 
     // See comments of `EventDispatcher::RegisterEvent'.
@@ -247,8 +257,7 @@ public:
             LOG(ERROR) << "IOEvent has not been initialized";
             return -1;
         }
-        return GetGlobalEventDispatcher(fd, _bthread_tag)
-            .RegisterEvent(_event_data_id, fd, pollin);
+        return GetEventDispatcher(fd).RegisterEvent(_event_data_id, fd, pollin);
     }
 
     // See comments of `EventDispatcher::UnregisterEvent'.
@@ -257,8 +266,7 @@ public:
             LOG(ERROR) << "IOEvent has not been initialized";
             return -1;
         }
-        return GetGlobalEventDispatcher(fd, _bthread_tag)
-            .UnregisterEvent(_event_data_id, fd, pollin);
+        return GetEventDispatcher(fd).UnregisterEvent(_event_data_id, fd, pollin);
     }
 
     void set_bthread_tag(bthread_tag_t bthread_tag) {
@@ -268,7 +276,21 @@ public:
         return _bthread_tag;
     }
 
+    // Watch events in the `index'-th dispatcher of the tag instead of the
+    // one selected by hashing the fd. Negative `index' restores hashing.
+    void set_event_dispatcher_index(int index) {
+        _event_dispatcher_index = index;
+    }
+
 private:
+    EventDispatcher& GetEventDispatcher(int fd) const {
+        if (_event_dispatcher_index < 0) {
+            return GetGlobalEventDispatcher(fd, _bthread_tag);
+        }
+        return GetGlobalEventDispatcherByIndex(_event_dispatcher_index,
+                                               _bthread_tag);
+    }
+
     // Generic callback to handle input event.
     static int OnInputEvent(void* user_data, uint32_t events,
                             const bthread_attr_t& thread_attr) {
@@ -294,6 +316,7 @@ private:
     bool _init;
     IOEventDataId _event_data_id;
     bthread_tag_t _bthread_tag;
+    int _event_dispatcher_index;
 };
 
 } // namespace brpc
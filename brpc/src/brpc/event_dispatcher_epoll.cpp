@@ -24,15 +24,26 @@ namespace brpc {
 
 EventDispatcher::EventDispatcher()
     : _event_dispatcher_fd(-1)
+    , _io_uring(NULL)
     , _stop(false)
     , _tid(0)
     , _thread_attr(BTHREAD_ATTR_NORMAL) {
-    _event_dispatcher_fd = epoll_create(1024 * 1024);
-    if (_event_dispatcher_fd < 0) {
-        PLOG(FATAL) << "Fail to create epoll";
-        return;
+    if (FLAGS_event_dispatcher_use_io_uring) {
+        _io_uring = IoUringPoller::Create(FLAGS_event_dispatcher_io_uring_entries);
+        if (_io_uring == NULL) {
+            LOG(WARNING) << "Fail to create io_uring, fall back to epoll";
+        }
+    }
+    if (_io_uring) {
+        _event_dispatcher_fd = _io_uring->fd();
+    } else {
+        _event_dispatcher_fd = epoll_create(1024 * 1024);
+        if (_event_dispatcher_fd < 0) {
+            PLOG(FATAL) << "Fail to create epoll";
+            return;
+        }
+        CHECK_EQ(0, butil::make_close_on_exec(_event_dispatcher_fd));
     }
-    CHECK_EQ(0, butil::make_close_on_exec(_event_dispatcher_fd));
 
     _wakeup_fds[0] = -1;
     _wakeup_fds[1] = -1;
@@ -45,6 +56,12 @@ EventDispatcher::EventDispatcher()
 EventDispatcher::~EventDispatcher() {
     Stop();
     Join();
+    if (_io_uring) {
+        // The io_uring fd is closed by IoUringPoller.
+        delete _io_uring;
+        _io_uring = NULL;
+        _event_dispatcher_fd = -1;
+    }
     if (_event_dispatcher_fd >= 0) {
         close(_event_dispatcher_fd);
         _event_dispatcher_fd = -1;
@@ -96,7 +113,17 @@ bool EventDispatcher::Running() const {
 void EventDispatcher::Stop() {
     _stop = true;
 
-    if (_event_dispatcher_fd >= 0) {
+    if (_io_uring) {
+        // Fails with EAGAIN when CQ is overflowed, which is being drained
+        // by the dispatcher.
+        for (int i = 0; _io_uring->Wakeup() != 0; ++i) {
+            if (errno != EAGAIN || i >= 1000) {
+                PLOG(ERROR) << "Fail to wake up io_uring";
+                break;
+            }
+            usleep(1000);
+        }
+    } else if (_event_dispatcher_fd >= 0) {
         epoll_event evt = { EPOLLOUT,  { NULL } };
         epoll_ctl(_event_dispatcher_fd, EPOLL_CTL_ADD, _wakeup_fds[1], &evt);
     }
@@ -124,12 +151,18 @@ int EventDispatcher::RegisterEvent(IOEventDataId event_data_id,
 #endif
     if (pollin) {
         evt.events |= EPOLLIN;
+        if (_io_uring) {
+            return _io_uring->ModifyPoll(event_data_id, fd, evt.events);
+        }
         if (epoll_ctl(_event_dispatcher_fd, EPOLL_CTL_MOD, fd, &evt) < 0) {
             // This fd has been removed from epoll via `RemoveConsumer',
             // in which case errno will be ENOENT
             return -1;
         }
     } else {
+        if (_io_uring) {
+            return _io_uring->AddPoll(event_data_id, fd, evt.events);
+        }
         if (epoll_ctl(_event_dispatcher_fd, EPOLL_CTL_ADD, fd, &evt) < 0) {
             return -1;
         }
@@ -146,8 +179,14 @@ int EventDispatcher::UnregisterEvent(IOEventDataId event_data_id,
 #ifdef BRPC_SOCKET_HAS_EOF
         evt.events |= has_epollrdhup;
 #endif
+        if (_io_uring) {
+            return _io_uring->ModifyPoll(event_data_id, fd, evt.events);
+        }
         return epoll_ctl(_event_dispatcher_fd, EPOLL_CTL_MOD, fd, &evt);
     } else {
+        if (_io_uring) {
+            return _io_uring->RemovePoll(fd);
+        }
         return epoll_ctl(_event_dispatcher_fd, EPOLL_CTL_DEL, fd, NULL);
     }
     return -1;
@@ -164,6 +203,9 @@ int EventDispatcher::AddConsumer(IOEventDataId event_data_id, int fd) {
 #ifdef BRPC_SOCKET_HAS_EOF
     evt.events |= has_epollrdhup;
 #endif
+    if (_io_uring) {
+        return _io_uring->AddPoll(event_data_id, fd, evt.events);
+    }
     return epoll_ctl(_event_dispatcher_fd, EPOLL_CTL_ADD, fd, &evt);
 }
 
@@ -177,7 +219,15 @@ int EventDispatcher::RemoveConsumer(int fd) {
     // remove the fd from epoll. More badly, the fd will not be removable
     // from epoll again! If the fd was level-triggered and there's data left,
     // epoll_wait will keep returning events of the fd continuously, making
-    // program abnormal.
+    // program abnormal. The same applies to io_uring in which a poll request
+    // holds a reference of the file until it's cancelled.
+    if (_io_uring) {
+        if (_io_uring->RemovePoll(fd) < 0) {
+            PLOG(WARNING) << "Fail to remove fd=" << fd << " from io_uring";
+            return -1;
+        }
+        return 0;
+    }
     if (epoll_ctl(_event_dispatcher_fd, EPOLL_CTL_DEL, fd, NULL) < 0) {
         PLOG(WARNING) << "Fail to remove fd=" << fd << " from epfd=" << _event_dispatcher_fd;
         return -1;
@@ -194,16 +244,23 @@ void EventDispatcher::Run() {
     LOG(INFO) << "epoll bthread id:" << _tid;
     while (!_stop) {
         epoll_event e[32];
+        int n = 0;
+        if (_io_uring) {
+            // Events are translated into epoll_event so that the callbacks
+            // below are shared by both backends.
+            n = _io_uring->Wait(e, ARRAY_SIZE(e));
+        } else {
 #ifdef BRPC_ADDITIONAL_EPOLL
-        // Performance downgrades in examples.
-        int n = epoll_wait(_event_dispatcher_fd, e, ARRAY_SIZE(e), 0);
-        if (n == 0) {
-            n = epoll_wait(_event_dispatcher_fd, e, ARRAY_SIZE(e), -1);
-        }
+            // Performance downgrades in examples.
+            n = epoll_wait(_event_dispatcher_fd, e, ARRAY_SIZE(e), 0);
+            if (n == 0) {
+                n = epoll_wait(_event_dispatcher_fd, e, ARRAY_SIZE(e), -1);
+            }
 #else
-        const int n = epoll_wait(_event_dispatcher_fd, e, ARRAY_SIZE(e), -1);
-        LOG(INFO) << "epoll_wait:" << n;
+            n = epoll_wait(_event_dispatcher_fd, e, ARRAY_SIZE(e), -1);
+            LOG(INFO) << "epoll_wait:" << n;
 #endif
+        }
         if (_stop) {
             // epoll_ctl/epoll_wait should have some sort of memory fencing
             // guaranteeing that we(after epoll_wait) see _stop set before
@@ -215,7 +272,7 @@ void EventDispatcher::Run() {
                 // We've checked _stop, no wake-up will be missed.
                 continue;
             }
-            PLOG(FATAL) << "Fail to epoll_wait epfd=" << _event_dispatcher_fd;
+            PLOG(FATAL) << "Fail to wait events on fd=" << _event_dispatcher_fd;
             break;
         }
         for (int i = 0; i < n; ++i) {
@@ -0,0 +1,575 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <vector>
+#include "butil/containers/flat_map.h"
+#include "butil/fd_guard.h"
+#include "butil/synchronization/lock.h"
+// Included after butil headers since <linux/fs.h> included by it defines
+// BLOCK_SIZE which conflicts with the one in butil/single_threaded_pool.h
+#include <linux/io_uring.h>
+
+namespace brpc {
+
+DEFINE_bool(event_dispatcher_use_io_uring, false,
+            "Poll events of file descriptors with io_uring(multishot "
+            "IORING_OP_POLL_ADD, linux >= 5.13) instead of epoll. Fall back "
+            "to epoll when io_uring is not available");
+DEFINE_int32(event_dispatcher_io_uring_entries, 4096,
+             "Number of SQ entries of each io_uring, CQ is 4 times larger");
+
+// Polls file descriptors with multishot IORING_OP_POLL_ADD and mimics the
+// interface of epoll_ctl/epoll_wait so that EventDispatcher can switch to
+// it transparently. A ring is not thread-safe: submissions are serialized
+// by _mutex, while completions are only consumed by the dispatching bthread.
+//
+// Each watched fd owns a PollEntry whose address is the user_data of the
+// poll request. The entry is only destroyed after the final CQE (the one
+// without IORING_CQE_F_MORE) of the cancelled request has been reaped, so
+// CQEs never reference freed memory.
+//
+// SQEs are submitted right after being prepared, and the ones not consumed
+// by the kernel are dropped, so the SQ is always empty out of _mutex and an
+// operation either takes effect or fails with EAGAIN. Otherwise a blocked
+// Wait() would not submit the remaining SQEs until some CQE arrived.
+class IoUringPoller {
+public:
+    // Returns NULL when io_uring is not supported (by the kernel or the
+    // seccomp policy of the container).
+    static IoUringPoller* Create(unsigned entries);
+    ~IoUringPoller();
+
+    int fd() const { return _ring_fd; }
+
+    // Same semantics as EPOLL_CTL_ADD/EPOLL_CTL_MOD/EPOLL_CTL_DEL.
+    int AddPoll(IOEventDataId event_data_id, int fd, uint32_t events);
+    int ModifyPoll(IOEventDataId event_data_id, int fd, uint32_t events);
+    int RemovePoll(int fd);
+
+    // Make a blocking Wait() return.
+    int Wakeup();
+
+    // Block until some CQEs are reaped. Returns number of events filled
+    // into `e' which may be 0 when the CQEs are not poll events.
+    int Wait(epoll_event* e, int max_events);
+
+private:
+    struct PollEntry {
+        IOEventDataId event_data_id;
+        int fd;
+        uint32_t events;
+        // Set when the poll request was cancelled, the entry will be
+        // deleted on its final CQE.
+        bool cancelled;
+    };
+
+    // user_data of requests whose completions are ignored.
+    static const uint64_t IGNORED_USER_DATA = 0;
+
+    IoUringPoller();
+    int Init(unsigned entries);
+    int ProbeMultishotPoll();
+
+    // Following functions must be called with _mutex held.
+    io_uring_sqe* GetSqe();
+    // Submit all prepared SQEs. SQEs not consumed by the kernel (CQ is
+    // overflowed or the kernel is short of memory) are dropped.
+    // Returns number of dropped SQEs, errno is set when it's positive.
+    int Submit();
+    int PrepareAdd(PollEntry* entry);
+    int PrepareCancel(PollEntry* entry);
+
+    // Rearm polls terminated by the kernel. Those failed to be submitted
+    // are left in _rearming_entries and retried by next Wait().
+    void RearmPolls();
+
+    int _ring_fd;
+
+    // SQ ring.
+    void* _sq_ring_ptr;
+    size_t _sq_ring_size;
+    unsigned* _sq_khead;
+    unsigned* _sq_ktail;
+    unsigned _sq_mask;
+    unsigned _sq_entries;
+    unsigned* _sq_array;
+    io_uring_sqe* _sqes;
+    size_t _sqes_size;
+    unsigned _sq_tail;
+
+    // CQ ring. Shares the mmap with SQ ring if IORING_FEAT_SINGLE_MMAP.
+    void* _cq_ring_ptr;
+    size_t _cq_ring_size;
+    unsigned* _cq_khead;
+    unsigned* _cq_ktail;
+    unsigned _cq_mask;
+    io_uring_cqe* _cqes;
+
+    butil::Mutex _mutex;
+    butil::FlatMap<int, PollEntry*> _entries;
+    // Only accessed by Wait().
+    std::vector<PollEntry*> _rearming_entries;
+};
+
+IoUringPoller::IoUringPoller()
+    : _ring_fd(-1)
+    , _sq_ring_ptr(MAP_FAILED)
+    , _sq_ring_size(0)
+    , _sq_khead(NULL)
+    , _sq_ktail(NULL)
+    , _sq_mask(0)
+    , _sq_entries(0)
+    , _sq_array(NULL)
+    , _sqes((io_uring_sqe*)MAP_FAILED)
+    , _sqes_size(0)
+    , _sq_tail(0)
+    , _cq_ring_ptr(MAP_FAILED)
+    , _cq_ring_size(0)
+    , _cq_khead(NULL)
+    , _cq_ktail(NULL)
+    , _cq_mask(0)
+    , _cqes(NULL) {}
+
+IoUringPoller::~IoUringPoller() {
+    for (butil::FlatMap<int, PollEntry*>::iterator
+             it = _entries.begin(); it != _entries.end(); ++it) {
+        delete it->second;
+    }
+    _entries.clear();
+    if (_sqes != MAP_FAILED) {
+        munmap(_sqes, _sqes_size);
+    }
+    if (_cq_ring_ptr != MAP_FAILED && _cq_ring_ptr != _sq_ring_ptr) {
+        munmap(_cq_ring_ptr, _cq_ring_size);
+    }
+    if (_sq_ring_ptr != MAP_FAILED) {
+        munmap(_sq_ring_ptr, _sq_ring_size);
+    }
+    if (_ring_fd >= 0) {
+        close(_ring_fd);
+    }
+    // Entries of cancelled requests whose final CQEs were not reaped are
+    // leaked intentionally: the ring is only destroyed at exit.
+}
+
+IoUringPoller* IoUringPoller::Create(unsigned entries) {
+    IoUringPoller* p = new (std::nothrow) IoUringPoller;
+    if (p == NULL) {
+        return NULL;
+    }
+    if (p->Init(entries) != 0) {
+        delete p;
+        return NULL;
+    }
+    return p;
+}
+
+int IoUringPoller::Init(unsigned entries) {
+    if (_entries.init(1024) != 0) {
+        LOG(ERROR) << "Fail to init _entries";
+        return -1;
+    }
+    io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    // Multishot polls are terminated when CQ overflows, make CQ large
+    // enough to hold bursts of events of all watched fds.
+    params.flags = IORING_SETUP_CQSIZE;
+    params.cq_entries = entries * 4;
+    _ring_fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (_ring_fd < 0) {
+        PLOG(WARNING) << "Fail to setup io_uring";
+        return -1;
+    }
+    if (butil::make_close_on_exec(_ring_fd) != 0) {
+        PLOG(WARNING) << "Fail to make io_uring fd close-on-exec";
+        return -1;
+    }
+    if (!(params.features & IORING_FEAT_NODROP)) {
+        // Without NODROP, events are silently lost on CQ overflow.
+        LOG(WARNING) << "io_uring of this kernel is too old";
+        return -1;
+    }
+
+    _sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    _cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        _sq_ring_size = std::max(_sq_ring_size, _cq_ring_size);
+        _cq_ring_size = _sq_ring_size;
+    }
+    _sq_ring_ptr = mmap(NULL, _sq_ring_size, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, _ring_fd, IORING_OFF_SQ_RING);
+    if (_sq_ring_ptr == MAP_FAILED) {
+        PLOG(WARNING) << "Fail to mmap SQ ring";
+        return -1;
+    }
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        _cq_ring_ptr = _sq_ring_ptr;
+    } else {
+        _cq_ring_ptr = mmap(NULL, _cq_ring_size, PROT_READ | PROT_WRITE,
+                            MAP_SHARED | MAP_POPULATE, _ring_fd, IORING_OFF_CQ_RING);
+        if (_cq_ring_ptr == MAP_FAILED) {
+            PLOG(WARNING) << "Fail to mmap CQ ring";
+            return -1;
+        }
+    }
+    _sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+    _sqes = (io_uring_sqe*)mmap(NULL, _sqes_size, PROT_READ | PROT_WRITE,
+                                MAP_SHARED | MAP_POPULATE, _ring_fd, IORING_OFF_SQES);
+    if (_sqes == MAP_FAILED) {
+        PLOG(WARNING) << "Fail to mmap SQEs";
+        return -1;
+    }
+
+    char* sq = (char*)_sq_ring_ptr;
+    _sq_khead = (unsigned*)(sq + params.sq_off.head);
+    _sq_ktail = (unsigned*)(sq + params.sq_off.tail);
+    _sq_mask = *(unsigned*)(sq + params.sq_off.ring_mask);
+    _sq_entries = *(unsigned*)(sq + params.sq_off.ring_entries);
+    _sq_array = (unsigned*)(sq + params.sq_off.array);
+    _sq_tail = *_sq_ktail;
+
+    char* cq = (char*)_cq_ring_ptr;
+    _cq_khead = (unsigned*)(cq + params.cq_off.head);
+    _cq_ktail = (unsigned*)(cq + params.cq_off.tail);
+    _cq_mask = *(unsigned*)(cq + params.cq_off.ring_mask);
+    _cqes = (io_uring_cqe*)(cq + params.cq_off.cqes);
+
+    return ProbeMultishotPoll();
+}
+
+int IoUringPoller::ProbeMultishotPoll() {
+    // IORING_POLL_ADD_MULTI was added in linux 5.13, older kernels fail
+    // the request with EINVAL. Probe it with a poll on an eventfd which
+    // never becomes readable and is cancelled right away.
+    butil::fd_guard efd(eventfd(0, EFD_CLOEXEC));
+    if (efd < 0) {
+        PLOG(WARNING) << "Fail to create eventfd";
+        return -1;
+    }
+    PollEntry probe_entry = { INVALID_IO_EVENT_DATA_ID, efd, EPOLLIN, false };
+    {
+        BAIDU_SCOPED_LOCK(_mutex);
+        if (PrepareAdd(&probe_entry) != 0 ||
+            PrepareCancel(&probe_entry) != 0 || Submit() != 0) {
+            PLOG(WARNING) << "Fail to submit probing requests";
+            return -1;
+        }
+    }
+    int poll_res = 0;
+    for (int ncqe = 0; ncqe < 2;) {
+        unsigned head = *_cq_khead;
+        const unsigned tail = __atomic_load_n(_cq_ktail, __ATOMIC_ACQUIRE);
+        if (head == tail) {
+            if (syscall(__NR_io_uring_enter, _ring_fd, 0, 1,
+                        IORING_ENTER_GETEVENTS, NULL, 0) < 0 && errno != EINTR) {
+                PLOG(WARNING) << "Fail to wait for probing requests";
+                return -1;
+            }
+            continue;
+        }
+        for (; head != tail; ++head, ++ncqe) {
+            const io_uring_cqe* cqe = &_cqes[head & _cq_mask];
+            if (cqe->user_data == (uint64_t)&probe_entry) {
+                poll_res = cqe->res;
+            }
+        }
+        __atomic_store_n(_cq_khead, head, __ATOMIC_RELEASE);
+    }
+    if (poll_res != -ECANCELED) {
+        LOG(WARNING) << "IORING_POLL_ADD_MULTI is not supported: "
+                     << berror(-poll_res);
+        return -1;
+    }
+    return 0;
+}
+
+io_uring_sqe* IoUringPoller::GetSqe() {
+    const unsigned head = __atomic_load_n(_sq_khead, __ATOMIC_ACQUIRE);
+    if (_sq_tail - head >= _sq_entries) {
+        // Prepared too many SQEs without submitting them.
+        errno = EAGAIN;
+        return NULL;
+    }
+    const unsigned index = _sq_tail & _sq_mask;
+    io_uring_sqe* sqe = &_sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    _sq_array[index] = index;
+    ++_sq_tail;
+    return sqe;
+}
+
+int IoUringPoller::Submit() {
+    const unsigned to_submit =
+        _sq_tail - __atomic_load_n(_sq_khead, __ATOMIC_ACQUIRE);
+    if (to_submit == 0) {
+        return 0;
+    }
+    __atomic_store_n(_sq_ktail, _sq_tail, __ATOMIC_RELEASE);
+    int rc = 0;
+    do {
+        rc = syscall(__NR_io_uring_enter, _ring_fd, to_submit, 0, 0, NULL, 0);
+    } while (rc < 0 && errno == EINTR);
+    const int saved_errno = errno;
+    const unsigned head = __atomic_load_n(_sq_khead, __ATOMIC_ACQUIRE);
+    const unsigned ndropped = _sq_tail - head;
+    if (ndropped == 0) {
+        return 0;
+    }
+    // Partially submitted when CQ is overflowed, or failed with EBUSY
+    // (CQ is overflowed, older kernels) or EAGAIN (the kernel is short of
+    // memory). Don't retry here: the CQ is only drained by Wait() which may
+    // be the caller. SQEs are only submitted with _mutex held and there's no
+    // SQPOLL thread, so the remaining SQEs can be taken back safely.
+    _sq_tail = head;
+    __atomic_store_n(_sq_ktail, head, __ATOMIC_RELEASE);
+    errno = ((rc >= 0 || saved_errno == EBUSY) ? EAGAIN : saved_errno);
+    return ndropped;
+}
+
+int IoUringPoller::PrepareAdd(PollEntry* entry) {
+    io_uring_sqe* sqe = GetSqe();
+    if (sqe == NULL) {
+        return -1;
+    }
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = entry->fd;
+    sqe->len = IORING_POLL_ADD_MULTI;
+    // EPOLLET is kept by io_uring, the multishot poll reports an event at
+    // each wakeup of the fd, which is what edge-triggered epoll does.
+    sqe->poll32_events = entry->events;
+    sqe->user_data = (uint64_t)entry;
+    return 0;
+}
+
+int IoUringPoller::PrepareCancel(PollEntry* entry) {
+    io_uring_sqe* sqe = GetSqe();
+    if (sqe == NULL) {
+        return -1;
+    }
+    sqe->opcode = IORING_OP_POLL_REMOVE;
+    sqe->fd = -1;
+    sqe->addr = (uint64_t)entry;
+    sqe->user_data = IGNORED_USER_DATA;
+    entry->cancelled = true;
+    return 0;
+}
+
+int IoUringPoller::AddPoll(IOEventDataId event_data_id, int fd, uint32_t events) {
+    BAIDU_SCOPED_LOCK(_mutex);
+    if (_entries.seek(fd) != NULL) {
+        errno = EEXIST;
+        return -1;
+    }
+    PollEntry* entry = new (std::nothrow) PollEntry;
+    if (entry == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    entry->event_data_id = event_data_id;
+    entry->fd = fd;
+    entry->events = events;
+    entry->cancelled = false;
+    if (PrepareAdd(entry) != 0 || Submit() != 0) {
+        delete entry;
+        return -1;
+    }
+    _entries[fd] = entry;
+    return 0;
+}
+
+int IoUringPoller::ModifyPoll(IOEventDataId event_data_id, int fd, uint32_t events) {
+    BAIDU_SCOPED_LOCK(_mutex);
+    PollEntry** old_entry = _entries.seek(fd);
+    if (old_entry == NULL) {
+        errno = ENOENT;
+        return -1;
+    }
+    // Replace the poll request instead of using IORING_POLL_UPDATE_EVENTS
+    // so that readiness is re-checked as EPOLL_CTL_MOD does.
+    PollEntry* entry = new (std::nothrow) PollEntry;
+    if (entry == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    entry->event_data_id = event_data_id;
+    entry->fd = fd;
+    entry->events = events;
+    entry->cancelled = false;
+    if (PrepareCancel(*old_entry) != 0) {
+        delete entry;
+        return -1;
+    }
+    int ndropped = 0;
+    if (PrepareAdd(entry) == 0) {
+        ndropped = Submit();
+    } else {
+        // Submit the cancellation only.
+        ndropped = 1 + Submit();
+    }
+    if (ndropped == 0) {
+        *old_entry = entry;
+        return 0;
+    }
+    const int saved_errno = errno;
+    delete entry;
+    if (ndropped == 1) {
+        // The old poll was cancelled while the new one was not added.
+        _entries.erase(fd);
+    } else {
+        // Nothing changed.
+        (*old_entry)->cancelled = false;
+    }
+    errno = saved_errno;
+    return -1;
+}
+
+int IoUringPoller::RemovePoll(int fd) {
+    BAIDU_SCOPED_LOCK(_mutex);
+    PollEntry** entry = _entries.seek(fd);
+    if (entry == NULL) {
+        errno = ENOENT;
+        return -1;
+    }
+    if (PrepareCancel(*entry) != 0) {
+        return -1;
+    }
+    if (Submit() != 0) {
+        (*entry)->cancelled = false;
+        return -1;
+    }
+    _entries.erase(fd);
+    return 0;
+}
+
+int IoUringPoller::Wakeup() {
+    BAIDU_SCOPED_LOCK(_mutex);
+    io_uring_sqe* sqe = GetSqe();
+    if (sqe == NULL) {
+        return -1;
+    }
+    sqe->opcode = IORING_OP_NOP;
+    sqe->user_data = IGNORED_USER_DATA;
+    return Submit() == 0 ? 0 : -1;
+}
+
+void IoUringPoller::RearmPolls() {
+    BAIDU_SCOPED_LOCK(_mutex);
+    std::vector<PollEntry*>& entries = _rearming_entries;
+    size_t nprepared = 0;
+    size_t i = 0;
+    for (; i < entries.size(); ++i) {
+        PollEntry* entry = entries[i];
+        if (entry->cancelled) {
+            // Removed or modified before being rearmed, no CQE references it.
+            delete entry;
+            continue;
+        }
+        if (PrepareAdd(entry) != 0) {
+            // SQ is full.
+            break;
+        }
+        entries[nprepared++] = entry;
+    }
+    const size_t ndropped = Submit();
+    if (ndropped != 0) {
+        PLOG(WARNING) << "Fail to rearm " << ndropped << " polls, retry later";
+    }
+    // Keep entries whose SQEs were dropped or not prepared.
+    size_t n = 0;
+    for (size_t j = nprepared - ndropped; j < nprepared; ++j) {
+        entries[n++] = entries[j];
+    }
+    for (size_t j = i; j < entries.size(); ++j) {
+        entries[n++] = entries[j];
+    }
+    entries.resize(n);
+}
+
+int IoUringPoller::Wait(epoll_event* e, int max_events) {
+    if (!_rearming_entries.empty()) {
+        RearmPolls();
+    }
+    unsigned head = *_cq_khead;
+    unsigned tail = __atomic_load_n(_cq_ktail, __ATOMIC_ACQUIRE);
+    if (head == tail) {
+        int rc = 0;
+        if (_rearming_entries.empty()) {
+            rc = syscall(__NR_io_uring_enter, _ring_fd, 0, 1,
+                         IORING_ENTER_GETEVENTS, NULL, 0);
+        } else {
+            // Don't block forever, retry rearming the polls soon.
+            __kernel_timespec ts = { 0, 1000000 };
+            io_uring_getevents_arg arg;
+            memset(&arg, 0, sizeof(arg));
+            arg.ts = (uint64_t)&ts;
+            rc = syscall(__NR_io_uring_enter, _ring_fd, 0, 1,
+                         IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG,
+                         &arg, sizeof(arg));
+            if (rc < 0 && errno == ETIME) {
+                rc = 0;
+            }
+        }
+        if (rc < 0) {
+            return -1;
+        }
+        tail = __atomic_load_n(_cq_ktail, __ATOMIC_ACQUIRE);
+    }
+    int n = 0;
+    bool terminated = false;
+    for (; head != tail && n < max_events; ++head) {
+        const io_uring_cqe* cqe = &_cqes[head & _cq_mask];
+        if (cqe->user_data == IGNORED_USER_DATA) {
+            continue;
+        }
+        PollEntry* entry = (PollEntry*)cqe->user_data;
+        if (cqe->res > 0) {
+            e[n].events = cqe->res;
+            e[n].data.u64 = entry->event_data_id;
+            ++n;
+        }
+        if (cqe->flags & IORING_CQE_F_MORE) {
+            continue;
+        }
+        // The multishot poll terminated.
+        BAIDU_SCOPED_LOCK(_mutex);
+        if (entry->cancelled) {
+            delete entry;
+        } else if (cqe->res >= 0) {
+            // Terminated by kernel (e.g. CQ overflowed), rearm it after
+            // the CQEs are reaped.
+            _rearming_entries.push_back(entry);
+            terminated = true;
+        } else {
+            LOG(ERROR) << "Fail to poll fd=" << entry->fd
+                       << ": " << berror(-cqe->res);
+            _entries.erase(entry->fd);
+            delete entry;
+        }
+    }
+    __atomic_store_n(_cq_khead, head, __ATOMIC_RELEASE);
+    if (terminated) {
+        RearmPolls();
+    }
+    return n;
+}
+
+} // namespace brpc
@@ -24,6 +24,7 @@ namespace brpc {
 
 EventDispatcher::EventDispatcher()
     : _event_dispatcher_fd(-1)
+    , _io_uring(NULL)
     , _stop(false)
     , _tid(0)
     , _thread_attr(BTHREAD_ATTR_NORMAL) {
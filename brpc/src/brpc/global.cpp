@@ -59,6 +59,8 @@
 #include "brpc/compress.h"
 #include "brpc/policy/gzip_compress.h"
 #include "brpc/policy/snappy_compress.h"
+#include "brpc/policy/lz4_compress.h"
+#include "brpc/policy/zstd_compress.h"
 
 // Protocols
 #include "brpc/protocol.h"
@@ -97,6 +99,7 @@
 #endif
 #include "butil/fd_guard.h"
 #include "butil/files/file_watcher.h"
+#include "butil/iobuf_arena.h"
 
 extern "C" {
 // defined in gperftools/malloc_extension_c.h
@@ -112,6 +115,10 @@ DEFINE_int32(free_memory_to_system_interval, 0,
              "values <= 0 disables this feature");
 BRPC_VALIDATE_GFLAG(free_memory_to_system_interval, PassValidate);
 
+DEFINE_bool(iobuf_use_arena, false,
+            "Allocate blocks of IOBuf from hugepage-backed arenas of NUMA "
+            "nodes instead of malloc, can't be turned off once enabled");
+
 namespace policy {
 // Defined in http_rpc_protocol.cpp
 void InitCommonStrings();
@@ -201,6 +208,39 @@ static int64_t GetIOBufNewBigViewCount(void*) {
 static int64_t GetIOBufBlockMemory(void*) {
     return butil::IOBuf::block_memory();
 }
+static int64_t GetIOBufArenaCarvedMemory(void* arg) {
+    butil::iobuf::ArenaStat stat;
+    butil::iobuf::get_arena_stat((int)(intptr_t)arg, &stat);
+    return stat.carved_bytes;
+}
+static int64_t GetIOBufArenaUsedMemory(void* arg) {
+    butil::iobuf::ArenaStat stat;
+    butil::iobuf::get_arena_stat((int)(intptr_t)arg, &stat);
+    return stat.used_bytes;
+}
+static int64_t GetIOBufArenaFallbackCount(void*) {
+    butil::iobuf::ArenaStat stat;
+    butil::iobuf::get_arena_stat(-1, &stat);
+    return stat.fallback_count;
+}
+static int64_t GetIOBufTLSBlockHitCount(void*) {
+    return butil::IOBuf::tls_block_hit_count();
+}
+static int64_t GetIOBufTLSBlockMissCount(void*) {
+    return butil::IOBuf::tls_block_miss_count();
+}
+
+typedef bvar::PerSecond<bvar::PassiveStatus<int64_t> > IOBufTLSBlockSecond;
+struct IOBufTLSBlockHitRatioArg {
+    IOBufTLSBlockSecond* hit_second;
+    IOBufTLSBlockSecond* miss_second;
+};
+static double GetIOBufTLSBlockHitRatio(void* arg) {
+    const IOBufTLSBlockHitRatioArg* a = static_cast<IOBufTLSBlockHitRatioArg*>(arg);
+    const int64_t nhit = a->hit_second->get_value();
+    const int64_t total = nhit + a->miss_second->get_value();
+    return total > 0 ? (double)nhit / total : 0;
+}
 
 // Defined in server.cpp
 extern butil::static_atomic<int> g_running_server_count;
@@ -222,8 +262,36 @@ static void* GlobalUpdate(void*) {
         "iobuf_newbigview_second", &var_iobuf_new_bigview_count);
     bvar::PassiveStatus<int64_t> var_iobuf_block_memory(
         "iobuf_block_memory", GetIOBufBlockMemory, NULL);
+    bvar::PassiveStatus<int64_t> var_iobuf_tls_block_hit_count(
+        GetIOBufTLSBlockHitCount, NULL);
+    IOBufTLSBlockSecond var_iobuf_tls_block_hit_second(
+        "iobuf_tls_block_hit_second", &var_iobuf_tls_block_hit_count);
+    bvar::PassiveStatus<int64_t> var_iobuf_tls_block_miss_count(
+        GetIOBufTLSBlockMissCount, NULL);
+    IOBufTLSBlockSecond var_iobuf_tls_block_miss_second(
+        "iobuf_tls_block_miss_second", &var_iobuf_tls_block_miss_count);
+    IOBufTLSBlockHitRatioArg tls_block_hit_ratio_arg = {
+        &var_iobuf_tls_block_hit_second, &var_iobuf_tls_block_miss_second };
+    bvar::PassiveStatus<double> var_iobuf_tls_block_hit_ratio(
+        "iobuf_tls_block_hit_ratio", GetIOBufTLSBlockHitRatio,
+        &tls_block_hit_ratio_arg);
     bvar::PassiveStatus<int> var_running_server_count(
         "rpc_server_count", GetRunningServerCount, NULL);
+    std::vector<std::unique_ptr<bvar::Variable> > var_iobuf_arena;
+    if (butil::iobuf::is_arena_allocator_enabled()) {
+        var_iobuf_arena.emplace_back(new bvar::PassiveStatus<int64_t>(
+            "iobuf_arena_carved_memory", GetIOBufArenaCarvedMemory, (void*)-1));
+        var_iobuf_arena.emplace_back(new bvar::PassiveStatus<int64_t>(
+            "iobuf_arena_used_memory", GetIOBufArenaUsedMemory, (void*)-1));
+        var_iobuf_arena.emplace_back(new bvar::PassiveStatus<int64_t>(
+            "iobuf_arena_fallback_count", GetIOBufArenaFallbackCount, NULL));
+        const int nnode = butil::iobuf::arena_node_count();
+        for (int i = 0; nnode > 1 && i < nnode; ++i) {
+            var_iobuf_arena.emplace_back(new bvar::PassiveStatus<int64_t>(
+                butil::string_printf("iobuf_arena_node%d_used_memory", i),
+                GetIOBufArenaUsedMemory, (void*)(intptr_t)i));
+        }
+    }
 
     butil::FileWatcher fw;
     if (fw.init_from_not_exist(DUMMY_SERVER_PORT_FILE) < 0) {
@@ -326,6 +394,11 @@ static void GlobalInitializeOrDieImpl() {
     // values even if the gflags will be set after main().          //
     //////////////////////////////////////////////////////////////////
 
+    if (FLAGS_iobuf_use_arena &&
+        butil::iobuf::enable_arena_allocator() != 0) {
+        LOG(ERROR) << "Fail to enable arena of IOBuf blocks, use malloc";
+    }
+
     // Ignore SIGPIPE.
     struct sigaction oldact;
     if (sigaction(SIGPIPE, NULL, &oldact) != 0 ||
@@ -403,6 +476,20 @@ static void GlobalInitializeOrDieImpl() {
     if (RegisterCompressHandler(COMPRESS_TYPE_SNAPPY, snappy_compress) != 0) {
         exit(1);
     }
+#if BRPC_WITH_LZ4
+    const CompressHandler lz4_compress =
+        { Lz4Compress, Lz4Decompress, "lz4" };
+    if (RegisterCompressHandler(COMPRESS_TYPE_LZ4, lz4_compress) != 0) {
+        exit(1);
+    }
+#endif
+#if BRPC_WITH_ZSTD
+    const CompressHandler zstd_compress =
+        { ZstdCompress, ZstdDecompress, "zstd" };
+    if (RegisterCompressHandler(COMPRESS_TYPE_ZSTD, zstd_compress) != 0) {
+        exit(1);
+    }
+#endif
 
     // Protocols
     Protocol baidu_protocol = { ParseRpcMessage,
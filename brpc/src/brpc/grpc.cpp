@@ -17,9 +17,11 @@
 
 
 
+#include <inttypes.h>
 #include <cstdint>                  // int64_t
 #include <sstream>                  // std::stringstream
 #include <iomanip>                  // std::setw
+#include <gflags/gflags.h>
 #include "brpc/grpc.h"
 #include "brpc/errno.pb.h"
 #include "brpc/http_status_code.h"
@@ -27,6 +29,8 @@
 
 namespace brpc {
 
+DECLARE_uint64(max_body_size);
+
 const char* GrpcStatusToString(GrpcStatus s) {
     switch (s) {
         case GRPC_OK: return "GRPC_OK";
@@ -206,4 +210,36 @@ int64_t ConvertGrpcTimeoutToUS(const std::string* grpc_timeout) {
     CHECK(false) << "Impossible";
 }
 
+butil::Status GrpcMessageReader::OnReadOnePart(const void* data, size_t length) {
+    _buf.append(data, length);
+    while (_buf.size() >= 5) {
+        uint8_t prefix[5];
+        _buf.copy_to(prefix, sizeof(prefix));
+        if (prefix[0] != 0) {
+            return butil::Status(EINVAL, "Compressed gRPC message is not supported");
+        }
+        const size_t message_size = ((uint32_t)prefix[1] << 24)
+            | ((uint32_t)prefix[2] << 16) | ((uint32_t)prefix[3] << 8)
+            | prefix[4];
+        if (message_size > FLAGS_max_body_size) {
+            // The length-prefix is from the peer, don't buffer the message
+            // whose size exceeds the limit like what unary calls do.
+            return butil::Status(ELIMIT, "gRPC message size=%zu is larger "
+                                 "than -max_body_size=%" PRIu64,
+                                 message_size, (uint64_t)FLAGS_max_body_size);
+        }
+        if (_buf.size() < sizeof(prefix) + message_size) {
+            break;
+        }
+        _buf.pop_front(sizeof(prefix));
+        butil::IOBuf message;
+        _buf.cutn(&message, message_size);
+        butil::Status st = OnMessage(message);
+        if (!st.ok()) {
+            return st;
+        }
+    }
+    return butil::Status::OK();
+}
+
 } // namespace brpc
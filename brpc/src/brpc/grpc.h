@@ -21,6 +21,9 @@
 
 #include <map>
 #include <brpc/http2.h>
+#include "butil/iobuf.h"
+#include "butil/status.h"
+#include "brpc/progressive_reader.h"
 
 namespace brpc {
 
@@ -155,6 +158,33 @@ void PercentEncode(const std::string& str, std::string* str_out);
 
 void PercentDecode(const std::string& str, std::string* str_out);
 
+// [Implement by user]
+// Split the body of a gRPC stream into messages, used for reading streaming
+// requests at server-side (methods with `stream' requests in services with
+// ServiceOptions.enable_progressive_read, other methods are not affected) and
+// streaming responses at client-side (with
+// Controller.response_will_be_read_progressively()):
+//   cntl->ReadProgressiveAttachmentBy(new MyGrpcMessageReader);
+// Compressed messages and messages larger than -max_body_size are not
+// supported and fail the reading.
+class GrpcMessageReader : public ProgressiveReader {
+public:
+    // Called for each message without the length-prefix. Error returned
+    // stops the reading and resets the stream.
+    virtual butil::Status OnMessage(butil::IOBuf& message) = 0;
+
+    // @ProgressiveReader
+    butil::Status OnReadOnePart(const void* data, size_t length) override;
+
+protected:
+    // True if bytes of an incomplete message are buffered, which indicates
+    // a truncated stream when OnEndOfMessage() is called.
+    bool has_partial_message() const { return !_buf.empty(); }
+
+private:
+    butil::IOBuf _buf;
+};
+
 
 } // namespace brpc
 
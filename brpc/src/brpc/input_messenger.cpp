@@ -16,6 +16,7 @@
 // under the License.
 
 
+#include <vector>
 #include <gflags/gflags.h>
 #include "butil/fd_guard.h"                      // fd_guard
 #include "butil/logging.h"                       // CHECK
@@ -33,6 +34,8 @@
 
 namespace brpc {
 
+extern SocketVarsCollector* g_vars;
+
 InputMessenger* g_messenger = NULL;
 static pthread_once_t g_messenger_init = PTHREAD_ONCE_INIT;
 static void InitClientSideMessenger() {
@@ -72,6 +75,28 @@ DEFINE_int32(socket_tcp_user_timeout_ms, -1,
              "connection and return ETIMEDOUT to the application. Only linux supports "
              "TCP_USER_TIMEOUT.");
 
+DEFINE_int32(socket_max_read_throttle_ms, 1000,
+             "Max milliseconds to stop reading a socket due to "
+             "-socket_max_buffered_bytes each time, after which the socket "
+             "reads once before being checked again");
+BRPC_VALIDATE_GFLAG(socket_max_read_throttle_ms, NonNegativeInteger);
+
+DEFINE_int32(batch_dispatch_max_messages, 1,
+             "Max number of small messages cut from one read of a socket that "
+             "are processed one after another in a single bthread instead of "
+             "one bthread each. 1 disables batching. Don't enable this if "
+             "processing of a request may wait for later requests from the "
+             "same connection");
+BRPC_VALIDATE_GFLAG(batch_dispatch_max_messages, PositiveInteger);
+
+DEFINE_int32(batch_dispatch_max_message_size, 1024,
+             "Only messages not larger than so many bytes are batched by "
+             "-batch_dispatch_max_messages");
+BRPC_VALIDATE_GFLAG(batch_dispatch_max_message_size, NonNegativeInteger);
+
+static bvar::Adder<int64_t> g_batch_dispatch_count(
+    "rpc_batch_dispatch_count");
+
 DECLARE_bool(usercode_in_pthread);
 DECLARE_bool(usercode_in_coroutine);
 DECLARE_uint64(max_body_size);
@@ -192,12 +217,9 @@ struct RunLastMessage {
     }
 };
 
-static void QueueMessage(InputMessageBase* to_run_msg,
-                         int* num_bthread_created,
-                         bthread_keytable_pool_t* keytable_pool) {
-    if (!to_run_msg) {
-        return;
-    }
+static void StartProcessing(void* (*fn)(void*), void* arg,
+                            int* num_bthread_created,
+                            bthread_keytable_pool_t* keytable_pool) {
     // Create bthread for last_msg. The bthread is not scheduled
     // until bthread_flush() is called (in the worse case).
                 
@@ -209,24 +231,111 @@ static void QueueMessage(InputMessageBase* to_run_msg,
     tmp.keytable_pool = keytable_pool;
     tmp.tag = bthread_self_tag();
     if (!FLAGS_usercode_in_coroutine && bthread_start_background(
-            &th, &tmp, ProcessInputMessage, to_run_msg) == 0) {
+            &th, &tmp, fn, arg) == 0) {
         ++*num_bthread_created;
     } else {
-        ProcessInputMessage(to_run_msg);
+        fn(arg);
     }
 }
 
+static void QueueMessage(InputMessageBase* to_run_msg,
+                         int* num_bthread_created,
+                         bthread_keytable_pool_t* keytable_pool) {
+    if (!to_run_msg) {
+        return;
+    }
+    StartProcessing(ProcessInputMessage, to_run_msg,
+                    num_bthread_created, keytable_pool);
+}
+
+// Small messages processed one after another in one bthread.
+struct InputMessageBatch {
+    std::vector<InputMessageBase*> msgs;
+};
+
+static void* ProcessInputMessageBatch(void* arg) {
+    InputMessageBatch* batch = static_cast<InputMessageBatch*>(arg);
+    for (size_t i = 0; i < batch->msgs.size(); ++i) {
+        ProcessInputMessage(batch->msgs[i]);
+    }
+    delete batch;
+    return NULL;
+}
+
+// Groups messages queued by ProcessNewMessage into batches when
+// -batch_dispatch_max_messages > 1, so that N pipelined small requests
+// cost N/max_messages bthreads instead of N. A batch is dispatched when
+// it's full, before a large message is queued, or by Flush().
+class MessageBatcher {
+public:
+    MessageBatcher(int* num_bthread_created,
+                   bthread_keytable_pool_t* keytable_pool)
+        : _max_messages(FLAGS_batch_dispatch_max_messages)
+        , _max_message_size(FLAGS_batch_dispatch_max_message_size)
+        , _num_bthread_created(num_bthread_created)
+        , _keytable_pool(keytable_pool)
+        , _batch(NULL) {}
+
+    ~MessageBatcher() { Flush(); }
+
+    void Queue(InputMessageBase* msg, size_t msg_size) {
+        if (!msg) {
+            return;
+        }
+        if (_max_messages <= 1 || msg_size > (size_t)_max_message_size) {
+            Flush();
+            return QueueMessage(msg, _num_bthread_created, _keytable_pool);
+        }
+        if (_batch == NULL) {
+            _batch = new InputMessageBatch;
+            _batch->msgs.reserve(_max_messages);
+        }
+        _batch->msgs.push_back(msg);
+        if (_batch->msgs.size() >= (size_t)_max_messages) {
+            Flush();
+        }
+    }
+
+    void Flush() {
+        if (_batch == NULL) {
+            return;
+        }
+        InputMessageBatch* batch = _batch;
+        _batch = NULL;
+        if (batch->msgs.size() == 1) {
+            QueueMessage(batch->msgs[0], _num_bthread_created, _keytable_pool);
+            delete batch;
+            return;
+        }
+        g_batch_dispatch_count << 1;
+        StartProcessing(ProcessInputMessageBatch, batch,
+                        _num_bthread_created, _keytable_pool);
+    }
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(MessageBatcher);
+
+    // Flags are loaded once so that they don't change during a read.
+    const int _max_messages;
+    const int _max_message_size;
+    int* _num_bthread_created;
+    bthread_keytable_pool_t* _keytable_pool;
+    InputMessageBatch* _batch;
+};
+
 InputMessenger::InputMessageClosure::~InputMessageClosure() noexcept(false) {
     if (_msg) {
         ProcessInputMessage(_msg);
     }
 }
 
-void InputMessenger::InputMessageClosure::reset(InputMessageBase* m) {
+void InputMessenger::InputMessageClosure::reset(InputMessageBase* m,
+                                                size_t msg_size) {
     if (_msg) {
         ProcessInputMessage(_msg);
     }
     _msg = m;
+    _msg_size = msg_size;
 }
 
 int InputMessenger::ProcessNewMessage(
@@ -240,6 +349,7 @@ int InputMessenger::ProcessNewMessage(
     
     size_t last_size = m->_read_buf.length();
     int num_bthread_created = 0;
+    MessageBatcher batcher(&num_bthread_created, m->_keytable_pool);
     while (1) {
         size_t index = 8888;
         ParseResult pr = CutInputMessage(m, &index, read_eof);
@@ -284,6 +394,7 @@ int InputMessenger::ProcessNewMessage(
         } else {
             m->_avg_msg_size = m->_last_msg_size;
         }
+        const size_t msg_size = m->_last_msg_size;
         m->_last_msg_size = 0;
         
         if (pr.message() == NULL) { // the Process() step can be skipped.
@@ -296,7 +407,8 @@ int InputMessenger::ProcessNewMessage(
         // This unique_ptr prevents msg to be lost before transfering
         // ownership to last_msg
         DestroyingPtr<InputMessageBase> msg(pr.message());
-        QueueMessage(last_msg.release(), &num_bthread_created, m->_keytable_pool);
+        const size_t last_msg_size = last_msg.msg_size();
+        batcher.Queue(last_msg.release(), last_msg_size);
         if (_handlers[index].process == NULL) {
             LOG(ERROR) << "process of index=" << index << " is NULL";
             continue;
@@ -327,20 +439,41 @@ int InputMessenger::ProcessNewMessage(
         }
         if (!m->is_read_progressive()) {
             // Transfer ownership to last_msg
-            last_msg.reset(msg.release());
+            last_msg.reset(msg.release(), msg_size);
         } else {
+            batcher.Flush();
             QueueMessage(msg.release(), &num_bthread_created,
                                 m->_keytable_pool);
             bthread_flush();
             num_bthread_created = 0;
         }
     }
+    batcher.Flush();
     if (num_bthread_created) {
         bthread_flush();
     }
     return 0;
 }
 
+// Stop reading `m' while m->ShouldThrottleRead() is true, namely `m' is
+// one of the sockets holding most unparsed input and buffers of sockets
+// exceed -socket_max_buffered_bytes. The wait is bounded by
+// -socket_max_read_throttle_ms so that the socket still makes progress(e.g.
+// completes the message or notices EOF) slowly.
+void InputMessenger::WaitForReadQuota(Socket* m) {
+    g_vars->nthrottled_read << 1;
+    LOG_EVERY_SECOND(WARNING) << "Stop reading " << *m << " holding "
+                              << m->read_buf_bytes() << " bytes unparsed";
+    m->_read_throttled = true;
+    const int64_t deadline_us = butil::cpuwide_time_us() +
+        FLAGS_socket_max_read_throttle_ms * 1000L;
+    while (!m->Failed() && m->ShouldThrottleRead() &&
+           butil::cpuwide_time_us() < deadline_us) {
+        bthread_usleep(10000);
+    }
+    m->_read_throttled = false;
+}
+
 void InputMessenger::OnNewMessages(Socket* m) {
     // Notes:
     // - If the socket has only one message, the message will be parsed and
@@ -364,6 +497,12 @@ void InputMessenger::OnNewMessages(Socket* m) {
         const int64_t received_us = butil::cpuwide_time_us();
         const int64_t base_realtime = butil::gettimeofday_us() - received_us;
 
+        if (m->ShouldThrottleRead()) {
+            // Process the pending message before waiting.
+            last_msg.reset(NULL);
+            WaitForReadQuota(m);
+        }
+
         // Calculate bytes to be read.
         size_t once_read = m->_avg_msg_size * 16;
         if (once_read < MIN_ONCE_READ) {
@@ -390,17 +529,27 @@ void InputMessenger::OnNewMessages(Socket* m) {
                 m->SetFailed(saved_errno, "Fail to read from %s: %s",
                              m->description().c_str(), berror(saved_errno));
                 return;
-            } else if (!m->MoreReadEvents(&progress)) {
-                return;
-            } else { // new events during processing
-                continue;
+            } else {
+                // Nothing to read for the moment. Return blocks cached by
+                // _read_buf even if a partial message is left inside,
+                // otherwise each idle connection pins blocks for the
+                // budgeted read size.
+                m->_read_buf.return_cached_blocks();
+                if (!m->MoreReadEvents(&progress)) {
+                    return;
+                }
+                continue;  // new events during processing
             }
         }
 
-        if (m->_rdma_state == Socket::RDMA_OFF && messenger->ProcessNewMessage(
-                    m, nr, read_eof, received_us, base_realtime, last_msg) < 0) {
-            return;
-        } 
+        if (m->_rdma_state == Socket::RDMA_OFF) {
+            const int rc = messenger->ProcessNewMessage(
+                m, nr, read_eof, received_us, base_realtime, last_msg);
+            m->UpdateReadBufBytes();
+            if (rc < 0) {
+                return;
+            }
+        }
     }
 
     if (read_eof) {
@@ -113,21 +113,29 @@ protected:
 private:
     class InputMessageClosure {
     public:
-        InputMessageClosure() : _msg(NULL) { }
+        InputMessageClosure() : _msg(NULL), _msg_size(0) { }
         ~InputMessageClosure() noexcept(false);
 
         InputMessageBase* release() {
             InputMessageBase* m = _msg;
             _msg = NULL;
+            _msg_size = 0;
             return m;
         }
 
-        void reset(InputMessageBase* m);
+        // Bytes of the message cut from the socket.
+        size_t msg_size() const { return _msg_size; }
+
+        void reset(InputMessageBase* m, size_t msg_size = 0);
 
     private:
         InputMessageBase* _msg;
+        size_t _msg_size;
     };
 
+    // Stop reading `m' for a while when m->ShouldThrottleRead() is true.
+    static void WaitForReadQuota(Socket* m);
+
     // Find a valid scissor from `handlers' to cut off `header' and `payload'
     // from m->read_buf, save index of the scissor into `index'.
     ParseResult CutInputMessage(Socket* m, size_t* index, bool read_eof);
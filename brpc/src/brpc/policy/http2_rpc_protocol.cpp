@@ -20,6 +20,7 @@
 #include "brpc/details/controller_private_accessor.h"
 #include "brpc/server.h"
 #include "butil/base64.h"
+#include "bthread/butex.h"
 #include "brpc/log.h"
 
 namespace brpc {
@@ -28,9 +29,12 @@ DECLARE_bool(http_verbose);
 DECLARE_int32(http_verbose_max_body_length);
 DECLARE_int32(health_check_interval);
 DECLARE_bool(usercode_in_pthread);
+DECLARE_int64(socket_max_unwritten_bytes);
 
 namespace policy {
 
+const CommonStrings* get_common_strings();
+
 DEFINE_int32(h2_client_header_table_size,
              H2Settings::DEFAULT_HEADER_TABLE_SIZE,
              "maximum size of compression tables for decoding headers");
@@ -323,6 +327,7 @@ inline H2Context::FrameHandler FindFrameHandler(H2FrameType type) {
 
 H2Context::H2Context(Socket* socket, const Server* server)
     : _socket(socket)
+    , _server(server)
     // Maximize the window size to make sending big request possible before
     // receving the remote settings.
     , _remote_window_left(H2Settings::MAX_WINDOW_SIZE)
@@ -331,7 +336,12 @@ H2Context::H2Context(Socket* socket, const Server* server)
     , _last_sent_stream_id(1)
     , _goaway_stream_id(-1)
     , _remote_settings_received(false)
+    , _has_abandoned_streams(false)
+    , _stream_count(0)
     , _deferred_window_update(0) {
+    for (size_t i = 0; i < STREAM_SHARD_NUM; ++i) {
+        _stream_shards[i].store(NULL, butil::memory_order_relaxed);
+    }
     // Stop printing the field which is useless for remote settings.
     _remote_settings.connection_window_size = 0;
     // Maximize the window size to make sending big request possible before
@@ -353,30 +363,66 @@ H2Context::H2Context(Socket* socket, const Server* server)
 }
 
 H2Context::~H2Context() {
-    for (StreamMap::iterator it = _pending_streams.begin();
-         it != _pending_streams.end(); ++it) {
-        delete it->second;
+    for (size_t i = 0; i < STREAM_SHARD_NUM; ++i) {
+        StreamShard* shard = _stream_shards[i].load(butil::memory_order_relaxed);
+        if (shard == NULL) {
+            continue;
+        }
+        for (StreamMap::iterator it = shard->streams.begin();
+             it != shard->streams.end(); ++it) {
+            if (!it->second->AbortStage2(ECONNRESET)) {
+                delete it->second;
+            }
+        }
+        delete shard;
     }
-    _pending_streams.clear();
 }
 
 int H2Context::Init() {
-    if (_pending_streams.init(64, 70) != 0) {
-        LOG(WARNING) << "Fail to init _pending_streams";
-    }
     if (_hpacker.Init(_unack_local_settings.header_table_size) != 0) {
         LOG(WARNING) << "Fail to init _hpacker";
     }
+    if (_writers.init(8, 70) != 0) {
+        LOG(WARNING) << "Fail to init _writers";
+    }
     return 0;
 }
 
+H2Context::StreamShard* H2Context::stream_shard(int stream_id, bool create) {
+    // Ids of streams initiated by the same side are all odd or even.
+    butil::atomic<StreamShard*>& slot =
+        _stream_shards[((uint32_t)stream_id >> 1) % STREAM_SHARD_NUM];
+    StreamShard* shard = slot.load(butil::memory_order_acquire);
+    if (shard != NULL || !create) {
+        return shard;
+    }
+    StreamShard* new_shard = new (std::nothrow) StreamShard;
+    if (new_shard == NULL || new_shard->streams.init(8, 70) != 0) {
+        LOG(WARNING) << "Fail to create stream shard";
+        delete new_shard;
+        return NULL;
+    }
+    if (!slot.compare_exchange_strong(shard, new_shard,
+                                      butil::memory_order_acq_rel)) {
+        // Created by another thread.
+        delete new_shard;
+        return shard;
+    }
+    return new_shard;
+}
+
 H2StreamContext* H2Context::RemoveStreamAndDeferWU(int stream_id) {
     H2StreamContext* sctx = NULL;
     {
-        std::unique_lock<butil::Mutex> mu(_stream_mutex);
-        if (!_pending_streams.erase(stream_id, &sctx)) {
+        StreamShard* shard = stream_shard(stream_id, false);
+        if (shard == NULL) {
+            return NULL;
+        }
+        std::unique_lock<butil::Mutex> mu(shard->mutex);
+        if (!shard->streams.erase(stream_id, &sctx)) {
             return NULL;
         }
+        _stream_count.fetch_sub(1, butil::memory_order_relaxed);
     }
     // The remote stream will not send any more data, sending back the
     // stream-level WINDOW_UPDATE is pointless, just move the value into
@@ -388,34 +434,44 @@ H2StreamContext* H2Context::RemoveStreamAndDeferWU(int stream_id) {
 void H2Context::RemoveGoAwayStreams(
     int goaway_stream_id, std::vector<H2StreamContext*>* out_streams) {
     out_streams->clear();
-    if (goaway_stream_id == 0) {  // quick path
-        StreamMap tmp;
-        {
-            std::unique_lock<butil::Mutex> mu(_stream_mutex);
-            _goaway_stream_id = goaway_stream_id;
-            _pending_streams.swap(tmp);
+    // Streams inserted after this store see the goaway_stream_id (the store
+    // happens before locking the shard below) and are rejected, streams
+    // inserted before are removed below.
+    _goaway_stream_id.store(goaway_stream_id, butil::memory_order_relaxed);
+    for (size_t i = 0; i < STREAM_SHARD_NUM; ++i) {
+        // A shard created after the load has no streams to remove, the
+        // insertion sees the goaway_stream_id.
+        StreamShard* shard = _stream_shards[i].load(butil::memory_order_acquire);
+        if (shard == NULL) {
+            continue;
         }
-        for (StreamMap::const_iterator it = tmp.begin(); it != tmp.end(); ++it) {
-            out_streams->push_back(it->second);
-        }
-    } else {
-        std::unique_lock<butil::Mutex> mu(_stream_mutex);
-        _goaway_stream_id = goaway_stream_id;
-        for (StreamMap::const_iterator it = _pending_streams.begin();
-             it != _pending_streams.end(); ++it) {
+        const size_t old_size = out_streams->size();
+        std::unique_lock<butil::Mutex> mu(shard->mutex);
+        for (StreamMap::const_iterator it = shard->streams.begin();
+             it != shard->streams.end(); ++it) {
             if (it->first > goaway_stream_id) {
                 out_streams->push_back(it->second);
             }
         }
-        for (size_t i = 0; i < out_streams->size(); ++i) {
-            _pending_streams.erase((*out_streams)[i]->stream_id());
+        _stream_count.fetch_sub(out_streams->size() - old_size,
+                                butil::memory_order_relaxed);
+        if (goaway_stream_id == 0) {  // quick path
+            shard->streams.clear();
+            continue;
+        }
+        for (size_t j = old_size; j < out_streams->size(); ++j) {
+            shard->streams.erase((*out_streams)[j]->stream_id());
         }
     }
 }
 
 H2StreamContext* H2Context::FindStream(int stream_id) {
-    std::unique_lock<butil::Mutex> mu(_stream_mutex);
-    H2StreamContext** psctx = _pending_streams.seek(stream_id);
+    StreamShard* shard = stream_shard(stream_id, false);
+    if (shard == NULL) {
+        return NULL;
+    }
+    std::unique_lock<butil::Mutex> mu(shard->mutex);
+    H2StreamContext** psctx = shard->streams.seek(stream_id);
     if (psctx) {
         return *psctx;
     }
@@ -423,18 +479,29 @@ H2StreamContext* H2Context::FindStream(int stream_id) {
 }
 
 int H2Context::TryToInsertStream(int stream_id, H2StreamContext* ctx) {
-    std::unique_lock<butil::Mutex> mu(_stream_mutex);
-    if (_goaway_stream_id >= 0 && stream_id > _goaway_stream_id) {
+    StreamShard* shard = stream_shard(stream_id, true);
+    if (shard == NULL) {
+        return -1;
+    }
+    std::unique_lock<butil::Mutex> mu(shard->mutex);
+    const int goaway_stream_id =
+        _goaway_stream_id.load(butil::memory_order_relaxed);
+    if (goaway_stream_id >= 0 && stream_id > goaway_stream_id) {
         return 1;
     }
-    H2StreamContext*& sctx = _pending_streams[stream_id];
+    H2StreamContext*& sctx = shard->streams[stream_id];
     if (sctx == NULL) {
         sctx = ctx;
+        _stream_count.fetch_add(1, butil::memory_order_relaxed);
         return 0;
     }
     return -1;
 }
 
+size_t H2Context::VolatilePendingStreamSize() const {
+    return _stream_count.load(butil::memory_order_relaxed);
+}
+
 ParseResult H2Context::ConsumeFrameHead(
     butil::IOBufBytesIterator& it, H2FrameHead* frame_head) {
     uint8_t length_buf[3];
@@ -514,8 +581,12 @@ ParseResult H2Context::Consume(
                 LOG(WARNING) << "Fail to send RST_STREAM to " << *_socket;
                 return MakeParseError(PARSE_ERROR_ABSOLUTELY_WRONG);
             }
+            StopStreamWriter(h2_res.stream_id(), ECANCELED);
             H2StreamContext* sctx = RemoveStreamAndDeferWU(h2_res.stream_id());
             if (sctx) {
+                if (sctx->AbortStage2(ECANCELED)) {
+                    return MakeMessage(NULL);
+                }
                 if (is_server_side()) {
                     delete sctx;
                     return MakeMessage(NULL);
@@ -642,7 +713,7 @@ H2ParseResult H2StreamContext::OnHeaders(
         if (frame_head.flags & H2_FLAGS_END_STREAM) {
             return OnEndStream();
         }
-        return MakeH2Message(NULL);
+        return OnHeadersComplete();
     } else {
         if (frame_head.flags & H2_FLAGS_END_STREAM) {
             // Delay calling OnEndStream() in OnContinuation()
@@ -692,10 +763,31 @@ H2ParseResult H2StreamContext::OnContinuation(
         if (_stream_ended) {
             return OnEndStream();
         }
+        return OnHeadersComplete();
     }
     return MakeH2Message(NULL);
 }
 
+H2ParseResult H2StreamContext::OnHeadersComplete() {
+    if (is_stage2()) {
+        // Trailers always end the stream.
+        return MakeH2Message(NULL);
+    }
+    if (_conn_ctx->is_server_side()) {
+        CheckProgressiveRead(_conn_ctx->_server, NULL);
+    }
+    if (!read_body_progressively()) {
+        return MakeH2Message(NULL);
+    }
+    // Return the headers without waiting for the body which is delivered
+    // to the reader set by user. The stream table owns the ref added for
+    // stage2 until the stream is ended or aborted.
+    _trailers.reset(new HttpHeader);
+    _stage2_socket_id = _conn_ctx->_socket->id();
+    AddOneRefForStage2();
+    return MakeH2Message(this);
+}
+
 H2ParseResult H2Context::OnData(
     butil::IOBufBytesIterator& it, const H2FrameHead& frame_head) {
     uint32_t frag_size = frame_head.payload_size;
@@ -732,6 +824,16 @@ H2ParseResult H2StreamContext::OnData(
     butil::IOBuf data;
     it.append_and_forward(&data, frag_size);
     it.forward(pad_length);
+    if (is_stage2()) {
+        H2ParseResult res = QueueStage2Data(data);
+        if (!res.is_ok()) {
+            return res;
+        }
+        if (frame_head.flags & H2_FLAGS_END_STREAM) {
+            return OnEndStream();
+        }
+        return MakeH2Message(NULL);
+    }
     for (size_t i = 0; i < data.backing_block_num(); ++i) {
         const butil::StringPiece blk = data.backing_block(i);
         if (OnBody(blk.data(), blk.size()) != 0) {
@@ -785,6 +887,7 @@ H2ParseResult H2Context::OnResetStream(
         return MakeH2Error(H2_FRAME_SIZE_ERROR);
     }
     const H2Error h2_error = static_cast<H2Error>(LoadUint32(it));
+    StopStreamWriter(frame_head.stream_id, ECONNRESET);
     H2StreamContext* sctx = FindStream(frame_head.stream_id);
     if (sctx == NULL) {
         RPC_VLOG << "Fail to find stream_id=" << frame_head.stream_id;
@@ -812,6 +915,9 @@ H2ParseResult H2StreamContext::OnResetStream(
         LOG(ERROR) << "Fail to find stream_id=" << stream_id();
         return MakeH2Error(H2_PROTOCOL_ERROR);
     }
+    if (sctx->AbortStage2(ECONNRESET)) {
+        return MakeH2Message(NULL);
+    }
     if (_conn_ctx->is_client_side()) {
         sctx->header().set_status_code(H2ErrorToStatusCode(h2_error));
         return MakeH2Message(sctx);
@@ -841,10 +947,196 @@ H2ParseResult H2StreamContext::OnEndStream() {
     }
     CHECK_EQ(sctx, this);
 
+    if (is_stage2()) {
+        // The headers were returned already, end the body being read
+        // progressively with the status in trailers of gRPC.
+        butil::Status st;
+        const CommonStrings* const common = get_common_strings();
+        const std::string* grpc_status = _trailers->GetHeader(common->GRPC_STATUS);
+        if (grpc_status) {
+            const GrpcStatus status =
+                (GrpcStatus)strtol(grpc_status->data(), NULL, 10);
+            if (status != GRPC_OK) {
+                const std::string* grpc_message =
+                    _trailers->GetHeader(common->GRPC_MESSAGE);
+                std::string message_decoded;
+                if (grpc_message) {
+                    PercentDecode(*grpc_message, &message_decoded);
+                } else {
+                    message_decoded = GrpcStatusToString(status);
+                }
+                st.set_error(GrpcStatusToErrorCode(status), "%s",
+                             message_decoded.c_str());
+            }
+        }
+        // May destroy this.
+        QueueStage2End(st);
+        return MakeH2Message(NULL);
+    }
     OnMessageComplete();
     return MakeH2Message(sctx);
 }
 
+bool H2StreamContext::AbortStage2(int error_code) {
+    if (!is_stage2()) {
+        return false;
+    }
+    QueueStage2End(butil::Status(error_code, "stream_id=%d was aborted: %s",
+                                 stream_id(), berror(error_code)));
+    return true;
+}
+
+H2ParseResult H2StreamContext::QueueStage2Data(butil::IOBuf& data) {
+    const int64_t size = data.size();
+    bool start_reader = false;
+    {
+        std::unique_lock<butil::Mutex> mu(_stage2_mutex);
+        _stage2_ungranted += size;
+        if (_stage2_ungranted > _conn_ctx->local_settings().stream_window_size) {
+            mu.unlock();
+            LOG(ERROR) << "Fail to satisfy the stream-level flow control policy";
+            return MakeH2Error(H2_FLOW_CONTROL_ERROR, stream_id());
+        }
+        if (!_stage2_cancelled && !data.empty()) {
+            _stage2_data.append(butil::IOBuf::Movable(data));
+            if (!_stage2_consuming) {
+                _stage2_consuming = true;
+                start_reader = true;
+            }
+        }
+    }
+    // The data is buffered within the stream-level window, which is enough
+    // to bound the memory, grant the connection-level window right now.
+    _conn_ctx->DeferWindowUpdate(size);
+    if (start_reader) {
+        StartStage2Reader();
+    }
+    return MakeH2Message(NULL);
+}
+
+void H2StreamContext::QueueStage2End(const butil::Status& st) {
+    bool start_reader = false;
+    {
+        std::unique_lock<butil::Mutex> mu(_stage2_mutex);
+        _end_status = st;
+        _stage2_end_queued = true;
+        if (!_stage2_consuming) {
+            _stage2_consuming = true;
+            start_reader = true;
+        }
+    }
+    if (start_reader) {
+        StartStage2Reader();
+    }
+    // May destroy this.
+    RemoveOneRefForStage2();
+}
+
+void H2StreamContext::StartStage2Reader() {
+    // Released in RunStage2Reader().
+    butil::intrusive_ptr<H2StreamContext>(this).detach();
+    bthread_t th;
+    bthread_attr_t tmp = (FLAGS_usercode_in_pthread ?
+                          BTHREAD_ATTR_PTHREAD :
+                          BTHREAD_ATTR_NORMAL);
+    tmp.keytable_pool = _conn_ctx->_socket->keytable_pool();
+    if (bthread_start_background(&th, &tmp, RunStage2Reader, this) != 0) {
+        LOG(ERROR) << "Fail to start bthread to read stream_id=" << stream_id();
+        RunStage2Reader(this);
+    }
+}
+
+void* H2StreamContext::RunStage2Reader(void* arg) {
+    butil::intrusive_ptr<H2StreamContext> sctx(
+        static_cast<H2StreamContext*>(arg), false);
+    sctx->ConsumeStage2();
+    return NULL;
+}
+
+void H2StreamContext::ConsumeStage2() {
+    while (true) {
+        butil::IOBuf data;
+        {
+            std::unique_lock<butil::Mutex> mu(_stage2_mutex);
+            if (_stage2_data.empty()) {
+                if (!_stage2_end_queued) {
+                    _stage2_consuming = false;
+                    return;
+                }
+                break;
+            }
+            data.swap(_stage2_data);
+        }
+        bool reader_failed = false;
+        for (size_t i = 0; i < data.backing_block_num(); ++i) {
+            const butil::StringPiece blk = data.backing_block(i);
+            if (OnBody(blk.data(), blk.size()) != 0) {
+                reader_failed = true;
+                break;
+            }
+        }
+        if (reader_failed) {
+            CancelStage2();
+        } else {
+            OnStage2Consumed(data.size());
+        }
+    }
+    // No more data after the end.
+    OnMessageComplete();
+}
+
+void H2StreamContext::OnStage2Consumed(int64_t size) {
+    SocketUniquePtr s;
+    if (Socket::Address(_stage2_socket_id, &s) != 0 ||
+        s->parsing_context() != _conn_ctx) {
+        // The connection is broken, nothing to grant.
+        return;
+    }
+    int64_t stream_wu = 0;
+    {
+        std::unique_lock<butil::Mutex> mu(_stage2_mutex);
+        _stage2_consumed += size;
+        // The peer will not send more data after ending the stream.
+        if (!_stage2_end_queued && _stage2_consumed >=
+            _conn_ctx->local_settings().stream_window_size / 2) {
+            stream_wu = _stage2_consumed;
+            _stage2_consumed = 0;
+            _stage2_ungranted -= stream_wu;
+        }
+    }
+    if (stream_wu > 0) {
+        char winbuf[FRAME_HEAD_SIZE + 4];
+        SerializeFrameHead(winbuf, 4, H2_FRAME_WINDOW_UPDATE, 0, stream_id());
+        SaveUint32(winbuf + FRAME_HEAD_SIZE, stream_wu);
+        if (WriteAck(s.get(), winbuf, sizeof(winbuf)) != 0) {
+            LOG(WARNING) << "Fail to send WINDOW_UPDATE to " << *s;
+        }
+    }
+}
+
+void H2StreamContext::CancelStage2() {
+    {
+        std::unique_lock<butil::Mutex> mu(_stage2_mutex);
+        _stage2_cancelled = true;
+        _stage2_data.clear();
+    }
+    SocketUniquePtr s;
+    if (Socket::Address(_stage2_socket_id, &s) != 0 ||
+        s->parsing_context() != _conn_ctx) {
+        return;
+    }
+    // The reader of user quit, only this stream is affected. The stream is
+    // removed by the parsing later, which ends the body.
+    char rstbuf[FRAME_HEAD_SIZE + 4];
+    SerializeFrameHead(rstbuf, 4, H2_FRAME_RST_STREAM, 0, stream_id());
+    SaveUint32(rstbuf + FRAME_HEAD_SIZE, H2_CANCEL);
+    if (WriteAck(s.get(), rstbuf, sizeof(rstbuf)) != 0) {
+        LOG(WARNING) << "Fail to send RST_STREAM to " << *s;
+    }
+    _conn_ctx->StopStreamWriter(stream_id(), ECANCELED);
+    _conn_ctx->AddAbandonedStream(stream_id());
+}
+
 H2ParseResult H2Context::OnSettings(
     butil::IOBufBytesIterator& it, const H2FrameHead& frame_head) {
     // SETTINGS frames always apply to a connection, never a single stream.
@@ -865,6 +1157,9 @@ H2ParseResult H2Context::OnSettings(
         _local_settings = _unack_local_settings;
         return MakeH2Message(NULL);
     }
+    // Writers being added read the window from remote settings or streams,
+    // see AddStreamWriter().
+    std::unique_lock<butil::Mutex> writers_mu(_writers_mutex);
     const int64_t old_stream_window_size = _remote_settings.stream_window_size;
     if (!_remote_settings_received) {
         // To solve the problem that sender can't send large request before receving
@@ -897,14 +1192,30 @@ H2ParseResult H2Context::OnSettings(
         // be changed using WINDOW_UPDATE frames.
         // https://tools.ietf.org/html/rfc7540#section-6.9.2
         // TODO(gejun): Has race conditions with AppendAndDestroySelf
-        std::unique_lock<butil::Mutex> mu(_stream_mutex);
-        for (StreamMap::const_iterator it = _pending_streams.begin();
-             it != _pending_streams.end(); ++it) {
+        for (size_t i = 0; i < STREAM_SHARD_NUM; ++i) {
+            StreamShard* shard =
+                _stream_shards[i].load(butil::memory_order_acquire);
+            if (shard == NULL) {
+                continue;
+            }
+            std::unique_lock<butil::Mutex> mu(shard->mutex);
+            for (StreamMap::const_iterator it = shard->streams.begin();
+                 it != shard->streams.end(); ++it) {
+                if (!AddWindowSize(&it->second->_remote_window_left,
+                                   window_diff)) {
+                    return MakeH2Error(H2_FLOW_CONTROL_ERROR);
+                }
+            }
+        }
+        for (WriterMap::const_iterator it = _writers.begin();
+             it != _writers.end(); ++it) {
             if (!AddWindowSize(&it->second->_remote_window_left, window_diff)) {
                 return MakeH2Error(H2_FLOW_CONTROL_ERROR);
             }
+            it->second->WakeUp();
         }
     }
+    writers_mu.unlock();
     // Respond with ack
     char headbuf[FRAME_HEAD_SIZE];
     SerializeFrameHead(headbuf, 0, H2_FRAME_SETTINGS, H2_FLAGS_ACK, 0);
@@ -982,6 +1293,15 @@ H2ParseResult H2Context::OnGoAway(
 
         std::vector<H2StreamContext*> goaway_streams;
         RemoveGoAwayStreams(last_stream_id, &goaway_streams);
+        size_t nkept = 0;
+        for (size_t i = 0; i < goaway_streams.size(); ++i) {
+            StopStreamWriter(goaway_streams[i]->stream_id(), ECONNRESET);
+            // Responses of stage2 streams were processed already.
+            if (!goaway_streams[i]->AbortStage2(ECONNRESET)) {
+                goaway_streams[nkept++] = goaway_streams[i];
+            }
+        }
+        goaway_streams.resize(nkept);
         if (goaway_streams.empty()) {
             return MakeH2Message(NULL);
         }
@@ -1021,8 +1341,26 @@ H2ParseResult H2Context::OnWindowUpdate(
             LOG(ERROR) << "Invalid connection-level window_size_increment=" << inc;
             return MakeH2Error(H2_FLOW_CONTROL_ERROR);
         }
+        std::unique_lock<butil::Mutex> mu(_writers_mutex);
+        for (WriterMap::const_iterator it = _writers.begin();
+             it != _writers.end(); ++it) {
+            it->second->WakeUp();
+        }
         return MakeH2Message(NULL);
     } else {
+        std::unique_lock<butil::Mutex> mu(_writers_mutex);
+        H2ProgressiveAttachment** pw = _writers.seek(frame_head.stream_id);
+        if (pw != NULL) {
+            if (!AddWindowSize(&(*pw)->_remote_window_left, inc)) {
+                LOG(ERROR) << "Invalid stream-level window_size_increment=" << inc
+                    << " to remote_window_left=" << (*pw)->_remote_window_left.load(butil::memory_order_relaxed);
+                return MakeH2Error(H2_FLOW_CONTROL_ERROR);
+            }
+            (*pw)->WakeUp();
+            return MakeH2Message(NULL);
+        }
+        // Keep _writers_mutex until the stream is updated, see comments
+        // in AddStreamWriter().
         H2StreamContext* sctx = FindStream(frame_head.stream_id);
         if (sctx == NULL) {
             RPC_VLOG << "Fail to find stream_id=" << frame_head.stream_id;
@@ -1094,6 +1432,37 @@ void H2Context::DeferWindowUpdate(int64_t size) {
     }
 }
 
+void H2Context::AddStreamWriter(int stream_id, H2ProgressiveAttachment* w) {
+    // WINDOW_UPDATE and SETTINGS apply to either the stream or the writer
+    // with _writers_mutex held, none of them is lost or applied twice.
+    std::unique_lock<butil::Mutex> mu(_writers_mutex);
+    int64_t remote_window_left = remote_settings().stream_window_size;
+    StreamShard* shard = stream_shard(stream_id, false);
+    if (shard != NULL) {
+        std::unique_lock<butil::Mutex> mu2(shard->mutex);
+        H2StreamContext** psctx = shard->streams.seek(stream_id);
+        if (psctx != NULL) {
+            remote_window_left =
+                (*psctx)->_remote_window_left.load(butil::memory_order_relaxed);
+        }
+    }
+    w->_remote_window_left.store(remote_window_left, butil::memory_order_relaxed);
+    _writers[stream_id] = w;
+}
+
+void H2Context::RemoveStreamWriter(int stream_id) {
+    std::unique_lock<butil::Mutex> mu(_writers_mutex);
+    _writers.erase(stream_id);
+}
+
+void H2Context::StopStreamWriter(int stream_id, int error_code) {
+    std::unique_lock<butil::Mutex> mu(_writers_mutex);
+    H2ProgressiveAttachment** pw = _writers.seek(stream_id);
+    if (pw != NULL) {
+        (*pw)->Stop(error_code);
+    }
+}
+
 #if defined(BRPC_PROFILE_H2)
 bvar::Adder<int64_t> g_parse_time;
 bvar::PerSecond<bvar::Adder<int64_t> > g_parse_time_per_second(
@@ -1140,16 +1509,22 @@ ParseResult ParseH2Message(butil::IOBuf *source, Socket *socket,
 void H2Context::AddAbandonedStream(uint32_t stream_id) {
     std::unique_lock<butil::Mutex> mu(_abandoned_streams_mutex);
     _abandoned_streams.push_back(stream_id);
+    _has_abandoned_streams.store(true, butil::memory_order_relaxed);
 }
 
 inline void H2Context::ClearAbandonedStreams() {
+    // Streams added after the check are cleared after parsing next message.
+    if (!_has_abandoned_streams.load(butil::memory_order_relaxed)) {
+        return;
+    }
     std::unique_lock<butil::Mutex> mu(_abandoned_streams_mutex);
+    _has_abandoned_streams.store(false, butil::memory_order_relaxed);
     while (!_abandoned_streams.empty()) {
         const uint32_t stream_id = _abandoned_streams.back();
         _abandoned_streams.pop_back();
         mu.unlock();
         H2StreamContext* sctx = RemoveStreamAndDeferWU(stream_id);
-        if (sctx != NULL) {
+        if (sctx != NULL && !sctx->AbortStage2(ECANCELED)) {
             delete sctx;
         }
         mu.lock();
@@ -1166,7 +1541,13 @@ H2StreamContext::H2StreamContext(bool read_body_progressively)
     , _stream_ended(false)
     , _remote_window_left(0)
     , _deferred_window_update(0)
-    , _correlation_id(INVALID_BTHREAD_ID.value) {
+    , _correlation_id(INVALID_BTHREAD_ID.value)
+    , _stage2_socket_id(INVALID_SOCKET_ID)
+    , _stage2_ungranted(0)
+    , _stage2_consumed(0)
+    , _stage2_consuming(false)
+    , _stage2_end_queued(false)
+    , _stage2_cancelled(false) {
     header().set_version(2, 0);
 #ifndef NDEBUG
     get_h2_bvars()->h2_stream_context_count << 1;
@@ -1220,7 +1601,7 @@ bool H2StreamContext::ConsumeWindowSize(int64_t size) {
 
 int H2StreamContext::ConsumeHeaders(butil::IOBufBytesIterator& it) {
     HPacker& hpacker = _conn_ctx->hpacker();
-    HttpHeader& h = header();
+    HttpHeader& h = (_trailers ? *_trailers : header());
     while (it) {
         HPacker::Header pair;
         const int rc = hpacker.Decode(it, &pair);
@@ -1305,19 +1686,18 @@ int H2StreamContext::ConsumeHeaders(butil::IOBufBytesIterator& it) {
     return 0;
 }
 
-const CommonStrings* get_common_strings();
-
 static void PackH2Message(butil::IOBuf* out,
                           butil::IOBuf& headers,
                           butil::IOBuf& trailer_headers,
                           const butil::IOBuf& data,
                           int stream_id,
+                          bool end_stream,
                           H2Context* conn_ctx) {
     const H2Settings& remote_settings = conn_ctx->remote_settings();
     char headbuf[FRAME_HEAD_SIZE];
     H2FrameHead headers_head = {
         (uint32_t)headers.size(), H2_FRAME_HEADERS, 0, stream_id};
-    if (data.empty() && trailer_headers.empty()) {
+    if (end_stream && data.empty() && trailer_headers.empty()) {
         headers_head.flags |= H2_FLAGS_END_STREAM;
     }
     if (headers_head.payload_size <= remote_settings.max_frame_size) {
@@ -1350,7 +1730,7 @@ static void PackH2Message(butil::IOBuf* out,
         while (it.bytes_left()) {
             if (it.bytes_left() <= remote_settings.max_frame_size) {
                 data_head.payload_size = it.bytes_left();
-                if (trailer_headers.empty()) {
+                if (end_stream && trailer_headers.empty()) {
                     data_head.flags |= H2_FLAGS_END_STREAM;
                 }
             } else {
@@ -1364,6 +1744,7 @@ static void PackH2Message(butil::IOBuf* out,
     if (!trailer_headers.empty()) {
         H2FrameHead headers_head = {
             (uint32_t)trailer_headers.size(), H2_FRAME_HEADERS, 0, stream_id};
+        // Trailers always end the stream.
         headers_head.flags |= H2_FLAGS_END_STREAM;
         headers_head.flags |= H2_FLAGS_END_HEADERS;
         SerializeFrameHead(headbuf, headers_head);
@@ -1452,6 +1833,11 @@ H2UnsentRequest* H2UnsentRequest::New(Controller* c) {
         val->append(encoded_user_info);
     }
     msg->_sctx.reset(new H2StreamContext(c->is_response_read_progressively()));
+    if (c->has_progressive_writer()) {
+        ControllerPrivateAccessor accessor(c);
+        msg->_writer.reset(static_cast<H2ProgressiveAttachment*>(
+                               accessor.release_progressive_attachment()), false);
+    }
     return msg;
 }
 
@@ -1476,12 +1862,20 @@ void H2UnsentRequest::DestroyStreamUserData(SocketUniquePtr& sending_sock,
                                             int error_code,
                                             bool /*end_of_rpc*/) {
     RemoveRefOnQuit deref_self(this);
+    if (error_code != 0) {
+        std::unique_lock<butil::Mutex> mu(_mutex);
+        if (_writer != NULL) {
+            // The request was not sent.
+            _writer->Stop(error_code);
+        }
+    }
     if (sending_sock != NULL && error_code != 0) {
         CHECK_EQ(cntl, _cntl);
         std::unique_lock<butil::Mutex> mu(_mutex);
         _cntl = NULL;
         if (_stream_id != 0) {
             H2Context* ctx = static_cast<H2Context*>(sending_sock->parsing_context());
+            ctx->StopStreamWriter(_stream_id, error_code);
             ctx->AddAbandonedStream(_stream_id);
         }
     }
@@ -1589,7 +1983,14 @@ H2UnsentRequest::AppendAndDestroySelf(butil::IOBuf* out, Socket* socket) {
     butil::IOBuf frag;
     appender.move_to(frag);
     butil::IOBuf dummy_buf;
-    PackH2Message(out, frag, dummy_buf, _cntl->request_attachment(), _stream_id, ctx);
+    PackH2Message(out, frag, dummy_buf, _cntl->request_attachment(), _stream_id,
+                  _writer == NULL, ctx);
+    if (_writer != NULL) {
+        bool is_grpc_ct = false;
+        ParseContentType(_cntl->http_request().content_type(), &is_grpc_ct);
+        _writer->Establish(socket, _stream_id, is_grpc_ct);
+        _writer.reset();
+    }
     return butil::Status::OK();
 }
 
@@ -1642,7 +2043,12 @@ H2UnsentResponse::H2UnsentResponse(Controller* c, int stream_id, bool is_grpc)
     , _stream_id(stream_id)
     , _http_response(c->release_http_response())
     , _is_grpc(is_grpc) {
-    _data.swap(c->response_attachment());
+    if (c->has_progressive_writer() && !c->Failed()) {
+        _writer.reset(static_cast<H2ProgressiveAttachment*>(
+                          ControllerPrivateAccessor(c).progressive_attachment()));
+    } else {
+        _data.swap(c->response_attachment());
+    }
     if (is_grpc) {
         _grpc_status = ErrorCodeToGrpcStatus(c->ErrorCode());
         PercentEncode(c->ErrorText(), &_grpc_message);
@@ -1692,6 +2098,9 @@ H2UnsentResponse::AppendAndDestroySelf(butil::IOBuf* out, Socket* socket) {
 #endif
     DestroyingPtr<H2UnsentResponse> destroy_self(this);
     if (socket == NULL) {
+        if (_writer != NULL) {
+            _writer->Stop(EFAILEDSOCKET);
+        }
         return butil::Status::OK();
     }
     H2Context* ctx = static_cast<H2Context*>(socket->parsing_context());
@@ -1712,7 +2121,6 @@ H2UnsentResponse::AppendAndDestroySelf(butil::IOBuf* out, Socket* socket) {
     }
 
     HPacker& hpacker = ctx->hpacker();
-    butil::IOBufAppender appender;
     HPackOptions options;
     options.encode_name = FLAGS_h2_hpack_encode_name;
     options.encode_value = FLAGS_h2_hpack_encode_value;
@@ -1720,32 +2128,46 @@ H2UnsentResponse::AppendAndDestroySelf(butil::IOBuf* out, Socket* socket) {
         options.index_policy = HPACK_NEVER_INDEX_HEADER;
     }
 
-    for (size_t i = 0; i < _size; ++i) {
-        hpacker.Encode(&appender, _list[i], options);
+    // Headers of responses are mostly the same, encode them with the caches
+    // of the connection to skip looking up the index tables.
+    const size_t nheader = _size +
+        (_http_response ? _http_response->HeaderCount() : 0);
+    DEFINE_SMALL_ARRAY(HPacker::HeaderRef, headers, nheader, 16);
+    size_t nref = 0;
+    for (size_t i = 0; i < _size; ++i, ++nref) {
+        headers[nref].name = &_list[i].name;
+        headers[nref].value = &_list[i].value;
     }
     if (_http_response) {
         for (HttpHeader::HeaderIterator it = _http_response->HeaderBegin();
-             it != _http_response->HeaderEnd(); ++it) {
-            HPacker::Header header(it->first, it->second);
-            hpacker.Encode(&appender, header, options);
+             it != _http_response->HeaderEnd(); ++it, ++nref) {
+            headers[nref].name = &it->first;
+            headers[nref].value = &it->second;
         }
     }
     butil::IOBuf frag;
-    appender.move_to(frag);
+    hpacker.EncodeBlock(&frag, headers, nref, options,
+                        &ctx->_response_headers_cache);
 
     butil::IOBuf trailer_frag;
-    if (_is_grpc) {
-        HPacker::Header status_header("grpc-status",
-                                      butil::string_printf("%d", _grpc_status));
-        hpacker.Encode(&appender, status_header, options);
-        if (!_grpc_message.empty()) {
-            HPacker::Header msg_header("grpc-message", _grpc_message);
-            hpacker.Encode(&appender, msg_header, options);
-        }
-        appender.move_to(trailer_frag);
+    // Trailers of progressive responses are sent when the writer ends.
+    if (_is_grpc && _writer == NULL) {
+        const CommonStrings* const common = get_common_strings();
+        const std::string grpc_status = butil::string_printf("%d", _grpc_status);
+        HPacker::HeaderRef trailers[2] = {
+            { &common->GRPC_STATUS, &grpc_status },
+            { &common->GRPC_MESSAGE, &_grpc_message }
+        };
+        hpacker.EncodeBlock(&trailer_frag, trailers,
+                            (_grpc_message.empty() ? 1 : 2), options,
+                            &ctx->_grpc_trailers_cache);
+    }
+
+    PackH2Message(out, frag, trailer_frag, _data, _stream_id,
+                  _writer == NULL, ctx);
+    if (_writer != NULL) {
+        _writer->Establish(socket, _stream_id, _is_grpc);
     }
-
-    PackH2Message(out, frag, trailer_frag, _data, _stream_id, ctx);
     return butil::Status::OK();
 }
 
@@ -1781,6 +2203,303 @@ void H2UnsentResponse::Print(std::ostream& os) const {
     os << butil::ToPrintable(_data, FLAGS_http_verbose_max_body_length);
 }
 
+// Interval of re-checking the windows when no WINDOW_UPDATE is received,
+// just in case of missing wakeups.
+static const int64_t WAIT_WINDOW_INTERVAL_MS = 100;
+
+H2ProgressiveAttachment::H2ProgressiveAttachment(SocketUniquePtr& movable_sock)
+    : ProgressiveAttachment(movable_sock, false)
+    , _established(false)
+    , _conn_ctx(NULL)
+    , _stream_id(0)
+    , _is_grpc(false)
+    , _error_code(0)
+    , _end_error_code(0)
+    , _remote_window_left(0)
+    , _window_butex(bthread::butex_create_checked<butil::atomic<int> >())
+    , _saved_size(0) {
+    bthread_mutex_init(&_write_mutex, NULL);
+    _window_butex->store(0, butil::memory_order_relaxed);
+}
+
+H2ProgressiveAttachment::~H2ProgressiveAttachment() {
+    if (_established) {
+        // The H2Context is alive because _httpsock is referenced.
+        _conn_ctx->RemoveStreamWriter(_stream_id);
+        const int error_code = _error_code.load(butil::memory_order_relaxed);
+        Socket::WriteOptions wopt;
+        wopt.ignore_eovercrowded = true;
+        if (_httpsock->Failed()) {
+            // Nothing to end.
+        } else if (error_code == 0 && (_end_error_code == 0 ||
+                   (_is_grpc && _conn_ctx->is_server_side()))) {
+            SocketMessagePtr<H2UnsentStreamEnd> end_msg(new H2UnsentStreamEnd(
+                    _stream_id, _is_grpc && _conn_ctx->is_server_side()));
+            if (_end_error_code != 0) {
+                end_msg->set_error(_end_error_code, _end_error_text);
+            }
+            _httpsock->Write(end_msg, &wopt);
+        } else if (error_code != ECONNRESET) {
+            char rstbuf[FRAME_HEAD_SIZE + 4];
+            SerializeFrameHead(rstbuf, 4, H2_FRAME_RST_STREAM, 0, _stream_id);
+            SaveUint32(rstbuf + FRAME_HEAD_SIZE, H2_CANCEL);
+            butil::IOBuf buf;
+            buf.append(rstbuf, sizeof(rstbuf));
+            _httpsock->Write(&buf, &wopt);
+        }
+    }
+    // Not write the last chunk of http/1.1 in ~ProgressiveAttachment().
+    _httpsock.reset();
+    bthread::butex_destroy(_window_butex);
+    bthread_mutex_destroy(&_write_mutex);
+}
+
+int H2ProgressiveAttachment::Write(const butil::IOBuf& data) {
+    {
+        std::unique_lock<butil::Mutex> mu(_mutex);
+        const int error_code = _error_code.load(butil::memory_order_relaxed);
+        if (error_code != 0) {
+            errno = error_code;
+            return -1;
+        }
+        if (_end_error_code != 0) {
+            errno = _end_error_code;
+            return -1;
+        }
+        if (!_established) {
+            if (_saved_size >= (size_t)FLAGS_socket_max_unwritten_bytes) {
+                errno = EOVERCROWDED;
+                return -1;
+            }
+            _saved_messages.push_back(data);
+            _saved_size += data.size();
+            return 0;
+        }
+    }
+    std::unique_lock<bthread_mutex_t> mu(_write_mutex);
+    if (FlushSaved() != 0) {
+        return -1;
+    }
+    return WriteMessage(data);
+}
+
+int H2ProgressiveAttachment::Write(const void* data, size_t n) {
+    butil::IOBuf buf;
+    if (data != NULL) {
+        buf.append(data, n);
+    }
+    return Write(buf);
+}
+
+int H2ProgressiveAttachment::Establish(Socket* sock, int stream_id,
+                                       bool is_grpc) {
+    std::unique_lock<butil::Mutex> mu(_mutex);
+    if (_established) {
+        return -1;
+    }
+    if (_httpsock == NULL) {
+        sock->ReAddress(&_httpsock);
+    }
+    _conn_ctx = static_cast<H2Context*>(sock->parsing_context());
+    _stream_id = stream_id;
+    _is_grpc = is_grpc;
+    _conn_ctx->AddStreamWriter(stream_id, this);
+    // Established even if stopped, to end or reset the stream on release.
+    _established = true;
+    if (_error_code.load(butil::memory_order_relaxed) != 0) {
+        _saved_messages.clear();
+        _saved_size = 0;
+        return 0;
+    }
+    if (_saved_messages.empty()) {
+        return 0;
+    }
+    mu.unlock();
+    // Establish() is called in AppendAndDestroySelf() which should not be
+    // blocked by the windows, flush in another bthread.
+    AddRefManually();
+    bthread_t th;
+    if (bthread_start_background(&th, NULL, RunFlushSaved, this) != 0) {
+        LOG(ERROR) << "Fail to start bthread to flush stream_id=" << stream_id;
+        Stop(ENOMEM);
+        RemoveRefManually();
+    }
+    return 0;
+}
+
+void* H2ProgressiveAttachment::RunFlushSaved(void* arg) {
+    H2ProgressiveAttachment* w = static_cast<H2ProgressiveAttachment*>(arg);
+    {
+        std::unique_lock<bthread_mutex_t> mu(w->_write_mutex);
+        if (w->FlushSaved() != 0) {
+            w->Stop(errno);
+        }
+    }
+    w->RemoveRefManually();
+    return NULL;
+}
+
+int H2ProgressiveAttachment::FlushSaved() {
+    std::vector<butil::IOBuf> saved;
+    {
+        std::unique_lock<butil::Mutex> mu(_mutex);
+        if (_saved_messages.empty()) {
+            return 0;
+        }
+        saved.swap(_saved_messages);
+        _saved_size = 0;
+    }
+    for (size_t i = 0; i < saved.size(); ++i) {
+        if (WriteMessage(saved[i]) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int H2ProgressiveAttachment::WriteMessage(const butil::IOBuf& data) {
+    butil::IOBuf buf;
+    if (_is_grpc) {
+        // Empty messages are valid in gRPC.
+        char prefix[5];
+        prefix[0] = 0;  // not compressed
+        SaveUint32(prefix + 1, (uint32_t)data.size());
+        buf.append(prefix, sizeof(prefix));
+    } else if (data.empty()) {
+        LOG_EVERY_SECOND(WARNING)
+            << "Write an empty chunk. To suppress this warning, check emptiness"
+            " of the chunk before calling ProgressiveAttachment.Write()";
+        return 0;
+    }
+    buf.append(data);
+    return WriteFrames(&buf);
+}
+
+int H2ProgressiveAttachment::WriteFrames(butil::IOBuf* data) {
+    Socket::WriteOptions wopt;
+    wopt.ignore_eovercrowded = true;
+    butil::IOBuf frames;
+    while (!data->empty()) {
+        const int expected_val = _window_butex->load(butil::memory_order_acquire);
+        const int error_code = _error_code.load(butil::memory_order_relaxed);
+        if (error_code != 0) {
+            errno = error_code;
+            return -1;
+        }
+        if (_httpsock->Failed()) {
+            errno = EFAILEDSOCKET;
+            return -1;
+        }
+        int64_t size = std::min((int64_t)data->size(), (int64_t)
+                                _conn_ctx->remote_settings().max_frame_size);
+        size = std::min(size, _remote_window_left.load(butil::memory_order_relaxed));
+        size = std::min(size, _conn_ctx->_remote_window_left.load(
+                            butil::memory_order_relaxed));
+        if (size <= 0) {
+            // Send frames packed so far before waiting for WINDOW_UPDATE,
+            // which may never come otherwise.
+            if (!frames.empty() && _httpsock->Write(&frames, &wopt) != 0) {
+                return -1;
+            }
+            const timespec abstime =
+                butil::milliseconds_from_now(WAIT_WINDOW_INTERVAL_MS);
+            bthread::butex_wait(_window_butex, expected_val, &abstime);
+            continue;
+        }
+        if (!MinusWindowSize(&_conn_ctx->_remote_window_left, size)) {
+            // Raced with other streams.
+            continue;
+        }
+        _remote_window_left.fetch_sub(size, butil::memory_order_relaxed);
+        char headbuf[FRAME_HEAD_SIZE];
+        SerializeFrameHead(headbuf, size, H2_FRAME_DATA, 0, _stream_id);
+        frames.append(headbuf, sizeof(headbuf));
+        data->cutn(&frames, size);
+    }
+    if (!frames.empty()) {
+        return _httpsock->Write(&frames, &wopt);
+    }
+    return 0;
+}
+
+void H2ProgressiveAttachment::Stop(int error_code) {
+    int expected = 0;
+    if (_error_code.compare_exchange_strong(
+            expected, error_code, butil::memory_order_relaxed)) {
+        WakeUp();
+    }
+}
+
+int H2ProgressiveAttachment::Stop(int error_code, const std::string& error_text) {
+    if (error_code == 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    std::unique_lock<butil::Mutex> mu(_mutex);
+    if (_error_code.load(butil::memory_order_relaxed) != 0 ||
+        _end_error_code != 0) {
+        errno = EPERM;
+        return -1;
+    }
+    // Unlike Stop(int), messages written before are still sent.
+    _end_error_code = error_code;
+    _end_error_text = error_text;
+    return 0;
+}
+
+void H2ProgressiveAttachment::WakeUp() {
+    _window_butex->fetch_add(1, butil::memory_order_release);
+    bthread::butex_wake_all(_window_butex);
+}
+
+void H2ProgressiveAttachment::MarkRPCAsDone(bool rpc_failed) {
+    if (rpc_failed) {
+        Stop(ECANCELED);
+    }
+}
+
+void H2UnsentStreamEnd::set_error(int error_code, const std::string& error_text) {
+    _grpc_status = ErrorCodeToGrpcStatus(error_code);
+    PercentEncode(error_text, &_grpc_message);
+}
+
+butil::Status
+H2UnsentStreamEnd::AppendAndDestroySelf(butil::IOBuf* out, Socket* socket) {
+    std::unique_ptr<H2UnsentStreamEnd> destroy_self(this);
+    if (socket == NULL) {
+        return butil::Status::OK();
+    }
+    H2Context* ctx = static_cast<H2Context*>(socket->parsing_context());
+    char headbuf[FRAME_HEAD_SIZE];
+    if (!_send_grpc_trailers) {
+        SerializeFrameHead(headbuf, 0, H2_FRAME_DATA, H2_FLAGS_END_STREAM,
+                           _stream_id);
+        out->append(headbuf, sizeof(headbuf));
+        return butil::Status::OK();
+    }
+    HPackOptions options;
+    options.encode_name = FLAGS_h2_hpack_encode_name;
+    options.encode_value = FLAGS_h2_hpack_encode_value;
+    if (ctx->remote_settings().header_table_size == 0) {
+        options.index_policy = HPACK_NEVER_INDEX_HEADER;
+    }
+    const CommonStrings* const common = get_common_strings();
+    const std::string grpc_status = butil::string_printf("%d", _grpc_status);
+    HPacker::HeaderRef trailers[2] = {
+        { &common->GRPC_STATUS, &grpc_status },
+        { &common->GRPC_MESSAGE, &_grpc_message }
+    };
+    butil::IOBuf trailer_frag;
+    ctx->hpacker().EncodeBlock(&trailer_frag, trailers,
+                               (_grpc_message.empty() ? 1 : 2), options,
+                               &ctx->_grpc_trailers_cache);
+    SerializeFrameHead(headbuf, trailer_frag.size(), H2_FRAME_HEADERS,
+                       H2_FLAGS_END_STREAM | H2_FLAGS_END_HEADERS, _stream_id);
+    out->append(headbuf, sizeof(headbuf));
+    out->append(butil::IOBuf::Movable(trailer_frag));
+    return butil::Status::OK();
+}
+
 void PackH2Request(butil::IOBuf*,
                    SocketMessage** user_message,
                    uint64_t correlation_id,
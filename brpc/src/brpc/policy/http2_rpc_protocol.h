@@ -25,6 +25,7 @@
 #include "brpc/details/hpack.h"
 #include "brpc/stream_creator.h"
 #include "brpc/controller.h"
+#include "brpc/progressive_attachment.h"
 
 #ifndef NDEBUG
 #include "bvar/bvar.h"
@@ -34,6 +35,7 @@ namespace brpc {
 namespace policy {
 
 class H2StreamContext;
+class H2ProgressiveAttachment;
 
 class H2ParseResult {
 public:
@@ -190,6 +192,9 @@ private:
     mutable butil::Mutex _mutex;
     Controller* _cntl;
     std::unique_ptr<H2StreamContext> _sctx;
+    // Writes the request progressively after the stream is created, moved
+    // out of the controller so that the stream ends when user releases it.
+    butil::intrusive_ptr<H2ProgressiveAttachment> _writer;
     HPacker::Header _list[0];
 };
 
@@ -222,6 +227,9 @@ private:
     bool _is_grpc;
     GrpcStatus _grpc_status;
     std::string _grpc_message;
+    // Non-NULL when the response is written progressively after headers,
+    // in which case the stream is ended by the writer.
+    butil::intrusive_ptr<H2ProgressiveAttachment> _writer;
     HPacker::Header _list[0];
 };
 
@@ -236,8 +244,15 @@ public:
     // does not need to complete.
     // Returns 0 on success, -1 otherwise.
     int ConsumeHeaders(butil::IOBufBytesIterator& it);
+    H2ParseResult OnHeadersComplete();
     H2ParseResult OnEndStream();
 
+    // Called when the stream is removed before being ended. If the headers
+    // were returned as a message whose body is read progressively, end the
+    // body with `error_code', release the ref owned by the stream table and
+    // return true. Otherwise return false and the caller still owns this.
+    bool AbortStage2(int error_code);
+
     H2ParseResult OnData(butil::IOBufBytesIterator&, const H2FrameHead&,
                        uint32_t frag_size, uint8_t pad_length);
     H2ParseResult OnHeaders(butil::IOBufBytesIterator&, const H2FrameHead&,
@@ -265,6 +280,22 @@ public:
     void SetState(H2StreamState state);
 #endif
 
+    // The body of stage2 is fed to the reader of user in a bthread rather
+    // than the one parsing the connection, which would otherwise be blocked
+    // by the reader and stop frames of other streams (e.g. WINDOW_UPDATE
+    // needed by the reader to write a bidi stream) from being processed.
+    // The stream-level WINDOW_UPDATE is sent after the reader consumed the
+    // data, so that a slow reader only throttles its own stream.
+    H2ParseResult QueueStage2Data(butil::IOBuf& data);
+    // End the body with `st' after the queued data, and release the ref
+    // owned by the stream table.
+    void QueueStage2End(const butil::Status& st);
+    void StartStage2Reader();
+    static void* RunStage2Reader(void* arg);
+    void ConsumeStage2();
+    void OnStage2Consumed(int64_t size);
+    void CancelStage2();
+
 friend class H2Context;
     H2Context* _conn_ctx;
 #if defined(BRPC_H2_STREAM_STATE)
@@ -276,6 +307,24 @@ friend class H2Context;
     butil::atomic<int64_t> _deferred_window_update;
     uint64_t _correlation_id;
     butil::IOBuf _remaining_header_fragment;
+    // Headers received after returning the stream as a progressively-read
+    // message, in which case header() may be used by the user.
+    std::unique_ptr<HttpHeader> _trailers;
+    // The connection of stage2, checked by the reader before writing to it.
+    SocketId _stage2_socket_id;
+    // Following fields are protected by _stage2_mutex.
+    butil::Mutex _stage2_mutex;
+    // Data received but not fed to the reader yet.
+    butil::IOBuf _stage2_data;
+    // Bytes received but not granted back to the peer by WINDOW_UPDATE.
+    int64_t _stage2_ungranted;
+    // Bytes fed to the reader but not granted back to the peer yet.
+    int64_t _stage2_consumed;
+    // True if a bthread is running ConsumeStage2().
+    bool _stage2_consuming;
+    bool _stage2_end_queued;
+    // The reader failed and the stream was reset, data is dropped.
+    bool _stage2_cancelled;
 };
 
 StreamCreator* get_h2_global_stream_creator();
@@ -335,9 +384,9 @@ public:
     int AllocateClientStreamId();
     bool RunOutStreams() const;
     // Try to map stream_id to ctx if stream_id does not exist before
-    // Returns 0 on success, -1 on exist, 1 on goaway.
+    // Returns 0 on success, -1 on exist (or out of memory), 1 on goaway.
     int TryToInsertStream(int stream_id, H2StreamContext* ctx);
-    size_t VolatilePendingStreamSize() const { return _pending_streams.size(); }
+    size_t VolatilePendingStreamSize() const;
 
     HPacker& hpacker() { return _hpacker; }
     const H2Settings& remote_settings() const { return _remote_settings; }
@@ -351,10 +400,19 @@ public:
     void DeferWindowUpdate(int64_t);
     int64_t ReleaseDeferredWindowUpdate();
 
+    // Map stream_id to `w' to deliver WINDOW_UPDATE/RST_STREAM of the stream.
+    // The stream-level window of `w' is inherited from the stream if it's
+    // not removed yet, which may have been updated by the peer.
+    void AddStreamWriter(int stream_id, H2ProgressiveAttachment* w);
+    void RemoveStreamWriter(int stream_id);
+    void StopStreamWriter(int stream_id, int error_code);
+
 private:
 friend class H2StreamContext;
 friend class H2UnsentRequest;
 friend class H2UnsentResponse;
+friend class H2UnsentStreamEnd;
+friend class H2ProgressiveAttachment;
 friend void InitFrameHandlers();
 
     ParseResult ConsumeFrameHead(butil::IOBufBytesIterator&, H2FrameHead*);
@@ -375,25 +433,134 @@ friend void InitFrameHandlers();
 
     H2StreamContext* FindStream(int stream_id);
 
+    // Streams are spread over shards by stream_id so that frames of
+    // different streams of a connection rarely contend for the same lock.
+    // A shard is created when a stream is inserted into it for the first
+    // time, so connections with few streams don't pay for all the shards.
+    typedef butil::FlatMap<int, H2StreamContext*> StreamMap;
+    struct BAIDU_CACHELINE_ALIGNMENT StreamShard {
+        butil::Mutex mutex;
+        StreamMap streams;
+    };
+    static const size_t STREAM_SHARD_NUM = 8;
+    // Returns the shard of `stream_id', or NULL if it's not created yet and
+    // `create' is false or the creation fails.
+    StreamShard* stream_shard(int stream_id, bool create);
+
     // True if the connection is established by client, otherwise it's
     // accepted by server.
     Socket* _socket;
+    const Server* _server;
     butil::atomic<int64_t> _remote_window_left;
     H2ConnectionState _conn_state;
     int _last_received_stream_id;
     uint32_t _last_sent_stream_id;
-    int _goaway_stream_id;
+    butil::atomic<int> _goaway_stream_id;
     H2Settings _remote_settings;
     bool _remote_settings_received;
     H2Settings _local_settings;
     H2Settings _unack_local_settings;
     HPacker _hpacker;
+    // Encoded headers of the last response, only used in sending responses
+    // which is serialized like other usages of _hpacker.
+    HPackBlockCache _response_headers_cache;
+    HPackBlockCache _grpc_trailers_cache;
     mutable butil::Mutex _abandoned_streams_mutex;
     std::vector<uint32_t> _abandoned_streams;
-    typedef butil::FlatMap<int, H2StreamContext*> StreamMap;
-    mutable butil::Mutex _stream_mutex;
-    StreamMap _pending_streams;
+    // Checked before locking _abandoned_streams_mutex, which is done after
+    // parsing each message.
+    butil::atomic<bool> _has_abandoned_streams;
+    butil::atomic<StreamShard*> _stream_shards[STREAM_SHARD_NUM];
+    // Number of streams in all the shards.
+    butil::atomic<size_t> _stream_count;
     butil::atomic<int64_t> _deferred_window_update;
+    // Streams written progressively, which may be removed from the stream
+    // table already (e.g. responses of server-side).
+    typedef butil::FlatMap<int, H2ProgressiveAttachment*> WriterMap;
+    butil::Mutex _writers_mutex;
+    WriterMap _writers;
+};
+
+// Write DATA frames of a stream after its headers, see comments on
+// ProgressiveAttachment. Created by Controller.CreateProgressiveAttachment()
+// and established by the protocol when the headers are sent.
+class H2ProgressiveAttachment : public ProgressiveAttachment {
+friend class H2Context;
+public:
+    // `movable_sock' is empty at client-side where the socket is not
+    // selected yet.
+    explicit H2ProgressiveAttachment(SocketUniquePtr& movable_sock);
+
+    // @ProgressiveAttachment
+    int Write(const butil::IOBuf& data) override;
+    int Write(const void* data, size_t n) override;
+
+    // @ProgressiveAttachment
+    int Stop(int error_code, const std::string& error_text) override;
+
+    // Start sending frames to `stream_id' of `sock' just after its headers.
+    // Data written before is flushed in background. If this attachment was
+    // stopped, the stream is ended or reset when it's released.
+    // Returns 0 on success, -1 if this attachment was established.
+    int Establish(Socket* sock, int stream_id, bool is_grpc);
+
+    // Make following Write() fail with `error_code', including the blocking
+    // ones. The stream is reset instead of being ended, unless `error_code'
+    // is ECONNRESET which means that the peer reset the stream.
+    void Stop(int error_code);
+
+protected:
+    ~H2ProgressiveAttachment();
+
+    // @ProgressiveAttachment
+    void MarkRPCAsDone(bool rpc_failed) override;
+
+private:
+    void WakeUp();
+    // Following methods are called with _write_mutex held.
+    int FlushSaved();
+    int WriteMessage(const butil::IOBuf& data);
+    int WriteFrames(butil::IOBuf* data);
+    static void* RunFlushSaved(void* arg);
+
+    // Serialize frames of different messages.
+    bthread_mutex_t _write_mutex;
+    bool _established;
+    H2Context* _conn_ctx;
+    int _stream_id;
+    bool _is_grpc;
+    butil::atomic<int> _error_code;
+    // Set by Stop(error_code, error_text) to end the stream with the status
+    // after messages written before, protected by _mutex.
+    int _end_error_code;
+    std::string _end_error_text;
+    // Written by the peer through WINDOW_UPDATE and SETTINGS.
+    butil::atomic<int64_t> _remote_window_left;
+    // Incremented when the windows were updated or stopped.
+    butil::atomic<int>* _window_butex;
+    // Messages written before the establishment, protected by _mutex.
+    std::vector<butil::IOBuf> _saved_messages;
+    size_t _saved_size;
+};
+
+// End a stream written progressively, with trailers in gRPC responses.
+class H2UnsentStreamEnd : public SocketMessage {
+public:
+    H2UnsentStreamEnd(int stream_id, bool send_grpc_trailers)
+        : _stream_id(stream_id)
+        , _send_grpc_trailers(send_grpc_trailers)
+        , _grpc_status(GRPC_OK) {}
+    // Send `error_code' and `error_text' in the trailers.
+    void set_error(int error_code, const std::string& error_text);
+    // @SocketMessage
+    butil::Status AppendAndDestroySelf(butil::IOBuf* out, Socket*) override;
+
+private:
+    int _stream_id;
+    bool _send_grpc_trailers;
+    GrpcStatus _grpc_status;
+    // Percent-encoded.
+    std::string _grpc_message;
 };
 
 inline int H2Context::AllocateClientStreamId() {
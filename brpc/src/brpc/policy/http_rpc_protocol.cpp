@@ -333,7 +333,9 @@ void ProcessHttpResponse(InputMessageBase* msg) {
                 }
             }
         } else if (is_grpc) {
-            if (!RemoveGrpcPrefix(&res_body, &grpc_compressed)) {
+            // Messages being read progressively are delimited by the reader.
+            if (!imsg_guard->read_body_progressively() &&
+                !RemoveGrpcPrefix(&res_body, &grpc_compressed)) {
                 cntl->SetFailed(ERESPONSE, "Invalid gRPC response");
                 break;
             }
@@ -377,8 +379,9 @@ void ProcessHttpResponse(InputMessageBase* msg) {
                                 static_cast<int>(res_header->status_code()),
                                 res_header->reason_phrase(),
                                 (int)body_str.size(), body_str.c_str());
-            } else if (cntl->response() != NULL &&
+            } else if (!is_grpc && cntl->response() != NULL &&
                        cntl->response()->GetDescriptor()->field_count() != 0) {
+                // Responses of gRPC streaming methods are parsed by user.
                 cntl->SetFailed(ERESPONSE, "A protobuf response can't be parsed"
                                 " from progressively-read HTTP body");
             }
@@ -508,7 +511,8 @@ void SerializeHttpRequest(butil::IOBuf* /*not used*/,
     }
     if (pbreq != NULL) {
         // If request is not NULL, message body will be serialized proto/json,
-        if (!pbreq->IsInitialized()) {
+        // unless user writes the body.
+        if (!cntl->has_progressive_writer() && !pbreq->IsInitialized()) {
             return cntl->SetFailed(
                 EREQUEST, "Missing required fields in request: %s",
                 pbreq->InitializationErrorString().c_str());
@@ -536,7 +540,9 @@ void SerializeHttpRequest(butil::IOBuf* /*not used*/,
         }
 
         butil::IOBufAsZeroCopyOutputStream wrapper(&cntl->request_attachment());
-        if (content_type == HTTP_CONTENT_PROTO) {
+        if (cntl->has_progressive_writer()) {
+            // Messages are written by user, e.g. streaming requests of gRPC.
+        } else if (content_type == HTTP_CONTENT_PROTO) {
             // Serialize content as protobuf
             if (!pbreq->SerializeToZeroCopyStream(&wrapper)) {
                 cntl->request_attachment().clear();
@@ -560,7 +566,7 @@ void SerializeHttpRequest(butil::IOBuf* /*not used*/,
             opt.enum_option = (FLAGS_pb_enum_as_number
                                ? json2pb::OUTPUT_ENUM_BY_NUMBER
                                : json2pb::OUTPUT_ENUM_BY_NAME);
-            if (!json2pb::ProtoMessageToJson(*pbreq, &wrapper, opt, &err)) {
+            if (!json2pb::ProtoMessageToJson(*pbreq, &cntl->request_attachment(), opt, &err)) {
                 cntl->request_attachment().clear();
                 return cntl->SetFailed(
                     EREQUEST, "Fail to convert request to json, %s", err.c_str());
@@ -632,8 +638,10 @@ void SerializeHttpRequest(butil::IOBuf* /*not used*/,
                 hreq.SetHeader(common->GRPC_TIMEOUT,
                         butil::string_printf("%" PRId64 "m", cntl->timeout_ms()));
             }
-            // Append compressed and length before body
-            AddGrpcPrefix(&cntl->request_attachment(), grpc_compressed);
+            if (!cntl->has_progressive_writer()) {
+                // Append compressed and length before body
+                AddGrpcPrefix(&cntl->request_attachment(), grpc_compressed);
+            }
         }
     }
 
@@ -805,6 +813,8 @@ HttpResponseSender::~HttpResponseSender() {
     if (res != NULL &&
         cntl->response_attachment().empty() &&
         // ^ user did not fill the body yet.
+        !cntl->has_progressive_writer() &&
+        // ^ user writes the body.
         res->GetDescriptor()->field_count() > 0 &&
         // ^ a pb service
         !cntl->Failed()) {
@@ -829,7 +839,7 @@ HttpResponseSender::~HttpResponseSender() {
             opt.enum_option = (FLAGS_pb_enum_as_number
                                ? json2pb::OUTPUT_ENUM_BY_NUMBER
                                : json2pb::OUTPUT_ENUM_BY_NAME);
-            if (!json2pb::ProtoMessageToJson(*res, &wrapper, opt, &err)) {
+            if (!json2pb::ProtoMessageToJson(*res, &cntl->response_attachment(), opt, &err)) {
                 cntl->SetFailed(ERESPONSE, "Fail to convert response to json, %s", err.c_str());
             }
         }
@@ -937,7 +947,7 @@ HttpResponseSender::~HttpResponseSender() {
     Socket::WriteOptions wopt;
     wopt.ignore_eovercrowded = true;
     if (is_http2) {
-        if (is_grpc) {
+        if (is_grpc && (cntl->Failed() || !cntl->has_progressive_writer())) {
             // Append compressed and length before body
             AddGrpcPrefix(&cntl->response_attachment(), grpc_compressed);
         }
@@ -1535,7 +1545,11 @@ void ProcessHttpRequest(InputMessageBase *msg) {
         cntl->SetFailed("Fail to new req or res");
         return;
     }
-    if (mp->params.allow_http_body_to_pb &&
+    if (imsg_guard->read_body_progressively()) {
+        // The body is read by user, e.g. streaming requests of gRPC, the
+        // pb request is left empty.
+        accessor.set_readable_progressive_attachment(imsg_guard.get());
+    } else if (mp->params.allow_http_body_to_pb &&
         method->input_type()->field_count() > 0) {
         // A protobuf service. No matter if Content-type is set to
         // applcation/json or body is empty, we have to treat body as a json
@@ -1628,12 +1642,8 @@ void ProcessHttpRequest(InputMessageBase *msg) {
             }
         }
     } else {
-        if (imsg_guard->read_body_progressively()) {
-            accessor.set_readable_progressive_attachment(imsg_guard.get());
-        } else {
-            // A http server, just keep content as it is.
-            cntl->request_attachment().swap(req_body);
-        }
+        // A http server, just keep content as it is.
+        cntl->request_attachment().swap(req_body);
     }
 
     google::protobuf::Closure* done = new HttpResponseSenderAsDone(&resp_sender);
@@ -1697,9 +1707,21 @@ void HttpContext::CheckProgressiveRead(const void* arg, Socket *socket) {
     const Server::MethodProperty *const sp = FindMethodPropertyByURI(
         header().uri().path(), (Server *)arg,
         const_cast<std::string *>(&header().unresolved_path()));
-    if (sp != NULL && sp->params.enable_progressive_read) {
+    if (sp == NULL || !sp->params.enable_progressive_read) {
+        return;
+    }
+    if (socket != NULL) {
         this->set_read_body_progressively(true);
         socket->read_will_be_progressive(CONNECTION_TYPE_SHORT);
+        return;
+    }
+    // In http2, only requests of gRPC methods streaming from the client are
+    // read progressively. Others, e.g. unary methods of the same service,
+    // are parsed as a whole like before.
+    bool is_grpc_ct = false;
+    ParseContentType(header().content_type(), &is_grpc_ct);
+    if (is_grpc_ct && sp->method != NULL && sp->method->client_streaming()) {
+        this->set_read_body_progressively(true);
     }
 }
 
@@ -118,6 +118,10 @@ public:
         return SetBodyReader(r);
     }
 
+    // Read body progressively if the method being called enables it.
+    // `socket' is NULL in http2 where the stream, rather than the socket,
+    // is read progressively, and only for gRPC methods streaming from the
+    // client.
     void CheckProgressiveRead(const void* arg, Socket *socket);
 
 private:
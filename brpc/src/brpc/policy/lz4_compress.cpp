@@ -0,0 +1,204 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+#if BRPC_WITH_LZ4
+#include <gflags/gflags.h>
+#include <lz4frame.h>
+#include "butil/logging.h"
+#include "butil/thread_local.h"
+#include "brpc/policy/lz4_compress.h"
+#include "brpc/protocol.h"
+
+
+namespace brpc {
+namespace policy {
+
+DEFINE_int32(lz4_compress_level, 0, "Compression level of LZ4, 0 is the "
+             "fast mode, 3 and above uses the slower LZ4_HC");
+
+// Input is fed to LZ4F_compressUpdate in pieces of at most so many bytes,
+// so that the output always fits into a staging buffer of fixed size.
+static const size_t LZ4_INPUT_PIECE_SIZE = 64 * 1024;
+
+// Contexts and the staging buffer are reused by calls in the same thread.
+struct Lz4ThreadContext {
+    LZ4F_cctx* cctx;
+    LZ4F_dctx* dctx;
+    char* staging;
+    size_t staging_size;
+};
+
+static BAIDU_THREAD_LOCAL Lz4ThreadContext* tls_lz4_ctx = NULL;
+
+static void DestroyLz4ThreadContext(void* arg) {
+    Lz4ThreadContext* ctx = static_cast<Lz4ThreadContext*>(arg);
+    if (ctx->cctx) {
+        LZ4F_freeCompressionContext(ctx->cctx);
+    }
+    if (ctx->dctx) {
+        LZ4F_freeDecompressionContext(ctx->dctx);
+    }
+    free(ctx->staging);
+    delete ctx;
+}
+
+static Lz4ThreadContext* GetLz4ThreadContext() {
+    if (tls_lz4_ctx == NULL) {
+        Lz4ThreadContext* ctx = new (std::nothrow) Lz4ThreadContext;
+        if (ctx == NULL) {
+            return NULL;
+        }
+        ctx->cctx = NULL;
+        ctx->dctx = NULL;
+        ctx->staging = NULL;
+        ctx->staging_size = 0;
+        if (LZ4F_isError(LZ4F_createCompressionContext(&ctx->cctx, LZ4F_VERSION)) ||
+            LZ4F_isError(LZ4F_createDecompressionContext(&ctx->dctx, LZ4F_VERSION))) {
+            LOG(ERROR) << "Fail to create LZ4 contexts";
+            DestroyLz4ThreadContext(ctx);
+            return NULL;
+        }
+        butil::thread_atexit(DestroyLz4ThreadContext, ctx);
+        tls_lz4_ctx = ctx;
+    }
+    return tls_lz4_ctx;
+}
+
+bool Lz4Compress(const butil::IOBuf& in, butil::IOBuf* out) {
+    Lz4ThreadContext* ctx = GetLz4ThreadContext();
+    if (ctx == NULL) {
+        return false;
+    }
+    LZ4F_preferences_t prefs;
+    memset(&prefs, 0, sizeof(prefs));
+    prefs.frameInfo.contentSize = in.size();
+    prefs.compressionLevel = FLAGS_lz4_compress_level;
+    // Also large enough for the frame header and the end mark.
+    const size_t bound = LZ4F_compressBound(LZ4_INPUT_PIECE_SIZE, &prefs);
+    if (ctx->staging_size < bound) {
+        char* staging = (char*)realloc(ctx->staging, bound);
+        if (staging == NULL) {
+            LOG(ERROR) << "Fail to allocate staging buffer of LZ4";
+            return false;
+        }
+        ctx->staging = staging;
+        ctx->staging_size = bound;
+    }
+    size_t rc = LZ4F_compressBegin(
+        ctx->cctx, ctx->staging, ctx->staging_size, &prefs);
+    if (LZ4F_isError(rc)) {
+        LOG(WARNING) << "Fail to LZ4F_compressBegin: " << LZ4F_getErrorName(rc);
+        return false;
+    }
+    out->append(ctx->staging, rc);
+    // Compress backing blocks one by one rather than flattening `in'.
+    const size_t nblock = in.backing_block_num();
+    for (size_t i = 0; i < nblock; ++i) {
+        butil::StringPiece blk = in.backing_block(i);
+        while (!blk.empty()) {
+            const size_t len = std::min(blk.size(), LZ4_INPUT_PIECE_SIZE);
+            rc = LZ4F_compressUpdate(ctx->cctx, ctx->staging, ctx->staging_size,
+                                     blk.data(), len, NULL);
+            if (LZ4F_isError(rc)) {
+                LOG(WARNING) << "Fail to LZ4F_compressUpdate: "
+                             << LZ4F_getErrorName(rc);
+                return false;
+            }
+            out->append(ctx->staging, rc);
+            blk.remove_prefix(len);
+        }
+    }
+    rc = LZ4F_compressEnd(ctx->cctx, ctx->staging, ctx->staging_size, NULL);
+    if (LZ4F_isError(rc)) {
+        LOG(WARNING) << "Fail to LZ4F_compressEnd: " << LZ4F_getErrorName(rc);
+        return false;
+    }
+    out->append(ctx->staging, rc);
+    return true;
+}
+
+bool Lz4Decompress(const butil::IOBuf& in, butil::IOBuf* out) {
+    Lz4ThreadContext* ctx = GetLz4ThreadContext();
+    if (ctx == NULL) {
+        return false;
+    }
+    butil::IOBufAsZeroCopyOutputStream stream(out);
+    void* data_out = NULL;
+    int size_out = 0;
+    // Becomes 0 when a frame is fully decoded.
+    size_t rc = 1;
+    const size_t nblock = in.backing_block_num();
+    for (size_t i = 0; i < nblock; ++i) {
+        butil::StringPiece blk = in.backing_block(i);
+        // Keep calling until the block is consumed and no decoded data is
+        // left in the context, which is indicated by a full output.
+        bool output_full = false;
+        while (!blk.empty() || output_full) {
+            if (size_out == 0 && !stream.Next(&data_out, &size_out)) {
+                LOG(WARNING) << "Fail to allocate output of LZ4";
+                LZ4F_resetDecompressionContext(ctx->dctx);
+                return false;
+            }
+            size_t dst_size = size_out;
+            size_t src_size = blk.size();
+            rc = LZ4F_decompress(ctx->dctx, data_out, &dst_size,
+                                 blk.data(), &src_size, NULL);
+            if (LZ4F_isError(rc)) {
+                LOG(WARNING) << "Fail to LZ4F_decompress: "
+                             << LZ4F_getErrorName(rc);
+                LZ4F_resetDecompressionContext(ctx->dctx);
+                return false;
+            }
+            blk.remove_prefix(src_size);
+            data_out = (char*)data_out + dst_size;
+            size_out -= dst_size;
+            output_full = (size_out == 0);
+        }
+    }
+    if (size_out != 0) {
+        stream.BackUp(size_out);
+    }
+    if (rc != 0) {
+        LOG(WARNING) << "Incomplete LZ4 frame, size=" << in.size();
+        LZ4F_resetDecompressionContext(ctx->dctx);
+        return false;
+    }
+    return true;
+}
+
+bool Lz4Compress(const google::protobuf::Message& msg, butil::IOBuf* buf) {
+    butil::IOBuf serialized_pb;
+    butil::IOBufAsZeroCopyOutputStream wrapper(&serialized_pb);
+    if (msg.SerializeToZeroCopyStream(&wrapper)) {
+        return Lz4Compress(serialized_pb, buf);
+    }
+    LOG(WARNING) << "Fail to serialize input pb=" << &msg;
+    return false;
+}
+
+bool Lz4Decompress(const butil::IOBuf& data, google::protobuf::Message* msg) {
+    butil::IOBuf binary_pb;
+    if (Lz4Decompress(data, &binary_pb)) {
+        return ParsePbFromIOBuf(msg, binary_pb);
+    }
+    return false;
+}
+
+}  // namespace policy
+} // namespace brpc
+
+#endif // BRPC_WITH_LZ4
@@ -0,0 +1,182 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+#if BRPC_WITH_ZSTD
+#include <gflags/gflags.h>
+#include <zstd.h>
+#include "butil/logging.h"
+#include "butil/thread_local.h"
+#include "brpc/policy/zstd_compress.h"
+#include "brpc/protocol.h"
+
+
+namespace brpc {
+namespace policy {
+
+DEFINE_int32(zstd_compress_level, 1, "Compression level of zstd, higher "
+             "levels compress better but slower");
+
+// Contexts are expensive to create, reuse them in the same thread.
+struct ZstdThreadContext {
+    ZSTD_CCtx* cctx;
+    ZSTD_DCtx* dctx;
+};
+
+static BAIDU_THREAD_LOCAL ZstdThreadContext* tls_zstd_ctx = NULL;
+
+static void DestroyZstdThreadContext(void* arg) {
+    ZstdThreadContext* ctx = static_cast<ZstdThreadContext*>(arg);
+    ZSTD_freeCCtx(ctx->cctx);
+    ZSTD_freeDCtx(ctx->dctx);
+    delete ctx;
+}
+
+static ZstdThreadContext* GetZstdThreadContext() {
+    if (tls_zstd_ctx == NULL) {
+        ZstdThreadContext* ctx = new (std::nothrow) ZstdThreadContext;
+        if (ctx == NULL) {
+            return NULL;
+        }
+        ctx->cctx = ZSTD_createCCtx();
+        ctx->dctx = ZSTD_createDCtx();
+        if (ctx->cctx == NULL || ctx->dctx == NULL) {
+            LOG(ERROR) << "Fail to create zstd contexts";
+            DestroyZstdThreadContext(ctx);
+            return NULL;
+        }
+        butil::thread_atexit(DestroyZstdThreadContext, ctx);
+        tls_zstd_ctx = ctx;
+    }
+    return tls_zstd_ctx;
+}
+
+bool ZstdCompress(const butil::IOBuf& in, butil::IOBuf* out) {
+    ZstdThreadContext* ctx = GetZstdThreadContext();
+    if (ctx == NULL) {
+        return false;
+    }
+    ZSTD_CCtx_reset(ctx->cctx, ZSTD_reset_session_only);
+    ZSTD_CCtx_setParameter(ctx->cctx, ZSTD_c_compressionLevel,
+                           FLAGS_zstd_compress_level);
+    ZSTD_CCtx_setPledgedSrcSize(ctx->cctx, in.size());
+    butil::IOBufAsZeroCopyOutputStream stream(out);
+    ZSTD_outBuffer output = { NULL, 0, 0 };
+    // Compress backing blocks one by one rather than flattening `in', the
+    // empty input after the last block ends the frame.
+    const size_t nblock = in.backing_block_num();
+    for (size_t i = 0; i <= nblock; ++i) {
+        const butil::StringPiece blk =
+            (i < nblock ? in.backing_block(i) : butil::StringPiece());
+        ZSTD_inBuffer input = { blk.data(), blk.size(), 0 };
+        const ZSTD_EndDirective mode = (i < nblock ? ZSTD_e_continue : ZSTD_e_end);
+        size_t rc = 0;
+        do {
+            if (output.pos == output.size) {
+                void* data = NULL;
+                int size = 0;
+                if (!stream.Next(&data, &size)) {
+                    LOG(WARNING) << "Fail to allocate output of zstd";
+                    return false;
+                }
+                output.dst = data;
+                output.size = size;
+                output.pos = 0;
+            }
+            rc = ZSTD_compressStream2(ctx->cctx, &output, &input, mode);
+            if (ZSTD_isError(rc)) {
+                LOG(WARNING) << "Fail to ZSTD_compressStream2: "
+                             << ZSTD_getErrorName(rc);
+                return false;
+            }
+            // For ZSTD_e_end, non-zero `rc' means that the frame is not
+            // fully flushed yet.
+        } while (input.pos < input.size || (mode == ZSTD_e_end && rc != 0));
+    }
+    if (output.pos != output.size) {
+        stream.BackUp(output.size - output.pos);
+    }
+    return true;
+}
+
+bool ZstdDecompress(const butil::IOBuf& in, butil::IOBuf* out) {
+    ZstdThreadContext* ctx = GetZstdThreadContext();
+    if (ctx == NULL) {
+        return false;
+    }
+    ZSTD_DCtx_reset(ctx->dctx, ZSTD_reset_session_only);
+    butil::IOBufAsZeroCopyOutputStream stream(out);
+    ZSTD_outBuffer output = { NULL, 0, 0 };
+    // Becomes 0 when a frame is fully decoded and flushed.
+    size_t rc = 1;
+    const size_t nblock = in.backing_block_num();
+    for (size_t i = 0; i < nblock; ++i) {
+        const butil::StringPiece blk = in.backing_block(i);
+        ZSTD_inBuffer input = { blk.data(), blk.size(), 0 };
+        // A full output may leave decoded data inside the context, call
+        // again to flush it.
+        while (input.pos < input.size || output.pos == output.size) {
+            if (output.pos == output.size) {
+                void* data = NULL;
+                int size = 0;
+                if (!stream.Next(&data, &size)) {
+                    LOG(WARNING) << "Fail to allocate output of zstd";
+                    return false;
+                }
+                output.dst = data;
+                output.size = size;
+                output.pos = 0;
+            }
+            rc = ZSTD_decompressStream(ctx->dctx, &output, &input);
+            if (ZSTD_isError(rc)) {
+                LOG(WARNING) << "Fail to ZSTD_decompressStream: "
+                             << ZSTD_getErrorName(rc);
+                return false;
+            }
+        }
+    }
+    if (output.pos != output.size) {
+        stream.BackUp(output.size - output.pos);
+    }
+    if (rc != 0) {
+        LOG(WARNING) << "Incomplete zstd frame, size=" << in.size();
+        return false;
+    }
+    return true;
+}
+
+bool ZstdCompress(const google::protobuf::Message& msg, butil::IOBuf* buf) {
+    butil::IOBuf serialized_pb;
+    butil::IOBufAsZeroCopyOutputStream wrapper(&serialized_pb);
+    if (msg.SerializeToZeroCopyStream(&wrapper)) {
+        return ZstdCompress(serialized_pb, buf);
+    }
+    LOG(WARNING) << "Fail to serialize input pb=" << &msg;
+    return false;
+}
+
+bool ZstdDecompress(const butil::IOBuf& data, google::protobuf::Message* msg) {
+    butil::IOBuf binary_pb;
+    if (ZstdDecompress(data, &binary_pb)) {
+        return ParsePbFromIOBuf(msg, binary_pb);
+    }
+    return false;
+}
+
+}  // namespace policy
+} // namespace brpc
+
+#endif // BRPC_WITH_ZSTD
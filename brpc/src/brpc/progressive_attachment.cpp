@@ -182,6 +182,14 @@ int ProgressiveAttachment::Write(const void* data, size_t n) {
     }
 }
 
+int ProgressiveAttachment::Stop(int /*error_code*/,
+                                const std::string& /*error_text*/) {
+    LOG(ERROR) << "Only http2 supports stopping ProgressiveAttachment with "
+        "an error";
+    errno = EPERM;
+    return -1;
+}
+
 void ProgressiveAttachment::MarkRPCAsDone(bool rpc_failed) {
     // Notes:
     // * Writing here is more timely than being flushed in next Write(), in
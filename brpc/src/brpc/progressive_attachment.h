@@ -33,11 +33,22 @@ class ProgressiveAttachment : public SharedObject {
 friend class Controller;
 public:
     // [Thread-safe]
-    // Write `data' as one HTTP chunk to peer ASAP.
+    // Write `data' as one HTTP chunk to peer ASAP. In http2, `data' is sent
+    // in DATA frames of the stream (as one message in gRPC) and Write()
+    // blocks until flow-control windows of the stream allow the sending.
     // Returns 0 on success, -1 otherwise and errno is set.
     // Errnos are same as what Socket.Write may set.
-    int Write(const butil::IOBuf& data);
-    int Write(const void* data, size_t n);
+    virtual int Write(const butil::IOBuf& data);
+    virtual int Write(const void* data, size_t n);
+
+    // [Thread-safe]
+    // Make following Write() fail and end the attachment with `error_code'
+    // (non-zero) and `error_text' when it's released, after data written
+    // before. In gRPC responses, they are sent as grpc-status and
+    // grpc-message in trailers, other http2 streams are reset. Not supported
+    // in http/1.x.
+    // Returns 0 on success, -1 otherwise and errno is set.
+    virtual int Stop(int error_code, const std::string& error_text);
 
     // Get ip/port of peer/self.
     butil::EndPoint remote_side() const;
@@ -61,7 +72,7 @@ protected:
     ~ProgressiveAttachment();
 
     // Called by controller only.
-    void MarkRPCAsDone(bool rpc_failed);
+    virtual void MarkRPCAsDone(bool rpc_failed);
     
     bool _before_http_1_1;
     bool _pause_from_mark_rpc_as_done;
@@ -31,6 +31,7 @@
 #include "butil/class_name.h"
 #include "butil/string_printf.h"
 #include "butil/debug/leak_annotations.h"
+#include "butil/memory/scope_guard.h"
 #include "brpc/log.h"
 #include "brpc/compress.h"
 #include "brpc/policy/nova_pbrpc_protocol.h"
@@ -118,6 +119,7 @@ DEFINE_bool(enable_threads_service, false, "Enable /threads");
 
 DECLARE_int32(usercode_backup_threads);
 DECLARE_bool(usercode_in_pthread);
+DECLARE_int32(event_dispatcher_num);
 
 // NOTE: never make s_ncore extern const whose ctor seq against other
 // compilation units is undefined.
@@ -142,9 +144,11 @@ ServerOptions::ServerOptions()
     , bthread_init_args(NULL)
     , bthread_init_count(0)
     , internal_port(-1)
+    , num_listeners(1)
     , has_builtin_services(true)
     , force_ssl(false)
     , use_rdma(false)
+    , zerocopy_threshold(-1)
     , baidu_master_service(NULL)
     , http_master_service(NULL)
     , health_reporter(NULL)
@@ -1077,10 +1081,25 @@ int Server::StartInternal(const butil::EndPoint& endpoint,
         LOG(ERROR) << "Only IPv4 address supports port range feature";
         return -1;
     }
+    int num_listeners = _options.num_listeners;
+    if (num_listeners == 0) {
+        num_listeners = FLAGS_event_dispatcher_num;
+    }
+    if (num_listeners < 0) {
+        LOG(ERROR) << "Invalid ServerOptions.num_listeners=" << num_listeners;
+        return -1;
+    }
+    if (num_listeners > 1 && butil::get_endpoint_type(endpoint) == AF_UNIX) {
+        LOG(WARNING) << "ServerOptions.num_listeners is ignored by unix "
+            "domain socket";
+        num_listeners = 1;
+    }
+    // All listeners must have SO_REUSEPORT, including the first one.
+    const bool reuse_port = (num_listeners > 1);
     _listen_addr = endpoint;
     for (int port = port_range.min_port; port <= port_range.max_port; ++port) {
         _listen_addr.port = port;
-        butil::fd_guard sockfd(tcp_listen(_listen_addr));
+        butil::fd_guard sockfd(tcp_listen(_listen_addr, reuse_port));
         if (sockfd < 0) {
             if (port != port_range.max_port) { // not the last port, try next
                 continue;
@@ -1103,6 +1122,30 @@ int Server::StartInternal(const butil::EndPoint& endpoint,
                 return -1;
             }
         }
+        std::vector<int> listened_fds(1, sockfd.release());
+        auto listened_fds_guard = butil::MakeScopeGuard([&listened_fds] {
+            for (size_t i = 0; i < listened_fds.size(); ++i) {
+                close(listened_fds[i]);
+            }
+        });
+        for (int i = 1; i < num_listeners; ++i) {
+            // Bind to the port of the first listener which may be
+            // dynamically selected.
+            const int fd = tcp_listen(_listen_addr, true);
+            if (fd < 0) {
+                break;
+            }
+            listened_fds.push_back(fd);
+        }
+        if ((int)listened_fds.size() != num_listeners) {
+            // `listened_fds_guard' closes listeners bound to this port.
+            if (port != port_range.max_port) { // not the last port, try next
+                continue;
+            }
+            PLOG(ERROR) << "Fail to listen " << _listen_addr
+                        << " with SO_REUSEPORT";
+            return -1;
+        }
         if (_am == NULL) {
             _am = BuildAcceptor();
             if (NULL == _am) {
@@ -1110,6 +1153,7 @@ int Server::StartInternal(const butil::EndPoint& endpoint,
                 return -1;
             }
             _am->_use_rdma = _options.use_rdma;
+            _am->_zerocopy_threshold = _options.zerocopy_threshold;
             _am->_bthread_tag = _options.bthread_tag;
         }
         // Set `_status' to RUNNING before accepting connections
@@ -1119,14 +1163,14 @@ int Server::StartInternal(const butil::EndPoint& endpoint,
         GenerateVersionIfNeeded();
         g_running_server_count.fetch_add(1, butil::memory_order_relaxed);
 
-        // Pass ownership of `sockfd' to `_am'
-        if (_am->StartAccept(sockfd, _options.idle_timeout_sec,
+        // Pass ownership of `listened_fds' to `_am'
+        listened_fds_guard.dismiss();
+        if (_am->StartAccept(listened_fds, _options.idle_timeout_sec,
                              _default_ssl_ctx,
                              _options.force_ssl) != 0) {
             LOG(ERROR) << "Fail to start acceptor";
             return -1;
         }
-        sockfd.release();
         break; // stop trying
     }
     if (_options.internal_port >= 0 && _options.has_builtin_services) {
@@ -1161,13 +1205,12 @@ int Server::StartInternal(const butil::EndPoint& endpoint,
             }
         }
         // Pass ownership of `sockfd' to `_internal_am'
-        if (_internal_am->StartAccept(sockfd, _options.idle_timeout_sec,
+        if (_internal_am->StartAccept(sockfd.release(), _options.idle_timeout_sec,
                                       _default_ssl_ctx,
                                       false) != 0) {
             LOG(ERROR) << "Fail to start internal_acceptor";
             return -1;
         }
-        sockfd.release();
     }
 
     PutPidFileIfNeeded();
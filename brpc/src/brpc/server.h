@@ -204,6 +204,16 @@ struct ServerOptions {
     // Default: -1
     int internal_port;
 
+    // Number of sockets listening to the port to Start(). If it's greater
+    // than 1, the sockets are bound with SO_REUSEPORT so that the kernel
+    // spreads new connections across them, and they're watched by different
+    // EventDispatchers and accepted in parallel instead of serializing
+    // connection storms on a single accept loop. 0 means one listener for
+    // each EventDispatcher(-event_dispatcher_num). Ignored by unix domain
+    // sockets and not applied to `internal_port'.
+    // Default: 1
+    int num_listeners;
+
     // Contain a set of builtin services to ease monitoring/debugging.
     // Read docs/cn/builtin_service.md for details.
     // DO NOT set this option to false if you don't even know what builtin
@@ -227,6 +237,12 @@ struct ServerOptions {
     // Default: false
     bool use_rdma;
 
+    // Write batches of at least so many bytes to accepted connections with
+    // MSG_ZEROCOPY. 0 disables zerocopy, negative value means
+    // -socket_zerocopy_threshold.
+    // Default: -1
+    int64_t zerocopy_threshold;
+
     // [CAUTION] This option is for implementing specialized baidu-std proxies,
     // most users don't need it. Don't change this option unless you fully
     // understand the description below.
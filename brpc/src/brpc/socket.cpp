@@ -55,6 +55,10 @@
 #if defined(OS_MACOSX)
 #include <sys/event.h>
 #endif
+#if defined(OS_LINUX)
+#include <linux/errqueue.h>                      // sock_extended_err
+#endif
+#include <deque>
 
 namespace bthread {
 size_t BAIDU_WEAK get_sizes(const bthread_id_list_t* list, size_t* cnt, size_t n);
@@ -86,6 +90,34 @@ DEFINE_int64(socket_max_unwritten_bytes, 64 * 1024 * 1024,
              "Max unwritten bytes in each socket, if the limit is reached,"
              " Socket.Write fails with EOVERCROWDED");
 
+DEFINE_int64(socket_max_buffered_bytes, 0,
+             "Max bytes of unparsed input and unwritten output of all sockets."
+             " When the limit is exceeded, sockets holding more unparsed input"
+             " than average stop reading for a while, and writes to sockets"
+             " holding more unwritten output than average fail with"
+             " EOVERCROWDED. Should be much larger than -max_body_size."
+             " 0 means unlimited");
+BRPC_VALIDATE_GFLAG(socket_max_buffered_bytes, NonNegativeInteger);
+
+DEFINE_int64(socket_zerocopy_threshold, 0,
+             "Write batches of at least so many bytes with MSG_ZEROCOPY to"
+             " save copying them into the kernel, 0 disables zerocopy. Only"
+             " plain tcp connections on linux >= 4.14 support this");
+
+DEFINE_int32(socket_zerocopy_linger_ms, 10000,
+             "Max milliseconds to wait for zerocopy writes in flight to complete"
+             " after the connection is closed, then the connection is reset");
+
+DEFINE_int64(socket_write_coalesce_max_bytes, 1024 * 1024,
+             "Max bytes of pending requests coalesced into one writev by"
+             " KeepWrite, a request is never split. 0 means unlimited");
+BRPC_VALIDATE_GFLAG(socket_write_coalesce_max_bytes, NonNegativeInteger);
+
+DEFINE_int32(socket_max_write_coalesce_delay_us, 1000,
+             "Upper bound of WriteOptions.coalesce_delay_us and"
+             " ChannelOptions.write_coalesce_delay_us, 0 disables the delay");
+BRPC_VALIDATE_GFLAG(socket_max_write_coalesce_delay_us, NonNegativeInteger);
+
 DEFINE_int64(socket_max_streams_unconsumed_bytes, 0,
              "Max stream receivers' unconsumed bytes in one socket,"
              " it used in stream for receiver buffer control.");
@@ -298,6 +330,71 @@ int64_t GetChannelConnectionCount() {
     return 0;
 }
 
+// Whether buffers of sockets exceed -socket_max_buffered_bytes, refreshed
+// at most every MEMORY_PRESSURE_INTERVAL_US since summing bvar::Adder is
+// not cheap.
+static const int64_t MEMORY_PRESSURE_INTERVAL_US = 10000;
+static butil::atomic<int64_t> s_memory_pressure_update_us(0);
+static butil::atomic<bool> s_over_memory_budget(false);
+static butil::atomic<int64_t> s_avg_read_buf_bytes(0);
+static butil::atomic<int64_t> s_avg_unwritten_bytes(0);
+
+static bool IsOverMemoryBudget() {
+    const int64_t max_bytes = FLAGS_socket_max_buffered_bytes;
+    if (max_bytes <= 0 || g_vars == NULL) {
+        return false;
+    }
+    const int64_t now = butil::cpuwide_time_us();
+    int64_t last = s_memory_pressure_update_us.load(butil::memory_order_relaxed);
+    if (now >= last + MEMORY_PRESSURE_INTERVAL_US &&
+        s_memory_pressure_update_us.compare_exchange_strong(
+            last, now, butil::memory_order_relaxed)) {
+        const int64_t read_bytes = g_vars->read_buf_bytes.get_value();
+        const int64_t unwritten_bytes = g_vars->unwritten_bytes.get_value();
+        const int64_t nreading = g_vars->nreading_socket.get_value();
+        const int64_t nwriting = g_vars->nwriting_socket.get_value();
+        s_avg_read_buf_bytes.store(nreading > 0 ? read_bytes / nreading : 0,
+                                   butil::memory_order_relaxed);
+        s_avg_unwritten_bytes.store(nwriting > 0 ? unwritten_bytes / nwriting : 0,
+                                    butil::memory_order_relaxed);
+        const bool over = (read_bytes + unwritten_bytes > max_bytes);
+        if (over != s_over_memory_budget.exchange(over, butil::memory_order_relaxed)) {
+            LOG(WARNING) << "Buffers of sockets use " << read_bytes
+                         << " bytes for input and " << unwritten_bytes
+                         << " bytes for output, which "
+                         << (over ? "exceeds" : "is within")
+                         << " -socket_max_buffered_bytes=" << max_bytes;
+        }
+    }
+    return s_over_memory_budget.load(butil::memory_order_relaxed);
+}
+
+bool Socket::ShouldThrottleRead() {
+    const int64_t nbytes = read_buf_bytes();
+    return nbytes > 0 && IsOverMemoryBudget() &&
+        nbytes >= s_avg_read_buf_bytes.load(butil::memory_order_relaxed);
+}
+
+bool Socket::ShouldThrottleWrite() {
+    const int64_t nbytes = unwritten_bytes();
+    return nbytes > 0 && IsOverMemoryBudget() &&
+        nbytes >= s_avg_unwritten_bytes.load(butil::memory_order_relaxed);
+}
+
+void Socket::UpdateReadBufBytes() {
+    const int64_t nbytes = _read_buf.size();
+    const int64_t before =
+        _read_buf_bytes.exchange(nbytes, butil::memory_order_relaxed);
+    if (nbytes != before) {
+        g_vars->read_buf_bytes << nbytes - before;
+        if (before == 0) {
+            g_vars->nreading_socket << 1;
+        } else if (nbytes == 0) {
+            g_vars->nreading_socket << -1;
+        }
+    }
+}
+
 bool Socket::CreatedByConnect() const {
     return _user == static_cast<SocketUser*>(get_client_side_messenger());
 }
@@ -402,6 +499,12 @@ void Socket::WriteRequest::Setup(Socket* s) {
         if (before_write + (int64_t)data.size() >= FLAGS_socket_max_unwritten_bytes) {
             s->_overcrowded = true;
         }
+        if (!data.empty()) {
+            g_vars->unwritten_bytes << data.size();
+            if (before_write == 0) {
+                g_vars->nwriting_socket << 1;
+            }
+        }
     }
     const uint32_t pc = pipelined_count();
     if (pc) {
@@ -474,25 +577,31 @@ Socket::Socket(Forbidden f)
     , _auth_id(INVALID_BTHREAD_ID)
     , _auth_context(NULL)
     , _ssl_state(SSL_UNKNOWN)
+    , _ktls_send(false)
     , _ssl_session(NULL)
     , _rdma_ep(NULL)
     , _rdma_state(RDMA_OFF)
     , _connection_type_for_progressive_read(CONNECTION_TYPE_UNKNOWN)
     , _controller_released_socket(false)
     , _overcrowded(false)
+    , _read_throttled(false)
     , _fail_me_at_server_stop(false)
     , _logoff_flag(false)
     , _error_code(0)
     , _pipeline_q(NULL)
     , _last_writetime_us(0)
     , _unwritten_bytes(0)
+    , _read_buf_bytes(0)
     , _epollout_butex(NULL)
     , _write_head(NULL)
     , _is_write_shutdown(false)
+    , _keepwrite_delay_us(0)
     , _stream_set(NULL)
     , _total_streams_unconsumed_size(0)
     , _ninflight_app_health_check(0)
     , _tcp_user_timeout_ms(-1)
+    , _zerocopy_threshold(0)
+    , _zerocopy(NULL)
     , _http_request_method(HTTP_METHOD_GET) {
     CreateVarsOnce();
     pthread_mutex_init(&_id_wait_list_mutex, NULL);
@@ -507,6 +616,7 @@ Socket::~Socket() {
 void Socket::ReturnSuccessfulWriteRequest(Socket::WriteRequest* p) {
     DCHECK(p->data.empty());
     AddOutputMessages(1);
+    g_vars->nwritten_request << 1;
     const bthread_id_t id_wait = p->id_wait;
     butil::return_object(p);
     if (id_wait != INVALID_BTHREAD_ID) {
@@ -566,6 +676,40 @@ void Socket::ReleaseAllFailedWriteRequests(Socket::WriteRequest* req) {
     ReturnFailedWriteRequest(req, error_code, error_text);
 }
 
+struct Socket::ZeroCopyContext {
+    struct Pending {
+        uint32_t seq;
+        bool completed;
+        // Blocks that the kernel may still be reading.
+        butil::IOBuf data;
+    };
+
+    ZeroCopyContext() : next_seq(0) {}
+
+    void Reset() {
+        BAIDU_SCOPED_LOCK(mutex);
+        next_seq = 0;
+        pending.clear();
+    }
+
+    // Release blocks of writes on `fd' that the kernel has completed.
+    // Returns number of writes still in flight.
+    size_t Reap(int fd);
+
+    butil::Mutex mutex;
+    // The kernel numbers zerocopy sendmsg calls that wrote something from 0
+    // and reports completions as inclusive ranges of the numbers.
+    uint32_t next_seq;
+    std::deque<Pending> pending;
+};
+
+struct Socket::ZeroCopyCloseArg {
+    int fd;
+    int64_t deadline_us;
+    // Blocks of writes in flight when the connection was closed.
+    ZeroCopyContext ctx;
+};
+
 int Socket::ResetFileDescriptor(int fd) {
     // Reset message sizes when fd is changed.
     _last_msg_size = 0;
@@ -601,6 +745,29 @@ int Socket::ResetFileDescriptor(int fd) {
 
     SetSocketOptions(fd);
 
+    if (_zerocopy) {
+        // Writes in flight on the previous fd were handed over in
+        // CloseFileDescriptor(), numbers of writes restart on the new fd.
+        _zerocopy->Reset();
+    }
+#if defined(OS_LINUX)
+    if (_zerocopy_threshold > 0) {
+        int on = 1;
+        if (setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &on, sizeof(on)) == 0) {
+            if (_zerocopy == NULL) {
+                _zerocopy = new ZeroCopyContext;
+            }
+        } else if (_zerocopy) {
+            delete _zerocopy;
+            _zerocopy = NULL;
+        }
+        // OK to fail, unix domain sockets and linux < 4.14 don't support
+        // this, writes are copied as usual.
+        RPC_VPLOG_IF(_zerocopy == NULL) << "Fail to enable SO_ZEROCOPY on fd="
+                                        << fd;
+    }
+#endif
+
     if (_on_edge_triggered_events) {
         if (_io_event.AddConsumer(fd) != 0) {
             PLOG(ERROR) << "Fail to add SocketId=" << id() 
@@ -718,6 +885,7 @@ int Socket::OnCreated(const SocketOptions& options) {
         return -1;
     }
     _io_event.set_bthread_tag(options.bthread_tag);
+    _io_event.set_event_dispatcher_index(options.event_dispatcher_index);
     auto guard = butil::MakeScopeGuard([this] {
         _io_event.Reset();
     });
@@ -754,6 +922,7 @@ int Socket::OnCreated(const SocketOptions& options) {
     _force_ssl = options.force_ssl;
     // Disable SSL check if there is no SSL context
     _ssl_state = (options.initial_ssl_ctx == NULL ? SSL_OFF : SSL_UNKNOWN);
+    _ktls_send = false;
     _ssl_session = NULL;
     _ssl_ctx = options.initial_ssl_ctx;
 #if BRPC_WITH_RDMA
@@ -790,11 +959,21 @@ int Socket::OnCreated(const SocketOptions& options) {
         return -1;
     }
     _last_writetime_us.store(cpuwide_now, butil::memory_order_relaxed);
-    _unwritten_bytes.store(0, butil::memory_order_relaxed);
+    const int64_t left_unwritten_bytes =
+        _unwritten_bytes.exchange(0, butil::memory_order_relaxed);
+    if (left_unwritten_bytes != 0) {
+        g_vars->unwritten_bytes << -left_unwritten_bytes;
+        g_vars->nwriting_socket << -1;
+    }
+    _read_throttled = false;
     _keepalive_options = options.keepalive_options;
     _tcp_user_timeout_ms = options.tcp_user_timeout_ms;
+    _zerocopy_threshold = (options.zerocopy_threshold >= 0 ?
+                           options.zerocopy_threshold :
+                           FLAGS_socket_zerocopy_threshold);
     CHECK(NULL == _write_head.load(butil::memory_order_relaxed));
     _is_write_shutdown = false;
+    _keepwrite_delay_us = 0;
     int fd = options.fd;
     if (!ValidFileDescriptor(fd) && options.connect_on_create) {
         // Connect on create.
@@ -854,12 +1033,16 @@ void Socket::BeforeRecycled() {
         if (_on_edge_triggered_events != NULL) {
             _io_event.RemoveConsumer(prev_fd);
         }
-        close(prev_fd);
+        CloseFileDescriptor(prev_fd);
         if (create_by_connect) {
             g_vars->channel_conn << -1;
         }
     }
 
+    // Writes in flight were handed over in CloseFileDescriptor().
+    delete _zerocopy;
+    _zerocopy = NULL;
+
 #if BRPC_WITH_RDMA
     if (_rdma_ep) {
         delete _rdma_ep;
@@ -870,6 +1053,7 @@ void Socket::BeforeRecycled() {
 
     reset_parsing_context(NULL);
     _read_buf.clear();
+    UpdateReadBufBytes();
 
     _auth_flag_error.store(0, butil::memory_order_relaxed);
     bthread_id_error(_auth_id, 0);
@@ -1025,7 +1209,7 @@ int Socket::WaitAndReset(int32_t expected_nref) {
         if (_on_edge_triggered_events != NULL) {
             _io_event.RemoveConsumer(prev_fd);
         }
-        close(prev_fd);
+        CloseFileDescriptor(prev_fd);
         if (CreatedByConnect()) {
             g_vars->channel_conn << -1;
         }
@@ -1044,6 +1228,7 @@ int Socket::WaitAndReset(int32_t expected_nref) {
         _ssl_session = NULL;
     }        
     _ssl_state = SSL_UNKNOWN;
+    _ktls_send = false;
     _nevent.store(0, butil::memory_order_relaxed);
     // parsing_context is very likely to be associated with the fd,
     // removing it is a safer choice and required by http2.
@@ -1051,6 +1236,7 @@ int Socket::WaitAndReset(int32_t expected_nref) {
     // Must clear _read_buf otehrwise even if the connections is recovered,
     // the kept old data is likely to make parsing fail.
     _read_buf.clear();
+    UpdateReadBufBytes();
     _ninprocess.store(1, butil::memory_order_relaxed);
     _auth_flag_error.store(0, butil::memory_order_relaxed);
     bthread_id_error(_auth_id, 0);
@@ -1645,6 +1831,10 @@ int Socket::Write(butil::IOBuf* data, const WriteOptions* options_in) {
     if (!opt.ignore_eovercrowded && _overcrowded) {
         return SetError(opt.id_wait, EOVERCROWDED);
     }
+    if (!opt.ignore_eovercrowded && ShouldThrottleWrite()) {
+        g_vars->nthrottled_write << 1;
+        return SetError(opt.id_wait, EOVERCROWDED);
+    }
 
     WriteRequest* req = butil::get_object<WriteRequest>();
     if (!req) {
@@ -1683,6 +1873,10 @@ int Socket::Write(SocketMessagePtr<>& msg, const WriteOptions* options_in) {
     if (!opt.ignore_eovercrowded && _overcrowded) {
         return SetError(opt.id_wait, EOVERCROWDED);
     }
+    if (!opt.ignore_eovercrowded && ShouldThrottleWrite()) {
+        g_vars->nthrottled_write << 1;
+        return SetError(opt.id_wait, EOVERCROWDED);
+    }
     
     WriteRequest* req = butil::get_object<WriteRequest>();
     if (!req) {
@@ -1745,14 +1939,22 @@ int Socket::StartWrite(WriteRequest* req, const WriteOptions& opt) {
     // in some protocols(namely RTMP).
     req->Setup(this);
     
-    if (opt.write_in_background || ssl_state() != SSL_OFF) {
+    if (opt.write_in_background || (ssl_state() != SSL_OFF && !_ktls_send)) {
         // Writing into SSL may block the current bthread, always write
         // in the background.
         goto KEEPWRITE_IN_BACKGROUND;
     }
+    if (opt.coalesce_delay_us > 0 &&
+        FLAGS_socket_max_write_coalesce_delay_us > 0) {
+        // Let KeepWrite wait for more requests to write them together.
+        _keepwrite_delay_us = std::min(
+            opt.coalesce_delay_us, FLAGS_socket_max_write_coalesce_delay_us);
+        goto KEEPWRITE_IN_BACKGROUND;
+    }
     
     // Write once in the calling thread. If the write is not complete,
     // continue it in KeepWrite thread.
+    g_vars->nwrite_syscall << 1;
     if (_conn) {
         butil::IOBuf* data_arr[1] = { &req->data };
         nw = _conn->CutMessageIntoFileDescriptor(fd(), data_arr, 1);
@@ -1765,7 +1967,13 @@ int Socket::StartWrite(WriteRequest* req, const WriteOptions& opt) {
 #else
         {
 #endif
-            nw = req->data.cut_into_file_descriptor(fd());
+            if (_zerocopy && !_ktls_send &&
+                (int64_t)req->data.size() >= _zerocopy_threshold) {
+                butil::IOBuf* data_arr[1] = { &req->data };
+                nw = DoZeroCopyWrite(data_arr, 1);
+            } else {
+                nw = req->data.cut_into_file_descriptor(fd());
+            }
         }
     }
     if (nw < 0) {
@@ -1811,6 +2019,11 @@ void* Socket::KeepWrite(void* void_arg) {
     g_vars->nkeepwrite << 1;
     WriteRequest* req = static_cast<WriteRequest*>(void_arg);
     SocketUniquePtr s(req->get_socket());
+    if (s->_keepwrite_delay_us > 0) {
+        const int32_t delay_us = s->_keepwrite_delay_us;
+        s->_keepwrite_delay_us = 0;
+        bthread_usleep(delay_us);
+    }
 
     // When error occurs, spin until there's no more requests instead of
     // returning directly otherwise _write_head is permantly non-NULL which
@@ -1928,11 +2141,22 @@ void* Socket::KeepWrite(void* void_arg) {
 }
 
 ssize_t Socket::DoWrite(WriteRequest* req) {
-    // Group butil::IOBuf in the list into a batch array.
+    // Group butil::IOBuf in the list into a batch array. Stop at the
+    // byte budget or when blocks of the batch fill up iovecs of a writev,
+    // later requests can't be written in this round anyway.
     butil::IOBuf* data_list[DATA_LIST_MAX];
     size_t ndata = 0;
+    size_t nbytes = 0;
+    size_t nblock = 0;
+    const size_t max_bytes = FLAGS_socket_write_coalesce_max_bytes;
     for (WriteRequest* p = req; p != NULL && ndata < DATA_LIST_MAX;
          p = p->next) {
+        if (ndata > 0 && ((max_bytes != 0 && nbytes >= max_bytes) ||
+                          nblock >= DATA_LIST_MAX)) {
+            break;
+        }
+        nbytes += p->data.size();
+        nblock += p->data.backing_block_num();
         data_list[ndata++] = &p->data;
         if (p->need_shutdown_write()) {
             // Write WriteRequest until shutdown write.
@@ -1941,8 +2165,10 @@ ssize_t Socket::DoWrite(WriteRequest* req) {
         }
     }
 
-    if (ssl_state() == SSL_OFF) {
-        // Write IOBuf in the batch array into the fd.
+    g_vars->nwrite_syscall << 1;
+    if (ssl_state() == SSL_OFF || _ktls_send) {
+        // Write IOBuf in the batch array into the fd. The kernel encrypts
+        // the data when _ktls_send is true.
         if (_conn) {
             return _conn->CutMessageIntoFileDescriptor(fd(), data_list, ndata);
         } else {
@@ -1951,6 +2177,12 @@ ssize_t Socket::DoWrite(WriteRequest* req) {
                 return _rdma_ep->CutFromIOBufList(data_list, ndata);
             }
 #endif
+            // MSG_ZEROCOPY is not supported by kTLS.
+            if (_zerocopy && !_ktls_send) {
+                if ((int64_t)nbytes >= _zerocopy_threshold) {
+                    return DoZeroCopyWrite(data_list, ndata);
+                }
+            }
             return butil::IOBuf::cut_multiple_into_file_descriptor(
                 fd(), data_list, ndata);
         }
@@ -1997,6 +2229,175 @@ ssize_t Socket::DoWrite(WriteRequest* req) {
     return nw;
 }
 
+ssize_t Socket::DoZeroCopyWrite(butil::IOBuf* const* data_list,
+                                size_t ndata) {
+#if defined(OS_LINUX)
+    // Release completed blocks before pinning more.
+    ReapZeroCopyCompletions();
+
+    struct iovec vec[DATA_LIST_MAX];
+    size_t nvec = 0;
+    for (size_t i = 0; i < ndata && nvec < DATA_LIST_MAX; ++i) {
+        const butil::IOBuf* p = data_list[i];
+        const size_t nblock = p->backing_block_num();
+        for (size_t j = 0; j < nblock && nvec < DATA_LIST_MAX; ++j, ++nvec) {
+            const butil::StringPiece blk = p->backing_block(j);
+            vec[nvec].iov_base = const_cast<char*>(blk.data());
+            vec[nvec].iov_len = blk.size();
+        }
+    }
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = vec;
+    msg.msg_iovlen = nvec;
+
+    // Hold the lock during sendmsg, otherwise the completion may be reaped
+    // by DoRead before the written blocks are queued.
+    BAIDU_SCOPED_LOCK(_zerocopy->mutex);
+    const ssize_t nw = sendmsg(fd(), &msg, MSG_ZEROCOPY);
+    if (nw < 0) {
+        if (errno == ENOBUFS) {
+            // Too many notifications are pending on the socket, copy.
+            g_vars->nzerocopy_copied << 1;
+            return butil::IOBuf::cut_multiple_into_file_descriptor(
+                fd(), data_list, ndata);
+        }
+        return -1;
+    }
+    if (nw == 0) {
+        return 0;
+    }
+    _zerocopy->pending.push_back(ZeroCopyContext::Pending());
+    ZeroCopyContext::Pending& p = _zerocopy->pending.back();
+    p.seq = _zerocopy->next_seq++;
+    p.completed = false;
+    size_t npop_all = nw;
+    for (size_t i = 0; i < ndata && npop_all > 0; ++i) {
+        npop_all -= data_list[i]->cutn(&p.data, npop_all);
+    }
+    g_vars->nzerocopy << 1;
+    return nw;
+#else
+    return butil::IOBuf::cut_multiple_into_file_descriptor(
+        fd(), data_list, ndata);
+#endif
+}
+
+size_t Socket::ZeroCopyContext::Reap(int fd) {
+#if defined(OS_LINUX)
+    BAIDU_SCOPED_LOCK(mutex);
+    while (!pending.empty()) {
+        char control[128];
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        if (recvmsg(fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+            // EAGAIN: no more completions.
+            break;
+        }
+        for (struct cmsghdr* cm = CMSG_FIRSTHDR(&msg); cm != NULL;
+             cm = CMSG_NXTHDR(&msg, cm)) {
+            if (!(cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) &&
+                !(cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR)) {
+                continue;
+            }
+            const sock_extended_err* serr = (const sock_extended_err*)CMSG_DATA(cm);
+            if (serr->ee_errno != 0 || serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY) {
+                continue;
+            }
+            // [lo, hi] may wrap around.
+            uint32_t lo = serr->ee_info;
+            uint32_t range = serr->ee_data - lo;
+            if (serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) {
+                // e.g. loopback, or the device does not support
+                // scatter-gather.
+                g_vars->nzerocopy_copied << ((int64_t)range + 1);
+            }
+            if (pending.empty()) {
+                continue;
+            }
+            // Numbers of pending writes are contiguous, index them directly.
+            const uint32_t first = pending.front().seq;
+            if ((int32_t)(lo - first) < 0) {
+                // Part of the range was reaped already.
+                const uint32_t nreaped = first - lo;
+                if (nreaped > range) {
+                    continue;
+                }
+                lo = first;
+                range -= nreaped;
+            }
+            const size_t begin = lo - first;
+            const size_t end = std::min(begin + range + 1, pending.size());
+            for (size_t i = begin; i < end; ++i) {
+                pending[i].completed = true;
+            }
+        }
+        while (!pending.empty() && pending.front().completed) {
+            pending.pop_front();
+        }
+    }
+    return pending.size();
+#else
+    return 0;
+#endif
+}
+
+size_t Socket::ReapZeroCopyCompletions() {
+    return _zerocopy->Reap(fd());
+}
+
+void Socket::CloseFileDescriptor(int fd) {
+#if defined(OS_LINUX)
+    if (_zerocopy != NULL && _zerocopy->Reap(fd) != 0) {
+        ZeroCopyCloseArg* arg = new ZeroCopyCloseArg;
+        arg->fd = fd;
+        arg->deadline_us = butil::gettimeofday_us() +
+            FLAGS_socket_zerocopy_linger_ms * 1000L;
+        {
+            BAIDU_SCOPED_LOCK(_zerocopy->mutex);
+            arg->ctx.pending.swap(_zerocopy->pending);
+        }
+        // Shut the connection down as close() does, while keeping `fd' open
+        // to read completions from its error queue.
+        shutdown(fd, SHUT_RDWR);
+        bthread_t th;
+        if (bthread_start_background(&th, &BTHREAD_ATTR_NORMAL,
+                                     CloseAfterZeroCopyCompleted, arg) != 0) {
+            PLOG(ERROR) << "Fail to start bthread";
+            arg->deadline_us = 0;
+            CloseAfterZeroCopyCompleted(arg);
+        }
+        return;
+    }
+#endif
+    close(fd);
+}
+
+void* Socket::CloseAfterZeroCopyCompleted(void* void_arg) {
+#if defined(OS_LINUX)
+    ZeroCopyCloseArg* arg = static_cast<ZeroCopyCloseArg*>(void_arg);
+    while (arg->ctx.Reap(arg->fd) != 0) {
+        if (butil::gettimeofday_us() >= arg->deadline_us) {
+            // The peer does not acknowledge the data. Reset the connection
+            // so that the kernel drops the data before the blocks are
+            // released.
+            struct linger lg = { 1, 0 };
+            setsockopt(arg->fd, SOL_SOCKET, SO_LINGER, &lg, sizeof(lg));
+            LOG(WARNING) << "Reset fd=" << arg->fd << " with "
+                         << arg->ctx.pending.size()
+                         << " zerocopy writes in flight";
+            break;
+        }
+        bthread_usleep(10000);
+    }
+    close(arg->fd);
+    delete arg;
+#endif
+    return NULL;
+}
+
 int Socket::SSLHandshake(int fd, bool server_mode) {
     if (_ssl_ctx == NULL) {
         if (server_mode) {
@@ -2006,7 +2407,6 @@ int Socket::SSLHandshake(int fd, bool server_mode) {
         return 0;
     }
 
-    // TODO: Reuse ssl session id for client
     if (_ssl_session) {
         // Free the last session, which may be deprecated when socket failed
         SSL_free(_ssl_session);
@@ -2021,8 +2421,13 @@ int Socket::SSLHandshake(int fd, bool server_mode) {
         SSL_set_tlsext_host_name(_ssl_session, _ssl_ctx->sni_name.c_str());
     }
 #endif
+    if (!server_mode) {
+        // Abbreviate the handshake with the session of a previous connection.
+        ResumeSSLSession(_ssl_session);
+    }
 
     _ssl_state = SSL_CONNECTING;
+    const int64_t start_us = butil::cpuwide_time_us();
 
     // Loop until SSL handshake has completed. For SSL_ERROR_WANT_READ/WRITE,
     // we use bthread_fd_wait as polling mechanism instead of EventDispatcher
@@ -2059,7 +2464,26 @@ int Socket::SSLHandshake(int fd, bool server_mode) {
             }
 
             _ssl_state = SSL_CONNECTED;
-            AddBIOBuffer(_ssl_session, fd, FLAGS_ssl_bio_buffer_size);
+            g_vars->ssl_handshake << butil::cpuwide_time_us() - start_us;
+#ifndef USE_MESALINK
+            if (SSL_session_reused(_ssl_session)) {
+                g_vars->nssl_resumed << 1;
+            }
+#endif
+            _ktls_send = IsKTLSSendEnabled(_ssl_session);
+            if (_ktls_send || IsKTLSRecvEnabled(_ssl_session)) {
+                // States of kTLS are kept in the socket BIO, which can't be
+                // replaced with the buffered one.
+                if (_ktls_send) {
+                    g_vars->nktls << 1;
+                }
+                if (!IsKTLSRecvEnabled(_ssl_session)) {
+                    // Read as much as possible per read() instead.
+                    SSL_set_read_ahead(_ssl_session, 1);
+                }
+            } else {
+                AddBIOBuffer(_ssl_session, fd, FLAGS_ssl_bio_buffer_size);
+            }
             return 0;
         }
 
@@ -2137,7 +2561,12 @@ ssize_t Socket::DoRead(size_t size_hint) {
             return -1;
         }
         CHECK(_rdma_state == RDMA_OFF);
-        return _read_buf.append_from_file_descriptor(fd(), size_hint);
+        if (_zerocopy) {
+            // Completions of zerocopy writes wake up input events as
+            // EPOLLERR.
+            ReapZeroCopyCompletions();
+        }
+        return _read_buf.append_from_socket(fd(), size_hint);
     }
 
     CHECK_EQ(SSL_CONNECTED, ssl_state());
@@ -2401,6 +2830,8 @@ void Socket::DebugSocket(std::ostream& os, SocketId id) {
         // NOTE: We're assuming that butil::IOBuf.size() is thread-safe, it is now
         // however it's not guaranteed.
        << "\nread_buf=" << ptr->_read_buf.size()
+       << "\nread_throttled=" << ptr->_read_throttled
+       << "\nunwritten_bytes=" << ptr->unwritten_bytes()
        << "\nlast_read_to_now=" << cpuwide_now - ptr->_last_readtime_us << "us"
        << "\nlast_write_to_now=" << cpuwide_now - ptr->_last_writetime_us << "us"
        << "\novercrowded=" << ptr->_overcrowded;
@@ -2448,7 +2879,8 @@ void Socket::DebugSocket(std::ostream& os, SocketId id) {
     }
     os << "\ncid=" << ptr->_correlation_id
        << "\nwrite_head=" << ptr->_write_head.load(butil::memory_order_relaxed)
-       << "\nssl_state=" << SSLStateToString(ssl_state);
+       << "\nssl_state=" << SSLStateToString(ssl_state)
+       << "\nktls_send=" << ptr->_ktls_send;
     const SocketSSLContext* ssl_ctx = ptr->_ssl_ctx.get();
     if (ssl_ctx) {
         os << "\ninitial_ssl_ctx=" << ssl_ctx->raw_ctx;
@@ -2983,6 +3415,12 @@ void Socket::CancelUnwrittenBytes(size_t bytes) {
     if (before_minus < (int64_t)bytes + FLAGS_socket_max_unwritten_bytes) {
         _overcrowded = false;
     }
+    if (bytes != 0) {
+        g_vars->unwritten_bytes << -(int64_t)bytes;
+        if (before_minus == (int64_t)bytes) {
+            g_vars->nwriting_socket << -1;
+        }
+    }
 }
 void Socket::AddOutputBytes(size_t bytes) {
     GetOrNewSharedPart()->out_size.fetch_add(bytes, butil::memory_order_relaxed);
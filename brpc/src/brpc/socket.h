@@ -143,8 +143,43 @@ struct SocketVarsCollector {
         , nkeepwrite_second("rpc_keepwrite_second", &nkeepwrite)
         , nwaitepollout("rpc_waitepollout_count")
         , nwaitepollout_second("rpc_waitepollout_second", &nwaitepollout)
+        , nzerocopy("rpc_socket_zerocopy_count")
+        , nzerocopy_copied("rpc_socket_zerocopy_copied_count")
+        , read_buf_bytes("rpc_socket_read_buffer_bytes")
+        , unwritten_bytes("rpc_socket_unwritten_bytes")
+        , nthrottled_read("rpc_socket_throttled_read_count")
+        , nthrottled_write("rpc_socket_throttled_write_count")
+        , nktls("rpc_socket_ktls_count")
+        , nwrite_syscall("rpc_socket_write_syscall_count")
+        , nwrite_syscall_second("rpc_socket_write_syscall_second",
+                                &nwrite_syscall)
+        , nwritten_request("rpc_socket_written_request_count")
+        , nwritten_request_second("rpc_socket_written_request_second",
+                                  &nwritten_request)
+        , write_syscall_per_request("rpc_socket_write_syscall_per_request",
+                                    GetWriteSyscallPerRequest, this)
+        , ssl_handshake("rpc_ssl_handshake")
+        , nssl_resumed("rpc_ssl_resumed_handshake_count")
+        , nssl_resumed_second("rpc_ssl_resumed_handshake_second",
+                              &nssl_resumed)
+        , ssl_resumption_ratio("rpc_ssl_resumption_ratio",
+                               GetSSLResumptionRatio, this)
     {}
 
+    static double GetSSLResumptionRatio(void* arg) {
+        SocketVarsCollector* v = static_cast<SocketVarsCollector*>(arg);
+        const int64_t nhandshake = v->ssl_handshake.qps();
+        return nhandshake > 0 ?
+            (double)v->nssl_resumed_second.get_value() / nhandshake : 0;
+    }
+
+    static double GetWriteSyscallPerRequest(void* arg) {
+        SocketVarsCollector* v = static_cast<SocketVarsCollector*>(arg);
+        const int64_t nreq = v->nwritten_request_second.get_value();
+        return nreq > 0 ?
+            (double)v->nwrite_syscall_second.get_value() / nreq : 0;
+    }
+
     bvar::Adder<int64_t> nsocket;
     bvar::Adder<int64_t> channel_conn;
     bvar::Adder<int> neventthread;
@@ -154,6 +189,36 @@ struct SocketVarsCollector {
     bvar::PerSecond<bvar::Adder<int64_t> > nkeepwrite_second;
     bvar::Adder<int64_t> nwaitepollout;
     bvar::PerSecond<bvar::Adder<int64_t> > nwaitepollout_second;
+    // Writes sent with MSG_ZEROCOPY.
+    bvar::Adder<int64_t> nzerocopy;
+    // Zerocopy writes that were copied anyway, either by the kernel or
+    // because the notification memory of the socket ran out.
+    bvar::Adder<int64_t> nzerocopy_copied;
+    // Unparsed input and unwritten output of all sockets, limited by
+    // -socket_max_buffered_bytes.
+    bvar::Adder<int64_t> read_buf_bytes;
+    bvar::Adder<int64_t> unwritten_bytes;
+    // Number of sockets with non-zero read_buf_bytes/unwritten_bytes.
+    bvar::Adder<int64_t> nreading_socket;
+    bvar::Adder<int64_t> nwriting_socket;
+    // Times of stopping reading or rejecting writes due to memory pressure.
+    bvar::Adder<int64_t> nthrottled_read;
+    bvar::Adder<int64_t> nthrottled_write;
+    // SSL connections whose writes are offloaded to kTLS.
+    bvar::Adder<int64_t> nktls;
+    // Writes into fds and requests fully written, the ratio shows how well
+    // requests are coalesced.
+    bvar::Adder<int64_t> nwrite_syscall;
+    bvar::PerSecond<bvar::Adder<int64_t> > nwrite_syscall_second;
+    bvar::Adder<int64_t> nwritten_request;
+    bvar::PerSecond<bvar::Adder<int64_t> > nwritten_request_second;
+    bvar::PassiveStatus<double> write_syscall_per_request;
+    // Latencies of successful SSL handshakes and the ones resuming previous
+    // sessions, at both client and server side.
+    bvar::LatencyRecorder ssl_handshake;
+    bvar::Adder<int64_t> nssl_resumed;
+    bvar::PerSecond<bvar::Adder<int64_t> > nssl_resumed_second;
+    bvar::PassiveStatus<double> ssl_resumption_ratio;
 };
 
 struct PipelinedInfo {
@@ -285,6 +350,16 @@ struct SocketOptions {
     int tcp_user_timeout_ms{ -1};
     // Tag of this socket
     bthread_tag_t bthread_tag{BTHREAD_TAG_DEFAULT};
+    // If non-negative, events of `fd' are watched by the
+    // `event_dispatcher_index'-th EventDispatcher of `bthread_tag' instead
+    // of the one selected by hashing `fd'.
+    int event_dispatcher_index{-1};
+    // Batches of at least so many bytes are written with MSG_ZEROCOPY,
+    // which saves copying them into the kernel but holds the blocks until
+    // the kernel acknowledges that they're sent. 0 disables zerocopy,
+    // negative value means -socket_zerocopy_threshold.
+    // Only plain tcp connections on linux >= 4.14 support this.
+    int64_t zerocopy_threshold{-1};
 };
 
 // Abstractions on reading from and writing into file descriptors.
@@ -311,6 +386,8 @@ friend class IOEvent<Socket>;
 friend void DereferenceSocket(Socket*);
     class SharedPart;
     struct WriteRequest;
+    struct ZeroCopyContext;
+    struct ZeroCopyCloseArg;
 
 public:
     const static int STREAM_FAKE_FD = INT_MAX;
@@ -380,6 +457,13 @@ public:
         // Default: false
         bool shutdown_write;
 
+        // If positive and this write gets the right to write the socket,
+        // the KeepWrite thread waits for at most so many microseconds
+        // before writing, so that writes during the interval are coalesced
+        // into fewer writev, like Nagle's algorithm but bounded.
+        // Default: 0
+        int32_t coalesce_delay_us;
+
         WriteOptions()
             : id_wait(INVALID_BTHREAD_ID)
             , notify_on_success(false)
@@ -388,7 +472,8 @@ public:
             , auth_flags(0)
             , ignore_eovercrowded(false)
             , write_in_background(false)
-            , shutdown_write(false) {}
+            , shutdown_write(false)
+            , coalesce_delay_us(0) {}
     };
 
     // True if write of socket is shutdown.
@@ -637,6 +722,21 @@ public:
     // Returns true if the remote side is overcrowded.
     bool is_overcrowded() const { return _overcrowded; }
 
+    // Bytes of unparsed input and unwritten output of this socket.
+    int64_t read_buf_bytes() const
+    { return _read_buf_bytes.load(butil::memory_order_relaxed); }
+    int64_t unwritten_bytes() const
+    { return _unwritten_bytes.load(butil::memory_order_relaxed); }
+
+    // When buffers of all sockets use more memory than
+    // -socket_max_buffered_bytes, sockets holding more unparsed input than
+    // average stop reading, and writes to sockets holding more unwritten
+    // output than average fail with EOVERCROWDED.
+    bool ShouldThrottleRead();
+    bool ShouldThrottleWrite();
+    // True if reading of this socket is stopped by ShouldThrottleRead().
+    bool is_read_throttled() const { return _read_throttled; }
+
     bthread_keytable_pool_t* keytable_pool() const { return _keytable_pool; }
 
     void set_http_request_method(const HttpMethod& method) { _http_request_method = method; }
@@ -688,11 +788,30 @@ private:
     // bytes on success, 0 on EOF, -1 otherwise and errno is set
     ssize_t DoRead(size_t size_hint);
 
+    // Sync read_buf_bytes() with size of `_read_buf'. Called after
+    // `_read_buf' is read or consumed.
+    void UpdateReadBufBytes();
+
     // Based upon whether the underlying channel is using SSL, write
     // `req' using the corresponding method. Returns written bytes on
     // success, -1 otherwise and errno is set
     ssize_t DoWrite(WriteRequest* req);
 
+    // Write `data_list' with MSG_ZEROCOPY and keep the written blocks in
+    // `_zerocopy' until their completions are reaped. Returns written bytes
+    // on success, -1 otherwise and errno is set
+    ssize_t DoZeroCopyWrite(butil::IOBuf* const* data_list, size_t ndata);
+
+    // Release blocks of zerocopy writes that the kernel has completed.
+    // Returns number of zerocopy writes still in flight.
+    size_t ReapZeroCopyCompletions();
+
+    // Close `fd' which was the fd of this socket. If zerocopy writes on `fd'
+    // are still in flight, `fd' is shut down and closed in a bthread after
+    // the kernel completes the writes, which keep referencing the blocks.
+    void CloseFileDescriptor(int fd);
+    static void* CloseAfterZeroCopyCompleted(void* arg);
+
     // [Not thread-safe] Wait for EPOLLOUT event on `fd'. If `pollin' is
     // true, EPOLLIN event will also be included and EPOLL_CTL_MOD will
     // be used instead of EPOLL_CTL_ADD. Note that spurious wakeups may
@@ -908,6 +1027,9 @@ private:
     // Only accept ssl connection.
     bool _force_ssl;
     SSLState _ssl_state;
+    // Writes of the SSL connection are encrypted by the kernel(kTLS), plain
+    // data can be written into the fd directly.
+    bool _ktls_send;
     // SSL objects cannot be read and written at the same time.
     // Use mutex to protect SSL objects when ssl_state is SSL_CONNECTED.
     mutable butil::Mutex _ssl_session_mutex;
@@ -926,6 +1048,9 @@ private:
     // True if the socket is too full to write.
     volatile bool _overcrowded;
 
+    // True if reading is stopped due to memory pressure.
+    volatile bool _read_throttled;
+
     bool _fail_me_at_server_stop;
 
     // Set by SetLogOff
@@ -951,6 +1076,9 @@ private:
     // Queued but written
     butil::atomic<int64_t> _unwritten_bytes;
 
+    // Size of _read_buf counted in SocketVarsCollector::read_buf_bytes.
+    butil::atomic<int64_t> _read_buf_bytes;
+
     // Butex to wait for EPOLLOUT event
     butil::atomic<int>* _epollout_butex;
 
@@ -959,6 +1087,11 @@ private:
 
     bool _is_write_shutdown;
 
+    // Microseconds for the next KeepWrite to wait before writing, set by
+    // StartWrite with WriteOptions.coalesce_delay_us. Only accessed by the
+    // thread having the right to write.
+    int32_t _keepwrite_delay_us;
+
     butil::Mutex _stream_mutex;
     std::set<StreamId> *_stream_set;
     butil::atomic<int64_t> _total_streams_unconsumed_size;
@@ -979,6 +1112,13 @@ private:
     // ETIMEDOUT to the application.
     int _tcp_user_timeout_ms;
 
+    // SocketOptions.zerocopy_threshold, or -socket_zerocopy_threshold if
+    // the option is negative. Writes of at least so many bytes use
+    // MSG_ZEROCOPY when it's positive, zerocopy is disabled otherwise.
+    int64_t _zerocopy_threshold;
+    // Non-NULL when MSG_ZEROCOPY is enabled on the fd.
+    ZeroCopyContext* _zerocopy;
+
     HttpMethod _http_request_method;
 };
 
@@ -25,6 +25,8 @@ VerifyOptions::VerifyOptions() : verify_depth(0) {}
 ChannelSSLOptions::ChannelSSLOptions()
     : ciphers("DEFAULT")
     , protocols("TLSv1, TLSv1.1, TLSv1.2")
+    , session_cache_size(0)
+    , enable_ktls(false)
 {}
 
 ServerSSLOptions::ServerSSLOptions()
@@ -33,7 +35,9 @@ ServerSSLOptions::ServerSSLOptions()
     , release_buffer(false)
     , session_lifetime_s(300)
     , session_cache_size(20480)
+    , session_ticket_key_rotation_s(0)
     , ecdhe_curve_name("prime256v1")
+    , enable_ktls(false)
 {}
 
 } // namespace brpc
@@ -88,6 +88,22 @@ struct ChannelSSLOptions {
     // Default: unset
     std::vector<std::string> alpn_protocols;
 
+    // Max number of sessions cached to resume later connections to the
+    // same server (remote endpoint and `sni_name') with abbreviated
+    // handshakes, which saves most CPU of handshakes for short or pooled
+    // connections. Sessions are cached per channel. 0 disables the cache.
+    // Default: 0
+    int session_cache_size;
+
+    // Offload encryption and decryption of connections to the kernel (kTLS)
+    // after handshakes. When the kernel encrypts writes, data is written
+    // into the fd with plain writev instead of being copied into the BIO
+    // buffer and encrypted by OpenSSL. Requires OpenSSL >= 3.0 built with
+    // ktls, the `tls' kernel module and a cipher supported by the kernel
+    // (e.g. AES-GCM), otherwise connections use OpenSSL silently.
+    // Default: false
+    bool enable_ktls;
+
     // TODO: Support CRL
 };
 
@@ -138,6 +154,13 @@ struct ServerSSLOptions {
     // Default: 20480
     int session_cache_size;
 
+    // Rotate the key encrypting session tickets every so many seconds.
+    // Tickets encrypted with the previous key are still accepted (and
+    // renewed with the current key) during the next period. 0 uses the key
+    // generated by OpenSSL, which never changes in the lifetime of server.
+    // Default: 0
+    int session_ticket_key_rotation_s;
+
     // Cipher suites allowed for each SSL handshake. The format of this string
     // should follow that in `man 1 ciphers'. If empty, OpenSSL will choose
     // a default cipher based on the certificate information
@@ -158,6 +181,11 @@ struct ServerSSLOptions {
     // Default: empty
     std::string alpns;
 
+    // Offload encryption and decryption of accepted connections to the
+    // kernel (kTLS). See `ChannelSSLOptions.enable_ktls' for detail.
+    // Default: false
+    bool enable_ktls;
+
     // TODO: Support OSCP stapling
 };
 
@@ -231,15 +231,9 @@ static bool validate_bthread_concurrency_by_tag(const char*, int32_t val) {
 
 __thread TaskGroup* tls_task_group_nosignal = NULL;
 
-BUTIL_FORCE_INLINE int
-start_from_non_worker(bthread_t* __restrict tid,
-                      const bthread_attr_t* __restrict attr,
-                      void* (*fn)(void*),
-                      void* __restrict arg) {
-    TaskControl* c = get_or_new_task_control();
-    if (NULL == c) {
-        return ENOMEM;
-    }
+BUTIL_FORCE_INLINE TaskGroup*
+choose_group_from_non_worker(TaskControl* c,
+                             const bthread_attr_t* __restrict attr) {
     auto tag = BTHREAD_TAG_DEFAULT;
     if (attr != NULL && attr->tag != BTHREAD_TAG_INVALID) {
         tag = attr->tag;
@@ -254,9 +248,35 @@ start_from_non_worker(bthread_t* __restrict tid,
             g = c->choose_one_group(tag);
             tls_task_group_nosignal = g;
         }
-        return g->start_background<true>(tid, attr, fn, arg);
+        return g;
+    }
+    return c->choose_one_group(tag);
+}
+
+BUTIL_FORCE_INLINE int
+start_from_non_worker(bthread_t* __restrict tid,
+                      const bthread_attr_t* __restrict attr,
+                      void* (*fn)(void*),
+                      void* __restrict arg) {
+    TaskControl* c = get_or_new_task_control();
+    if (NULL == c) {
+        return ENOMEM;
+    }
+    return choose_group_from_non_worker(c, attr)
+        ->start_background<true>(tid, attr, fn, arg);
+}
+
+BUTIL_FORCE_INLINE int
+start_batch_from_non_worker(bthread_t* __restrict tids, size_t n,
+                            const bthread_attr_t* __restrict attr,
+                            void* (*fn)(void*),
+                            void* const* args) {
+    TaskControl* c = get_or_new_task_control();
+    if (NULL == c) {
+        return ENOMEM;
     }
-    return c->choose_one_group(tag)->start_background<true>(tid, attr, fn, arg);
+    return choose_group_from_non_worker(c, attr)
+        ->start_background_batch<true>(tids, n, attr, fn, args);
 }
 
 // Meet one of the three conditions, can run in thread local
@@ -321,6 +341,25 @@ int bthread_start_background(bthread_t* __restrict tid,
     return bthread::start_from_non_worker(tid, attr, fn, arg);
 }
 
+int bthread_start_batch(bthread_t* __restrict tids, size_t n,
+                        const bthread_attr_t* __restrict attr,
+                        void * (*fn)(void*),
+                        void* const* args) {
+    if (n == 0) {
+        return 0;
+    }
+    if (NULL == tids || NULL == args) {
+        return EINVAL;
+    }
+    bthread::TaskGroup* g = bthread::tls_task_group;
+    if (g) {
+        if (bthread::can_run_thread_local(attr)) {
+            return g->start_background_batch<false>(tids, n, attr, fn, args);
+        }
+    }
+    return bthread::start_batch_from_non_worker(tids, n, attr, fn, args);
+}
+
 void bthread_flush() {
     bthread::TaskGroup* g = bthread::tls_task_group;
     if (g) {
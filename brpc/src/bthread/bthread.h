@@ -68,6 +68,18 @@ extern int bthread_start_background(bthread_t* __restrict tid,
                                     void * (*fn)(void*),
                                     void* __restrict args);
 
+// Create `n' bthreads `fn(args[i])' with attributes `attr' and put the
+// identifiers into `tids[0..n)'. Behaves like calling
+// bthread_start_background() `n' times, but all bthreads go to the same
+// worker and idle workers are signaled once for the whole batch.
+// If creating one bthread fails, bthreads before it are still started and
+// tids of the rest are set to INVALID_BTHREAD.
+// Return 0 on success, errno otherwise.
+extern int bthread_start_batch(bthread_t* __restrict tids, size_t n,
+                               const bthread_attr_t* __restrict attr,
+                               void * (*fn)(void*),
+                               void* const* args);
+
 // Wake up operations blocking the thread. Different functions may behave
 // differently:
 //   bthread_usleep(): returns -1 and sets errno to ESTOP if bthread_stop()
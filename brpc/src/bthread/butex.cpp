@@ -19,14 +19,14 @@
 
 // Date: Tue Jul 22 17:30:12 CST 2014
 
+#include <gflags/gflags.h>
 #include "butil/atomicops.h"                // butil::atomic
 #include "butil/scoped_lock.h"              // BAIDU_SCOPED_LOCK
 #include "butil/macros.h"
 #include "butil/containers/flat_map.h"
 #include "butil/containers/linked_list.h"   // LinkNode
-#ifdef SHOW_BTHREAD_BUTEX_WAITER_COUNT_IN_VARS
 #include "butil/memory/singleton_on_pthread_once.h"
-#endif
+#include "butil/reloadable_flags.h"
 #include "butil/logging.h"
 #include "butil/object_pool.h"
 #include "bthread/errno.h"                 // EWOULDBLOCK
@@ -37,6 +37,7 @@
 #include "bthread/timer_thread.h"
 #include "bthread/butex.h"
 #include "bthread/mutex.h"
+#include "bvar/reducer.h"
 
 // This file implements butex.h
 // Provides futex-like semantics which is sequenced wait and wake operations
@@ -59,6 +60,26 @@
 
 namespace bthread {
 
+DEFINE_int32(bthread_butex_max_spin, 0,
+             "Max iterations that butex_wait spins for the value to change "
+             "before queueing the waiter and switching out. The actual count "
+             "is learned from recent waits on the same butex. 0 disables "
+             "spinning");
+BUTIL_VALIDATE_GFLAG(bthread_butex_max_spin, butil::NonNegativeInteger);
+
+struct ButexSpinCount {
+    ButexSpinCount()
+        : success("bthread_butex_spin_success")
+        , failure("bthread_butex_spin_failure") {}
+    // Waits which saw the value changed while spinning.
+    bvar::Adder<int64_t> success;
+    // Waits which spun and queued anyway.
+    bvar::Adder<int64_t> failure;
+};
+inline ButexSpinCount& butex_spin_count() {
+    return *butil::get_leaky_singleton<ButexSpinCount>();
+}
+
 #ifdef SHOW_BTHREAD_BUTEX_WAITER_COUNT_IN_VARS
 struct ButexWaiterCount : public bvar::Adder<int64_t> {
     ButexWaiterCount() : bvar::Adder<int64_t>("bthread_butex_waiter_count") {}
@@ -115,6 +136,10 @@ struct BAIDU_CACHELINE_ALIGNMENT Butex {
     ~Butex() {}
 
     butil::atomic<int> value;
+    // Estimated iterations for the value to change after a waiter starts
+    // spinning, which is roughly the remaining hold time of the lock built
+    // on this butex. Fits in the padding before `waiters'.
+    butil::atomic<int> spin_estimate;
     ButexWaiterList waiters;
     FastPthreadMutex waiter_lock;
 };
@@ -254,6 +279,7 @@ inline int unsleep_if_necessary(ButexBthreadWaiter* w,
 void* butex_create() {
     Butex* b = butil::get_object<Butex>();
     if (b) {
+        b->spin_estimate.store(0, butil::memory_order_relaxed);
         return &b->value;
     }
     return NULL;
@@ -598,6 +624,29 @@ void wait_for_butex(void* arg) {
     // TaskGroup::sched_to(&g, bw->tid, false/*2*/);
 }
 
+// Spin for the value of `b' to change from `expected_value' within a bound
+// learned from recent waits on `b'. Returns true if the value changed.
+static bool butex_spin_wait(Butex* b, int expected_value, int max_spin) {
+    const int estimate = b->spin_estimate.load(butil::memory_order_relaxed);
+    // Spin a bit more than what previous successful waits needed.
+    const int limit = std::min(max_spin, estimate * 2 + 16);
+    for (int i = 0; i < limit; ++i) {
+        cpu_relax();
+        if (b->value.load(butil::memory_order_relaxed) != expected_value) {
+            b->spin_estimate.store(estimate + (i - estimate) / 8,
+                                   butil::memory_order_relaxed);
+            butex_spin_count().success << 1;
+            return true;
+        }
+    }
+    // The value is held for long, spin less next time.
+    b->spin_estimate.store(estimate - estimate / 8 - 1 > 0 ?
+                           estimate - estimate / 8 - 1 : 0,
+                           butil::memory_order_relaxed);
+    butex_spin_count().failure << 1;
+    return false;
+}
+
 static int butex_wait_from_pthread(TaskGroup* g, Butex* b, int expected_value,
                                    const timespec* abstime, bool prepend) {
     TaskMeta* task = NULL;
@@ -666,6 +715,16 @@ int butex_wait(void* arg, int expected_value, const timespec* abstime, bool prep
         return -1;
     }
     TaskGroup* g = tls_task_group;
+    const int max_spin = FLAGS_bthread_butex_max_spin;
+    // Spinning is only worthwhile when there are no other bthreads to run
+    // in this worker, or the waiter is a pthread.
+    if (max_spin > 0 && (NULL == g || g->rq_size() == 0) &&
+        butex_spin_wait(b, expected_value, max_spin)) {
+        // Same as the unmatched value above.
+        errno = EWOULDBLOCK;
+        butil::atomic_thread_fence(butil::memory_order_acquire);
+        return -1;
+    }
     if (NULL == g || g->is_current_pthread_task()) {
         return butex_wait_from_pthread(g, b, expected_value, abstime, prepend);
     }
@@ -22,50 +22,31 @@
 #ifndef BTHREAD_REMOTE_TASK_QUEUE_H
 #define BTHREAD_REMOTE_TASK_QUEUE_H
 
-#include "butil/containers/bounded_queue.h"
+#include "butil/containers/mpmc_bounded_queue.h"
 #include "butil/macros.h"
 
 namespace bthread {
 
 class TaskGroup;
 
-// A queue for storing bthreads created by non-workers. Since non-workers
-// randomly choose a TaskGroup to push which distributes the contentions,
-// this queue is simply implemented as a queue protected with a lock.
+// A queue for storing bthreads created by non-workers. Non-workers randomly
+// choose a TaskGroup to push, while the owner worker and stealing workers
+// pop, so multiple producers and consumers are common. This queue is
+// lock-free to avoid pthread producers from serializing on a mutex.
 // The function names should be self-explanatory.
 class RemoteTaskQueue {
 public:
     RemoteTaskQueue() {}
 
     int init(size_t cap) {
-        const size_t memsize = sizeof(bthread_t) * cap;
-        void* q_mem = malloc(memsize);
-        if (q_mem == NULL) {
-            return -1;
-        }
-        butil::BoundedQueue<bthread_t> q(q_mem, memsize, butil::OWNS_STORAGE);
-        _tasks.swap(q);
-        return 0;
+        return _tasks.init(cap);
     }
 
     bool pop(bthread_t* task) {
-        if (_tasks.empty()) {
-            return false;
-        }
-        _mutex.lock();
-        const bool result = _tasks.pop(task);
-        _mutex.unlock();
-        return result;
+        return _tasks.pop(task);
     }
 
     bool push(bthread_t task) {
-        _mutex.lock();
-        const bool res = push_locked(task);
-        _mutex.unlock();
-        return res;
-    }
-
-    bool push_locked(bthread_t task) {
         return _tasks.push(task);
     }
 
@@ -74,8 +55,7 @@ public:
 private:
 friend class TaskGroup;
     DISALLOW_COPY_AND_ASSIGN(RemoteTaskQueue);
-    butil::BoundedQueue<bthread_t> _tasks;
-    butil::Mutex _mutex;
+    butil::MPMCBoundedQueue<bthread_t> _tasks;
 };
 
 }  // namespace bthread
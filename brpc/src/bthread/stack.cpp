@@ -23,7 +23,11 @@
 #include <sys/mman.h>                             // mmap, munmap, mprotect
 #include <algorithm>                              // std::max
 #include <stdlib.h>                               // posix_memalign
+#include <map>
+#include <vector>
+#include "butil/build_config.h"                    // OS_LINUX
 #include "butil/macros.h"                          // BAIDU_CASSERT
+#include "butil/scoped_lock.h"
 #include "butil/memory/singleton_on_pthread_once.h"
 #include "butil/third_party/dynamic_annotations/dynamic_annotations.h" // RunningOnValgrind
 #include "butil/third_party/valgrind/valgrind.h"   // VALGRIND_STACK_REGISTER
@@ -37,6 +41,14 @@ DEFINE_int32(stack_size_large, 8388608, "size of large stacks");
 DEFINE_int32(guard_page_size, 4096, "size of guard page, allocate stacks by malloc if it's 0(not recommended)");
 DEFINE_int32(tc_stack_small, 32, "maximum small stacks cached by each thread");
 DEFINE_int32(tc_stack_normal, 8, "maximum normal stacks cached by each thread");
+DEFINE_bool(stack_pool, false, "Carve stacks out of large regions reserved "
+            "in advance instead of mmap-ing each stack, which saves VMAs and "
+            "mmap/mprotect calls when there are lots of bthreads");
+DEFINE_int32(stack_pool_region_size, 64 * 1024 * 1024,
+             "size of each region reserved by the stack pool");
+DEFINE_bool(stack_pool_huge_page, false, "Back regions of the stack pool "
+            "with transparent huge pages, works best with -guard_page_size=0 "
+            "since a guard page splits the huge page containing it");
 
 namespace bthread {
 
@@ -53,6 +65,133 @@ static int64_t get_stack_count(void*) {
 static bvar::PassiveStatus<int64_t> bvar_stack_count(
     "bthread_stack_count", get_stack_count, NULL);
 
+#if defined(OS_LINUX) && !defined(MADV_GUARD_INSTALL)
+#define MADV_GUARD_INSTALL 102
+#endif
+
+// Make [mem, mem + len) inaccessible. Guard regions installed by madvise
+// do not split VMA, use them if the kernel supports (linux >= 6.13).
+static int protect_guard_pages(void* mem, size_t len) {
+#if defined(OS_LINUX)
+    static bool s_guard_install_unsupported = false;
+    if (!s_guard_install_unsupported) {
+        if (madvise(mem, len, MADV_GUARD_INSTALL) == 0) {
+            return 0;
+        }
+        s_guard_install_unsupported = true;
+    }
+#endif
+    return mprotect(mem, len, PROT_NONE);
+}
+
+static butil::static_atomic<int64_t> s_stack_pool_reserved =
+    BUTIL_STATIC_ATOMIC_INIT(0);
+static int64_t get_stack_pool_reserved(void*) {
+    return s_stack_pool_reserved.load(butil::memory_order_relaxed);
+}
+static bvar::PassiveStatus<int64_t> bvar_stack_pool_reserved(
+    "bthread_stack_pool_reserved", get_stack_pool_reserved, NULL);
+
+// Stacks of the same size (including the guard page) are carved out of
+// regions of -stack_pool_region_size bytes. Slots are never unmapped,
+// deallocated ones are reused by later allocations of the same size.
+// Allocations are rare since stacks are cached by ObjectPool in each
+// worker, a global lock is enough.
+class StackPool {
+public:
+    static StackPool* singleton() {
+        return butil::get_leaky_singleton<StackPool>();
+    }
+
+    // Returns the lowest address of the slot, NULL on error.
+    void* allocate(int memsize, int guardsize);
+    void deallocate(void* mem, int memsize, int guardsize);
+
+private:
+    struct SizedPool {
+        SizedPool() : cur(NULL), end(NULL) {}
+        char* cur;
+        char* end;
+        std::vector<void*> free_slots;
+    };
+
+    int reserve(SizedPool* pool, int memsize);
+
+    butil::Mutex _mutex;
+    // Indexed by (memsize, guardsize).
+    std::map<std::pair<int, int>, SizedPool> _pools;
+};
+
+int StackPool::reserve(SizedPool* pool, int memsize) {
+    const size_t HUGE_PAGE_SIZE = 2 * 1024 * 1024;
+    size_t region_size = std::max(FLAGS_stack_pool_region_size, memsize);
+    region_size = region_size / memsize * memsize;
+    const bool huge_page = FLAGS_stack_pool_huge_page;
+    // Reserve more to align the region with huge pages.
+    const size_t mapped_size = region_size + (huge_page ? HUGE_PAGE_SIZE : 0);
+    int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+#if defined(MAP_NORESERVE)
+    flags |= MAP_NORESERVE;
+#endif
+    void* mem = mmap(NULL, mapped_size, (PROT_READ | PROT_WRITE), flags, -1, 0);
+    if (MAP_FAILED == mem) {
+        PLOG_EVERY_SECOND(ERROR) << "Fail to mmap size=" << mapped_size
+                                 << " for stack pool";
+        return -1;
+    }
+    char* region = (char*)mem;
+    if (huge_page) {
+        region = (char*)(((uintptr_t)mem + HUGE_PAGE_SIZE - 1) &
+                         ~(HUGE_PAGE_SIZE - 1));
+        if (region != mem) {
+            munmap(mem, region - (char*)mem);
+        }
+        const size_t tail = (char*)mem + mapped_size - (region + region_size);
+        if (tail) {
+            munmap(region + region_size, tail);
+        }
+#if defined(MADV_HUGEPAGE)
+        if (madvise(region, region_size, MADV_HUGEPAGE) != 0) {
+            PLOG_ONCE(WARNING) << "Fail to madvise MADV_HUGEPAGE";
+        }
+#endif
+    }
+    s_stack_pool_reserved.fetch_add(region_size, butil::memory_order_relaxed);
+    pool->cur = region;
+    pool->end = region + region_size;
+    return 0;
+}
+
+void* StackPool::allocate(int memsize, int guardsize) {
+    BAIDU_SCOPED_LOCK(_mutex);
+    SizedPool& pool = _pools[std::make_pair(memsize, guardsize)];
+    if (!pool.free_slots.empty()) {
+        void* mem = pool.free_slots.back();
+        pool.free_slots.pop_back();
+        return mem;
+    }
+    if (pool.end - pool.cur < memsize && reserve(&pool, memsize) != 0) {
+        return NULL;
+    }
+    void* mem = pool.cur;
+    // Guard pages are installed when the slot is carved for the first
+    // time and kept when the slot is reused.
+    if (guardsize > 0 && protect_guard_pages(mem, guardsize) != 0) {
+        PLOG_EVERY_SECOND(ERROR) << "Fail to protect guard pages of "
+                                 << mem << " length=" << guardsize;
+        return NULL;
+    }
+    pool.cur += memsize;
+    return mem;
+}
+
+void StackPool::deallocate(void* mem, int memsize, int guardsize) {
+    // Give back the physical memory, the guard pages are not touched.
+    madvise((char*)mem + guardsize, memsize - guardsize, MADV_DONTNEED);
+    BAIDU_SCOPED_LOCK(_mutex);
+    _pools[std::make_pair(memsize, guardsize)].free_slots.push_back(mem);
+}
+
 int allocate_stack_storage(StackStorage* s, int stacksize_in, int guardsize_in) {
     const static int PAGESIZE = getpagesize();
     const int PAGESIZE_M1 = PAGESIZE - 1;
@@ -64,7 +203,28 @@ int allocate_stack_storage(StackStorage* s, int stacksize_in, int guardsize_in)
         (std::max(stacksize_in, MIN_STACKSIZE) + PAGESIZE_M1) &
         ~PAGESIZE_M1;
 
-    if (guardsize_in <= 0) {
+    if (FLAGS_stack_pool) {
+        const int guardsize = (guardsize_in <= 0 ? 0 :
+            (std::max(guardsize_in, MIN_GUARDSIZE) + PAGESIZE_M1) &
+            ~PAGESIZE_M1);
+        const int memsize = stacksize + guardsize;
+        void* mem = StackPool::singleton()->allocate(memsize, guardsize);
+        if (NULL == mem) {
+            return -1;
+        }
+        s_stack_count.fetch_add(1, butil::memory_order_relaxed);
+        s->bottom = (char*)mem + memsize;
+        s->stacksize = stacksize;
+        s->guardsize = guardsize;
+        s->pooled = true;
+        if (RunningOnValgrind()) {
+            s->valgrind_stack_id = VALGRIND_STACK_REGISTER(
+                s->bottom, (char*)s->bottom - stacksize);
+        } else {
+            s->valgrind_stack_id = 0;
+        }
+        return 0;
+    } else if (guardsize_in <= 0) {
         void* mem = malloc(stacksize);
         if (NULL == mem) {
             PLOG_EVERY_SECOND(ERROR) << "Fail to malloc (size="
@@ -75,6 +235,7 @@ int allocate_stack_storage(StackStorage* s, int stacksize_in, int guardsize_in)
         s->bottom = (char*)mem + stacksize;
         s->stacksize = stacksize;
         s->guardsize = 0;
+        s->pooled = false;
         if (RunningOnValgrind()) {
             s->valgrind_stack_id = VALGRIND_STACK_REGISTER(
                 s->bottom, (char*)s->bottom - stacksize);
@@ -120,6 +281,7 @@ int allocate_stack_storage(StackStorage* s, int stacksize_in, int guardsize_in)
         s->bottom = (char*)mem + memsize;
         s->stacksize = stacksize;
         s->guardsize = guardsize;
+        s->pooled = false;
         if (RunningOnValgrind()) {
             s->valgrind_stack_id = VALGRIND_STACK_REGISTER(
                 s->bottom, (char*)s->bottom - stacksize);
@@ -139,7 +301,10 @@ void deallocate_stack_storage(StackStorage* s) {
         return;
     }
     s_stack_count.fetch_sub(1, butil::memory_order_relaxed);
-    if (s->guardsize <= 0) {
+    if (s->pooled) {
+        StackPool::singleton()->deallocate(
+            (char*)s->bottom - memsize, memsize, s->guardsize);
+    } else if (s->guardsize <= 0) {
         free((char*)s->bottom - memsize);
     } else {
         munmap((char*)s->bottom - memsize, memsize);
@@ -37,6 +37,8 @@ struct StackStorage {
     // http://www.boost.org/doc/libs/1_55_0/libs/context/doc/html/context/stack.html
     void* bottom;
     unsigned valgrind_stack_id;
+    // Carved out of regions of the stack pool(-stack_pool).
+    bool pooled;
 
     // Clears all members.
     void zeroize() {
@@ -44,6 +46,7 @@ struct StackStorage {
         guardsize = 0;
         bottom = NULL;
         valgrind_stack_id = 0;
+        pooled = false;
     }
 };
  
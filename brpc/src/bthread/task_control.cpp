@@ -20,6 +20,9 @@
 // Date: Tue Jul 10 17:40:58 CST 2012
 
 #include <sys/syscall.h>                   // SYS_gettid
+#include <sched.h>                         // sched_getcpu
+#include <stdio.h>                         // fopen
+#include <map>
 #include "butil/scoped_lock.h"             // BAIDU_SCOPED_LOCK
 #include "butil/errno.h"                   // berror
 #include "butil/logging.h"
@@ -41,6 +44,13 @@ DEFINE_int32(task_group_runqueue_capacity, 4096,
 DEFINE_int32(task_group_yield_before_idle, 0,
              "TaskGroup yields so many times before idle");
 DEFINE_int32(task_group_ntags, 1, "TaskGroup will be grouped by number ntags");
+DEFINE_bool(task_group_cpu_affinity, false,
+            "Pin each worker pthread to one cpu, workers are spread over NUMA "
+            "nodes in turn. Must be set before bthread is used");
+DEFINE_bool(task_group_numa_aware, false,
+            "Bind worker pthreads to NUMA nodes, workers steal tasks from the "
+            "same node before remote ones and are woken up by parking lots of "
+            "their own node. Must be set before bthread is used");
 
 namespace bthread {
 
@@ -83,6 +93,10 @@ void* TaskControl::worker_thread(void* arg) {
     delete dummy;
     run_tagged_worker_startfn(tag);
 
+    const int worker_id =
+        c->_next_worker_id.fetch_add(1, butil::memory_order_relaxed);
+    // Pin before creating the group, which gets the NUMA node from the cpu.
+    c->pin_worker(worker_id);
     TaskGroup* g = c->create_group(tag);
     TaskStatistics stat;
     if (NULL == g) {
@@ -93,8 +107,7 @@ void* TaskControl::worker_thread(void* arg) {
     g->_tid = syscall(SYS_gettid);
 
     std::string worker_thread_name = butil::string_printf(
-        "brpc_wkr:%d-%d", g->tag(),
-        c->_next_worker_id.fetch_add(1, butil::memory_order_relaxed));
+        "brpc_wkr:%d-%d", g->tag(), worker_id);
     butil::PlatformThread::SetName(worker_thread_name.c_str());
     BT_VLOG << "Created worker=" << pthread_self() << " tid=" << g->_tid
             << " bthread=" << g->main_tid() << " tag=" << g->tag();
@@ -183,9 +196,156 @@ TaskControl::TaskControl()
     , _signal_per_second(&_cumulated_signal_count)
     , _status(print_rq_sizes_in_the_tc, this)
     , _nbthreads("bthread_count")
-    , _pl(FLAGS_task_group_ntags)
+    , _nnuma_node(init_cpu_topology(&_worker_cpus, &_cpu_nodes))
+    , _pl(FLAGS_task_group_ntags * _nnuma_node)
 {}
 
+#if defined(OS_LINUX)
+// Parse cpulist format of sysfs, e.g. "0-23,48-71".
+static bool parse_cpu_list(const char* str, std::vector<int>* cpus) {
+    while (*str != '\0' && *str != '\n') {
+        char* end = NULL;
+        const long first = strtol(str, &end, 10);
+        if (end == str || first < 0) {
+            return false;
+        }
+        long last = first;
+        str = end;
+        if (*str == '-') {
+            ++str;
+            last = strtol(str, &end, 10);
+            if (end == str || last < first) {
+                return false;
+            }
+            str = end;
+        }
+        for (long i = first; i <= last; ++i) {
+            cpus->push_back(i);
+        }
+        if (*str == ',') {
+            ++str;
+        }
+    }
+    return true;
+}
+#endif
+
+int TaskControl::init_cpu_topology(std::vector<int>* worker_cpus,
+                                   std::vector<int>* cpu_nodes) {
+    worker_cpus->clear();
+    cpu_nodes->clear();
+#if defined(OS_LINUX)
+    if (!FLAGS_task_group_cpu_affinity && !FLAGS_task_group_numa_aware) {
+        return 1;
+    }
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+        PLOG(WARNING) << "Fail to get cpu affinity, workers are not pinned";
+        return 1;
+    }
+    // Allowed cpus of each NUMA node present in sysfs. Machines without
+    // NUMA(or sysfs) are treated as one node.
+    std::map<int, std::vector<int> > node_cpus;
+    for (int node = 0; node < CPU_SETSIZE; ++node) {
+        char path[64];
+        snprintf(path, sizeof(path),
+                 "/sys/devices/system/node/node%d/cpulist", node);
+        FILE* fp = fopen(path, "r");
+        if (fp == NULL) {
+            continue;
+        }
+        char buf[4096];
+        std::vector<int> cpus;
+        if (fgets(buf, sizeof(buf), fp) != NULL && parse_cpu_list(buf, &cpus)) {
+            for (size_t i = 0; i < cpus.size(); ++i) {
+                if (cpus[i] < CPU_SETSIZE && CPU_ISSET(cpus[i], &allowed)) {
+                    node_cpus[node].push_back(cpus[i]);
+                }
+            }
+        }
+        fclose(fp);
+    }
+    if (node_cpus.empty()) {
+        for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+            if (CPU_ISSET(cpu, &allowed)) {
+                node_cpus[0].push_back(cpu);
+            }
+        }
+    }
+    // Dense node indexes without nodes that have no allowed cpus.
+    std::vector<std::vector<int>*> nodes;
+    for (std::map<int, std::vector<int> >::iterator
+             it = node_cpus.begin(); it != node_cpus.end(); ++it) {
+        if (!it->second.empty()) {
+            nodes.push_back(&it->second);
+        }
+    }
+    cpu_nodes->assign(CPU_SETSIZE, -1);
+    size_t max_ncpu = 0;
+    for (size_t i = 0; i < nodes.size(); ++i) {
+        for (size_t j = 0; j < nodes[i]->size(); ++j) {
+            (*cpu_nodes)[(*nodes[i])[j]] = i;
+        }
+        max_ncpu = std::max(max_ncpu, nodes[i]->size());
+    }
+    // Take cpus from nodes in turn so that consecutive workers are spread
+    // over nodes.
+    for (size_t j = 0; j < max_ncpu; ++j) {
+        for (size_t i = 0; i < nodes.size(); ++i) {
+            if (j < nodes[i]->size()) {
+                worker_cpus->push_back((*nodes[i])[j]);
+            }
+        }
+    }
+    if (worker_cpus->empty()) {
+        cpu_nodes->clear();
+        return 1;
+    }
+    return FLAGS_task_group_numa_aware ? std::max((int)nodes.size(), 1) : 1;
+#else
+    return 1;
+#endif
+}
+
+void TaskControl::pin_worker(int worker_id) {
+#if defined(OS_LINUX)
+    if (_worker_cpus.empty()) {
+        return;
+    }
+    const int cpu = _worker_cpus[worker_id % _worker_cpus.size()];
+    cpu_set_t cs;
+    CPU_ZERO(&cs);
+    if (FLAGS_task_group_cpu_affinity) {
+        CPU_SET(cpu, &cs);
+    } else {
+        // Any cpu in the same NUMA node.
+        for (size_t i = 0; i < _cpu_nodes.size(); ++i) {
+            if (_cpu_nodes[i] == _cpu_nodes[cpu]) {
+                CPU_SET(i, &cs);
+            }
+        }
+    }
+    const int rc = pthread_setaffinity_np(pthread_self(), sizeof(cs), &cs);
+    if (rc != 0) {
+        LOG(WARNING) << "Fail to pin worker=" << worker_id << " to cpu="
+                     << cpu << ": " << berror(rc);
+    }
+#endif
+}
+
+int TaskControl::current_numa_node() const {
+#if defined(OS_LINUX)
+    if (_nnuma_node > 1) {
+        const int cpu = sched_getcpu();
+        if (cpu >= 0 && (size_t)cpu < _cpu_nodes.size() && _cpu_nodes[cpu] >= 0) {
+            return _cpu_nodes[cpu];
+        }
+    }
+#endif
+    return 0;
+}
+
 int TaskControl::init(int concurrency) {
     if (_concurrency != 0) {
         LOG(ERROR) << "Already initialized";
@@ -319,7 +479,7 @@ void TaskControl::stop_and_join() {
             _tagged_ngroup.begin(), _tagged_ngroup.end(),
             [](butil::atomic<size_t>& index) { index.store(0, butil::memory_order_relaxed); });
     }
-    for (int i = 0; i < FLAGS_task_group_ntags; ++i) {
+    for (size_t i = 0; i < _pl.size(); ++i) {
         for (auto& pl : _pl[i]) {
             pl.stop();
         }
@@ -361,7 +521,10 @@ int TaskControl::_add_group(TaskGroup* g, bthread_tag_t tag) {
         return -1;
     }
     g->set_tag(tag);
-    g->set_pl(&_pl[tag][butil::fmix64(pthread_numeric_id()) % PARKING_LOT_NUM]);
+    const int numa_node = current_numa_node();
+    g->set_numa_node(numa_node);
+    g->set_pl(&tag_pl(tag, numa_node)[
+                  butil::fmix64(pthread_numeric_id()) % PARKING_LOT_NUM]);
     size_t ngroup = _tagged_ngroup[tag].load(butil::memory_order_relaxed);
     if (ngroup < (size_t)BTHREAD_MAX_CONCURRENCY) {
         _tagged_groups[tag][ngroup] = g;
@@ -441,17 +604,27 @@ bool TaskControl::steal_task(bthread_t* tid, size_t* seed, size_t offset) {
     bool stolen = false;
     size_t s = *seed;
     auto& groups = tag_group(tag);
-    for (size_t i = 0; i < ngroup; ++i, s += offset) {
-        TaskGroup* g = groups[s % ngroup];
-        // g is possibly NULL because of concurrent _destroy_group
-        if (g) {
-            if (g->_rq.steal(tid)) {
-                stolen = true;
-                break;
-            }
-            if (g->_remote_rq.pop(tid)) {
-                stolen = true;
-                break;
+    // With multiple NUMA nodes, the first pass only steals from groups of
+    // the same node and the second pass from the others, so that tasks
+    // tend to stay with the memory they touch.
+    const int numa_node = (tls_task_group ? tls_task_group->numa_node() : 0);
+    const int npass = (_nnuma_node > 1 ? 2 : 1);
+    for (int pass = 0; pass < npass && !stolen; ++pass) {
+        for (size_t i = 0; i < ngroup; ++i, s += offset) {
+            TaskGroup* g = groups[s % ngroup];
+            // g is possibly NULL because of concurrent _destroy_group
+            if (g) {
+                if (npass > 1 && (g->numa_node() == numa_node) != (pass == 0)) {
+                    continue;
+                }
+                if (g->_rq.steal(tid)) {
+                    stolen = true;
+                    break;
+                }
+                if (g->_remote_rq.pop(tid)) {
+                    stolen = true;
+                    break;
+                }
             }
         }
     }
@@ -459,7 +632,7 @@ bool TaskControl::steal_task(bthread_t* tid, size_t* seed, size_t offset) {
     return stolen;
 }
 
-void TaskControl::signal_task(int num_task, bthread_tag_t tag) {
+void TaskControl::signal_task(int num_task, bthread_tag_t tag, int numa_node) {
     if (num_task <= 0) {
         return;
     }
@@ -470,15 +643,18 @@ void TaskControl::signal_task(int num_task, bthread_tag_t tag) {
     if (num_task > 2) {
         num_task = 2;
     }
-    auto& pl = tag_pl(tag);
-    int start_index = butil::fmix64(pthread_numeric_id()) % PARKING_LOT_NUM;
-    num_task -= pl[start_index].signal(1);
-    if (num_task > 0) {
-        for (int i = 1; i < PARKING_LOT_NUM && num_task > 0; ++i) {
-            if (++start_index >= PARKING_LOT_NUM) {
-                start_index = 0;
+    // Wake up workers in the same NUMA node first.
+    for (int n = 0; n < _nnuma_node && num_task > 0; ++n) {
+        auto& pl = tag_pl(tag, (numa_node + n) % _nnuma_node);
+        int start_index = butil::fmix64(pthread_numeric_id()) % PARKING_LOT_NUM;
+        num_task -= pl[start_index].signal(1);
+        if (num_task > 0) {
+            for (int i = 1; i < PARKING_LOT_NUM && num_task > 0; ++i) {
+                if (++start_index >= PARKING_LOT_NUM) {
+                    start_index = 0;
+                }
+                num_task -= pl[start_index].signal(1);
             }
-            num_task -= pl[start_index].signal(1);
         }
     }
     if (num_task > 0 &&
@@ -553,7 +729,8 @@ int64_t TaskControl::get_cumulated_signal_count() {
     BAIDU_SCOPED_LOCK(_modify_group_mutex);
     for_each_task_group([&](TaskGroup* g) {
         if (g) {
-            c += g->_nsignaled + g->_remote_nsignaled;
+            c += g->_nsignaled +
+                g->_remote_nsignaled.load(butil::memory_order_relaxed);
         }
     });
     return c;
@@ -60,11 +60,13 @@ public:
     // Create a TaskGroup in this control.
     TaskGroup* create_group(bthread_tag_t tag);
 
-    // Steal a task from a "random" group.
+    // Steal a task from a "random" group. Groups in the same NUMA node are
+    // tried first if -task_group_numa_aware is on.
     bool steal_task(bthread_t* tid, size_t* seed, size_t offset);
 
-    // Tell other groups that `n' tasks was just added to caller's runqueue
-    void signal_task(int num_task, bthread_tag_t tag);
+    // Tell other groups that `n' tasks was just added to caller's runqueue,
+    // which is in NUMA node `numa_node'.
+    void signal_task(int num_task, bthread_tag_t tag, int numa_node);
 
     // Stop and join worker threads in TaskControl.
     void stop_and_join();
@@ -76,6 +78,10 @@ public:
     int concurrency(bthread_tag_t tag) const 
     { return _tagged_ngroup[tag].load(butil::memory_order_acquire); }
 
+    // Get # of NUMA nodes that workers are spread over, which is 1 unless
+    // -task_group_numa_aware is on.
+    int numa_node_num() const { return _nnuma_node; }
+
     void print_rq_sizes(std::ostream& os);
 
     double get_cumulated_worker_time();
@@ -113,7 +119,19 @@ private:
     butil::atomic<size_t>& tag_ngroup(int tag) { return _tagged_ngroup[tag]; }
 
     // Tag parking slot
-    TaggedParkingLot& tag_pl(bthread_tag_t tag) { return _pl[tag]; }
+    TaggedParkingLot& tag_pl(bthread_tag_t tag, int numa_node)
+    { return _pl[tag * _nnuma_node + numa_node]; }
+
+    // Find cpus that workers are pinned to and NUMA nodes of them.
+    // Returns # of NUMA nodes that workers are spread over.
+    static int init_cpu_topology(std::vector<int>* worker_cpus,
+                                 std::vector<int>* cpu_nodes);
+
+    // Pin the calling worker to its cpu or NUMA node.
+    void pin_worker(int worker_id);
+
+    // NUMA node of the calling worker.
+    int current_numa_node() const;
 
     static void delete_task_group(void* arg);
 
@@ -154,6 +172,14 @@ private:
     std::vector<bvar::PerSecond<bvar::PassiveStatus<double>>*> _tagged_worker_usage_second;
     std::vector<bvar::Adder<int64_t>*> _tagged_nbthreads;
 
+    // Worker i is pinned to _worker_cpus[i % size], in which adjacent cpus
+    // are from different NUMA nodes. Empty if workers are not pinned.
+    std::vector<int> _worker_cpus;
+    // Dense NUMA node index of each cpu id, -1 for cpus not allowed.
+    std::vector<int> _cpu_nodes;
+    int _nnuma_node;
+
+    // Indexed by tag * _nnuma_node + NUMA node.
     std::vector<TaggedParkingLot> _pl;
 
 #ifdef BRPC_BTHREAD_TRACER
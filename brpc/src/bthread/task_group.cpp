@@ -201,6 +201,7 @@ TaskGroup::TaskGroup(TaskControl* c)
     , _sched_recursive_guard(0)
 #endif
     , _tag(BTHREAD_TAG_DEFAULT)
+    , _numa_node(0)
     , _tid(-1) {
     _steal_seed = butil::fast_rand();
     _steal_offset = OFFSET_TABLE[_steal_seed % ARRAY_SIZE(OFFSET_TABLE)];
@@ -445,21 +446,15 @@ int TaskGroup::start_foreground(TaskGroup** pg,
     return 0;
 }
 
-template <bool REMOTE>
-int TaskGroup::start_background(bthread_t* __restrict th,
-                                const bthread_attr_t* __restrict attr,
-                                void * (*fn)(void*),
-                                void* __restrict arg) {
-    // 流水线预测
-    if (__builtin_expect(!fn, 0)) {
-        return EINVAL;
-    }
-    const int64_t start_ns = butil::cpuwide_time_ns();
-    const bthread_attr_t using_attr = (attr ? *attr : BTHREAD_ATTR_NORMAL);
+TaskMeta* TaskGroup::new_background_task(bthread_t* __restrict th,
+                                         const bthread_attr_t& using_attr,
+                                         void * (*fn)(void*),
+                                         void* __restrict arg,
+                                         int64_t start_ns) {
     butil::ResourceId<TaskMeta> slot;
     TaskMeta* m = butil::get_resource(&slot);
     if (BAIDU_UNLIKELY(NULL == m)) {
-        return ENOMEM;
+        return NULL;
     }
     CHECK(m->current_waiter.load(butil::memory_order_relaxed) == NULL);
     m->sleep_failed = false;
@@ -481,11 +476,29 @@ int TaskGroup::start_background(bthread_t* __restrict th,
     if (using_attr.flags & BTHREAD_LOG_START_AND_FINISH) {
         LOG(INFO) << "Started bthread " << m->tid;
     }
-    _control->_nbthreads << 1;
-    _control->tag_nbthreads(tag()) << 1;
 #ifdef BRPC_BTHREAD_TRACER
     _control->_task_tracer.set_status(TASK_STATUS_CREATED, m);
 #endif // BRPC_BTHREAD_TRACER
+    return m;
+}
+
+template <bool REMOTE>
+int TaskGroup::start_background(bthread_t* __restrict th,
+                                const bthread_attr_t* __restrict attr,
+                                void * (*fn)(void*),
+                                void* __restrict arg) {
+    // 流水线预测
+    if (__builtin_expect(!fn, 0)) {
+        return EINVAL;
+    }
+    const int64_t start_ns = butil::cpuwide_time_ns();
+    const bthread_attr_t using_attr = (attr ? *attr : BTHREAD_ATTR_NORMAL);
+    TaskMeta* m = new_background_task(th, using_attr, fn, arg, start_ns);
+    if (BAIDU_UNLIKELY(NULL == m)) {
+        return ENOMEM;
+    }
+    _control->_nbthreads << 1;
+    _control->tag_nbthreads(tag()) << 1;
     if (REMOTE) {
         ready_to_run_remote(m, (using_attr.flags & BTHREAD_NOSIGNAL));
     } else {
@@ -494,6 +507,49 @@ int TaskGroup::start_background(bthread_t* __restrict th,
     return 0;
 }
 
+template <bool REMOTE>
+int TaskGroup::start_background_batch(bthread_t* __restrict tids, size_t n,
+                                      const bthread_attr_t* __restrict attr,
+                                      void * (*fn)(void*),
+                                      void* const* args) {
+    if (__builtin_expect(!fn, 0)) {
+        return EINVAL;
+    }
+    const int64_t start_ns = butil::cpuwide_time_ns();
+    const bthread_attr_t using_attr = (attr ? *attr : BTHREAD_ATTR_NORMAL);
+    int rc = 0;
+    size_t i = 0;
+    for (; i < n; ++i) {
+        TaskMeta* m = new_background_task(&tids[i], using_attr, fn,
+                                          args[i], start_ns);
+        if (BAIDU_UNLIKELY(NULL == m)) {
+            rc = ENOMEM;
+            break;
+        }
+        // Signal later for all tasks together.
+        if (REMOTE) {
+            ready_to_run_remote(m, true);
+        } else {
+            ready_to_run(m, true);
+        }
+    }
+    for (size_t j = i; j < n; ++j) {
+        tids[j] = INVALID_BTHREAD;
+    }
+    if (i > 0) {
+        _control->_nbthreads << i;
+        _control->tag_nbthreads(tag()) << i;
+        if (!(using_attr.flags & BTHREAD_NOSIGNAL)) {
+            if (REMOTE) {
+                flush_nosignal_tasks_remote();
+            } else {
+                flush_nosignal_tasks();
+            }
+        }
+    }
+    return rc;
+}
+
 // Explicit instantiations.
 template int
 TaskGroup::start_background<true>(bthread_t* __restrict th,
@@ -505,6 +561,16 @@ TaskGroup::start_background<false>(bthread_t* __restrict th,
                                    const bthread_attr_t* __restrict attr,
                                    void * (*fn)(void*),
                                    void* __restrict arg);
+template int
+TaskGroup::start_background_batch<true>(bthread_t* __restrict tids, size_t n,
+                                        const bthread_attr_t* __restrict attr,
+                                        void * (*fn)(void*),
+                                        void* const* args);
+template int
+TaskGroup::start_background_batch<false>(bthread_t* __restrict tids, size_t n,
+                                         const bthread_attr_t* __restrict attr,
+                                         void * (*fn)(void*),
+                                         void* const* args);
 
 int TaskGroup::join(bthread_t tid, void** return_value) {
     if (__builtin_expect(!tid, 0)) {  // tid of bthread is never 0.
@@ -727,7 +793,7 @@ void TaskGroup::ready_to_run(TaskMeta* meta, bool nosignal) {
         const int additional_signal = _num_nosignal;
         _num_nosignal = 0;
         _nsignaled += 1 + additional_signal;
-        _control->signal_task(1 + additional_signal, _tag);
+        _control->signal_task(1 + additional_signal, _tag, _numa_node);
     }
 }
 
@@ -736,7 +802,7 @@ void TaskGroup::flush_nosignal_tasks() {
     if (val) {
         _num_nosignal = 0;
         _nsignaled += val;
-        _control->signal_task(val, _tag);
+        _control->signal_task(val, _tag, _numa_node);
     }
 }
 
@@ -744,36 +810,22 @@ void TaskGroup::ready_to_run_remote(TaskMeta* meta, bool nosignal) {
 #ifdef BRPC_BTHREAD_TRACER
     _control->_task_tracer.set_status(TASK_STATUS_READY, meta);
 #endif // BRPC_BTHREAD_TRACER
-    _remote_rq._mutex.lock();
-    while (!_remote_rq.push_locked(meta->tid)) {
-        flush_nosignal_tasks_remote_locked(_remote_rq._mutex);
+    while (!_remote_rq.push(meta->tid)) {
+        flush_nosignal_tasks_remote();
         LOG_EVERY_SECOND(ERROR) << "_remote_rq is full, capacity="
                                 << _remote_rq.capacity();
         ::usleep(1000);
-        _remote_rq._mutex.lock();
     }
     if (nosignal) {
-        ++_remote_num_nosignal;
-        _remote_rq._mutex.unlock();
+        _remote_num_nosignal.fetch_add(1, butil::memory_order_relaxed);
     } else {
-        const int additional_signal = _remote_num_nosignal;
-        _remote_num_nosignal = 0;
-        _remote_nsignaled += 1 + additional_signal;
-        _remote_rq._mutex.unlock();
-        _control->signal_task(1 + additional_signal, _tag);
-    }
-}
-
-void TaskGroup::flush_nosignal_tasks_remote_locked(butil::Mutex& locked_mutex) {
-    const int val = _remote_num_nosignal;
-    if (!val) {
-        locked_mutex.unlock();
-        return;
+        // Take signals of tasks pushed with nosignal before as well.
+        const int additional_signal =
+            _remote_num_nosignal.exchange(0, butil::memory_order_relaxed);
+        _remote_nsignaled.fetch_add(1 + additional_signal,
+                                    butil::memory_order_relaxed);
+        _control->signal_task(1 + additional_signal, _tag, _numa_node);
     }
-    _remote_num_nosignal = 0;
-    _remote_nsignaled += val;
-    locked_mutex.unlock();
-    _control->signal_task(val, _tag);
 }
 
 void TaskGroup::ready_to_run_general(TaskMeta* meta, bool nosignal) {
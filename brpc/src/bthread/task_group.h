@@ -74,6 +74,19 @@ public:
                          void * (*fn)(void*),
                          void* __restrict arg);
 
+    // Create `n' tasks `fn(args[i])' with attributes `attr' in this TaskGroup
+    // and put the identifiers into `tids'. All tasks are pushed before
+    // signaling workers once.
+    //   Called from worker: start_background_batch<false>
+    //   Called from non-worker: start_background_batch<true>
+    // Return 0 on success, errno otherwise. Tasks before the failed one are
+    // started, identifiers of the remaining are set to INVALID_BTHREAD.
+    template <bool REMOTE>
+    int start_background_batch(bthread_t* __restrict tids, size_t n,
+                               const bthread_attr_t* __restrict attr,
+                               void * (*fn)(void*),
+                               void* const* args);
+
     // Suspend caller and run next bthread in TaskGroup *pg.
     static void sched(TaskGroup** pg);
     static void ending_sched(TaskGroup** pg);
@@ -157,7 +170,6 @@ public:
 
     // Push a bthread into the runqueue from another non-worker thread.
     void ready_to_run_remote(TaskMeta* meta, bool nosignal = false);
-    void flush_nosignal_tasks_remote_locked(butil::Mutex& locked_mutex);
     void flush_nosignal_tasks_remote();
 
     // Automatically decide the caller is remote or local, and call
@@ -189,6 +201,9 @@ public:
 
     bthread_tag_t tag() const { return _tag; }
 
+    // NUMA node of the worker running this group, see TaskControl.
+    int numa_node() const { return _numa_node; }
+
     pid_t tid() const { return _tid; }
 
     int64_t current_task_cpu_clock_ns() {
@@ -203,6 +218,14 @@ public:
 private:
 friend class TaskControl;
 
+    // Allocate and initialize TaskMeta of a background task.
+    // Returns NULL on failure.
+    TaskMeta* new_background_task(bthread_t* __restrict tid,
+                                  const bthread_attr_t& attr,
+                                  void * (*fn)(void*),
+                                  void* __restrict arg,
+                                  int64_t start_ns);
+
     // You shall use TaskControl::create_group to create new instance.
     explicit TaskGroup(TaskControl*);
 
@@ -243,6 +266,8 @@ friend class TaskControl;
 
     void set_pl(ParkingLot* pl) { _pl = pl; }
 
+    void set_numa_node(int numa_node) { _numa_node = numa_node; }
+
     TaskMeta* _cur_meta;
     
     // the control that this group belongs to
@@ -269,12 +294,13 @@ friend class TaskControl;
     bthread_t _main_tid;
     WorkStealingQueue<bthread_t> _rq;
     RemoteTaskQueue _remote_rq;
-    int _remote_num_nosignal;
-    int _remote_nsignaled;
+    butil::atomic<int> _remote_num_nosignal;
+    butil::atomic<int> _remote_nsignaled;
 
     int _sched_recursive_guard;
     // tag of this taskgroup
     bthread_tag_t _tag;
+    int _numa_node;
 
     // Worker thread id.
     pid_t _tid;
@@ -19,6 +19,7 @@
 
 
 #include <queue>                           // heap functions
+#include <gflags/gflags.h>
 #include "butil/scoped_lock.h"
 #include "butil/logging.h"
 #include "butil/third_party/murmurhash3/murmurhash3.h"   // fmix64
@@ -31,13 +32,21 @@
 
 namespace bthread {
 
+DEFINE_bool(bthread_timer_use_timing_wheel, false,
+            "Use a hierarchical timing wheel in the global TimerThread. "
+            "Must be set before bthread is used");
+DEFINE_int64(bthread_timer_wheel_tick_us, 1000,
+             "Tick of the timing wheel in the global TimerThread");
+
 // Defined in task_control.cpp
 void run_worker_startfn();
 
 const TimerThread::TaskId TimerThread::INVALID_TASK_ID = 0;
 
 TimerThreadOptions::TimerThreadOptions()
-    : num_buckets(13) {
+    : num_buckets(13)
+    , use_timing_wheel(false)
+    , timing_wheel_tick_us(1000) {
 }
 
 // A task contains the necessary information for running fn(arg).
@@ -117,6 +126,171 @@ inline bool task_greater(const TimerThread::Task* a, const TimerThread::Task* b)
     return a->run_time > b->run_time;
 }
 
+inline void push_task_heap(std::vector<TimerThread::Task*>* tasks,
+                           TimerThread::Task* task) {
+    tasks->push_back(task);
+    std::push_heap(tasks->begin(), tasks->end(), task_greater);
+}
+
+// Hierarchical timing wheel of NLEVEL levels, each level has NSLOT slots.
+// A task is put into the level of the highest differing SLOT_BITS between
+// its tick and the current tick. When the current tick enters the range of
+// a slot, tasks in the slot are cascaded into lower levels, and tasks of
+// the current tick are moved into the min-heap of TimerThread::run to be
+// run at their precise time. Tasks beyond the range of the wheel are kept
+// in an overflow list which is re-added once per range.
+// Only accessed by the timer thread.
+class TimerThread::TimingWheel {
+public:
+    TimingWheel(int64_t tick_us, int64_t now_us)
+        : _tick_us(tick_us)
+        , _cur_tick(now_us / tick_us)
+        , _overflow(NULL) {
+        memset(_levels, 0, sizeof(_levels));
+    }
+
+    // Put the task into the wheel, or into `tasks' if it expires within
+    // the current tick.
+    void add(Task* task, std::vector<Task*>* tasks);
+
+    // Move the current tick to `now_us', tasks of ticks passed by are
+    // moved into `tasks'.
+    void advance(int64_t now_us, std::vector<Task*>* tasks);
+
+    // Realtime at which advance() has something to do.
+    int64_t next_run_time() const {
+        const int64_t tick = next_event_tick();
+        return tick == std::numeric_limits<int64_t>::max() ?
+            tick : tick * _tick_us;
+    }
+
+private:
+    static const int SLOT_BITS = 8;
+    static const int NSLOT = 1 << SLOT_BITS;
+    static const int NLEVEL = 4;
+    static const int NWORD = NSLOT / 64;
+
+    struct Level {
+        Task* slots[NSLOT];
+        uint64_t nonempty[NWORD];  // bitmap of non-empty slots
+    };
+
+    void push_slot(int level, int index, Task* task) {
+        Level& l = _levels[level];
+        task->next = l.slots[index];
+        l.slots[index] = task;
+        l.nonempty[index / 64] |= (1UL << (index % 64));
+    }
+
+    Task* take_slot(int level, int index) {
+        Level& l = _levels[level];
+        Task* head = l.slots[index];
+        l.slots[index] = NULL;
+        l.nonempty[index / 64] &= ~(1UL << (index % 64));
+        return head;
+    }
+
+    // Re-add a list of tasks, unscheduled ones are deleted.
+    void readd(Task* head, std::vector<Task*>* tasks) {
+        while (head != NULL) {
+            Task* next_task = head->next;
+            if (!head->try_delete()) {
+                add(head, tasks);
+            }
+            head = next_task;
+        }
+    }
+
+    // Index of the first non-empty slot not less than `from', -1 if none.
+    int first_nonempty(int level, int from) const {
+        const uint64_t* bits = _levels[level].nonempty;
+        for (int w = from / 64; w < NWORD; ++w) {
+            uint64_t word = bits[w];
+            if (w == from / 64) {
+                word &= (~0UL << (from % 64));
+            }
+            if (word) {
+                return w * 64 + __builtin_ctzll(word);
+            }
+        }
+        return -1;
+    }
+
+    // The nearest tick after the current one at which a slot should be
+    // cascaded or expired.
+    int64_t next_event_tick() const;
+
+    int64_t _tick_us;
+    int64_t _cur_tick;
+    Task* _overflow;
+    Level _levels[NLEVEL];
+};
+
+void TimerThread::TimingWheel::add(Task* task, std::vector<Task*>* tasks) {
+    const int64_t tick = task->run_time / _tick_us;
+    if (tick <= _cur_tick) {
+        push_task_heap(tasks, task);
+        return;
+    }
+    const uint64_t diff = (uint64_t)tick ^ (uint64_t)_cur_tick;
+    for (int i = 0; i < NLEVEL; ++i) {
+        const int shift = SLOT_BITS * i;
+        if ((diff >> (shift + SLOT_BITS)) == 0) {
+            push_slot(i, (tick >> shift) & (NSLOT - 1), task);
+            return;
+        }
+    }
+    task->next = _overflow;
+    _overflow = task;
+}
+
+int64_t TimerThread::TimingWheel::next_event_tick() const {
+    // Slots in lower levels are always earlier than the ones in higher
+    // levels. Slots at the current index of each level are empty.
+    for (int i = 0; i < NLEVEL; ++i) {
+        const int shift = SLOT_BITS * i;
+        const int cur_index = (_cur_tick >> shift) & (NSLOT - 1);
+        const int index = first_nonempty(i, cur_index + 1);
+        if (index >= 0) {
+            return ((_cur_tick >> (shift + SLOT_BITS)) << (shift + SLOT_BITS))
+                | ((int64_t)index << shift);
+        }
+    }
+    if (_overflow != NULL) {
+        const int shift = SLOT_BITS * NLEVEL;
+        return ((_cur_tick >> shift) + 1) << shift;
+    }
+    return std::numeric_limits<int64_t>::max();
+}
+
+void TimerThread::TimingWheel::advance(int64_t now_us,
+                                       std::vector<Task*>* tasks) {
+    const int64_t now_tick = now_us / _tick_us;
+    while (_cur_tick < now_tick) {
+        const int64_t tick = next_event_tick();
+        if (tick > now_tick) {
+            _cur_tick = now_tick;
+            break;
+        }
+        _cur_tick = tick;
+        // Cascade from the highest level, tasks of higher levels may be
+        // put into the slots of lower levels being cascaded.
+        const int64_t range = (int64_t)1 << (SLOT_BITS * NLEVEL);
+        if (_overflow != NULL && (tick & (range - 1)) == 0) {
+            Task* head = _overflow;
+            _overflow = NULL;
+            readd(head, tasks);
+        }
+        for (int i = NLEVEL - 1; i > 0; --i) {
+            const int shift = SLOT_BITS * i;
+            if ((tick & (((int64_t)1 << shift) - 1)) == 0) {
+                readd(take_slot(i, (tick >> shift) & (NSLOT - 1)), tasks);
+            }
+        }
+        readd(take_slot(0, tick & (NSLOT - 1)), tasks);
+    }
+}
+
 void* TimerThread::run_this(void* arg) {
     butil::PlatformThread::SetName("brpc_timer");
     static_cast<TimerThread*>(arg)->run();
@@ -127,6 +301,7 @@ TimerThread::TimerThread()
     : _started(false)
     , _stop(false)
     , _buckets(NULL)
+    , _wheel(NULL)
     , _nearest_run_time(std::numeric_limits<int64_t>::max())
     , _nsignals(0)
     , _thread(0) {
@@ -136,6 +311,8 @@ TimerThread::~TimerThread() {
     stop_and_join();
     delete [] _buckets;
     _buckets = NULL;
+    delete _wheel;
+    _wheel = NULL;
 }
 
 int TimerThread::start(const TimerThreadOptions* options_in) {
@@ -158,6 +335,19 @@ int TimerThread::start(const TimerThreadOptions* options_in) {
         LOG(ERROR) << "Fail to new _buckets";
         return ENOMEM;
     }        
+    if (_options.use_timing_wheel) {
+        if (_options.timing_wheel_tick_us <= 0) {
+            LOG(ERROR) << "Invalid timing_wheel_tick_us="
+                       << _options.timing_wheel_tick_us;
+            return EINVAL;
+        }
+        _wheel = new (std::nothrow) TimingWheel(
+            _options.timing_wheel_tick_us, butil::gettimeofday_us());
+        if (NULL == _wheel) {
+            LOG(ERROR) << "Fail to new _wheel";
+            return ENOMEM;
+        }
+    }
     const int ret = pthread_create(&_thread, NULL, TimerThread::run_this, this);
     if (ret) {
         return ret;
@@ -321,7 +511,8 @@ void TimerThread::run() {
     int64_t last_sleep_time = butil::gettimeofday_us();
     BT_VLOG << "Started TimerThread=" << pthread_self();
 
-    // min heap of tasks (ordered by run_time)
+    // min heap of tasks (ordered by run_time). When the timing wheel is
+    // used, only tasks of the current tick are in the heap.
     std::vector<Task*> tasks;
     tasks.reserve(4096);
 
@@ -359,12 +550,18 @@ void TimerThread::run() {
                 Task* next_task = p->next;
 
                 if (!p->try_delete()) { // remove the task if it's unscheduled
-                    tasks.push_back(p);
-                    std::push_heap(tasks.begin(), tasks.end(), task_greater);
+                    if (_wheel) {
+                        _wheel->add(p, &tasks);
+                    } else {
+                        push_task_heap(&tasks, p);
+                    }
                 }
                 p = next_task;
             }
         }
+        if (_wheel) {
+            _wheel->advance(butil::gettimeofday_us(), &tasks);
+        }
 
         bool pull_again = false;
         while (!tasks.empty()) {
@@ -406,6 +603,14 @@ void TimerThread::run() {
         if (!tasks.empty()) {
             next_run_time = tasks[0]->run_time;
         }
+        if (_wheel) {
+            const int64_t wheel_run_time = _wheel->next_run_time();
+            if (wheel_run_time <= butil::gettimeofday_us()) {
+                // Ticks passed while running tasks.
+                continue;
+            }
+            next_run_time = std::min(next_run_time, wheel_run_time);
+        }
         // Similarly with the situation before running tasks, we check
         // _nearest_run_time to prevent us from waiting on a non-earliest
         // task. We also use the _nsignal to make sure that if new task 
@@ -464,6 +669,8 @@ static void init_global_timer_thread() {
     }
     TimerThreadOptions options;
     options.bvar_prefix = "bthread_timer";
+    options.use_timing_wheel = FLAGS_bthread_timer_use_timing_wheel;
+    options.timing_wheel_tick_us = FLAGS_bthread_timer_wheel_tick_us;
     const int rc = g_timer_thread->start(&options);
     if (rc != 0) {
         LOG(FATAL) << "Fail to start timer_thread, " << berror(rc);
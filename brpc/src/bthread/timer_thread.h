@@ -43,6 +43,20 @@ struct TimerThreadOptions {
     // Default: ""
     std::string bvar_prefix;
 
+    // Tasks pulled from buckets are kept in a hierarchical timing wheel
+    // instead of a single min-heap, only tasks about to run are moved into
+    // the heap. This makes adding a task O(1) in the timer thread, which
+    // matters when there are lots of pending tasks, e.g. timeouts of
+    // hundreds of thousands of in-flight RPC.
+    // Default: false
+    bool use_timing_wheel;
+
+    // Length of a tick of the timing wheel in microseconds. Tasks are still
+    // run at their precise time, a bigger tick makes the wheel cover a longer
+    // time range with fewer cascades, but puts more tasks into the heap.
+    // Default: 1000
+    int64_t timing_wheel_tick_us;
+
     // Constructed with default options.
     TimerThreadOptions();
 };
@@ -54,6 +68,7 @@ class TimerThread {
 public:
     struct Task;
     class Bucket;
+    class TimingWheel;
 
     typedef uint64_t TaskId;
     const static TaskId INVALID_TASK_ID;
@@ -95,6 +110,7 @@ private:
 
     TimerThreadOptions _options;
     Bucket* _buckets;        // list of tasks to be run
+    TimingWheel* _wheel;     // NULL unless options.use_timing_wheel is true
     FastPthreadMutex _mutex;    // protect _nearest_run_time
     int64_t _nearest_run_time;
     // the futex for wake up timer thread. can't use _nearest_run_time because
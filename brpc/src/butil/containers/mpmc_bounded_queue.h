@@ -0,0 +1,168 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+// A bounded queue which allows multiple threads to push and multiple
+// threads to pop concurrently without locks.
+
+#ifndef BUTIL_MPMC_BOUNDED_QUEUE_H
+#define BUTIL_MPMC_BOUNDED_QUEUE_H
+
+#include <stdlib.h>                          // malloc, free
+#include <new>                               // placement new
+#include "butil/atomicops.h"
+#include "butil/macros.h"
+
+namespace butil {
+
+// Each slot carries a sequence number telling whether the slot is ready
+// for the producer or the consumer of a position, so that threads only
+// contend on the CAS of enqueue/dequeue positions and never wait for each
+// other inside the queue (Dmitry Vyukov's bounded MPMC queue).
+// NOTE: pop() may return false when an element is being pushed into the
+// slot at the head, and push() may return false when an element is being
+// popped from the slot at the tail. Callers must tolerate the spurious
+// empty/full, which is fine for queues paired with wakeups after push.
+template <typename T>
+class MPMCBoundedQueue {
+public:
+    MPMCBoundedQueue()
+        : _cells(NULL)
+        , _mask(0)
+        , _enqueue_pos(0)
+        , _dequeue_pos(0) {}
+
+    ~MPMCBoundedQueue() {
+        if (_cells == NULL) {
+            return;
+        }
+        const size_t enq = _enqueue_pos.load(butil::memory_order_relaxed);
+        for (size_t pos = _dequeue_pos.load(butil::memory_order_relaxed);
+             pos != enq; ++pos) {
+            reinterpret_cast<T*>(_cells[pos & _mask].data)->~T();
+        }
+        for (size_t i = 0; i <= _mask; ++i) {
+            _cells[i].~Cell();
+        }
+        free(_cells);
+        _cells = NULL;
+    }
+
+    // Allocate slots for at least `cap' elements, the capacity is rounded
+    // up to power of 2. Must be called once before other methods.
+    // Returns 0 on success, -1 otherwise.
+    int init(size_t cap) {
+        if (_cells != NULL || cap == 0) {
+            return -1;
+        }
+        size_t n = 1;
+        while (n < cap) {
+            n <<= 1;
+        }
+        _cells = static_cast<Cell*>(malloc(sizeof(Cell) * n));
+        if (_cells == NULL) {
+            return -1;
+        }
+        for (size_t i = 0; i < n; ++i) {
+            new (&_cells[i]) Cell;
+            _cells[i].seq.store(i, butil::memory_order_relaxed);
+        }
+        _mask = n - 1;
+        return 0;
+    }
+
+    // Push `item' into the back of the queue.
+    // Returns false if the queue is full.
+    bool push(const T& item) {
+        Cell* cell;
+        size_t pos = _enqueue_pos.load(butil::memory_order_relaxed);
+        while (true) {
+            cell = &_cells[pos & _mask];
+            const size_t seq = cell->seq.load(butil::memory_order_acquire);
+            const intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+            if (diff == 0) {
+                if (_enqueue_pos.compare_exchange_weak(
+                        pos, pos + 1, butil::memory_order_relaxed)) {
+                    break;
+                }
+            } else if (diff < 0) {
+                return false;
+            } else {
+                pos = _enqueue_pos.load(butil::memory_order_relaxed);
+            }
+        }
+        new (cell->data) T(item);
+        cell->seq.store(pos + 1, butil::memory_order_release);
+        return true;
+    }
+
+    // Pop the front element into `item'.
+    // Returns false if the queue is empty.
+    bool pop(T* item) {
+        Cell* cell;
+        size_t pos = _dequeue_pos.load(butil::memory_order_relaxed);
+        while (true) {
+            cell = &_cells[pos & _mask];
+            const size_t seq = cell->seq.load(butil::memory_order_acquire);
+            const intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+            if (diff == 0) {
+                if (_dequeue_pos.compare_exchange_weak(
+                        pos, pos + 1, butil::memory_order_relaxed)) {
+                    break;
+                }
+            } else if (diff < 0) {
+                return false;
+            } else {
+                pos = _dequeue_pos.load(butil::memory_order_relaxed);
+            }
+        }
+        T* data = reinterpret_cast<T*>(cell->data);
+        *item = *data;
+        data->~T();
+        cell->seq.store(pos + _mask + 1, butil::memory_order_release);
+        return true;
+    }
+
+    // Approximate number of elements, may be stale once returned.
+    size_t size() const {
+        const size_t deq = _dequeue_pos.load(butil::memory_order_relaxed);
+        const size_t enq = _enqueue_pos.load(butil::memory_order_relaxed);
+        return enq > deq ? enq - deq : 0;
+    }
+
+    bool empty() const { return size() == 0; }
+
+    size_t capacity() const { return _cells ? _mask + 1 : 0; }
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(MPMCBoundedQueue);
+
+    struct Cell {
+        butil::atomic<size_t> seq;
+        alignas(T) char data[sizeof(T)];
+    };
+
+    Cell* _cells;
+    size_t _mask;
+    // Separate positions of producers and consumers into different
+    // cachelines.
+    BAIDU_CACHELINE_ALIGNMENT butil::atomic<size_t> _enqueue_pos;
+    BAIDU_CACHELINE_ALIGNMENT butil::atomic<size_t> _dequeue_pos;
+};
+
+}  // namespace butil
+
+#endif  // BUTIL_MPMC_BOUNDED_QUEUE_H
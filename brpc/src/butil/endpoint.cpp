@@ -537,6 +537,10 @@ int tcp_connect(const EndPoint& server, int* self_port, int connect_timeout_ms)
 }
 
 int tcp_listen(EndPoint point) {
+    return tcp_listen(point, false);
+}
+
+int tcp_listen(EndPoint point, bool reuse_port) {
     struct sockaddr_storage serv_addr;
     socklen_t serv_addr_size = 0;
     if (endpoint2sockaddr(point, &serv_addr, &serv_addr_size) != 0) {
@@ -560,12 +564,15 @@ int tcp_listen(EndPoint point) {
 #endif
     }
 
-    if (FLAGS_reuse_port) {
+    if (FLAGS_reuse_port || reuse_port) {
 #if defined(SO_REUSEPORT)
         const int on = 1;
         if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT,
                        &on, sizeof(on)) != 0) {
             LOG(WARNING) << "Fail to setsockopt SO_REUSEPORT of sockfd=" << sockfd;
+            if (reuse_port) {
+                return -1;
+            }
         }
 #else
         LOG(ERROR) << "Missing def of SO_REUSEPORT while -reuse_port is on";
@@ -141,6 +141,9 @@ int tcp_connect(const EndPoint& server, int* self_port, int connect_timeout_ms);
 // To enable SO_REUSEPORT for the whole program, enable gflag -reuse_port
 // Returns the socket descriptor, -1 otherwise and errno is set.
 int tcp_listen(EndPoint ip_and_port);
+// Same as above, but SO_REUSEPORT is always enabled if `reuse_port' is true,
+// and failing to enable it fails the call.
+int tcp_listen(EndPoint ip_and_port, bool reuse_port);
 
 // Get the local end of a socket connection
 int get_local_side(int fd, EndPoint *out);
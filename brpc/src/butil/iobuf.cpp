@@ -31,6 +31,7 @@
 #include <errno.h>                         // errno
 #include <limits.h>                        // CHAR_BIT
 #include <stdexcept>                       // std::invalid_argument
+#include <gflags/gflags.h>
 #include "butil/build_config.h"             // ARCH_CPU_X86_64
 #include "butil/atomicops.h"                // butil::atomic
 #include "butil/thread_local.h"             // thread_atexit
@@ -39,8 +40,25 @@
 #include "butil/fd_guard.h"                 // butil::fd_guard
 #include "butil/iobuf.h"
 #include "butil/iobuf_profiler.h"
+#include "butil/reloadable_flags.h"
 
 namespace butil {
+
+DEFINE_int32(iobuf_max_blocks_per_thread, 8,
+             "Max number of blocks of each size class cached in TLS");
+BUTIL_VALIDATE_GFLAG(iobuf_max_blocks_per_thread, butil::NonNegativeInteger);
+
+DEFINE_bool(iobuf_portal_adaptive_block_size, false,
+            "IOPortal chooses among blocks of IOBuf::SMALL_BLOCK_SIZE, "
+            "IOBuf::DEFAULT_BLOCK_SIZE and IOBuf::LARGE_BLOCK_SIZE according "
+            "to sizes of recent reads");
+BUTIL_VALIDATE_GFLAG(iobuf_portal_adaptive_block_size, butil::PassValidate);
+
+DEFINE_int32(iobuf_portal_max_recycled_blocks, 4,
+             "Max number of full blocks kept by each IOPortal to be reused "
+             "after data inside are consumed, 0 to disable");
+BUTIL_VALIDATE_GFLAG(iobuf_portal_max_recycled_blocks, butil::NonNegativeInteger);
+
 namespace iobuf {
 
 typedef ssize_t (*iov_function)(int fd, const struct iovec *vector,
@@ -356,61 +374,137 @@ inline IOBuf::Block* create_block() {
 }
 
 // === Share TLS blocks between appending operations ===
-// Max number of blocks in each TLS. This is a soft limit namely
-// release_tls_block_chain() may exceed this limit sometimes.
-const int MAX_BLOCKS_PER_THREAD = 8;
+// Blocks cached in TLS are grouped by size classes. share_tls_block() only
+// uses blocks of the default class, while IOPortal may acquire blocks of
+// other classes according to sizes of recent reads.
+enum BlockClass {
+    SMALL_BLOCK_CLASS = 0,
+    DEFAULT_BLOCK_CLASS = 1,
+    LARGE_BLOCK_CLASS = 2,
+    NUM_BLOCK_CLASSES = 3
+};
 
+static const size_t BLOCK_CLASS_SIZES[NUM_BLOCK_CLASSES] = {
+    IOBuf::SMALL_BLOCK_SIZE, IOBuf::DEFAULT_BLOCK_SIZE, IOBuf::LARGE_BLOCK_SIZE
+};
+
+// Blocks in other sizes(e.g. created by IOBufAsZeroCopyOutputStream with
+// a user-specified block_size) are cached as default ones as before.
+inline int block_class_of(const IOBuf::Block* b) {
+    const size_t block_size = b->cap + sizeof(IOBuf::Block);
+    if (block_size == IOBuf::SMALL_BLOCK_SIZE) {
+        return SMALL_BLOCK_CLASS;
+    } else if (block_size == IOBuf::LARGE_BLOCK_SIZE) {
+        return LARGE_BLOCK_CLASS;
+    }
+    return DEFAULT_BLOCK_CLASS;
+}
+
+// Max number of blocks of each class in TLS. This is a soft limit namely
+// release_tls_block_chain() may exceed this limit sometimes.
 inline int max_blocks_per_thread() {
     // If IOBufProfiler is enabled, do not cache blocks in TLS.
-    return IsIOBufProfilerEnabled() ? 0 : MAX_BLOCKS_PER_THREAD;
+    return IsIOBufProfilerEnabled() ? 0 : FLAGS_iobuf_max_blocks_per_thread;
 }
 
 struct TLSData {
-    // Head of the TLS block chain.
-    IOBuf::Block* block_head;
+    // Heads of the TLS block chains, one for each class.
+    IOBuf::Block* block_head[NUM_BLOCK_CLASSES];
     
-    // Number of TLS blocks
-    int num_blocks;
+    // Number of TLS blocks in each chain.
+    int num_blocks[NUM_BLOCK_CLASSES];
     
     // True if the remote_tls_block_chain is registered to the thread.
     bool registered;
+
+    // Blocks got from/not found in TLS which are not added to the global
+    // counters yet.
+    uint32_t num_hits;
+    uint32_t num_misses;
 };
 
-static __thread TLSData g_tls_data = { NULL, 0, false };
+static __thread TLSData g_tls_data = { { NULL, NULL, NULL }, { 0, 0, 0 },
+                                       false, 0, 0 };
 
 // Used in UT
-IOBuf::Block* get_tls_block_head() { return g_tls_data.block_head; }
-int get_tls_block_count() { return g_tls_data.num_blocks; }
+IOBuf::Block* get_tls_block_head() {
+    return g_tls_data.block_head[DEFAULT_BLOCK_CLASS];
+}
+int get_tls_block_count() {
+    return g_tls_data.num_blocks[DEFAULT_BLOCK_CLASS];
+}
 
 // Number of blocks that can't be returned to TLS which has too many block
 // already. This counter should be 0 in most scenarios, otherwise performance
 // of appending functions in IOPortal may be lowered.
 static butil::static_atomic<size_t> g_num_hit_tls_threshold = BUTIL_STATIC_ATOMIC_INIT(0);
 
+// Number of blocks got from TLS and number of blocks created because TLS
+// did not have one. Counted in TLS first to avoid contentions.
+static butil::static_atomic<size_t> g_num_tls_block_hit = BUTIL_STATIC_ATOMIC_INIT(0);
+static butil::static_atomic<size_t> g_num_tls_block_miss = BUTIL_STATIC_ATOMIC_INIT(0);
+static const uint32_t TLS_BLOCK_STAT_FLUSH_INTERVAL = 128;
+
+static void flush_tls_block_stat(TLSData& tls_data) {
+    if (tls_data.num_hits) {
+        g_num_tls_block_hit.fetch_add(tls_data.num_hits,
+                                      butil::memory_order_relaxed);
+        tls_data.num_hits = 0;
+    }
+    if (tls_data.num_misses) {
+        g_num_tls_block_miss.fetch_add(tls_data.num_misses,
+                                       butil::memory_order_relaxed);
+        tls_data.num_misses = 0;
+    }
+}
+
+inline void add_tls_block_stat(TLSData& tls_data, bool hit) {
+    if (hit) {
+        ++tls_data.num_hits;
+    } else {
+        ++tls_data.num_misses;
+    }
+    if (tls_data.num_hits + tls_data.num_misses >=
+        TLS_BLOCK_STAT_FLUSH_INTERVAL) {
+        flush_tls_block_stat(tls_data);
+    }
+}
+
+inline void register_tls_block_chain(TLSData& tls_data) {
+    if (!tls_data.registered) {
+        tls_data.registered = true;
+        // Only register atexit at the first time
+        butil::thread_atexit(remove_tls_block_chain);
+    }
+}
+
 // Called in UT.
 void remove_tls_block_chain() {
     TLSData& tls_data = g_tls_data;
-    IOBuf::Block* b = tls_data.block_head;
-    if (!b) {
-        return;
+    flush_tls_block_stat(tls_data);
+    for (int i = 0; i < NUM_BLOCK_CLASSES; ++i) {
+        IOBuf::Block* b = tls_data.block_head[i];
+        if (!b) {
+            continue;
+        }
+        tls_data.block_head[i] = NULL;
+        int n = 0;
+        do {
+            IOBuf::Block* const saved_next = b->u.portal_next;
+            b->dec_ref();
+            b = saved_next;
+            ++n;
+        } while (b);
+        CHECK_EQ(n, tls_data.num_blocks[i]);
+        tls_data.num_blocks[i] = 0;
     }
-    tls_data.block_head = NULL;
-    int n = 0;
-    do {
-        IOBuf::Block* const saved_next = b->u.portal_next;
-        b->dec_ref();
-        b = saved_next;
-        ++n;
-    } while (b);
-    CHECK_EQ(n, tls_data.num_blocks);
-    tls_data.num_blocks = 0;
 }
 
 // Get a (non-full) block from TLS.
 // Notice that the block is not removed from TLS.
 IOBuf::Block* share_tls_block() {
     TLSData& tls_data = g_tls_data;
-    IOBuf::Block* const b = tls_data.block_head;
+    IOBuf::Block* const b = tls_data.block_head[DEFAULT_BLOCK_CLASS];
     if (b != NULL && !b->full()) {
         return b;
     }
@@ -420,21 +514,22 @@ IOBuf::Block* share_tls_block() {
         while (new_block && new_block->full()) {
             IOBuf::Block* const saved_next = new_block->u.portal_next;
             new_block->dec_ref();
-            --tls_data.num_blocks;
+            --tls_data.num_blocks[DEFAULT_BLOCK_CLASS];
             new_block = saved_next;
         }
-    } else if (!tls_data.registered) {
-        tls_data.registered = true;
-        // Only register atexit at the first time
-        butil::thread_atexit(remove_tls_block_chain);
+    } else {
+        register_tls_block_chain(tls_data);
     }
     if (!new_block) {
         new_block = create_block(); // may be NULL
         if (new_block) {
-            ++tls_data.num_blocks;
+            ++tls_data.num_blocks[DEFAULT_BLOCK_CLASS];
         }
+        add_tls_block_stat(tls_data, false);
+    } else {
+        add_tls_block_stat(tls_data, true);
     }
-    tls_data.block_head = new_block;
+    tls_data.block_head[DEFAULT_BLOCK_CLASS] = new_block;
     return new_block;
 }
 
@@ -444,19 +539,17 @@ inline void release_tls_block(IOBuf::Block* b) {
         return;
     }
     TLSData& tls_data = g_tls_data;
+    const int c = block_class_of(b);
     if (b->full()) {
         b->dec_ref();
-    } else if (tls_data.num_blocks >= max_blocks_per_thread()) {
+    } else if (tls_data.num_blocks[c] >= max_blocks_per_thread()) {
         b->dec_ref();
         g_num_hit_tls_threshold.fetch_add(1, butil::memory_order_relaxed);
     } else {
-        b->u.portal_next = tls_data.block_head;
-        tls_data.block_head = b;
-        ++tls_data.num_blocks;
-        if (!tls_data.registered) {
-            tls_data.registered = true;
-            butil::thread_atexit(remove_tls_block_chain);
-        }
+        b->u.portal_next = tls_data.block_head[c];
+        tls_data.block_head[c] = b;
+        ++tls_data.num_blocks[c];
+        register_tls_block_chain(tls_data);
     }
 }
 
@@ -464,60 +557,86 @@ inline void release_tls_block(IOBuf::Block* b) {
 // NOTE: b MUST be non-NULL and all blocks linked SHOULD not be full.
 void release_tls_block_chain(IOBuf::Block* b) {
     TLSData& tls_data = g_tls_data;
-    size_t n = 0;
-    if (tls_data.num_blocks >= max_blocks_per_thread()) {
-        do {
-            ++n;
-            IOBuf::Block* const saved_next = b->u.portal_next;
+    const int max_blocks = max_blocks_per_thread();
+    // Split the chain by classes and keep the order of blocks.
+    IOBuf::Block* first_b[NUM_BLOCK_CLASSES] = { NULL, NULL, NULL };
+    IOBuf::Block* last_b[NUM_BLOCK_CLASSES] = { NULL, NULL, NULL };
+    int n[NUM_BLOCK_CLASSES] = { 0, 0, 0 };
+    size_t ndropped = 0;
+    do {
+        IOBuf::Block* const saved_next = b->u.portal_next;
+        const int c = block_class_of(b);
+        if (tls_data.num_blocks[c] >= max_blocks) {
             b->dec_ref();
-            b = saved_next;
-        } while (b);
-        g_num_hit_tls_threshold.fetch_add(n, butil::memory_order_relaxed);
-        return;
+            ++ndropped;
+        } else {
+            CHECK(!b->full());
+            b->u.portal_next = NULL;
+            if (last_b[c]) {
+                last_b[c]->u.portal_next = b;
+            } else {
+                first_b[c] = b;
+            }
+            last_b[c] = b;
+            ++n[c];
+        }
+        b = saved_next;
+    } while (b);
+    if (ndropped) {
+        g_num_hit_tls_threshold.fetch_add(ndropped, butil::memory_order_relaxed);
     }
-    IOBuf::Block* first_b = b;
-    IOBuf::Block* last_b = NULL;
-    do {
-        ++n;
-        CHECK(!b->full());
-        if (b->u.portal_next == NULL) {
-            last_b = b;
-            break;
+    for (int i = 0; i < NUM_BLOCK_CLASSES; ++i) {
+        if (first_b[i]) {
+            last_b[i]->u.portal_next = tls_data.block_head[i];
+            tls_data.block_head[i] = first_b[i];
+            tls_data.num_blocks[i] += n[i];
+            register_tls_block_chain(tls_data);
         }
-        b = b->u.portal_next;
-    } while (true);
-    last_b->u.portal_next = tls_data.block_head;
-    tls_data.block_head = first_b;
-    tls_data.num_blocks += n;
-    if (!tls_data.registered) {
-        tls_data.registered = true;
-        butil::thread_atexit(remove_tls_block_chain);
     }
 }
 
-// Get and remove one (non-full) block from TLS. If TLS is empty, create one.
-IOBuf::Block* acquire_tls_block() {
+// Get and remove one (non-full) block of class `c' from TLS. If TLS is
+// empty, create one.
+IOBuf::Block* acquire_tls_block(int c) {
     TLSData& tls_data = g_tls_data;
-    IOBuf::Block* b = tls_data.block_head;
-    if (!b) {
-        return create_block();
-    }
-    while (b->full()) {
+    IOBuf::Block* b = tls_data.block_head[c];
+    while (b && b->full()) {
         IOBuf::Block* const saved_next = b->u.portal_next;
         b->dec_ref();
-        tls_data.block_head = saved_next;
-        --tls_data.num_blocks;
+        tls_data.block_head[c] = saved_next;
+        --tls_data.num_blocks[c];
         b = saved_next;
-        if (!b) {
-            return create_block();
-        }
     }
-    tls_data.block_head = b->u.portal_next;
-    --tls_data.num_blocks;
+    if (!b) {
+        add_tls_block_stat(tls_data, false);
+        return create_block(BLOCK_CLASS_SIZES[c]);
+    }
+    add_tls_block_stat(tls_data, true);
+    tls_data.block_head[c] = b->u.portal_next;
+    --tls_data.num_blocks[c];
     b->u.portal_next = NULL;
     return b;
 }
 
+IOBuf::Block* acquire_tls_block() {
+    return acquire_tls_block(DEFAULT_BLOCK_CLASS);
+}
+
+// Choose the class of blocks for reading `avg_read_size' bytes in average.
+inline int block_class_for_read_size(size_t avg_read_size) {
+    if (!FLAGS_iobuf_portal_adaptive_block_size) {
+        return DEFAULT_BLOCK_CLASS;
+    }
+    if (avg_read_size < IOBuf::SMALL_BLOCK_SIZE - sizeof(IOBuf::Block)) {
+        return SMALL_BLOCK_CLASS;
+    }
+    // Such reads span 4+ default blocks.
+    if (avg_read_size >= IOBuf::LARGE_BLOCK_SIZE / 2) {
+        return LARGE_BLOCK_CLASS;
+    }
+    return DEFAULT_BLOCK_CLASS;
+}
+
 inline IOBuf::BlockRef* acquire_blockref_array(size_t cap) {
     iobuf::g_newbigview.fetch_add(1, butil::memory_order_relaxed);
     return new IOBuf::BlockRef[cap];
@@ -537,6 +656,14 @@ size_t IOBuf::block_count_hit_tls_threshold() {
     return iobuf::g_num_hit_tls_threshold.load(butil::memory_order_relaxed);
 }
 
+size_t IOBuf::tls_block_hit_count() {
+    return iobuf::g_num_tls_block_hit.load(butil::memory_order_relaxed);
+}
+
+size_t IOBuf::tls_block_miss_count() {
+    return iobuf::g_num_tls_block_miss.load(butil::memory_order_relaxed);
+}
+
 BAIDU_CASSERT(sizeof(IOBuf::SmallView) == sizeof(IOBuf::BigView),
               sizeof_small_and_big_view_should_equal);
 
@@ -1618,17 +1745,79 @@ void IOPortal::clear() {
 
 const int MAX_APPEND_IOVEC = 64;
 
-ssize_t IOPortal::pappend_from_file_descriptor(
-    int fd, off_t offset, size_t max_count) {
-    iovec vec[MAX_APPEND_IOVEC];
+// Min and max bytes of IOPortal::_read_budget.
+static const size_t MIN_READ_BUDGET = IOBuf::SMALL_BLOCK_SIZE;
+static const size_t MAX_READ_BUDGET = 1024 * 1024;
+
+IOBuf::Block* IOPortal::acquire_block(int block_class) {
+    // Reuse the recycled block whose data are all released, namely only
+    // referenced by this IOPortal. The acquire-load pairs with the
+    // release-decrement in dec_ref() of other threads.
+    Block* prev = NULL;
+    for (Block* b = _recycled_block; b != NULL; prev = b, b = b->u.portal_next) {
+        if (b->nshared.load(butil::memory_order_acquire) == 1) {
+            if (prev) {
+                prev->u.portal_next = b->u.portal_next;
+            } else {
+                _recycled_block = b->u.portal_next;
+            }
+            b->u.portal_next = NULL;
+            b->size = 0;
+            return b;
+        }
+    }
+    return iobuf::acquire_tls_block(block_class);
+}
+
+void IOPortal::pop_full_block() {
+    Block* const b = _block;
+    _block = b->u.portal_next;
+    const int max_recycled = FLAGS_iobuf_portal_max_recycled_blocks;
+    if (max_recycled <= 0) {
+        b->dec_ref();  // b may be deleted
+        return;
+    }
+    b->u.portal_next = _recycled_block;
+    _recycled_block = b;
+    // Drop the oldest one when there're too many recycled blocks.
+    int n = 1;
+    for (Block* p = b; p->u.portal_next != NULL; p = p->u.portal_next) {
+        if (++n > max_recycled) {
+            Block* const oldest = p->u.portal_next;
+            p->u.portal_next = oldest->u.portal_next;
+            oldest->dec_ref();
+            break;
+        }
+    }
+}
+
+void IOPortal::return_recycled_blocks() {
+    Block* b = _recycled_block;
+    _recycled_block = NULL;
+    while (b) {
+        Block* const saved_next = b->u.portal_next;
+        b->u.portal_next = NULL;
+        if (b->nshared.load(butil::memory_order_acquire) == 1) {
+            // Reusable by others.
+            b->size = 0;
+            iobuf::release_tls_block(b);
+        } else {
+            b->dec_ref();
+        }
+        b = saved_next;
+    }
+}
+
+int IOPortal::prepare_iovec(iovec* vec, size_t max_count, size_t* space_out) {
     int nvec = 0;
     size_t space = 0;
     Block* prev_p = NULL;
     Block* p = _block;
+    const int block_class = iobuf::block_class_for_read_size(_avg_read_size);
     // Prepare at most MAX_APPEND_IOVEC blocks or space of blocks >= max_count
     do {
         if (p == NULL) {
-            p = iobuf::acquire_tls_block();
+            p = acquire_block(block_class);
             if (BAIDU_UNLIKELY(!p)) {
                 errno = ENOMEM;
                 return -1;
@@ -1649,6 +1838,32 @@ ssize_t IOPortal::pappend_from_file_descriptor(
         prev_p = p;
         p = p->u.portal_next;
     } while (1);
+    *space_out = space;
+    return nvec;
+}
+
+void IOPortal::append_read_bytes(size_t nr) {
+    size_t total_len = nr;
+    do {
+        const size_t len = std::min(total_len, _block->left_space());
+        total_len -= len;
+        const IOBuf::BlockRef r = { _block->size, (uint32_t)len, _block };
+        _push_back_ref(r);
+        _block->size += len;
+        if (_block->full()) {
+            pop_full_block();
+        }
+    } while (total_len);
+}
+
+ssize_t IOPortal::pappend_from_file_descriptor(
+    int fd, off_t offset, size_t max_count) {
+    iovec vec[MAX_APPEND_IOVEC];
+    size_t space = 0;
+    const int nvec = prepare_iovec(vec, max_count, &space);
+    if (nvec < 0) {
+        return -1;
+    }
 
     ssize_t nr = 0;
     if (offset < 0) {
@@ -1663,53 +1878,23 @@ ssize_t IOPortal::pappend_from_file_descriptor(
         }
         return nr;
     }
-
-    size_t total_len = nr;
-    do {
-        const size_t len = std::min(total_len, _block->left_space());
-        total_len -= len;
-        const IOBuf::BlockRef r = { _block->size, (uint32_t)len, _block };
-        _push_back_ref(r);
-        _block->size += len;
-        if (_block->full()) {
-            Block* const saved_next = _block->u.portal_next;
-            _block->dec_ref();  // _block may be deleted
-            _block = saved_next;
-        }
-    } while (total_len);
+    update_read_stat(nr, space);
+    append_read_bytes(nr);
     return nr;
 }
 
+ssize_t IOPortal::append_from_socket(int fd, size_t max_count) {
+    return pappend_from_file_descriptor(
+        fd, -1, std::min(max_count, (size_t)_read_budget));
+}
+
 ssize_t IOPortal::append_from_reader(IReader* reader, size_t max_count) {
     iovec vec[MAX_APPEND_IOVEC];
-    int nvec = 0;
     size_t space = 0;
-    Block* prev_p = NULL;
-    Block* p = _block;
-    // Prepare at most MAX_APPEND_IOVEC blocks or space of blocks >= max_count
-    do {
-        if (p == NULL) {
-            p = iobuf::acquire_tls_block();
-            if (BAIDU_UNLIKELY(!p)) {
-                errno = ENOMEM;
-                return -1;
-            }
-            if (prev_p != NULL) {
-                prev_p->u.portal_next = p;
-            } else {
-                _block = p;
-            }
-        }
-        vec[nvec].iov_base = p->data + p->size;
-        vec[nvec].iov_len = std::min(p->left_space(), max_count - space);
-        space += vec[nvec].iov_len;
-        ++nvec;
-        if (space >= max_count || nvec >= MAX_APPEND_IOVEC) {
-            break;
-        }
-        prev_p = p;
-        p = p->u.portal_next;
-    } while (1);
+    const int nvec = prepare_iovec(vec, max_count, &space);
+    if (nvec < 0) {
+        return -1;
+    }
 
     const ssize_t nr = reader->ReadV(vec, nvec);
     if (nr <= 0) {  // -1 or 0
@@ -1718,30 +1903,17 @@ ssize_t IOPortal::append_from_reader(IReader* reader, size_t max_count) {
         }
         return nr;
     }
-
-    size_t total_len = nr;
-    do {
-        const size_t len = std::min(total_len, _block->left_space());
-        total_len -= len;
-        const IOBuf::BlockRef r = { _block->size, (uint32_t)len, _block };
-        _push_back_ref(r);
-        _block->size += len;
-        if (_block->full()) {
-            Block* const saved_next = _block->u.portal_next;
-            _block->dec_ref();  // _block may be deleted
-            _block = saved_next;
-        }
-    } while (total_len);
+    update_read_stat(nr, space);
+    append_read_bytes(nr);
     return nr;
 }
 
-
 ssize_t IOPortal::append_from_SSL_channel(
     SSL* ssl, int* ssl_error, size_t max_count) {
     size_t nr = 0;
     do {
         if (!_block) {
-            _block = iobuf::acquire_tls_block();
+            _block = acquire_block(iobuf::DEFAULT_BLOCK_CLASS);
             if (BAIDU_UNLIKELY(!_block)) {
                 errno = ENOMEM;
                 *ssl_error = SSL_ERROR_SYSCALL;
@@ -1758,9 +1930,7 @@ ssize_t IOPortal::append_from_SSL_channel(
             _push_back_ref(r);
             _block->size += rc;
             if (_block->full()) {
-                Block* const saved_next = _block->u.portal_next;
-                _block->dec_ref();  // _block may be deleted
-                _block = saved_next;
+                pop_full_block();
             }
             nr += rc;
         } else {
@@ -1781,6 +1951,21 @@ ssize_t IOPortal::append_from_SSL_channel(
     return nr;
 }
 
+void IOPortal::update_read_stat(size_t nr, size_t space) {
+    // Moving average which follows changes of message sizes quickly.
+    _avg_read_size = (uint32_t)std::min<size_t>(
+        ((size_t)_avg_read_size * 3 + nr) / 4, UINT32_MAX);
+    size_t budget = _read_budget;
+    if (nr >= space) {
+        // Probably more data to read.
+        budget = std::min(budget * 2, MAX_READ_BUDGET);
+    } else {
+        // Shrink gradually to tolerate occasional short reads.
+        budget = std::max(std::max(nr * 2, budget / 2), MIN_READ_BUDGET);
+    }
+    _read_budget = (uint32_t)budget;
+}
+
 void IOPortal::return_cached_blocks_impl(Block* b) {
     iobuf::release_tls_block_chain(b);
 }
@@ -66,6 +66,10 @@ friend class IOBufBytesIterator;
 friend class IOBufCutter;
 public:
     static const size_t DEFAULT_BLOCK_SIZE = 8192;
+    // Sizes of other block classes cached in TLS, see
+    // -iobuf_portal_adaptive_block_size.
+    static const size_t SMALL_BLOCK_SIZE = 1024;
+    static const size_t LARGE_BLOCK_SIZE = 65536;
     static const size_t INITIAL_CAP = 32; // must be power of 2
 
     struct Block;
@@ -352,6 +356,10 @@ public:
     static size_t block_memory();
     static size_t new_bigview_count();
     static size_t block_count_hit_tls_threshold();
+    // Number of blocks got from TLS caches and number of blocks created
+    // because TLS caches were empty.
+    static size_t tls_block_hit_count();
+    static size_t tls_block_miss_count();
 
     // Equal with a string/IOBuf or not.
     bool equals(const butil::StringPiece&) const;
@@ -447,8 +455,17 @@ inline bool operator!=(const butil::IOBuf& b1, const butil::IOBuf& b2)
 // Typically used as the buffer to store bytes from sockets.
 class IOPortal : public IOBuf {
 public:
-    IOPortal() : _block(NULL) { }
-    IOPortal(const IOPortal& rhs) : IOBuf(rhs), _block(NULL) { } 
+    IOPortal()
+        : _block(NULL)
+        , _avg_read_size(DEFAULT_BLOCK_SIZE / 2)
+        , _read_budget(DEFAULT_BLOCK_SIZE / 2)
+        , _recycled_block(NULL) { }
+    IOPortal(const IOPortal& rhs)
+        : IOBuf(rhs)
+        , _block(NULL)
+        , _avg_read_size(DEFAULT_BLOCK_SIZE / 2)
+        , _read_budget(DEFAULT_BLOCK_SIZE / 2)
+        , _recycled_block(NULL) { }
     ~IOPortal();
     IOPortal& operator=(const IOPortal& rhs);
         
@@ -458,6 +475,14 @@ public:
     // Read at most `max_count' bytes from file descriptor `fd' and
     // append to self.
     ssize_t append_from_file_descriptor(int fd, size_t max_count);
+
+    // Like append_from_file_descriptor(), but bytes read by one call is also
+    // limited by a budget adapting to results of recent reads: the budget
+    // doubles when a read fills it and shrinks towards twice of bytes read
+    // otherwise, so that a connection with little data does not hold blocks
+    // for `max_count' bytes. Callers must read again until EAGAIN or EOF,
+    // as what sockets usually do.
+    ssize_t append_from_socket(int fd, size_t max_count);
  
     // Read at most `max_count' bytes from file descriptor `fd' at a given
     // offset and append to self. The file offset is not changed.
@@ -473,20 +498,47 @@ public:
     void clear();
 
     // Return cached blocks to TLS. This function should be called by users
-    // when this IOPortal are cut into intact messages and becomes empty, to
-    // let continuing code on IOBuf to reuse the blocks. Calling this function
-    // after each call to append_xxx does not make sense and may hurt
-    // performance. Read comments on field `_block' below.
+    // when this IOPortal are cut into intact messages and becomes empty, or
+    // when there's nothing to read for the moment, to let continuing code on
+    // IOBuf to reuse the blocks. Calling this function after each call to
+    // append_xxx does not make sense and may hurt performance. Read comments
+    // on field `_block' below.
     void return_cached_blocks();
 
 private:
     static void return_cached_blocks_impl(Block*);
+    void return_recycled_blocks();
+
+    // Get a block for appending, from recycled blocks preferably.
+    Block* acquire_block(int block_class);
+    // Called when `_block' is full.
+    void pop_full_block();
+
+    // Fill `vec' with space of cached blocks for reading at most
+    // `max_count' bytes. Returns number of iovec filled or -1 on error.
+    int prepare_iovec(iovec* vec, size_t max_count, size_t* space);
+    // Append `nr' bytes which were read into the iovec prepared.
+    void append_read_bytes(size_t nr);
+
+    void update_read_stat(size_t nr, size_t space);
 
     // Cached blocks for appending. Notice that the blocks are released
     // until return_cached_blocks()/clear()/dtor() are called, rather than
     // released after each append_xxx(), which makes messages read from one
     // file descriptor more likely to share blocks and have less BlockRefs.
     Block* _block;
+
+    // Average size of recent reads, deciding the size of blocks to acquire
+    // when -iobuf_portal_adaptive_block_size is on.
+    uint32_t _avg_read_size;
+
+    // Max bytes to read in next append_from_socket().
+    uint32_t _read_budget;
+
+    // Full blocks which will be reused after all data inside are released,
+    // at most -iobuf_portal_max_recycled_blocks ones. Reusing them saves
+    // allocations when messages are consumed as fast as being read.
+    Block* _recycled_block;
 };
 
 // Specialized utility to cut from IOBuf faster than using corresponding
@@ -0,0 +1,490 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+#include <sched.h>                          // sched_getcpu
+#include <stdio.h>                          // fopen
+#include <stdlib.h>                         // malloc, free
+#include <sys/mman.h>                       // mmap, madvise
+#include <sys/syscall.h>                    // __NR_mbind
+#include <unistd.h>                         // syscall
+#include <algorithm>                        // std::min, std::max
+#include <map>
+#include <vector>
+#include <gflags/gflags.h>
+#include "butil/atomicops.h"                // butil::atomic
+#include "butil/build_config.h"             // OS_LINUX
+#include "butil/iobuf.h"
+#include "butil/logging.h"
+#include "butil/scoped_lock.h"
+#include "butil/synchronization/lock.h"
+#include "butil/thread_local.h"             // thread_atexit
+#include "butil/iobuf_arena.h"
+
+namespace butil {
+
+DEFINE_int32(iobuf_arena_size_per_node_mb, 4096,
+             "Size of virtual memory reserved for IOBuf blocks on each "
+             "NUMA node, blocks are allocated by malloc when it's used up");
+DEFINE_bool(iobuf_arena_huge_page, true,
+            "Back the arena of IOBuf blocks with transparent huge pages");
+DEFINE_int32(iobuf_arena_tls_cache_size, 64,
+             "Max number of blocks of each size cached by each thread "
+             "in the arena of IOBuf blocks");
+
+namespace iobuf {
+
+extern void* (*blockmem_allocate)(size_t);
+extern void (*blockmem_deallocate)(void*);
+
+static const size_t ARENA_CHUNK_SIZE = 2 * 1024 * 1024;
+static const int NUM_ARENA_CLASSES = 3;
+static const size_t ARENA_BLOCK_SIZES[NUM_ARENA_CLASSES] = {
+    IOBuf::SMALL_BLOCK_SIZE, IOBuf::DEFAULT_BLOCK_SIZE, IOBuf::LARGE_BLOCK_SIZE
+};
+
+inline int arena_class_of_size(size_t size) {
+    for (int i = 0; i < NUM_ARENA_CLASSES; ++i) {
+        if (size == ARENA_BLOCK_SIZES[i]) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+struct FreeBlock {
+    FreeBlock* next;
+};
+
+// Free blocks of one size in one node.
+struct ArenaFreeList {
+    ArenaFreeList() : head(NULL), cur(NULL), end(NULL), free_bytes(0) {}
+
+    butil::Mutex mutex;
+    FreeBlock* head;
+    // Uncarved part of the chunk being carved.
+    char* cur;
+    char* end;
+    // Bytes of free blocks and the uncarved part, for statistics.
+    butil::atomic<size_t> free_bytes;
+};
+
+struct ArenaNode {
+    ArenaNode() : begin(NULL), carved(0) {}
+
+    char* begin;
+    // Offset of the next chunk to carve, may exceed size of the node.
+    butil::atomic<size_t> carved;
+    ArenaFreeList lists[NUM_ARENA_CLASSES];
+};
+
+struct ArenaTLSCache {
+    FreeBlock* head[NUM_ARENA_CLASSES];
+    int nblock[NUM_ARENA_CLASSES];
+    // Node of the cached blocks, -1 when nothing is cached.
+    int node;
+    bool registered;
+};
+
+static __thread ArenaTLSCache tls_arena_cache = {
+    { NULL, NULL, NULL }, { 0, 0, 0 }, -1, false };
+
+#if defined(OS_LINUX)
+static bool parse_cpu_list(const char* str, std::vector<int>* cpus) {
+    while (*str != '\0' && *str != '\n') {
+        char* end = NULL;
+        const long first = strtol(str, &end, 10);
+        if (end == str || first < 0) {
+            return false;
+        }
+        long last = first;
+        str = end;
+        if (*str == '-') {
+            ++str;
+            last = strtol(str, &end, 10);
+            if (end == str || last < first) {
+                return false;
+            }
+            str = end;
+        }
+        for (long i = first; i <= last; ++i) {
+            cpus->push_back(i);
+        }
+        if (*str == ',') {
+            ++str;
+        }
+    }
+    return true;
+}
+#endif
+
+class IOBufArena {
+public:
+    IOBufArena()
+        : _base(NULL), _node_size(0), _nnode(0), _nodes(NULL)
+        , _chunk_classes(NULL), _fallback_count(0) {}
+
+    int init();
+    void* allocate(size_t size);
+    void deallocate(void* mem);
+    int node_count() const { return _nnode; }
+    void get_stat(int node, ArenaStat* stat) const;
+
+    // Give cached blocks of this thread back to their node.
+    void flush_tls_cache();
+
+private:
+    int current_node() const;
+    void* allocate_from_node(int node, int c);
+    void push_to_node(int node, int c, FreeBlock* head, FreeBlock* tail, int n);
+
+    char* _base;
+    size_t _node_size;
+    int _nnode;
+    ArenaNode* _nodes;
+    // Class(+1) of each carved chunk, 0 for chunks not carved yet.
+    butil::atomic<uint8_t>* _chunk_classes;
+    // Map from cpu to the index of node.
+    std::vector<int> _cpu_nodes;
+    butil::atomic<size_t> _fallback_count;
+};
+
+static IOBufArena* g_arena = NULL;
+static pthread_once_t g_arena_once = PTHREAD_ONCE_INIT;
+static int g_arena_init_rc = -1;
+
+static void flush_arena_tls_cache() {
+    if (g_arena) {
+        g_arena->flush_tls_cache();
+    }
+}
+
+int IOBufArena::init() {
+    // Node ids present in sysfs, machines without NUMA(or sysfs) are
+    // treated as one node.
+    std::vector<int> node_ids;
+#if defined(OS_LINUX)
+    std::map<int, std::vector<int> > node_cpus;
+    for (int node = 0; node < CPU_SETSIZE; ++node) {
+        char path[64];
+        snprintf(path, sizeof(path),
+                 "/sys/devices/system/node/node%d/cpulist", node);
+        FILE* fp = fopen(path, "r");
+        if (fp == NULL) {
+            continue;
+        }
+        char buf[4096];
+        std::vector<int> cpus;
+        if (fgets(buf, sizeof(buf), fp) != NULL &&
+            parse_cpu_list(buf, &cpus) && !cpus.empty()) {
+            node_cpus[node].swap(cpus);
+        }
+        fclose(fp);
+    }
+    _cpu_nodes.assign(CPU_SETSIZE, 0);
+    for (std::map<int, std::vector<int> >::const_iterator
+             it = node_cpus.begin(); it != node_cpus.end(); ++it) {
+        for (size_t i = 0; i < it->second.size(); ++i) {
+            if (it->second[i] < CPU_SETSIZE) {
+                _cpu_nodes[it->second[i]] = node_ids.size();
+            }
+        }
+        node_ids.push_back(it->first);
+    }
+#endif
+    _nnode = std::max((int)node_ids.size(), 1);
+
+    _node_size = (size_t)FLAGS_iobuf_arena_size_per_node_mb * 1024 * 1024
+        / ARENA_CHUNK_SIZE * ARENA_CHUNK_SIZE;
+    if (_node_size == 0) {
+        LOG(ERROR) << "Invalid iobuf_arena_size_per_node_mb="
+                   << FLAGS_iobuf_arena_size_per_node_mb;
+        return -1;
+    }
+    const size_t total_size = _node_size * _nnode;
+    // Reserve more to align the range with huge pages(and chunks).
+    const size_t mapped_size = total_size + ARENA_CHUNK_SIZE;
+    int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+#if defined(MAP_NORESERVE)
+    flags |= MAP_NORESERVE;
+#endif
+    void* mem = mmap(NULL, mapped_size, (PROT_READ | PROT_WRITE), flags, -1, 0);
+    if (MAP_FAILED == mem) {
+        PLOG(ERROR) << "Fail to mmap size=" << mapped_size
+                    << " for arena of IOBuf blocks";
+        return -1;
+    }
+    _base = (char*)(((uintptr_t)mem + ARENA_CHUNK_SIZE - 1) &
+                    ~(ARENA_CHUNK_SIZE - 1));
+    if (_base != mem) {
+        munmap(mem, _base - (char*)mem);
+    }
+    const size_t tail = (char*)mem + mapped_size - (_base + total_size);
+    if (tail) {
+        munmap(_base + total_size, tail);
+    }
+#if defined(MADV_HUGEPAGE)
+    if (FLAGS_iobuf_arena_huge_page &&
+        madvise(_base, total_size, MADV_HUGEPAGE) != 0) {
+        PLOG(WARNING) << "Fail to madvise MADV_HUGEPAGE";
+    }
+#endif
+#if defined(OS_LINUX) && defined(__NR_mbind)
+    if (node_ids.size() > 1) {
+        // Prefer(rather than bind to) the node so that allocations do not
+        // fail when the node is short of memory. 1 is MPOL_PREFERRED.
+        const int MPOL_PREFERRED_MODE = 1;
+        const size_t MAX_NODES = 1024;
+        for (size_t i = 0; i < node_ids.size(); ++i) {
+            if ((size_t)node_ids[i] >= MAX_NODES) {
+                continue;
+            }
+            unsigned long nodemask[MAX_NODES / (8 * sizeof(unsigned long))] = {};
+            nodemask[node_ids[i] / (8 * sizeof(unsigned long))] |=
+                1UL << (node_ids[i] % (8 * sizeof(unsigned long)));
+            if (syscall(__NR_mbind, _base + i * _node_size, _node_size,
+                        MPOL_PREFERRED_MODE, nodemask, MAX_NODES + 1, 0) != 0) {
+                PLOG(WARNING) << "Fail to bind arena of IOBuf blocks to node="
+                              << node_ids[i];
+            }
+        }
+    }
+#endif
+    _nodes = new ArenaNode[_nnode];
+    for (int i = 0; i < _nnode; ++i) {
+        _nodes[i].begin = _base + i * _node_size;
+    }
+    const size_t nchunk = total_size / ARENA_CHUNK_SIZE;
+    _chunk_classes = new butil::atomic<uint8_t>[nchunk];
+    for (size_t i = 0; i < nchunk; ++i) {
+        _chunk_classes[i].store(0, butil::memory_order_relaxed);
+    }
+    LOG(INFO) << "Reserved " << total_size << " bytes on " << _nnode
+              << " NUMA node(s) for arena of IOBuf blocks";
+    return 0;
+}
+
+int IOBufArena::current_node() const {
+#if defined(OS_LINUX)
+    if (_nnode > 1) {
+        const int cpu = sched_getcpu();
+        if (cpu >= 0 && (size_t)cpu < _cpu_nodes.size()) {
+            return _cpu_nodes[cpu];
+        }
+    }
+#endif
+    return 0;
+}
+
+void* IOBufArena::allocate_from_node(int node, int c) {
+    ArenaNode& n = _nodes[node];
+    ArenaFreeList& fl = n.lists[c];
+    const size_t block_size = ARENA_BLOCK_SIZES[c];
+    BAIDU_SCOPED_LOCK(fl.mutex);
+    if (fl.head) {
+        FreeBlock* b = fl.head;
+        fl.head = b->next;
+        fl.free_bytes.store(fl.free_bytes.load(butil::memory_order_relaxed)
+                            - block_size, butil::memory_order_relaxed);
+        return b;
+    }
+    if (fl.cur == fl.end) {
+        const size_t offset =
+            n.carved.fetch_add(ARENA_CHUNK_SIZE, butil::memory_order_relaxed);
+        if (offset + ARENA_CHUNK_SIZE > _node_size) {
+            return NULL;
+        }
+        char* chunk = n.begin + offset;
+        _chunk_classes[(chunk - _base) / ARENA_CHUNK_SIZE].store(
+            c + 1, butil::memory_order_release);
+        fl.cur = chunk;
+        fl.end = chunk + ARENA_CHUNK_SIZE;
+        fl.free_bytes.store(fl.free_bytes.load(butil::memory_order_relaxed)
+                            + ARENA_CHUNK_SIZE, butil::memory_order_relaxed);
+    }
+    void* mem = fl.cur;
+    fl.cur += block_size;
+    fl.free_bytes.store(fl.free_bytes.load(butil::memory_order_relaxed)
+                        - block_size, butil::memory_order_relaxed);
+    return mem;
+}
+
+void IOBufArena::push_to_node(int node, int c, FreeBlock* head,
+                              FreeBlock* tail, int n) {
+    ArenaFreeList& fl = _nodes[node].lists[c];
+    BAIDU_SCOPED_LOCK(fl.mutex);
+    tail->next = fl.head;
+    fl.head = head;
+    fl.free_bytes.store(fl.free_bytes.load(butil::memory_order_relaxed)
+                        + n * ARENA_BLOCK_SIZES[c], butil::memory_order_relaxed);
+}
+
+void* IOBufArena::allocate(size_t size) {
+    const int c = arena_class_of_size(size);
+    if (c < 0) {
+        _fallback_count.fetch_add(1, butil::memory_order_relaxed);
+        return ::malloc(size);
+    }
+    const int node = current_node();
+    ArenaTLSCache& tc = tls_arena_cache;
+    if (tc.node != node) {
+        // The thread was migrated to another node.
+        flush_tls_cache();
+        tc.node = node;
+        if (!tc.registered) {
+            tc.registered = true;
+            butil::thread_atexit(flush_arena_tls_cache);
+        }
+    }
+    FreeBlock* b = tc.head[c];
+    if (b) {
+        tc.head[c] = b->next;
+        --tc.nblock[c];
+        return b;
+    }
+    void* mem = allocate_from_node(node, c);
+    if (mem == NULL) {
+        _fallback_count.fetch_add(1, butil::memory_order_relaxed);
+        return ::malloc(size);
+    }
+    return mem;
+}
+
+void IOBufArena::deallocate(void* mem) {
+    char* const p = (char*)mem;
+    if (p < _base || p >= _base + _node_size * _nnode) {
+        return ::free(mem);
+    }
+    const int node = (p - _base) / _node_size;
+    const int c = _chunk_classes[(p - _base) / ARENA_CHUNK_SIZE].load(
+        butil::memory_order_acquire) - 1;
+    FreeBlock* b = (FreeBlock*)mem;
+    ArenaTLSCache& tc = tls_arena_cache;
+    if (node != tc.node) {
+        // Freed by a thread of another node.
+        return push_to_node(node, c, b, b, 1);
+    }
+    if (tc.nblock[c] >= FLAGS_iobuf_arena_tls_cache_size) {
+        // Return half of the cached blocks to the node in one batch.
+        const int n = tc.nblock[c] / 2;
+        if (n > 0) {
+            FreeBlock* head = tc.head[c];
+            FreeBlock* tail = head;
+            for (int i = 1; i < n; ++i) {
+                tail = tail->next;
+            }
+            tc.head[c] = tail->next;
+            tc.nblock[c] -= n;
+            push_to_node(node, c, head, tail, n);
+        }
+        if (tc.nblock[c] >= FLAGS_iobuf_arena_tls_cache_size) {
+            return push_to_node(node, c, b, b, 1);
+        }
+    }
+    b->next = tc.head[c];
+    tc.head[c] = b;
+    ++tc.nblock[c];
+}
+
+void IOBufArena::flush_tls_cache() {
+    ArenaTLSCache& tc = tls_arena_cache;
+    if (tc.node < 0) {
+        return;
+    }
+    for (int c = 0; c < NUM_ARENA_CLASSES; ++c) {
+        FreeBlock* head = tc.head[c];
+        if (head == NULL) {
+            continue;
+        }
+        FreeBlock* tail = head;
+        while (tail->next) {
+            tail = tail->next;
+        }
+        push_to_node(tc.node, c, head, tail, tc.nblock[c]);
+        tc.head[c] = NULL;
+        tc.nblock[c] = 0;
+    }
+    tc.node = -1;
+}
+
+void IOBufArena::get_stat(int node, ArenaStat* stat) const {
+    stat->carved_bytes = 0;
+    stat->used_bytes = 0;
+    stat->fallback_count = _fallback_count.load(butil::memory_order_relaxed);
+    for (int i = 0; i < _nnode; ++i) {
+        if (node >= 0 && node != i) {
+            continue;
+        }
+        const size_t carved = std::min(
+            _nodes[i].carved.load(butil::memory_order_relaxed), _node_size);
+        size_t free_bytes = 0;
+        for (int c = 0; c < NUM_ARENA_CLASSES; ++c) {
+            free_bytes += _nodes[i].lists[c].free_bytes.load(
+                butil::memory_order_relaxed);
+        }
+        stat->carved_bytes += carved;
+        // Blocks cached by threads are counted as used.
+        stat->used_bytes += (carved > free_bytes ? carved - free_bytes : 0);
+    }
+}
+
+static void* arena_allocate(size_t size) {
+    return g_arena->allocate(size);
+}
+
+static void arena_deallocate(void* mem) {
+    g_arena->deallocate(mem);
+}
+
+static void init_arena_allocator() {
+    IOBufArena* arena = new IOBufArena;
+    if (arena->init() != 0) {
+        delete arena;
+        return;
+    }
+    g_arena = arena;
+    // Blocks allocated by previous hooks are freed by free() in
+    // arena_deallocate().
+    blockmem_deallocate = arena_deallocate;
+    blockmem_allocate = arena_allocate;
+    g_arena_init_rc = 0;
+}
+
+int enable_arena_allocator() {
+    pthread_once(&g_arena_once, init_arena_allocator);
+    return g_arena_init_rc;
+}
+
+bool is_arena_allocator_enabled() {
+    return g_arena != NULL;
+}
+
+int arena_node_count() {
+    return g_arena ? g_arena->node_count() : 0;
+}
+
+void get_arena_stat(int node, ArenaStat* stat) {
+    if (g_arena) {
+        g_arena->get_stat(node, stat);
+    } else {
+        stat->carved_bytes = 0;
+        stat->used_bytes = 0;
+        stat->fallback_count = 0;
+    }
+}
+
+}  // namespace iobuf
+}  // namespace butil
@@ -0,0 +1,70 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+#ifndef BUTIL_IOBUF_ARENA_H
+#define BUTIL_IOBUF_ARENA_H
+
+#include <stddef.h>
+
+namespace butil {
+namespace iobuf {
+
+// An allocator of IOBuf blocks which replaces the default malloc/free
+// hooks(blockmem_allocate/blockmem_deallocate).
+//
+// A contiguous range of virtual memory is reserved for each NUMA node and
+// bound to the node, backed by transparent huge pages optionally. Blocks
+// of IOBuf::SMALL_BLOCK_SIZE, IOBuf::DEFAULT_BLOCK_SIZE and
+// IOBuf::LARGE_BLOCK_SIZE are carved out of 2MB chunks of the range of the
+// node on which the allocating thread runs. A freed block always goes back
+// to the node owning it, no matter which thread frees it, so that memory
+// of blocks does not drift across nodes. Each thread caches a few blocks
+// of its current node to avoid contentions on the free lists.
+//
+// Blocks in other sizes, or allocated after the range of the node is used
+// up, fall back to malloc.
+//
+// The allocator can be enabled at any time since blocks not in the arena
+// are freed by free(), but it can't be disabled once enabled. Don't call
+// reset_blockmem_allocate_and_deallocate() after enabling it.
+
+// Install the arena as the allocator of IOBuf blocks.
+// Returns 0 on success(or already enabled), -1 otherwise.
+int enable_arena_allocator();
+
+bool is_arena_allocator_enabled();
+
+// Number of NUMA nodes of the arena, 0 when the arena is not enabled.
+int arena_node_count();
+
+struct ArenaStat {
+    // Bytes of chunks carved from the reserved range.
+    size_t carved_bytes;
+    // Bytes of blocks being used by IOBuf.
+    size_t used_bytes;
+    // Number of blocks allocated by malloc because they can't be carved
+    // from the arena.
+    size_t fallback_count;
+};
+
+// Get statistics of `node', or all nodes when `node' is negative.
+void get_arena_stat(int node, ArenaStat* stat);
+
+}  // namespace iobuf
+}  // namespace butil
+
+#endif  // BUTIL_IOBUF_ARENA_H
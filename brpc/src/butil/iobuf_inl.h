@@ -50,6 +50,9 @@ inline void IOPortal::return_cached_blocks() {
         return_cached_blocks_impl(_block);
         _block = NULL;
     }
+    if (_recycled_block) {
+        return_recycled_blocks();
+    }
 }
 
 inline void reset_block_ref(IOBuf::BlockRef& ref) {
@@ -0,0 +1,146 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+#include <stdlib.h>                     // strtoll
+#include <math.h>                       // ceil
+#include "butil/logging.h"
+#include "bvar/detail/histogram.h"
+
+namespace bvar {
+namespace detail {
+
+void HistogramSamples::merge(const HistogramSamples& rhs) {
+    _num_added += rhs._num_added;
+    _sum += rhs._sum;
+    for (size_t i = 0; i < HISTOGRAM_NUM_BUCKETS; ++i) {
+        _counts[i] += rhs._counts[i];
+    }
+}
+
+void HistogramSamples::remove(const HistogramSamples& rhs) {
+    _num_added -= rhs._num_added;
+    _sum -= rhs._sum;
+    for (size_t i = 0; i < HISTOGRAM_NUM_BUCKETS; ++i) {
+        _counts[i] -= rhs._counts[i];
+    }
+}
+
+int64_t HistogramSamples::get_number(double ratio) const {
+    uint64_t n = (uint64_t)ceil(ratio * _num_added);
+    if (n > _num_added) {
+        n = _num_added;
+    } else if (n == 0) {
+        return 0;
+    }
+    for (size_t i = 0; i < HISTOGRAM_NUM_BUCKETS; ++i) {
+        if (n <= _counts[i]) {
+            const int64_t lower = histogram_bucket_lower_bound(i);
+            return lower + (histogram_bucket_upper_bound(i) - lower + 1) / 2;
+        }
+        n -= _counts[i];
+    }
+    // _num_added and _counts are loaded from different atomics of agents
+    // and may be slightly inconsistent.
+    return histogram_bucket_upper_bound(HISTOGRAM_NUM_BUCKETS - 1);
+}
+
+void HistogramSamples::describe(std::ostream& os) const {
+    os << "{\"count\":" << _num_added << ",\"sum\":" << _sum
+       << ",\"buckets\":[";
+    bool first = true;
+    for (size_t i = 0; i < HISTOGRAM_NUM_BUCKETS; ++i) {
+        if (_counts[i] == 0) {
+            continue;
+        }
+        if (!first) {
+            os << ',';
+        }
+        first = false;
+        os << '[' << histogram_bucket_upper_bound(i) << ',' << _counts[i] << ']';
+    }
+    os << "]}";
+}
+
+// Consume `expected' at the front of `*s'.
+static bool consume(butil::StringPiece* s, const butil::StringPiece& expected) {
+    if (!s->starts_with(expected)) {
+        return false;
+    }
+    s->remove_prefix(expected.size());
+    return true;
+}
+
+// Consume a decimal integer at the front of `*s'.
+static bool consume_integer(butil::StringPiece* s, int64_t* value) {
+    // The string is not always null-terminated, copy digits out.
+    char buf[24];
+    size_t len = 0;
+    while (len < s->size() && len + 1 < sizeof(buf) &&
+           ((*s)[len] == '-' || ((*s)[len] >= '0' && (*s)[len] <= '9'))) {
+        buf[len] = (*s)[len];
+        ++len;
+    }
+    if (len == 0) {
+        return false;
+    }
+    buf[len] = '\0';
+    char* endptr = NULL;
+    *value = strtoll(buf, &endptr, 10);
+    if (endptr != buf + len) {
+        return false;
+    }
+    s->remove_prefix(len);
+    return true;
+}
+
+int HistogramSamples::parse(const butil::StringPiece& str) {
+    HistogramSamples tmp;
+    butil::StringPiece s = str;
+    int64_t count = 0;
+    if (!consume(&s, "{\"count\":") || !consume_integer(&s, &count) ||
+        !consume(&s, ",\"sum\":") || !consume_integer(&s, &tmp._sum) ||
+        !consume(&s, ",\"buckets\":[")) {
+        return -1;
+    }
+    while (!consume(&s, "]}")) {
+        if (tmp._num_added != 0 && !consume(&s, ",")) {
+            return -1;
+        }
+        int64_t upper = 0;
+        int64_t n = 0;
+        if (!consume(&s, "[") || !consume_integer(&s, &upper) ||
+            !consume(&s, ",") || !consume_integer(&s, &n) ||
+            !consume(&s, "]") || n <= 0) {
+            return -1;
+        }
+        const size_t index = histogram_bucket_index(upper);
+        if (histogram_bucket_upper_bound(index) != upper) {
+            // Not produced by the same bucket layout.
+            return -1;
+        }
+        tmp._counts[index] += n;
+        tmp._num_added += n;
+    }
+    if (!s.empty() || (uint64_t)count != tmp._num_added) {
+        return -1;
+    }
+    *this = tmp;
+    return 0;
+}
+
+}  // namespace detail
+}  // namespace bvar
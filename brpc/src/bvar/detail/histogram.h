@@ -0,0 +1,192 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+#ifndef  BVAR_DETAIL_HISTOGRAM_H
+#define  BVAR_DETAIL_HISTOGRAM_H
+
+#include <stdint.h>                     // uint64_t
+#include <string.h>                     // memset
+#include <ostream>                      // std::ostream
+#include "butil/macros.h"               // BAIDU_CASSERT
+#include "butil/atomicops.h"            // butil::atomic
+#include "butil/strings/string_piece.h" // butil::StringPiece
+#include "bvar/detail/combiner.h"       // ElementContainer
+
+namespace bvar {
+namespace detail {
+
+// Buckets of HistogramSamples are log-linear (as in HdrHistogram): values
+// in [0, 16) have one bucket each, every [2^e, 2^(e+1)) for e >= 4 is split
+// into 16 buckets of equal width. The layout is fixed so that histograms
+// from different threads or processes are merged by simply adding up counts
+// of buckets, without losing any precision. Values are clamped into
+// [0, 2^32) which is what Percentile accepts as well.
+// Any value read from a HistogramSamples lies in the same bucket as the
+// exact one, the midpoint of the bucket is returned, thus the relative error
+// is less than 1/32.
+static const size_t HISTOGRAM_SUB_BUCKET_BITS = 4;
+static const size_t HISTOGRAM_SUB_BUCKET_COUNT = 1 << HISTOGRAM_SUB_BUCKET_BITS;
+static const size_t HISTOGRAM_MAX_VALUE_BITS = 32;
+static const size_t HISTOGRAM_NUM_BUCKETS = HISTOGRAM_SUB_BUCKET_COUNT *
+    (HISTOGRAM_MAX_VALUE_BITS - HISTOGRAM_SUB_BUCKET_BITS + 1);
+
+// Index of the bucket that `value' belongs to.
+inline size_t histogram_bucket_index(int64_t value) {
+    if (value < (int64_t)HISTOGRAM_SUB_BUCKET_COUNT) {
+        return value > 0 ? (size_t)value : 0;
+    }
+    if (value >= (1LL << HISTOGRAM_MAX_VALUE_BITS)) {
+        return HISTOGRAM_NUM_BUCKETS - 1;
+    }
+    const size_t e = 63 - __builtin_clzll((uint64_t)value);
+    const size_t shift = e - HISTOGRAM_SUB_BUCKET_BITS;
+    return (shift + 1) * HISTOGRAM_SUB_BUCKET_COUNT +
+        (((uint64_t)value >> shift) - HISTOGRAM_SUB_BUCKET_COUNT);
+}
+
+// Smallest value inside the bucket at `index'.
+inline int64_t histogram_bucket_lower_bound(size_t index) {
+    if (index < HISTOGRAM_SUB_BUCKET_COUNT) {
+        return index;
+    }
+    const size_t shift = index / HISTOGRAM_SUB_BUCKET_COUNT - 1;
+    const size_t sub = index % HISTOGRAM_SUB_BUCKET_COUNT;
+    return (int64_t)(HISTOGRAM_SUB_BUCKET_COUNT + sub) << shift;
+}
+
+// Largest value inside the bucket at `index'.
+inline int64_t histogram_bucket_upper_bound(size_t index) {
+    if (index + 1 >= HISTOGRAM_NUM_BUCKETS) {
+        return (1LL << HISTOGRAM_MAX_VALUE_BITS) - 1;
+    }
+    return histogram_bucket_lower_bound(index + 1) - 1;
+}
+
+// Counts of values in buckets. Unlike PercentileSamples which keeps limited
+// samples, the memory is fixed and merging is exact.
+class HistogramSamples {
+public:
+    HistogramSamples() { memset(this, 0, sizeof(*this)); }
+
+    // Add one value.
+    void add(int64_t value) {
+        ++_counts[histogram_bucket_index(value)];
+        ++_num_added;
+        _sum += value;
+    }
+
+    // Add counts in `rhs'.
+    void merge(const HistogramSamples& rhs);
+
+    // Remove counts in `rhs' which must be merged into this before.
+    void remove(const HistogramSamples& rhs);
+
+    // Get the `ratio'-ile value. E.g. 0.99 means 99%-ile value.
+    int64_t get_number(double ratio) const;
+
+    // #values added.
+    uint64_t count() const { return _num_added; }
+
+    // Sum of values added.
+    int64_t sum() const { return _sum; }
+
+    // #values inside the bucket at `index'.
+    uint64_t bucket_count(size_t index) const { return _counts[index]; }
+
+    // Print as {"count":N,"sum":S,"buckets":[[U,C],...]}, U is the largest
+    // value inside a non-empty bucket and C is the #values inside.
+    void describe(std::ostream& os) const;
+
+    // Parse output of describe(), possibly from another process, so that
+    // histograms are mergeable after being exported.
+    // Returns 0 on success, -1 otherwise.
+    int parse(const butil::StringPiece& str);
+
+    bool operator==(const HistogramSamples& rhs) const {
+        return _num_added == rhs._num_added && _sum == rhs._sum &&
+            memcmp(_counts, rhs._counts, sizeof(_counts)) == 0;
+    }
+
+private:
+friend class ElementContainer<HistogramSamples>;
+
+    uint64_t _num_added;
+    int64_t _sum;
+    uint64_t _counts[HISTOGRAM_NUM_BUCKETS];
+};
+
+inline std::ostream& operator<<(std::ostream& os, const HistogramSamples& s) {
+    s.describe(os);
+    return os;
+}
+
+// Thread-local HistogramSamples whose fields are all atomic. Adding a value
+// is done with relaxed atomic additions by the owner thread and does not
+// contend with AgentCombiner reading or resetting the element, so the
+// butil::Lock of the generic ElementContainer is unnecessary.
+template <>
+class ElementContainer<HistogramSamples> {
+public:
+    ElementContainer() {
+        _sum.store(0, butil::memory_order_relaxed);
+        for (size_t i = 0; i < HISTOGRAM_NUM_BUCKETS; ++i) {
+            _counts[i].store(0, butil::memory_order_relaxed);
+        }
+    }
+
+    void load(HistogramSamples* out) {
+        out->_num_added = 0;
+        out->_sum = _sum.load(butil::memory_order_relaxed);
+        for (size_t i = 0; i < HISTOGRAM_NUM_BUCKETS; ++i) {
+            out->_counts[i] = _counts[i].load(butil::memory_order_relaxed);
+            out->_num_added += out->_counts[i];
+        }
+    }
+
+    void store(const HistogramSamples& new_value) {
+        _sum.store(new_value._sum, butil::memory_order_relaxed);
+        for (size_t i = 0; i < HISTOGRAM_NUM_BUCKETS; ++i) {
+            _counts[i].store(new_value._counts[i], butil::memory_order_relaxed);
+        }
+    }
+
+    void exchange(HistogramSamples* prev, const HistogramSamples& new_value) {
+        prev->_num_added = 0;
+        prev->_sum = _sum.exchange(new_value._sum, butil::memory_order_relaxed);
+        for (size_t i = 0; i < HISTOGRAM_NUM_BUCKETS; ++i) {
+            prev->_counts[i] = _counts[i].exchange(
+                new_value._counts[i], butil::memory_order_relaxed);
+            prev->_num_added += prev->_counts[i];
+        }
+    }
+
+    // [Unique]
+    void add(int64_t value) {
+        _counts[histogram_bucket_index(value)].fetch_add(
+            1, butil::memory_order_relaxed);
+        _sum.fetch_add(value, butil::memory_order_relaxed);
+    }
+
+private:
+    butil::atomic<int64_t> _sum;
+    butil::atomic<uint64_t> _counts[HISTOGRAM_NUM_BUCKETS];
+};
+
+}  // namespace detail
+}  // namespace bvar
+
+#endif  //BVAR_DETAIL_HISTOGRAM_H
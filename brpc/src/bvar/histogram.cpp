@@ -0,0 +1,48 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+#include "butil/logging.h"
+#include "bvar/histogram.h"
+
+namespace bvar {
+
+Histogram::~Histogram() {
+    // Calling hide() manually is a MUST required by Variable.
+    hide();
+    if (_sampler) {
+        _sampler->destroy();
+        _sampler = NULL;
+    }
+}
+
+Histogram& Histogram::operator<<(int64_t value) {
+    if (BAIDU_UNLIKELY(value < 0)) {
+        LOG_EVERY_SECOND(WARNING) << "Input=" << value << " to `" << name()
+                                  << "' is negative, drop";
+        return *this;
+    }
+    // Wait-free unless the thread adds value for the first time.
+    agent_type* agent = _combiner.get_or_create_tls_agent();
+    if (BAIDU_UNLIKELY(!agent)) {
+        LOG(FATAL) << "Fail to create agent";
+        return *this;
+    }
+    agent->element.add(value);
+    return *this;
+}
+
+}  // namespace bvar
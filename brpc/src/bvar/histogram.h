@@ -0,0 +1,120 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+#ifndef  BVAR_HISTOGRAM_H
+#define  BVAR_HISTOGRAM_H
+
+#include "bvar/variable.h"
+#include "bvar/detail/combiner.h"
+#include "bvar/detail/sampler.h"
+#include "bvar/detail/histogram.h"
+
+namespace bvar {
+namespace detail {
+
+struct AddHistogramSamples {
+    void operator()(HistogramSamples& s1, const HistogramSamples& s2) const {
+        s1.merge(s2);
+    }
+};
+
+struct MinusHistogramSamples {
+    void operator()(HistogramSamples& s1, const HistogramSamples& s2) const {
+        s1.remove(s2);
+    }
+};
+
+}  // namespace detail
+
+// Count non-negative values (typically latencies) into fixed log-linear
+// buckets, see detail/histogram.h for the layout and the error bound.
+// Compared to the sampled percentiles of LatencyRecorder, tail percentiles
+// like 99.99% are stable and histograms of different processes can be merged
+// exactly by adding up the buckets, e.g. by Prometheus.
+// The value is cumulative, use Window<> for recent values:
+//   bvar::Histogram h("foo_latency_histogram");
+//   bvar::Window<bvar::Histogram> w(&h, 60);
+//   h << 23 << 300;
+//   ...
+//   LOG(INFO) << w.get_value().get_number(0.9999);
+class Histogram : public Variable {
+public:
+    typedef detail::HistogramSamples value_type;
+    typedef detail::AgentCombiner<value_type, value_type,
+                                  detail::AddHistogramSamples> combiner_type;
+    typedef combiner_type::Agent agent_type;
+    typedef detail::ReducerSampler<Histogram, value_type,
+                                   detail::AddHistogramSamples,
+                                   detail::MinusHistogramSamples> sampler_type;
+
+    Histogram() : _sampler(NULL) {}
+    explicit Histogram(const butil::StringPiece& name) : _sampler(NULL) {
+        expose(name);
+    }
+    Histogram(const butil::StringPiece& prefix,
+              const butil::StringPiece& name) : _sampler(NULL) {
+        expose_as(prefix, name);
+    }
+    ~Histogram();
+
+    // Add a value, negative ones are dropped.
+    // Returns self reference for chaining.
+    Histogram& operator<<(int64_t value);
+
+    // Get the counts of all values ever added.
+    // Notice that this function walks through threads that ever add values
+    // into this histogram. You should avoid calling it frequently.
+    value_type get_value() const { return _combiner.combine_agents(); }
+
+    // Reset all buckets to zero. Returns the counts before reset.
+    value_type reset() { return _combiner.reset_all_agents(); }
+
+    // Get the `ratio'-ile value of all values ever added.
+    int64_t get_number(double ratio) const {
+        return get_value().get_number(ratio);
+    }
+
+    void describe(std::ostream& os, bool) const override {
+        get_value().describe(os);
+    }
+
+    bool valid() const { return _combiner.valid(); }
+
+    const detail::AddHistogramSamples& op() const { return _combiner.op(); }
+    detail::MinusHistogramSamples inv_op() const {
+        return detail::MinusHistogramSamples();
+    }
+
+    // The sampler for windows over the histogram.
+    sampler_type* get_sampler() {
+        if (NULL == _sampler) {
+            _sampler = new sampler_type(this);
+            _sampler->schedule();
+        }
+        return _sampler;
+    }
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(Histogram);
+
+    combiner_type _combiner;
+    sampler_type* _sampler;
+};
+
+}  // namespace bvar
+
+#endif  //BVAR_HISTOGRAM_H
@@ -39,11 +39,16 @@ BUTIL_VALIDATE_GFLAG(bvar_latency_p2, valid_percentile);
 DEFINE_int32(bvar_latency_p3, 99, "Third latency percentile");
 BUTIL_VALIDATE_GFLAG(bvar_latency_p3, valid_percentile);
 
+DEFINE_bool(bvar_latency_use_histogram, false, "Percentiles of LatencyRecorder"
+            " created afterwards are computed from bvar::Histogram instead of"
+            " sampled values, and the histogram is exposed as"
+            " <prefix>_latency_histogram");
+
 namespace detail {
 
 typedef PercentileSamples<1022> CombinedPercentileSamples;
 
-CDF::CDF(PercentileWindow* w) : _w(w) {}
+CDF::CDF(PercentileWindow* w, HistogramWindow* hw) : _w(w), _hw(hw) {}
 
 CDF::~CDF() {
     hide();
@@ -61,23 +66,36 @@ int CDF::describe_series(
     if (options.test_only) {
         return 0;
     }
-    std::unique_ptr<CombinedPercentileSamples> cb(new CombinedPercentileSamples);
-    std::vector<GlobalPercentileSamples> buckets;
-    _w->get_samples(&buckets);
-    for (size_t i = 0; i < buckets.size(); ++i) {
-        cb->combine_of(buckets.begin(), buckets.end());
-    }
-    std::pair<int, int> values[20];
+    std::pair<int, double> ratios[20];
     size_t n = 0;
     for (int i = 1; i < 10; ++i) {
-        values[n++] = std::make_pair(i*10, cb->get_number(i * 0.1));
+        ratios[n++] = std::make_pair(i*10, i * 0.1);
     }
     for (int i = 91; i < 100; ++i) {
-        values[n++] = std::make_pair(i, cb->get_number(i * 0.01));
+        ratios[n++] = std::make_pair(i, i * 0.01);
+    }
+    ratios[n++] = std::make_pair(100, 0.999);
+    ratios[n++] = std::make_pair(101, 0.9999);
+    CHECK_EQ(n, arraysize(ratios));
+    std::pair<int, int64_t> values[20];
+    if (_hw != NULL) {
+        const HistogramSamples s = _hw->get_value();
+        for (size_t i = 0; i < n; ++i) {
+            values[i] = std::make_pair(ratios[i].first,
+                                       s.get_number(ratios[i].second));
+        }
+    } else {
+        std::unique_ptr<CombinedPercentileSamples> cb(new CombinedPercentileSamples);
+        std::vector<GlobalPercentileSamples> buckets;
+        _w->get_samples(&buckets);
+        for (size_t i = 0; i < buckets.size(); ++i) {
+            cb->combine_of(buckets.begin(), buckets.end());
+        }
+        for (size_t i = 0; i < n; ++i) {
+            values[i] = std::make_pair(ratios[i].first,
+                                       (int64_t)cb->get_number(ratios[i].second));
+        }
     }
-    values[n++] = std::make_pair(100, cb->get_number(0.999));
-    values[n++] = std::make_pair(101, cb->get_number(0.9999));
-    CHECK_EQ(n, arraysize(values));
     os << "{\"label\":\"cdf\",\"data\":[";
     for (size_t i = 0; i < n; ++i) {
         if (i) {
@@ -140,22 +158,32 @@ static int64_t get_p3(void* arg) {
     return lr->latency_percentile(FLAGS_bvar_latency_p3 / 100.0);
 }
 
-static Vector<int64_t, 4> get_latencies(void *arg) {
-    std::unique_ptr<CombinedPercentileSamples> cb(
-        combine((PercentileWindow*)arg));
+template <typename Samples>
+static Vector<int64_t, 4> get_latencies_from(Samples* s) {
     // NOTE: We don't show 99.99% since it's often significantly larger than
     // other values and make other curves on the plotted graph small and
     // hard to read.
     Vector<int64_t, 4> result;
-    result[0] = cb->get_number(FLAGS_bvar_latency_p1 / 100.0);
-    result[1] = cb->get_number(FLAGS_bvar_latency_p2 / 100.0);
-    result[2] = cb->get_number(FLAGS_bvar_latency_p3 / 100.0);
-    result[3] = cb->get_number(0.999);
+    result[0] = s->get_number(FLAGS_bvar_latency_p1 / 100.0);
+    result[1] = s->get_number(FLAGS_bvar_latency_p2 / 100.0);
+    result[2] = s->get_number(FLAGS_bvar_latency_p3 / 100.0);
+    result[3] = s->get_number(0.999);
     return result;
 }
 
+static Vector<int64_t, 4> get_latencies(void *arg) {
+    return static_cast<LatencyRecorder*>(arg)->latency_percentiles();
+}
+
+static Histogram* new_histogram_if_enabled() {
+    return FLAGS_bvar_latency_use_histogram ? new Histogram : NULL;
+}
+
 LatencyRecorderBase::LatencyRecorderBase(time_t window_size)
     : _max_latency(0)
+    , _latency_histogram(new_histogram_if_enabled())
+    , _latency_histogram_window(_latency_histogram ?
+          new HistogramWindow(_latency_histogram.get(), window_size) : NULL)
     , _latency_window(&_latency, window_size)
     , _max_latency_window(&_max_latency, window_size)
     , _count(get_recorder_count, &_latency)
@@ -166,16 +194,21 @@ LatencyRecorderBase::LatencyRecorderBase(time_t window_size)
     , _latency_p3(get_p3, this)
     , _latency_999(get_percetile<999, 1000>, this)
     , _latency_9999(get_percetile<9999, 10000>, this)
-    , _latency_cdf(&_latency_percentile_window)
-    , _latency_percentiles(get_latencies, &_latency_percentile_window)
+    , _latency_cdf(&_latency_percentile_window, _latency_histogram_window.get())
+    , _latency_percentiles(get_latencies, this)
 {}
 
 }  // namespace detail
 
 Vector<int64_t, 4> LatencyRecorder::latency_percentiles() const {
+    if (_latency_histogram_window) {
+        detail::HistogramSamples s = _latency_histogram_window->get_value();
+        return detail::get_latencies_from(&s);
+    }
     // const_cast here is just to adapt parameter type and safe.
-    return detail::get_latencies(
-        const_cast<detail::PercentileWindow*>(&_latency_percentile_window));
+    std::unique_ptr<detail::CombinedPercentileSamples> cb(detail::combine(
+        const_cast<detail::PercentileWindow*>(&_latency_percentile_window)));
+    return detail::get_latencies_from(cb.get());
 }
 
 int64_t LatencyRecorder::qps(time_t window_size) const {
@@ -253,6 +286,10 @@ int LatencyRecorder::expose(const butil::StringPiece& prefix1,
     if (_latency_percentiles.expose_as(prefix, "latency_percentiles", DISPLAY_ON_HTML) != 0) {
         return -1;
     }
+    if (_latency_histogram &&
+        _latency_histogram->expose_as(prefix, "latency_histogram") != 0) {
+        return -1;
+    }
     snprintf(namebuf, sizeof(namebuf), "%d%%,%d%%,%d%%,99.9%%",
              (int)FLAGS_bvar_latency_p1, (int)FLAGS_bvar_latency_p2,
              (int)FLAGS_bvar_latency_p3);
@@ -261,6 +298,9 @@ int LatencyRecorder::expose(const butil::StringPiece& prefix1,
 }
 
 int64_t LatencyRecorder::latency_percentile(double ratio) const {
+    if (_latency_histogram_window) {
+        return _latency_histogram_window->get_value().get_number(ratio);
+    }
     std::unique_ptr<detail::CombinedPercentileSamples> cb(
         combine((detail::PercentileWindow*)&_latency_percentile_window));
     return cb->get_number(ratio);
@@ -278,6 +318,9 @@ void LatencyRecorder::hide() {
     _latency_9999.hide();
     _latency_cdf.hide();
     _latency_percentiles.hide();
+    if (_latency_histogram) {
+        _latency_histogram->hide();
+    }
 }
 
 DEFINE_uint64(latency_scale_factor, 1, "latency scale factor, used by method status, etc., latency_us = latency * latency_scale_factor");
@@ -286,7 +329,11 @@ LatencyRecorder& LatencyRecorder::operator<<(int64_t latency) {
     latency = latency / FLAGS_latency_scale_factor;
     _latency << latency;
     _max_latency << latency;
-    _latency_percentile << latency;
+    if (_latency_histogram) {
+        *_latency_histogram << latency;
+    } else {
+        _latency_percentile << latency;
+    }
     return *this;
 }
 
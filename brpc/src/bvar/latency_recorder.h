@@ -20,9 +20,11 @@
 #ifndef  BVAR_LATENCY_RECORDER_H
 #define  BVAR_LATENCY_RECORDER_H
 
+#include <memory>
 #include "bvar/recorder.h"
 #include "bvar/reducer.h"
 #include "bvar/passive_status.h"
+#include "bvar/histogram.h"
 #include "bvar/detail/percentile.h"
 
 namespace bvar {
@@ -32,17 +34,20 @@ class Percentile;
 typedef Window<IntRecorder, SERIES_IN_SECOND> RecorderWindow;
 typedef Window<Maxer<int64_t>, SERIES_IN_SECOND> MaxWindow;
 typedef Window<Percentile, SERIES_IN_SECOND> PercentileWindow;
+typedef Window<Histogram, SERIES_IN_SECOND> HistogramWindow;
 
 // NOTE: Always use int64_t in the interfaces no matter what the impl. is.
 
 class CDF : public Variable {
 public:
-    explicit CDF(PercentileWindow* w);
+    // Values are read from `hw' if it's not NULL, from `w' otherwise.
+    explicit CDF(PercentileWindow* w, HistogramWindow* hw = NULL);
     ~CDF();
     void describe(std::ostream& os, bool quote_string) const override;
     int describe_series(std::ostream& os, const SeriesOptions& options) const override;
 private:
     PercentileWindow* _w; 
+    HistogramWindow* _hw;
 };
 
 // For mimic constructor inheritance.
@@ -54,6 +59,10 @@ protected:
     IntRecorder _latency;
     Maxer<int64_t> _max_latency;
     Percentile _latency_percentile;
+    // Replace _latency_percentile if -bvar_latency_use_histogram is true
+    // at construction, NULL otherwise.
+    std::unique_ptr<Histogram> _latency_histogram;
+    std::unique_ptr<HistogramWindow> _latency_histogram_window;
 
     RecorderWindow _latency_window;
     MaxWindow _max_latency_window;
@@ -111,6 +120,8 @@ public:
     //                                    // foo_bar_read_max_latency
     //                                    // foo_bar_read_count
     //                                    // foo_bar_read_qps
+    // With -bvar_latency_use_histogram, foo_bar_write_latency_histogram is
+    // exposed as well.
     int expose(const butil::StringPiece& prefix) {
         return expose(butil::StringPiece(), prefix);
     }
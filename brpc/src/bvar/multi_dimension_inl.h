@@ -267,77 +267,86 @@ size_t MultiDimension<bvar::LatencyRecorder>::dump(Dumper* dumper, const DumpOpt
     if (label_names.empty()) {
         return 0;
     }
-    size_t n = 0;
+    std::vector<std::pair<const key_type*, bvar::LatencyRecorder*> > stats;
+    stats.reserve(label_names.size());
     for (auto &label_name : label_names) {
         bvar::LatencyRecorder* bvar = get_stats_impl(label_name);
-        if (!bvar) {
-            continue;
-        }
-
-        // latency comment
-        if (!dumper->dump_comment(name() + "_latency", METRIC_TYPE_GAUGE)) {
-            continue;
+        if (bvar) {
+            stats.emplace_back(&label_name, bvar);
         }
-        // latency
-        std::ostringstream oss_latency_key;
-        make_dump_key(oss_latency_key, label_name, "_latency");
-        if (dumper->dump(oss_latency_key.str(), std::to_string(bvar->latency()))) {
-            n++;
-        }
-        // latency_percentiles
-        // p1/p2/p3
-        int latency_percentiles[3] {FLAGS_bvar_latency_p1, FLAGS_bvar_latency_p2, FLAGS_bvar_latency_p3};
-        for (auto lp : latency_percentiles) {
-            std::ostringstream oss_lp_key;
-            make_dump_key(oss_lp_key, label_name, "_latency", lp);
-            if (dumper->dump(oss_lp_key.str(), std::to_string(bvar->latency_percentile(lp / 100.0)))) {
+    }
+    // Samples of a metric family are dumped together, e.g. latencies of
+    // all label values before max_latency of any, as required by prometheus.
+    size_t n = 0;
+    // latency comment
+    if (dumper->dump_comment(name() + "_latency", METRIC_TYPE_GAUGE)) {
+        const int latency_percentiles[3] {FLAGS_bvar_latency_p1, FLAGS_bvar_latency_p2, FLAGS_bvar_latency_p3};
+        for (auto &stat : stats) {
+            const key_type& label_name = *stat.first;
+            bvar::LatencyRecorder* bvar = stat.second;
+            // latency
+            std::ostringstream oss_latency_key;
+            make_dump_key(oss_latency_key, label_name, "_latency");
+            if (dumper->dump(oss_latency_key.str(), std::to_string(bvar->latency()))) {
+                n++;
+            }
+            // latency_percentiles
+            // p1/p2/p3
+            for (auto lp : latency_percentiles) {
+                std::ostringstream oss_lp_key;
+                make_dump_key(oss_lp_key, label_name, "_latency", lp);
+                if (dumper->dump(oss_lp_key.str(), std::to_string(bvar->latency_percentile(lp / 100.0)))) {
+                    n++;
+                }
+            }
+            // 999
+            std::ostringstream oss_p999_key;
+            make_dump_key(oss_p999_key, label_name, "_latency", 999);
+            if (dumper->dump(oss_p999_key.str(), std::to_string(bvar->latency_percentile(0.999)))) {
+                n++;
+            }
+            // 9999
+            std::ostringstream oss_p9999_key;
+            make_dump_key(oss_p9999_key, label_name, "_latency", 9999);
+            if (dumper->dump(oss_p9999_key.str(), std::to_string(bvar->latency_percentile(0.9999)))) {
                 n++;
             }
         }
-        // 999
-        std::ostringstream oss_p999_key;
-        make_dump_key(oss_p999_key, label_name, "_latency", 999);
-        if (dumper->dump(oss_p999_key.str(), std::to_string(bvar->latency_percentile(0.999)))) {
-            n++;
-        }
-        // 9999
-        std::ostringstream oss_p9999_key;
-        make_dump_key(oss_p9999_key, label_name, "_latency", 9999);
-        if (dumper->dump(oss_p9999_key.str(), std::to_string(bvar->latency_percentile(0.9999)))) {
-            n++;
-        }
+    }
 
-        // max_latency comment
-        if (!dumper->dump_comment(name() + "_max_latency", METRIC_TYPE_GAUGE)) {
-            continue;
-        }
-        // max_latency
-        std::ostringstream oss_max_latency_key;
-        make_dump_key(oss_max_latency_key, label_name, "_max_latency");
-        if (dumper->dump(oss_max_latency_key.str(), std::to_string(bvar->max_latency()))) {
-            n++;
-        }
-        
-        // qps comment
-        if (!dumper->dump_comment(name() + "_qps", METRIC_TYPE_GAUGE)) {
-            continue;
-        }
-        // qps
-        std::ostringstream oss_qps_key;
-        make_dump_key(oss_qps_key, label_name, "_qps");
-        if (dumper->dump(oss_qps_key.str(), std::to_string(bvar->qps()))) {
-            n++;
+    // max_latency comment
+    if (dumper->dump_comment(name() + "_max_latency", METRIC_TYPE_GAUGE)) {
+        for (auto &stat : stats) {
+            // max_latency
+            std::ostringstream oss_max_latency_key;
+            make_dump_key(oss_max_latency_key, *stat.first, "_max_latency");
+            if (dumper->dump(oss_max_latency_key.str(), std::to_string(stat.second->max_latency()))) {
+                n++;
+            }
         }
+    }
 
-        // qps comment
-        if (!dumper->dump_comment(name() + "_count", METRIC_TYPE_COUNTER)) {
-            continue;
+    // qps comment
+    if (dumper->dump_comment(name() + "_qps", METRIC_TYPE_GAUGE)) {
+        for (auto &stat : stats) {
+            // qps
+            std::ostringstream oss_qps_key;
+            make_dump_key(oss_qps_key, *stat.first, "_qps");
+            if (dumper->dump(oss_qps_key.str(), std::to_string(stat.second->qps()))) {
+                n++;
+            }
         }
-        // count
-        std::ostringstream oss_count_key;
-        make_dump_key(oss_count_key, label_name, "_count");
-        if (dumper->dump(oss_count_key.str(), std::to_string(bvar->count()))) {
-            n++;
+    }
+
+    // count comment
+    if (dumper->dump_comment(name() + "_count", METRIC_TYPE_COUNTER)) {
+        for (auto &stat : stats) {
+            // count
+            std::ostringstream oss_count_key;
+            make_dump_key(oss_count_key, *stat.first, "_count");
+            if (dumper->dump(oss_count_key.str(), std::to_string(stat.second->count()))) {
+                n++;
+            }
         }
     }
     return n;
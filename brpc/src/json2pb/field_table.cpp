@@ -0,0 +1,152 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+#include <pthread.h>
+#include <string.h>
+#include "butil/logging.h"
+#include "butil/thread_local.h"
+#include "encode_decode.h"
+#include "protobuf_map.h"
+#include "field_table.h"
+
+namespace json2pb {
+
+// Messages with more fields find fields by hashing.
+static const int MAX_FIELDS_TO_SCAN = 8;
+
+FieldTable::FieldTable(const google::protobuf::Descriptor* descriptor)
+    : _descriptor(descriptor)
+    , _map_field_count(0) {
+    const int field_count = descriptor->field_count();
+    _fields.resize(field_count);
+    std::string decoded;
+    for (int i = 0; i < field_count; ++i) {
+        Field& f = _fields[i];
+        f.descriptor = descriptor->field(i);
+        if (decode_name(f.descriptor->name(), decoded)) {
+            f.name = decoded;
+        } else {
+            f.name = f.descriptor->name();
+        }
+        f.is_map = IsProtobufMap(f.descriptor);
+        if (f.is_map) {
+            ++_map_field_count;
+        } else {
+            _map_last_order.push_back(i);
+        }
+        if (f.descriptor->is_required()) {
+            _required_fields.push_back(i);
+        }
+    }
+    for (int i = 0; i < field_count; ++i) {
+        if (_fields[i].is_map) {
+            _map_last_order.push_back(i);
+        }
+    }
+    if (field_count > MAX_FIELDS_TO_SCAN) {
+        if (_index_map.init(field_count * 2, 50) != 0) {
+            LOG(WARNING) << "Fail to init _index_map of "
+                         << descriptor->full_name();
+            return;
+        }
+        for (int i = 0; i < field_count; ++i) {
+            // Keep the first one of fields with the same json name.
+            if (_index_map.seek(_fields[i].name) == NULL) {
+                _index_map[_fields[i].name] = i;
+            }
+        }
+    }
+}
+
+int FieldTable::FindField(const char* name, size_t length) const {
+    if (!_index_map.empty()) {
+        const int* index = _index_map.seek(butil::StringPiece(name, length));
+        return index ? *index : -1;
+    }
+    for (size_t i = 0; i < _fields.size(); ++i) {
+        const std::string& s = _fields[i].name;
+        if (s.size() == length && memcmp(s.data(), name, length) == 0) {
+            return (int)i;
+        }
+    }
+    return -1;
+}
+
+typedef butil::FlatMap<const google::protobuf::Descriptor*, FieldTable*> TableMap;
+static pthread_once_t s_init_table_map_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t s_table_map_mutex = PTHREAD_MUTEX_INITIALIZER;
+static TableMap* s_table_map = NULL;
+
+static void init_table_map() {
+    s_table_map = new TableMap;
+    if (s_table_map->init(64, 50) != 0) {
+        LOG(WARNING) << "Fail to init s_table_map";
+    }
+}
+
+static const FieldTable* find_shared_table(
+    const google::protobuf::Descriptor* descriptor) {
+    pthread_once(&s_init_table_map_once, init_table_map);
+    pthread_mutex_lock(&s_table_map_mutex);
+    FieldTable** ptable = s_table_map->seek(descriptor);
+    FieldTable* table = (ptable ? *ptable : NULL);
+    if (table == NULL) {
+        // Never deleted, like descriptors in the generated pool.
+        table = new FieldTable(descriptor);
+        (*s_table_map)[descriptor] = table;
+    }
+    pthread_mutex_unlock(&s_table_map_mutex);
+    return table;
+}
+
+// Shared tables recently found by this thread, indexed by hash of the
+// descriptor, so that finding a table rarely locks s_table_map_mutex.
+struct TableCacheSlot {
+    const google::protobuf::Descriptor* descriptor;
+    const FieldTable* table;
+};
+static const size_t TABLE_CACHE_SIZE = 64;
+static BAIDU_THREAD_LOCAL TableCacheSlot tls_table_cache[TABLE_CACHE_SIZE];
+
+FieldTableFinder::~FieldTableFinder() {
+    for (size_t i = 0; i < _local_tables.size(); ++i) {
+        delete _local_tables[i];
+    }
+}
+
+const FieldTable* FieldTableFinder::Find(
+    const google::protobuf::Descriptor* descriptor) {
+    if (descriptor->file()->pool() !=
+        google::protobuf::DescriptorPool::generated_pool()) {
+        for (size_t i = 0; i < _local_tables.size(); ++i) {
+            if (_local_tables[i]->descriptor() == descriptor) {
+                return _local_tables[i];
+            }
+        }
+        _local_tables.push_back(new FieldTable(descriptor));
+        return _local_tables.back();
+    }
+    const uint64_t h = (uint64_t)(uintptr_t)descriptor * 0x9E3779B97F4A7C15ULL;
+    TableCacheSlot& slot = tls_table_cache[(h >> 32) % TABLE_CACHE_SIZE];
+    if (slot.descriptor != descriptor) {
+        slot.table = find_shared_table(descriptor);
+        slot.descriptor = descriptor;
+    }
+    return slot.table;
+}
+
+} // namespace json2pb
@@ -0,0 +1,97 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+#ifndef BRPC_JSON2PB_FIELD_TABLE_H
+#define BRPC_JSON2PB_FIELD_TABLE_H
+
+#include <string>
+#include <vector>
+#include <google/protobuf/descriptor.h>
+#include "butil/macros.h"
+#include "butil/containers/flat_map.h"
+
+namespace json2pb {
+
+// Json names of the fields of a message type, computed once instead of
+// decoding names of all fields in each conversion.
+// Extensions are not included since they can be registered at any time.
+class FieldTable {
+public:
+    struct Field {
+        const google::protobuf::FieldDescriptor* descriptor;
+        // Name of the field in json, namely the decoded name (encode_decode.h)
+        std::string name;
+        // Convertible to a json object, see protobuf_map.h
+        bool is_map;
+    };
+
+    explicit FieldTable(const google::protobuf::Descriptor* descriptor);
+
+    const google::protobuf::Descriptor* descriptor() const { return _descriptor; }
+
+    // Fields in the order of declaration.
+    int field_count() const { return (int)_fields.size(); }
+    const Field& field(int index) const { return _fields[index]; }
+
+    // Indexes of fields with non-map fields before map fields, which is the
+    // order of printing json when protobuf maps are enabled.
+    const std::vector<int>& map_last_order() const { return _map_last_order; }
+    int map_field_count() const { return _map_field_count; }
+
+    // Indexes of required fields.
+    const std::vector<int>& required_fields() const { return _required_fields; }
+
+    bool has_extension_ranges() const
+    { return _descriptor->extension_range_count() > 0; }
+
+    // Returns index of the field named `name' in json, -1 if not found.
+    int FindField(const char* name, size_t length) const;
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(FieldTable);
+
+    const google::protobuf::Descriptor* _descriptor;
+    std::vector<Field> _fields;
+    std::vector<int> _map_last_order;
+    int _map_field_count;
+    std::vector<int> _required_fields;
+    // Only filled for messages with many fields, which are faster to
+    // be found by hashing than by comparing names one by one.
+    butil::FlatMap<std::string, int> _index_map;
+};
+
+// Find tables of message types for one conversion.
+// Tables of types in the generated pool are created once and shared by all
+// threads. Tables of other types (e.g. created by DynamicMessageFactory) are
+// owned by the finder, since their descriptors may be destroyed along with
+// the pool while a global cache keyed by address would not notice.
+class FieldTableFinder {
+public:
+    FieldTableFinder() {}
+    ~FieldTableFinder();
+
+    const FieldTable* Find(const google::protobuf::Descriptor* descriptor);
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(FieldTableFinder);
+
+    std::vector<FieldTable*> _local_tables;
+};
+
+} // namespace json2pb
+
+#endif // BRPC_JSON2PB_FIELD_TABLE_H
@@ -17,6 +17,7 @@
 
 #include <vector>
 #include <map>
+#include <algorithm>
 #include <string>
 #include <sstream>
 #include <sys/time.h>
@@ -33,6 +34,7 @@
 #include "butil/base64.h"
 #include "butil/string_printf.h"
 #include "protobuf_map.h"
+#include "field_table.h"
 #include "rapidjson.h"
 
 
@@ -273,12 +275,6 @@ inline bool convert_uint64_type(const BUTIL_RAPIDJSON_NAMESPACE::Value& item,
     return true;
 }
 
-bool JsonValueToProtoMessage(const BUTIL_RAPIDJSON_NAMESPACE::Value& json_value,
-                             google::protobuf::Message* message,
-                             const Json2PbOptions& options,
-                             std::string* err,
-                             bool root_val = false);
-
 //Json value to protobuf convert rules for type:
 //Json value type                 Protobuf type                convert rules
 //int                             int uint int64 uint64        valid convert is available
@@ -302,42 +298,24 @@ bool JsonValueToProtoMessage(const BUTIL_RAPIDJSON_NAMESPACE::Value& json_value,
             match_type;                                             \
         })
 
-
-static bool JsonValueToProtoField(const BUTIL_RAPIDJSON_NAMESPACE::Value& value,
-                                  const google::protobuf::FieldDescriptor* field,
-                                  google::protobuf::Message* message,
-                                  const Json2PbOptions& options,
-                                  std::string* err) {
-    if (value.IsNull()) {
-        if (field->is_required()) {
-            J2PERROR(err, "Missing required field: %s", field->full_name().c_str());
-            return false;
-        }
-        return true;
-    }
-        
-    if (field->is_repeated()) {
-        if (!value.IsArray()) {
-            J2PERROR(err, "Invalid value for repeated field: %s",
-                     field->full_name().c_str());
-            return false;
-        }
-    } 
-
-    const google::protobuf::Reflection* reflection = message->GetReflection();
+// Set `value' to the non-message `field', or add it to `field' if `repeated'
+// is true. `reflection' is the reflection of `message'.
+static bool JsonValueToProtoScalar(const BUTIL_RAPIDJSON_NAMESPACE::Value& value,
+                                   const google::protobuf::FieldDescriptor* field,
+                                   bool repeated,
+                                   google::protobuf::Message* message,
+                                   const google::protobuf::Reflection* reflection,
+                                   const Json2PbOptions& options,
+                                   std::string* err) {
     switch (field->cpp_type()) {
 #define CASE_FIELD_TYPE(cpptype, method, jsontype)                      \
         case google::protobuf::FieldDescriptor::CPPTYPE_##cpptype: {                      \
-            if (field->is_repeated()) {                                 \
-                const BUTIL_RAPIDJSON_NAMESPACE::SizeType size = value.Size();          \
-                for (BUTIL_RAPIDJSON_NAMESPACE::SizeType index = 0; index < size; ++index) { \
-                    const BUTIL_RAPIDJSON_NAMESPACE::Value & item = value[index];       \
-                    if (TYPE_MATCH == J2PCHECKTYPE(item, cpptype, jsontype)) { \
-                        reflection->Add##method(message, field, item.Get##jsontype()); \
-                    }                                                   \
+            if (TYPE_MATCH == J2PCHECKTYPE(value, cpptype, jsontype)) { \
+                if (repeated) {                                         \
+                    reflection->Add##method(message, field, value.Get##jsontype()); \
+                } else {                                                \
+                    reflection->Set##method(message, field, value.Get##jsontype()); \
                 }                                                       \
-            } else if (TYPE_MATCH == J2PCHECKTYPE(value, cpptype, jsontype)) { \
-                reflection->Set##method(message, field, value.Get##jsontype()); \
             }                                                           \
             break;                                                      \
         }                                                               \
@@ -348,91 +326,19 @@ static bool JsonValueToProtoField(const BUTIL_RAPIDJSON_NAMESPACE::Value& value,
 #undef CASE_FIELD_TYPE
 
     case google::protobuf::FieldDescriptor::CPPTYPE_INT64:
-        if (field->is_repeated()) {
-            const BUTIL_RAPIDJSON_NAMESPACE::SizeType size = value.Size();
-            for (BUTIL_RAPIDJSON_NAMESPACE::SizeType index = 0; index < size;
-                 ++index) {
-                const BUTIL_RAPIDJSON_NAMESPACE::Value& item = value[index];
-                if (!convert_int64_type(item, true, message, field, reflection,
-                                        err)) {
-                    return false;
-                }
-            }
-        } else if (!convert_int64_type(value, false, message, field, reflection,
-                                       err)) {
-            return false;
-        }
-        break;
+        return convert_int64_type(value, repeated, message, field, reflection, err);
 
     case google::protobuf::FieldDescriptor::CPPTYPE_UINT64:
-        if (field->is_repeated()) {
-            const BUTIL_RAPIDJSON_NAMESPACE::SizeType size = value.Size();
-            for (BUTIL_RAPIDJSON_NAMESPACE::SizeType index = 0; index < size;
-                 ++index) {
-                const BUTIL_RAPIDJSON_NAMESPACE::Value& item = value[index];
-                if (!convert_uint64_type(item, true, message, field, reflection,
-                                         err)) {
-                    return false;
-                }
-            }
-        } else if (!convert_uint64_type(value, false, message, field, reflection,
-                                       err)) {
-            return false;
-        }
-        break;
+        return convert_uint64_type(value, repeated, message, field, reflection, err);
 
     case google::protobuf::FieldDescriptor::CPPTYPE_FLOAT:
-        if (field->is_repeated()) {
-            const BUTIL_RAPIDJSON_NAMESPACE::SizeType size = value.Size();
-            for (BUTIL_RAPIDJSON_NAMESPACE::SizeType index = 0; index < size; ++index) {
-                const BUTIL_RAPIDJSON_NAMESPACE::Value & item = value[index];
-                if (!convert_float_type(item, true, message, field,
-                                        reflection, err)) {
-                    return false;
-                }
-            }
-        } else if (!convert_float_type(value, false, message, field,
-                                       reflection, err)) {
-            return false;
-        }
-        break;
+        return convert_float_type(value, repeated, message, field, reflection, err);
 
     case google::protobuf::FieldDescriptor::CPPTYPE_DOUBLE: 
-        if (field->is_repeated()) {
-            const BUTIL_RAPIDJSON_NAMESPACE::SizeType size = value.Size();
-            for (BUTIL_RAPIDJSON_NAMESPACE::SizeType index = 0; index < size; ++index) {
-                const BUTIL_RAPIDJSON_NAMESPACE::Value & item = value[index];
-                if (!convert_double_type(item, true, message, field,
-                                         reflection, err)) {
-                    return false;
-                }
-            }
-        } else if (!convert_double_type(value, false, message, field,
-                                        reflection, err)) {
-            return false;
-        }
-        break;
+        return convert_double_type(value, repeated, message, field, reflection, err);
         
     case google::protobuf::FieldDescriptor::CPPTYPE_STRING:
-        if (field->is_repeated()) {
-            const BUTIL_RAPIDJSON_NAMESPACE::SizeType size = value.Size();
-            for (BUTIL_RAPIDJSON_NAMESPACE::SizeType index = 0; index < size; ++index) {
-                const BUTIL_RAPIDJSON_NAMESPACE::Value & item = value[index];
-                if (TYPE_MATCH == J2PCHECKTYPE(item, string, String)) { 
-                    std::string str(item.GetString(), item.GetStringLength());
-                    if (field->type() == google::protobuf::FieldDescriptor::TYPE_BYTES &&
-                        options.base64_to_bytes) {
-                        std::string str_decoded;
-                        if (!butil::Base64Decode(str, &str_decoded)) {
-                            J2PERROR_WITH_PB(message, err, "Fail to decode base64 string=%s", str.c_str());
-                            return false;
-                        }
-                        str = str_decoded;
-                    }
-                    reflection->AddString(message, field, str);
-                }  
-            }
-        } else if (TYPE_MATCH == J2PCHECKTYPE(value, string, String)) {
+        if (TYPE_MATCH == J2PCHECKTYPE(value, string, String)) {
             std::string str(value.GetString(), value.GetStringLength());
             if (field->type() == google::protobuf::FieldDescriptor::TYPE_BYTES &&
                 options.base64_to_bytes) {
@@ -441,96 +347,29 @@ static bool JsonValueToProtoField(const BUTIL_RAPIDJSON_NAMESPACE::Value& value,
                     J2PERROR_WITH_PB(message, err, "Fail to decode base64 string=%s", str.c_str());
                     return false;
                 }
-                str = str_decoded;
+                str.swap(str_decoded);
+            }
+            if (repeated) {
+                reflection->AddString(message, field, std::move(str));
+            } else {
+                reflection->SetString(message, field, std::move(str));
             }
-            reflection->SetString(message, field, str);
         }
         break;
 
     case google::protobuf::FieldDescriptor::CPPTYPE_ENUM:
-        if (field->is_repeated()) {
-            const BUTIL_RAPIDJSON_NAMESPACE::SizeType size = value.Size();
-            for (BUTIL_RAPIDJSON_NAMESPACE::SizeType index = 0; index < size; ++index) {
-                const BUTIL_RAPIDJSON_NAMESPACE::Value & item = value[index];
-                if (!convert_enum_type(item, true, message, field,
-                                       reflection, err)) {
-                    return false;
-                }
-            }
-        } else if (!convert_enum_type(value, false, message, field,
-                                      reflection, err)) {
-            return false;
-        }
-        break;
+        return convert_enum_type(value, repeated, message, field, reflection, err);
         
     case google::protobuf::FieldDescriptor::CPPTYPE_MESSAGE:
-        if (field->is_repeated()) {
-            const BUTIL_RAPIDJSON_NAMESPACE::SizeType size = value.Size();
-            for (BUTIL_RAPIDJSON_NAMESPACE::SizeType index = 0; index < size; ++index) {
-                const BUTIL_RAPIDJSON_NAMESPACE::Value& item = value[index];
-                if (TYPE_MATCH == J2PCHECKTYPE(item, message, Object)) { 
-                    if (!JsonValueToProtoMessage(
-                            item, reflection->AddMessage(message, field), options, err)) {
-                        return false;
-                    }
-                } 
-            }
-        } else if (!JsonValueToProtoMessage(
-            value, reflection->MutableMessage(message, field), options, err)) {
-            return false;
-        }
         break;
     }
     return true;
 }
 
-bool JsonMapToProtoMap(const BUTIL_RAPIDJSON_NAMESPACE::Value& value,
-                       const google::protobuf::FieldDescriptor* map_desc,
-                       google::protobuf::Message* message,
-                       const Json2PbOptions& options,
-                       std::string* err) {
-    if (!value.IsObject()) {
-        J2PERROR(err, "Non-object value for map field: %s",
-                 map_desc->full_name().c_str());
-        return false;
-    }
-
-    const google::protobuf::Reflection* reflection = message->GetReflection();
-    const google::protobuf::FieldDescriptor* key_desc =
-            map_desc->message_type()->FindFieldByName(KEY_NAME);
-    const google::protobuf::FieldDescriptor* value_desc =
-            map_desc->message_type()->FindFieldByName(VALUE_NAME);
-
-    for (BUTIL_RAPIDJSON_NAMESPACE::Value::ConstMemberIterator it =
-                 value.MemberBegin(); it != value.MemberEnd(); ++it) {
-        google::protobuf::Message* entry = reflection->AddMessage(message, map_desc);
-        const google::protobuf::Reflection* entry_reflection = entry->GetReflection();
-        entry_reflection->SetString(
-            entry, key_desc, std::string(it->name.GetString(),
-                                         it->name.GetStringLength()));
-        if (!JsonValueToProtoField(it->value, value_desc, entry, options, err)) {
-            return false;
-        }
-    }
-    return true;
-}
-
-bool JsonValueToProtoMessage(const BUTIL_RAPIDJSON_NAMESPACE::Value& json_value,
-                             google::protobuf::Message* message,
-                             const Json2PbOptions& options,
-                             std::string* err,
-                             bool root_val) {
+static void AppendExtensions(const google::protobuf::Message* message,
+                             std::vector<const google::protobuf::FieldDescriptor*>* fields) {
     const google::protobuf::Descriptor* descriptor = message->GetDescriptor();
-    if (!json_value.IsObject() &&
-        !(json_value.IsArray() && options.array_to_single_repeated && root_val)) {
-        J2PERROR_WITH_PB(message, err, "The input is not a json object");
-        return false;
-    }
-
     const google::protobuf::Reflection* reflection = message->GetReflection();
-    
-    std::vector<const google::protobuf::FieldDescriptor*> fields;
-    fields.reserve(64);
     for (int i = 0; i < descriptor->extension_range_count(); ++i) {
         const google::protobuf::Descriptor::ExtensionRange*
             ext_range = descriptor->extension_range(i);
@@ -543,99 +382,525 @@ bool JsonValueToProtoMessage(const BUTIL_RAPIDJSON_NAMESPACE::Value& json_value,
             const google::protobuf::FieldDescriptor* field =
                 reflection->FindKnownExtensionByNumber(tag_number);
             if (field) {
-                fields.push_back(field);
+                fields->push_back(field);
             }
         }
     }
-    for (int i = 0; i < descriptor->field_count(); ++i) {
-        fields.push_back(descriptor->field(i));
-    }
+}
 
-    if (json_value.IsArray()) {
-        if (fields.size() == 1 && fields.front()->is_repeated()) {
-            return JsonValueToProtoField(json_value, fields.front(), message, options, err);
+// Convert json to protobuf on the fly as a handler of rapidjson::Reader,
+// instead of parsing the json into a DOM first.
+// Converting a DOM visits fields in the order of declaration (extensions
+// first) and stops at the first error that fails the conversion. To report
+// the same errors, each error is tagged with its position in that order,
+// namely indexes of fields and elements from the root, and errors are
+// sorted by positions in Finish(). Parsing never stops at errors of
+// conversion to tell whether the json is valid, which is always checked
+// before converting a DOM.
+class ProtoMessageBuilder {
+public:
+    typedef char Ch;
+    typedef BUTIL_RAPIDJSON_NAMESPACE::Value Value;
+    typedef BUTIL_RAPIDJSON_NAMESPACE::SizeType SizeType;
+
+    ProtoMessageBuilder(google::protobuf::Message* root,
+                        const Json2PbOptions& options)
+        : _root(root), _options(options), _skip_depth(0) {}
+
+    // Handler of rapidjson::Reader
+    bool Null() { return OnValue(Value()); }
+    bool Bool(bool b) { return OnValue(Value(b)); }
+    bool AddInt(int i) { return OnValue(Value(i)); }
+    bool AddUint(unsigned u) { return OnValue(Value(u)); }
+    bool AddInt64(int64_t i) { return OnValue(Value(i)); }
+    bool AddUint64(uint64_t u) { return OnValue(Value(u)); }
+    bool Double(double d) { return OnValue(Value(d)); }
+    // `str' is valid during the call only.
+    bool String(const char* str, SizeType length, bool) {
+        return OnValue(Value(str, length));
+    }
+    bool StartObject() { return OnStart(BUTIL_RAPIDJSON_NAMESPACE::kObjectType); }
+    bool Key(const char* str, SizeType length, bool);
+    bool EndObject(SizeType);
+    bool StartArray() { return OnStart(BUTIL_RAPIDJSON_NAMESPACE::kArrayType); }
+    bool EndArray(SizeType);
+
+    // Append errors to `err' (if not NULL) after parsing successfully.
+    // Returns false if the conversion failed.
+    bool Finish(std::string* err);
+
+private:
+    enum FrameType {
+        FRAME_MESSAGE,
+        FRAME_MAP,
+        FRAME_ARRAY,
+    };
+    struct Frame {
+        FrameType type;
+        google::protobuf::Message* message;
+        // Reflection of `message', which is costly to get for each value.
+        const google::protobuf::Reflection* reflection;
+        // FRAME_MESSAGE: the field of the last key, NULL to skip the value.
+        // FRAME_MAP: the map field. FRAME_ARRAY: the repeated field.
+        const google::protobuf::FieldDescriptor* field;
+        // FRAME_MESSAGE: position of `field' in the order of visiting.
+        // FRAME_MAP/FRAME_ARRAY: index of the current entry/element.
+        int index;
+        // FRAME_MESSAGE only.
+        bool field_is_map;
+        const FieldTable* table;
+        // Extensions of the message are _extensions[ext_begin, ext_begin +
+        // ext_count), whether fields(extensions first) are set are
+        // _set_flags[flag_begin, ...)
+        uint32_t ext_begin;
+        uint32_t ext_count;
+        uint32_t flag_begin;
+        // FRAME_MAP only: the entry of the last key.
+        google::protobuf::Message* entry;
+        const google::protobuf::Reflection* entry_reflection;
+        const google::protobuf::FieldDescriptor* key_field;
+        const google::protobuf::FieldDescriptor* value_field;
+    };
+    struct Error {
+        std::vector<int> position;
+        std::string text;
+        bool fatal;
+    };
+
+    bool OnValue(const Value& value);
+    bool OnStart(BUTIL_RAPIDJSON_NAMESPACE::Type type);
+    void OnRootArray();
+    void OnFieldValue(const Value& value, google::protobuf::Message* message,
+                      const google::protobuf::Reflection* reflection,
+                      const google::protobuf::FieldDescriptor* field);
+    void OnFieldStart(BUTIL_RAPIDJSON_NAMESPACE::Type type,
+                      google::protobuf::Message* message,
+                      const google::protobuf::Reflection* reflection,
+                      const google::protobuf::FieldDescriptor* field);
+    void OnElementValue(const Value& value, google::protobuf::Message* message,
+                        const google::protobuf::Reflection* reflection,
+                        const google::protobuf::FieldDescriptor* field);
+    void PushMessage(google::protobuf::Message* message);
+    void PushRepeated(FrameType type, google::protobuf::Message* message,
+                      const google::protobuf::Reflection* reflection,
+                      const google::protobuf::FieldDescriptor* field);
+    // Record _text as an error at the current position.
+    void AddError(bool fatal);
+    // Record errors (if any) of conversions returning `ok'.
+    void CheckError(bool ok) {
+        if (!ok || !_text.empty()) {
+            AddError(!ok);
         }
+    }
 
-        J2PERROR_WITH_PB(message, err, "the input json can't be array here");
-        return false;
+    // Target of J2PERROR which can't be `&_text'.
+    std::string* text() { return &_text; }
+
+    google::protobuf::Message* _root;
+    const Json2PbOptions& _options;
+    FieldTableFinder _tables;
+    std::vector<Frame> _stack;
+    std::vector<const google::protobuf::FieldDescriptor*> _extensions;
+    std::vector<char> _set_flags;
+    // Depth of the object or array being skipped.
+    int _skip_depth;
+    std::string _text;
+    std::vector<Error> _errors;
+    std::string _name;
+};
+
+void ProtoMessageBuilder::PushMessage(google::protobuf::Message* message) {
+    Frame f;
+    f.type = FRAME_MESSAGE;
+    f.message = message;
+    f.reflection = message->GetReflection();
+    f.field = NULL;
+    f.index = -1;
+    f.field_is_map = false;
+    f.table = _tables.Find(message->GetDescriptor());
+    f.ext_begin = _extensions.size();
+    if (f.table->has_extension_ranges()) {
+        AppendExtensions(message, &_extensions);
     }
+    f.ext_count = _extensions.size() - f.ext_begin;
+    f.flag_begin = _set_flags.size();
+    _set_flags.resize(_set_flags.size() + f.ext_count + f.table->field_count(), 0);
+    f.entry = NULL;
+    f.entry_reflection = NULL;
+    f.key_field = NULL;
+    f.value_field = NULL;
+    _stack.push_back(f);
+}
 
-    std::string field_name_str_temp; 
-    const BUTIL_RAPIDJSON_NAMESPACE::Value* value_ptr = NULL;
-    for (size_t i = 0; i < fields.size(); ++i) {
-        const google::protobuf::FieldDescriptor* field = fields[i];
-        
-        const std::string& orig_name = field->name();
-        bool res = decode_name(orig_name, field_name_str_temp); 
-        const std::string& field_name_str = (res ? field_name_str_temp : orig_name);
-
-#ifndef RAPIDJSON_VERSION_0_1
-        BUTIL_RAPIDJSON_NAMESPACE::Value::ConstMemberIterator member =
-                json_value.FindMember(field_name_str.data());
-        if (member == json_value.MemberEnd()) {
-            if (field->is_required()) {
-                J2PERROR(err, "Missing required field: %s", field->full_name().c_str());
-                return false;
-            }
-            continue; 
+void ProtoMessageBuilder::PushRepeated(FrameType type,
+                                       google::protobuf::Message* message,
+                                       const google::protobuf::Reflection* reflection,
+                                       const google::protobuf::FieldDescriptor* field) {
+    Frame f;
+    f.type = type;
+    f.message = message;
+    f.reflection = reflection;
+    f.field = field;
+    f.index = -1;
+    f.field_is_map = false;
+    f.table = NULL;
+    f.ext_begin = 0;
+    f.ext_count = 0;
+    f.flag_begin = 0;
+    f.entry = NULL;
+    f.entry_reflection = NULL;
+    if (type == FRAME_MAP) {
+        f.key_field = field->message_type()->field(KEY_INDEX);
+        f.value_field = field->message_type()->field(VALUE_INDEX);
+    } else {
+        f.key_field = NULL;
+        f.value_field = NULL;
+    }
+    _stack.push_back(f);
+}
+
+void ProtoMessageBuilder::AddError(bool fatal) {
+    _errors.push_back(Error());
+    Error& e = _errors.back();
+    e.position.reserve(_stack.size());
+    for (size_t i = 0; i < _stack.size(); ++i) {
+        e.position.push_back(_stack[i].index);
+    }
+    e.text.swap(_text);
+    _text.clear();
+    e.fatal = fatal;
+}
+
+bool ProtoMessageBuilder::OnValue(const Value& value) {
+    if (_skip_depth) {
+        return true;
+    }
+    if (_stack.empty()) {
+        J2PERROR_WITH_PB(_root, text(), "The input is not a json object");
+        AddError(true);
+        return true;
+    }
+    Frame& top = _stack.back();
+    switch (top.type) {
+    case FRAME_MESSAGE:
+        if (top.field) {
+            OnFieldValue(value, top.message, top.reflection, top.field);
         }
-        value_ptr = &(member->value);
-#else 
-        const BUTIL_RAPIDJSON_NAMESPACE::Value::Member* member =
-                json_value.FindMember(field_name_str.data());
-        if (member == NULL) {
-            if (field->is_required()) {
-                J2PERROR(err, "Missing required field: %s", field->full_name().c_str());
-                return false;
-            }
-            continue; 
+        break;
+    case FRAME_MAP:
+        OnFieldValue(value, top.entry, top.entry_reflection, top.value_field);
+        break;
+    case FRAME_ARRAY:
+        ++top.index;
+        OnElementValue(value, top.message, top.reflection, top.field);
+        break;
+    }
+    return true;
+}
+
+void ProtoMessageBuilder::OnFieldValue(const Value& value,
+                                       google::protobuf::Message* message,
+                                       const google::protobuf::Reflection* reflection,
+                                       const google::protobuf::FieldDescriptor* field) {
+    if (value.IsNull()) {
+        if (field->is_required()) {
+            J2PERROR(text(), "Missing required field: %s", field->full_name().c_str());
+            AddError(true);
         }
-        value_ptr = &(member->value);
-#endif
+        return;
+    }
+    if (field->is_repeated()) {
+        J2PERROR(text(), "Invalid value for repeated field: %s",
+                 field->full_name().c_str());
+        AddError(true);
+        return;
+    }
+    if (field->cpp_type() == google::protobuf::FieldDescriptor::CPPTYPE_MESSAGE) {
+        google::protobuf::Message* sub =
+            reflection->MutableMessage(message, field);
+        J2PERROR_WITH_PB(sub, text(), "The input is not a json object");
+        AddError(true);
+        return;
+    }
+    CheckError(JsonValueToProtoScalar(value, field, false, message, reflection,
+                                      _options, &_text));
+}
+
+void ProtoMessageBuilder::OnElementValue(const Value& value,
+                                         google::protobuf::Message* message,
+                                         const google::protobuf::Reflection* reflection,
+                                         const google::protobuf::FieldDescriptor* field) {
+    if (field->cpp_type() == google::protobuf::FieldDescriptor::CPPTYPE_MESSAGE) {
+        if (!value.IsObject()) {
+            CheckError(value_invalid(field, "message", value, &_text));
+        }
+        return;
+    }
+    CheckError(JsonValueToProtoScalar(value, field, true, message, reflection,
+                                      _options, &_text));
+}
 
-        if (IsProtobufMap(field) && value_ptr->IsObject()) {
+bool ProtoMessageBuilder::OnStart(BUTIL_RAPIDJSON_NAMESPACE::Type type) {
+    if (_skip_depth) {
+        ++_skip_depth;
+        return true;
+    }
+    if (_stack.empty()) {
+        if (type == BUTIL_RAPIDJSON_NAMESPACE::kObjectType) {
+            PushMessage(_root);
+        } else {
+            OnRootArray();
+        }
+        return true;
+    }
+    // Copy the frame which is invalidated by pushing.
+    const Frame top = _stack.back();
+    switch (top.type) {
+    case FRAME_MESSAGE:
+        if (top.field == NULL) {
+            _skip_depth = 1;
+        } else if (top.field_is_map && type == BUTIL_RAPIDJSON_NAMESPACE::kObjectType) {
             // Try to parse json like {"key":value, ...} into protobuf map
-            if (!JsonMapToProtoMap(*value_ptr, field, message, options, err)) {
-                return false;
-            }
+            PushRepeated(FRAME_MAP, top.message, top.reflection, top.field);
         } else {
-            if (!JsonValueToProtoField(*value_ptr, field, message, options, err)) {
-                return false;
-            }
+            OnFieldStart(type, top.message, top.reflection, top.field);
         }
+        break;
+    case FRAME_MAP:
+        OnFieldStart(type, top.entry, top.entry_reflection, top.value_field);
+        break;
+    case FRAME_ARRAY: {
+        ++_stack.back().index;
+        if (top.field->cpp_type() == google::protobuf::FieldDescriptor::CPPTYPE_MESSAGE &&
+            type == BUTIL_RAPIDJSON_NAMESPACE::kObjectType) {
+            PushMessage(top.reflection->AddMessage(top.message, top.field));
+        } else {
+            OnElementValue(Value(type), top.message, top.reflection, top.field);
+            _skip_depth = 1;
+        }
+        break;
+    }
     }
     return true;
 }
 
-inline bool JsonToProtoMessageInline(const std::string& json_string, 
-                        google::protobuf::Message* message,
-                        const Json2PbOptions& options,
-                        std::string* error,
-                        size_t* parsed_offset) {
-    if (error) {
-        error->clear();
+void ProtoMessageBuilder::OnFieldStart(BUTIL_RAPIDJSON_NAMESPACE::Type type,
+                                       google::protobuf::Message* message,
+                                       const google::protobuf::Reflection* reflection,
+                                       const google::protobuf::FieldDescriptor* field) {
+    if (field->is_repeated()) {
+        if (type == BUTIL_RAPIDJSON_NAMESPACE::kArrayType) {
+            PushRepeated(FRAME_ARRAY, message, reflection, field);
+            return;
+        }
+        J2PERROR(text(), "Invalid value for repeated field: %s",
+                 field->full_name().c_str());
+        AddError(true);
+    } else if (field->cpp_type() == google::protobuf::FieldDescriptor::CPPTYPE_MESSAGE) {
+        google::protobuf::Message* sub =
+            reflection->MutableMessage(message, field);
+        if (type == BUTIL_RAPIDJSON_NAMESPACE::kObjectType) {
+            PushMessage(sub);
+            return;
+        }
+        J2PERROR_WITH_PB(sub, text(), "The input is not a json object");
+        AddError(true);
+    } else {
+        CheckError(JsonValueToProtoScalar(Value(type), field, false, message, reflection,
+                                          _options, &_text));
     }
-    BUTIL_RAPIDJSON_NAMESPACE::Document d;
-    if (options.allow_remaining_bytes_after_parsing) {
-        d.Parse<BUTIL_RAPIDJSON_NAMESPACE::kParseStopWhenDoneFlag>(json_string.c_str());
-        if (parsed_offset != nullptr) {
-            *parsed_offset = d.GetErrorOffset();
+    _skip_depth = 1;
+}
+
+void ProtoMessageBuilder::OnRootArray() {
+    _skip_depth = 1;
+    if (!_options.array_to_single_repeated) {
+        J2PERROR_WITH_PB(_root, text(), "The input is not a json object");
+        AddError(true);
+        return;
+    }
+    const FieldTable* table = _tables.Find(_root->GetDescriptor());
+    std::vector<const google::protobuf::FieldDescriptor*> fields;
+    if (table->has_extension_ranges()) {
+        AppendExtensions(_root, &fields);
+    }
+    for (int i = 0; i < table->field_count(); ++i) {
+        fields.push_back(table->field(i).descriptor);
+    }
+    if (fields.size() == 1 && fields.front()->is_repeated()) {
+        _skip_depth = 0;
+        PushRepeated(FRAME_ARRAY, _root, _root->GetReflection(), fields.front());
+        return;
+    }
+    J2PERROR_WITH_PB(_root, text(), "the input json can't be array here");
+    AddError(true);
+}
+
+bool ProtoMessageBuilder::Key(const char* str, SizeType length, bool) {
+    if (_skip_depth) {
+        return true;
+    }
+    Frame& top = _stack.back();
+    if (top.type == FRAME_MAP) {
+        ++top.index;
+        top.entry = top.reflection->AddMessage(top.message, top.field);
+        if (top.entry_reflection == NULL) {
+            top.entry_reflection = top.entry->GetReflection();
         }
+        top.entry_reflection->SetString(top.entry, top.key_field,
+                                        std::string(str, length));
+        return true;
+    }
+    top.field = NULL;
+    const google::protobuf::FieldDescriptor* field = NULL;
+    int position = -1;
+    bool is_map = false;
+    const int index = top.table->FindField(str, length);
+    if (index >= 0) {
+        const FieldTable::Field& f = top.table->field(index);
+        field = f.descriptor;
+        position = top.ext_count + index;
+        is_map = f.is_map;
     } else {
-        d.Parse<0>(json_string.c_str());
+        for (uint32_t i = 0; i < top.ext_count; ++i) {
+            const google::protobuf::FieldDescriptor* ext =
+                _extensions[top.ext_begin + i];
+            const std::string& orig_name = ext->name();
+            const std::string& name =
+                (decode_name(orig_name, _name) ? _name : orig_name);
+            if (name.size() == length && memcmp(name.data(), str, length) == 0) {
+                field = ext;
+                position = i;
+                is_map = IsProtobufMap(ext);
+                break;
+            }
+        }
+        if (field == NULL) {
+            return true;
+        }
+    }
+    char& set_flag = _set_flags[top.flag_begin + position];
+    if (set_flag) {
+        // Same as converting a DOM which only uses the first one of
+        // duplicated keys.
+        return true;
+    }
+    set_flag = 1;
+    top.field = field;
+    top.index = position;
+    top.field_is_map = is_map;
+    return true;
+}
+
+bool ProtoMessageBuilder::EndObject(SizeType) {
+    if (_skip_depth) {
+        --_skip_depth;
+        return true;
     }
-    if (d.HasParseError()) {
+    Frame& top = _stack.back();
+    if (top.type == FRAME_MESSAGE) {
+        const std::vector<int>& required = top.table->required_fields();
+        for (size_t i = 0; i < required.size(); ++i) {
+            const int position = top.ext_count + required[i];
+            if (!_set_flags[top.flag_begin + position]) {
+                top.index = position;
+                J2PERROR(text(), "Missing required field: %s",
+                         top.table->field(required[i]).descriptor->full_name().c_str());
+                AddError(true);
+            }
+        }
+        _set_flags.resize(top.flag_begin);
+        _extensions.resize(top.ext_begin);
+    }
+    _stack.pop_back();
+    return true;
+}
+
+bool ProtoMessageBuilder::EndArray(SizeType) {
+    if (_skip_depth) {
+        --_skip_depth;
+        return true;
+    }
+    _stack.pop_back();
+    return true;
+}
+
+bool ProtoMessageBuilder::Finish(std::string* err) {
+    if (_errors.empty()) {
+        return true;
+    }
+    std::vector<const Error*> sorted(_errors.size());
+    for (size_t i = 0; i < _errors.size(); ++i) {
+        sorted[i] = &_errors[i];
+    }
+    std::stable_sort(sorted.begin(), sorted.end(),
+                     [](const Error* e1, const Error* e2) {
+                         return e1->position < e2->position;
+                     });
+    for (size_t i = 0; i < sorted.size(); ++i) {
+        if (err) {
+            if (!err->empty()) {
+                err->append(", ", 2);
+            }
+            err->append(sorted[i]->text);
+        }
+        if (sorted[i]->fatal) {
+            return false;
+        }
+    }
+    return true;
+}
+
+template <unsigned parseFlags, typename InputStream>
+static bool ParseJsonToProtoMessage(InputStream& json,
+                                    google::protobuf::Message* message,
+                                    const Json2PbOptions& options,
+                                    std::string* error,
+                                    size_t* parsed_offset) {
+    ProtoMessageBuilder builder(message, options);
+    BUTIL_RAPIDJSON_NAMESPACE::Reader reader;
+    const BUTIL_RAPIDJSON_NAMESPACE::ParseResult result =
+        reader.Parse<parseFlags>(json, builder);
+    if (parsed_offset != nullptr) {
+        *parsed_offset = result.Offset();
+    }
+    if (result.IsError()) {
         if (options.allow_remaining_bytes_after_parsing) {
-            if (d.GetParseError() == BUTIL_RAPIDJSON_NAMESPACE::kParseErrorDocumentEmpty) {
+            if (result.Code() == BUTIL_RAPIDJSON_NAMESPACE::kParseErrorDocumentEmpty) {
                 // This is usual when parsing multiple jsons, don't waste time
                 // on setting the `empty error'
                 return false;
             }
         }
-        J2PERROR_WITH_PB(message, error, "Invalid json: %s", BUTIL_RAPIDJSON_NAMESPACE::GetParseError_En(d.GetParseError()));
+        J2PERROR_WITH_PB(message, error, "Invalid json: %s", BUTIL_RAPIDJSON_NAMESPACE::GetParseError_En(result.Code()));
         return false;
     }
-    return JsonValueToProtoMessage(d, message, options, error, true);
+    return builder.Finish(error);
+}
+
+template <typename InputStream>
+static bool JsonStreamToProtoMessage(InputStream& json,
+                                     google::protobuf::Message* message,
+                                     const Json2PbOptions& options,
+                                     std::string* error,
+                                     size_t* parsed_offset) {
+    if (error) {
+        error->clear();
+    }
+    if (options.allow_remaining_bytes_after_parsing) {
+        return ParseJsonToProtoMessage<BUTIL_RAPIDJSON_NAMESPACE::kParseStopWhenDoneFlag>(
+            json, message, options, error, parsed_offset);
+    }
+    return ParseJsonToProtoMessage<0>(json, message, options, error, nullptr);
+}
+
+inline bool JsonToProtoMessageInline(const std::string& json_string, 
+                        google::protobuf::Message* message,
+                        const Json2PbOptions& options,
+                        std::string* error,
+                        size_t* parsed_offset) {
+    BUTIL_RAPIDJSON_NAMESPACE::StringStream stream(json_string.c_str());
+    return JsonStreamToProtoMessage(stream, message, options, error, parsed_offset);
 }
 
 bool JsonToProtoMessage(const std::string& json_string,
@@ -660,30 +925,7 @@ bool JsonToProtoMessage(ZeroCopyStreamReader* reader,
                         const Json2PbOptions& options,
                         std::string* error,
                         size_t* parsed_offset) {
-    if (error) {
-        error->clear();
-    }
-    BUTIL_RAPIDJSON_NAMESPACE::Document d;
-    if (options.allow_remaining_bytes_after_parsing) {
-        d.ParseStream<BUTIL_RAPIDJSON_NAMESPACE::kParseStopWhenDoneFlag, BUTIL_RAPIDJSON_NAMESPACE::UTF8<>>(*reader);
-        if (parsed_offset != nullptr) {
-            *parsed_offset = d.GetErrorOffset();
-        }
-    } else {
-        d.ParseStream<0, BUTIL_RAPIDJSON_NAMESPACE::UTF8<>>(*reader);
-    }
-    if (d.HasParseError()) {
-        if (options.allow_remaining_bytes_after_parsing) {
-            if (d.GetParseError() == BUTIL_RAPIDJSON_NAMESPACE::kParseErrorDocumentEmpty) {
-                // This is usual when parsing multiple jsons, don't waste time
-                // on setting the `empty error'
-                return false;
-            }
-        }
-        J2PERROR_WITH_PB(message, error, "Invalid json: %s", BUTIL_RAPIDJSON_NAMESPACE::GetParseError_En(d.GetParseError()));
-        return false;
-    }
-    return JsonValueToProtoMessage(d, message, options, error, true);
+    return JsonStreamToProtoMessage(*reader, message, options, error, parsed_offset);
 }
 
 bool JsonToProtoMessage(const std::string& json_string, 
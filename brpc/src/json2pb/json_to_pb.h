@@ -46,6 +46,8 @@ struct Json2PbOptions {
 // Convert `json' to protobuf `message'.
 // Returns true on success. `error' (if not NULL) will be set with error
 // message on failure.
+// `json' is converted while being parsed, so `message' may be partially
+// filled on failure, even if `json' is invalid.
 //
 // [When options.allow_remaining_bytes_after_parsing is true]
 // * `parse_offset' will be set with #bytes parsed
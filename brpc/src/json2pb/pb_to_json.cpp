@@ -23,8 +23,10 @@
 #include <time.h>
 #include <google/protobuf/descriptor.h>
 #include "butil/base64.h"
+#include "butil/iobuf.h"
 #include "zero_copy_stream_writer.h"
 #include "encode_decode.h"
+#include "field_table.h"
 #include "protobuf_map.h"
 #include "rapidjson.h"
 #include "pb_to_json.h"
@@ -59,120 +61,183 @@ private:
                         const google::protobuf::FieldDescriptor* field,
                         Handler& handler);
 
+    template <typename Handler>
+    bool _PbNamedFieldToJson(const google::protobuf::Message& message,
+                             const google::protobuf::FieldDescriptor* field,
+                             const std::string& name,
+                             Handler& handler);
+
+    template <typename Handler>
+    bool _PbMapToJson(const google::protobuf::Message& message,
+                      const google::protobuf::FieldDescriptor* map_desc,
+                      const std::string& name,
+                      Handler& handler);
+
+    template <typename Handler>
+    void _StringToJson(const google::protobuf::FieldDescriptor* field,
+                       const std::string& value, Handler& handler);
+
     std::string _error;
     Pb2JsonOptions _option;
+    FieldTableFinder _tables;
+    // Reused by strings of fields.
+    std::string _scratch;
+    std::string _base64;
 };
 
 template <typename Handler>
 bool PbToJsonConverter::Convert(const google::protobuf::Message& message, Handler& handler, bool root_msg) {
     const google::protobuf::Reflection* reflection = message.GetReflection();
     const google::protobuf::Descriptor* descriptor = message.GetDescriptor();
+    const FieldTable* table = _tables.Find(descriptor);
 
-    int ext_range_count = descriptor->extension_range_count();
-    int field_count = descriptor->field_count();
-    std::vector<const google::protobuf::FieldDescriptor*> fields;
-    fields.reserve(64);
-    for (int i = 0; i < ext_range_count; ++i) {
-        const google::protobuf::Descriptor::ExtensionRange*
-            ext_range = descriptor->extension_range(i);
+    std::vector<const google::protobuf::FieldDescriptor*> ext_fields;
+    if (table->has_extension_ranges()) {
+        int ext_range_count = descriptor->extension_range_count();
+        for (int i = 0; i < ext_range_count; ++i) {
+            const google::protobuf::Descriptor::ExtensionRange*
+                ext_range = descriptor->extension_range(i);
 #if GOOGLE_PROTOBUF_VERSION < 4025000
-        for (int tag_number = ext_range->start; tag_number < ext_range->end; ++tag_number)
+            for (int tag_number = ext_range->start; tag_number < ext_range->end; ++tag_number)
 #else
-        for (int tag_number = ext_range->start_number(); tag_number < ext_range->end_number(); ++tag_number)
+            for (int tag_number = ext_range->start_number(); tag_number < ext_range->end_number(); ++tag_number)
 #endif
-        {
-            const google::protobuf::FieldDescriptor* field =
-                    reflection->FindKnownExtensionByNumber(tag_number);
-            if (field) {
-                fields.push_back(field);
+            {
+                const google::protobuf::FieldDescriptor* field =
+                        reflection->FindKnownExtensionByNumber(tag_number);
+                if (field) {
+                    ext_fields.push_back(field);
+                }
             }
         }
     }
-    std::vector<const google::protobuf::FieldDescriptor*> map_fields;
-    for (int i = 0; i < field_count; ++i) {
-        const google::protobuf::FieldDescriptor* field = descriptor->field(i);
-        if (_option.enable_protobuf_map && json2pb::IsProtobufMap(field)) {
-            map_fields.push_back(field);
-        } else {
-            fields.push_back(field);
-        }
-    }
+    // Fields are printed in the order of extensions, non-map fields and
+    // map fields, the latter two are both in the order of declaration.
+    const int map_field_count =
+        (_option.enable_protobuf_map ? table->map_field_count() : 0);
+    const int non_map_field_count = table->field_count() - map_field_count;
 
     if (root_msg && _option.single_repeated_to_array) {
-        if (map_fields.empty() && fields.size() == 1 && fields.front()->is_repeated()) {
-            return _PbFieldToJson(message, fields.front(), handler);
+        if (map_field_count == 0 &&
+            ext_fields.size() + non_map_field_count == 1) {
+            const google::protobuf::FieldDescriptor* field =
+                (ext_fields.empty() ? table->field(0).descriptor : ext_fields[0]);
+            if (field->is_repeated()) {
+                return _PbFieldToJson(message, field, handler);
+            }
         }
     }
 
     handler.StartObject();
 
-    // Fill in non-map fields
+    // Fill in extensions whose names are decoded each time
     std::string field_name_str;
-    for (size_t i = 0; i < fields.size(); ++i) {
-        const google::protobuf::FieldDescriptor* field = fields[i];
-        if (!field->is_repeated() && !reflection->HasField(message, field)) {
-            // Field that has not been set
-            if (field->is_required()) {
-                _error = "Missing required field: " + field->full_name();
-                return false;
-            }
-            // Whether dumps default fields
-            if (!_option.always_print_primitive_fields) {
-                continue;
-            }
-        } else if (field->is_repeated()
-                   && reflection->FieldSize(message, field) == 0
-                   && !_option.jsonify_empty_array) {
-            // Repeated field that has no entry
-            continue;
+    for (size_t i = 0; i < ext_fields.size(); ++i) {
+        const std::string& orig_name = ext_fields[i]->name();
+        bool decoded = decode_name(orig_name, field_name_str);
+        const std::string& name = decoded ? field_name_str : orig_name;
+        if (!_PbNamedFieldToJson(message, ext_fields[i], name, handler)) {
+            return false;
         }
+    }
 
-        const std::string& orig_name = field->name();
-        bool decoded = decode_name(orig_name, field_name_str); 
-        const std::string& name = decoded ? field_name_str : orig_name;
-        handler.Key(name.data(), name.size(), false);
-        if (!_PbFieldToJson(message, field, handler)) {
+    // Fill in non-map fields
+    const std::vector<int>& order = table->map_last_order();
+    for (int i = 0; i < non_map_field_count; ++i) {
+        const FieldTable::Field& f =
+            table->field(map_field_count ? order[i] : i);
+        if (!_PbNamedFieldToJson(message, f.descriptor, f.name, handler)) {
             return false;
         }
     }
 
     // Fill in map fields
-    for (size_t i = 0; i < map_fields.size(); ++i) {
-        const google::protobuf::FieldDescriptor* map_desc = map_fields[i];
-        const google::protobuf::FieldDescriptor* key_desc =
-                map_desc->message_type()->field(json2pb::KEY_INDEX);
-        const google::protobuf::FieldDescriptor* value_desc =
-                map_desc->message_type()->field(json2pb::VALUE_INDEX);
-
-        // Write a json object corresponding to hold protobuf map
-        // such as {"key": value, ...}
-        const std::string& orig_name = map_desc->name();
-        bool decoded = decode_name(orig_name, field_name_str);
-        const std::string& name = decoded ? field_name_str : orig_name;
-        handler.Key(name.data(), name.size(), false);
-        handler.StartObject();
-        std::string entry_name;
-        for (int j = 0; j < reflection->FieldSize(message, map_desc); ++j) {
-            const google::protobuf::Message& entry =
-                    reflection->GetRepeatedMessage(message, map_desc, j);
-            const google::protobuf::Reflection* entry_reflection = entry.GetReflection();
-            entry_name = entry_reflection->GetStringReference(
-                entry, key_desc, &entry_name);
-            handler.Key(entry_name.data(), entry_name.size(), false);
-
-            // Fill in entries into this json object
-            if (!_PbFieldToJson(entry, value_desc, handler)) {
-                return false;
-            }
+    for (int i = non_map_field_count; i < table->field_count(); ++i) {
+        const FieldTable::Field& f = table->field(order[i]);
+        if (!_PbMapToJson(message, f.descriptor, f.name, handler)) {
+            return false;
+        }
+    }
+    // Hack: Pass 0 as parameter since Writer doesn't care this
+    handler.EndObject(0);
+    return true;
+}
+
+template <typename Handler>
+bool PbToJsonConverter::_PbNamedFieldToJson(
+    const google::protobuf::Message& message,
+    const google::protobuf::FieldDescriptor* field,
+    const std::string& name,
+    Handler& handler) {
+    const google::protobuf::Reflection* reflection = message.GetReflection();
+    if (!field->is_repeated() && !reflection->HasField(message, field)) {
+        // Field that has not been set
+        if (field->is_required()) {
+            _error = "Missing required field: " + field->full_name();
+            return false;
+        }
+        // Whether dumps default fields
+        if (!_option.always_print_primitive_fields) {
+            return true;
+        }
+    } else if (field->is_repeated()
+               && reflection->FieldSize(message, field) == 0
+               && !_option.jsonify_empty_array) {
+        // Repeated field that has no entry
+        return true;
+    }
+    handler.Key(name.data(), name.size(), false);
+    return _PbFieldToJson(message, field, handler);
+}
+
+template <typename Handler>
+bool PbToJsonConverter::_PbMapToJson(
+    const google::protobuf::Message& message,
+    const google::protobuf::FieldDescriptor* map_desc,
+    const std::string& name,
+    Handler& handler) {
+    const google::protobuf::Reflection* reflection = message.GetReflection();
+    const google::protobuf::FieldDescriptor* key_desc =
+            map_desc->message_type()->field(json2pb::KEY_INDEX);
+    const google::protobuf::FieldDescriptor* value_desc =
+            map_desc->message_type()->field(json2pb::VALUE_INDEX);
+
+    // Write a json object corresponding to hold protobuf map
+    // such as {"key": value, ...}
+    handler.Key(name.data(), name.size(), false);
+    handler.StartObject();
+    const int entry_count = reflection->FieldSize(message, map_desc);
+    for (int j = 0; j < entry_count; ++j) {
+        const google::protobuf::Message& entry =
+                reflection->GetRepeatedMessage(message, map_desc, j);
+        const google::protobuf::Reflection* entry_reflection = entry.GetReflection();
+        const std::string& entry_name = entry_reflection->GetStringReference(
+            entry, key_desc, &_scratch);
+        handler.Key(entry_name.data(), entry_name.size(), false);
+
+        // Fill in entries into this json object
+        if (!_PbFieldToJson(entry, value_desc, handler)) {
+            return false;
         }
-        // Hack: Pass 0 as parameter since Writer doesn't care this
-        handler.EndObject(0);
     }
     // Hack: Pass 0 as parameter since Writer doesn't care this
     handler.EndObject(0);
     return true;
 }
 
+template <typename Handler>
+void PbToJsonConverter::_StringToJson(
+    const google::protobuf::FieldDescriptor* field,
+    const std::string& value, Handler& handler) {
+    if (field->type() == google::protobuf::FieldDescriptor::TYPE_BYTES
+        && _option.bytes_to_base64) {
+        butil::Base64Encode(value, &_base64);
+        handler.String(_base64.data(), _base64.size(), false);
+    } else {
+        handler.String(value.data(), value.size(), false);
+    }
+}
+
 template <typename Handler>
 bool PbToJsonConverter::_PbFieldToJson(
     const google::protobuf::Message& message,
@@ -209,34 +274,20 @@ bool PbToJsonConverter::_PbFieldToJson(
 #undef CASE_FIELD_TYPE
 
     case google::protobuf::FieldDescriptor::CPPTYPE_STRING: {
-        std::string value;
+        // The references point to the fields unless the message is
+        // implemented in a way that _scratch is needed.
         if (field->is_repeated()) {
             int field_size = reflection->FieldSize(message, field);
             handler.StartArray();
             for (int index = 0; index < field_size; ++index) {
-                value = reflection->GetRepeatedStringReference(
-                    message, field, index, &value);
-                if (field->type() == google::protobuf::FieldDescriptor::TYPE_BYTES
-                    && _option.bytes_to_base64) {
-                    std::string value_decoded;
-                    butil::Base64Encode(value, &value_decoded);
-                    handler.String(value_decoded.data(), value_decoded.size(), false);
-                } else {
-                    handler.String(value.data(), value.size(), false);
-                }
+                _StringToJson(field, reflection->GetRepeatedStringReference(
+                                  message, field, index, &_scratch), handler);
             }
             handler.EndArray(field_size);
             
         } else {
-            value = reflection->GetStringReference(message, field, &value);
-            if (field->type() == google::protobuf::FieldDescriptor::TYPE_BYTES
-                && _option.bytes_to_base64) {
-                std::string value_decoded;
-                butil::Base64Encode(value, &value_decoded);
-                handler.String(value_decoded.data(), value_decoded.size(), false);
-            } else {
-                handler.String(value.data(), value.size(), false);
-            }
+            _StringToJson(field, reflection->GetStringReference(
+                              message, field, &_scratch), handler);
         }
         break;
     }
@@ -314,17 +365,64 @@ bool ProtoMessageToJsonStream(const google::protobuf::Message& message,
     return succ;
 }
 
+// Output stream of rapidjson appending to a std::string directly.
+class StringWriter {
+public:
+    typedef char Ch;
+    explicit StringWriter(std::string* str) : _str(str) {}
+
+    void Put(char c) { _str->push_back(c); }
+    void PutN(char c, size_t n) { _str->append(n, c); }
+    void Puts(const char* str, size_t length) { _str->append(str, length); }
+    void Flush() {}
+
+    char Peek() { return 0; }
+    char Take() { return 0; }
+    size_t Tell() { return 0; }
+    char *PutBegin() { return NULL; }
+    size_t PutEnd(char *) { return 0; }
+private:
+    std::string* _str;
+};
+
+// Output stream of rapidjson appending to blocks of IOBuf directly, which
+// is much cheaper than ZeroCopyStreamWriter for characters put one by one.
+class IOBufWriter {
+public:
+    typedef char Ch;
+
+    void Put(char c) { _appender.push_back(c); }
+    void PutN(char c, size_t n) {
+        for (; n > 0; --n) {
+            _appender.push_back(c);
+        }
+    }
+    void Puts(const char* str, size_t length) { _appender.append(str, length); }
+    void Flush() {}
+
+    char Peek() { return 0; }
+    char Take() { return 0; }
+    size_t Tell() { return 0; }
+    char *PutBegin() { return NULL; }
+    size_t PutEnd(char *) { return 0; }
+
+    void MoveTo(butil::IOBuf* buf) {
+        buf->append(butil::IOBuf::Movable(_appender.buf()));
+    }
+private:
+    butil::IOBufAppender _appender;
+};
+
 bool ProtoMessageToJson(const google::protobuf::Message& message,
                         std::string* json,
                         const Pb2JsonOptions& options,
                         std::string* error) {
-    // TODO(gejun): We could further wrap a std::string as a buffer to reduce
-    // a copying.
-    BUTIL_RAPIDJSON_NAMESPACE::StringBuffer buffer;
-    if (json2pb::ProtoMessageToJsonStream(message, options, buffer, error)) {
-        json->append(buffer.GetString(), buffer.GetSize());
+    const size_t old_size = json->size();
+    StringWriter writer(json);
+    if (json2pb::ProtoMessageToJsonStream(message, options, writer, error)) {
         return true;
     }
+    json->resize(old_size);
     return false;
 }
 
@@ -345,4 +443,21 @@ bool ProtoMessageToJson(const google::protobuf::Message& message,
                         std::string* error) {
     return ProtoMessageToJson(message, stream, Pb2JsonOptions(), error);
 }
+
+bool ProtoMessageToJson(const google::protobuf::Message& message,
+                        butil::IOBuf* json,
+                        const Pb2JsonOptions& options,
+                        std::string* error) {
+    IOBufWriter writer;
+    if (json2pb::ProtoMessageToJsonStream(message, options, writer, error)) {
+        writer.MoveTo(json);
+        return true;
+    }
+    return false;
+}
+
+bool ProtoMessageToJson(const google::protobuf::Message& message,
+                        butil::IOBuf* json, std::string* error) {
+    return ProtoMessageToJson(message, json, Pb2JsonOptions(), error);
+}
 } // namespace json2pb
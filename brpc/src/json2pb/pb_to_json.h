@@ -24,6 +24,10 @@
 #include <google/protobuf/message.h>
 #include <google/protobuf/io/zero_copy_stream.h> // ZeroCopyOutputStream
 
+namespace butil {
+class IOBuf;
+}
+
 namespace json2pb {
 
 enum EnumOption {
@@ -83,6 +87,13 @@ bool ProtoMessageToJson(const google::protobuf::Message& message,
                         const Pb2JsonOptions& options,
                         std::string* error = NULL);
 
+// Append output to IOBuf. Faster than wrapping the IOBuf as a
+// ZeroCopyOutputStream, and `json' is unchanged on failure.
+bool ProtoMessageToJson(const google::protobuf::Message& message,
+                        butil::IOBuf* json,
+                        const Pb2JsonOptions& options,
+                        std::string* error = NULL);
+
 // Using default Pb2JsonOptions.
 bool ProtoMessageToJson(const google::protobuf::Message& message,
                         std::string* json,
@@ -90,6 +101,9 @@ bool ProtoMessageToJson(const google::protobuf::Message& message,
 bool ProtoMessageToJson(const google::protobuf::Message& message,
                         google::protobuf::io::ZeroCopyOutputStream* json,
                         std::string* error = NULL);
+bool ProtoMessageToJson(const google::protobuf::Message& message,
+                        butil::IOBuf* json,
+                        std::string* error = NULL);
 } // namespace json2pb
 
 #endif // BRPC_JSON2PB_PB_TO_JSON_H
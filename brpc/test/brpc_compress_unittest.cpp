@@ -0,0 +1,160 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+#include <gtest/gtest.h>
+#include "butil/macros.h"
+#include "butil/iobuf.h"
+#include "butil/time.h"
+#include "brpc/compress.h"
+#include "brpc/global.h"
+#include "brpc/policy/lz4_compress.h"
+#include "brpc/policy/zstd_compress.h"
+#include "snappy_message.pb.h"
+
+namespace {
+
+class CompressTest : public testing::Test {
+protected:
+    void SetUp() override {
+        brpc::GlobalInitializeOrDie();
+    }
+};
+
+// Texts of `len' bytes which are either repetitive or random.
+std::string MakeText(size_t len, bool random) {
+    const char table[] =
+        "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789";
+    std::string text;
+    text.reserve(len);
+    for (size_t i = 0; i < len; ++i) {
+        text.push_back(random ? table[rand() % (sizeof(table) - 1)]
+                              : table[i % 36]);
+    }
+    return text;
+}
+
+// An IOBuf of many small blocks, to make sure that handlers do not depend
+// on a flat buffer.
+void AppendInPieces(const std::string& text, butil::IOBuf* buf) {
+    for (size_t i = 0; i < text.size(); i += 1000) {
+        butil::IOBuf piece;
+        piece.append(text.data() + i, std::min((size_t)1000, text.size() - i));
+        buf->append(piece);
+    }
+}
+
+#if BRPC_WITH_LZ4 || BRPC_WITH_ZSTD
+typedef bool (*IOBufCompress)(const butil::IOBuf&, butil::IOBuf*);
+
+void CheckIOBufRoundTrip(IOBufCompress compress, IOBufCompress decompress) {
+    const size_t lens[] = { 0, 1, 100, 8192, 64 * 1024 + 7, 1024 * 1024 };
+    for (size_t i = 0; i < arraysize(lens); ++i) {
+        const std::string text = MakeText(lens[i], i % 2);
+        butil::IOBuf in;
+        AppendInPieces(text, &in);
+        butil::IOBuf compressed;
+        ASSERT_TRUE(compress(in, &compressed));
+        // Decompress from small blocks as well.
+        butil::IOBuf pieces;
+        AppendInPieces(compressed.to_string(), &pieces);
+        butil::IOBuf out;
+        ASSERT_TRUE(decompress(pieces, &out));
+        ASSERT_EQ(text, out.to_string());
+
+        // Truncated data must be rejected.
+        if (compressed.size() > 1) {
+            butil::IOBuf truncated;
+            compressed.append_to(&truncated, compressed.size() - 1);
+            butil::IOBuf out2;
+            ASSERT_FALSE(decompress(truncated, &out2));
+        }
+    }
+}
+#endif
+
+#if BRPC_WITH_LZ4
+TEST_F(CompressTest, lz4_iobuf) {
+    CheckIOBufRoundTrip(brpc::policy::Lz4Compress, brpc::policy::Lz4Decompress);
+}
+#endif
+
+#if BRPC_WITH_ZSTD
+TEST_F(CompressTest, zstd_iobuf) {
+    CheckIOBufRoundTrip(brpc::policy::ZstdCompress, brpc::policy::ZstdDecompress);
+}
+#endif
+
+TEST_F(CompressTest, all_handlers_round_trip) {
+    std::vector<brpc::CompressHandler> handlers;
+    brpc::ListCompressHandler(&handlers);
+    ASSERT_FALSE(handlers.empty());
+    snappy_message::SnappyMessageProto msg;
+    msg.set_text(MakeText(100000, false));
+    msg.add_numbers(2);
+    msg.add_numbers(7);
+    for (size_t i = 0; i < handlers.size(); ++i) {
+        butil::IOBuf buf;
+        ASSERT_TRUE(handlers[i].Compress(msg, &buf)) << handlers[i].name;
+        snappy_message::SnappyMessageProto new_msg;
+        ASSERT_TRUE(handlers[i].Decompress(buf, &new_msg)) << handlers[i].name;
+        ASSERT_EQ(msg.text(), new_msg.text()) << handlers[i].name;
+        ASSERT_EQ(2, new_msg.numbers_size()) << handlers[i].name;
+    }
+}
+
+// Compares ratio and throughput of all registered handlers.
+TEST_F(CompressTest, throughput_of_all_handlers) {
+    std::vector<brpc::CompressHandler> handlers;
+    brpc::ListCompressHandler(&handlers);
+    const int lens[] = { 1024, 16 * 1024, 512 * 1024, 4 * 1024 * 1024 };
+    printf("%10s%10s%12s%16s%20s%22s\n", "method", "random", "size(B)",
+           "ratio", "compress(MB/s)", "decompress(MB/s)");
+    for (int random = 0; random < 2; ++random) {
+        for (size_t i = 0; i < arraysize(lens); ++i) {
+            snappy_message::SnappyMessageProto msg;
+            msg.set_text(MakeText(lens[i], random));
+            const int times = std::max(std::min(256 * 1024 * 1024 / lens[i], 5000), 1);
+            for (size_t j = 0; j < handlers.size(); ++j) {
+                butil::Timer timer;
+                int64_t compress_ns = 0;
+                int64_t decompress_ns = 0;
+                size_t compressed_size = 0;
+                for (int k = 0; k < times; ++k) {
+                    butil::IOBuf buf;
+                    timer.start();
+                    ASSERT_TRUE(handlers[j].Compress(msg, &buf));
+                    timer.stop();
+                    compress_ns += timer.n_elapsed();
+                    compressed_size += buf.size();
+                    snappy_message::SnappyMessageProto new_msg;
+                    timer.start();
+                    ASSERT_TRUE(handlers[j].Decompress(buf, &new_msg));
+                    timer.stop();
+                    decompress_ns += timer.n_elapsed();
+                }
+                const double total_mb = (double)lens[i] * times / 1024 / 1024;
+                printf("%10s%10d%12d%15.2f%%%20.1f%22.1f\n", handlers[j].name,
+                       random, lens[i],
+                       compressed_size * 100.0 / ((double)lens[i] * times),
+                       total_mb * 1e9 / compress_ns,
+                       total_mb * 1e9 / decompress_ns);
+            }
+        }
+    }
+}
+
+} // namespace
@@ -23,6 +23,8 @@
 #include "brpc/channel.h"
 #include "brpc/grpc.h"
 #include "butil/time.h"
+#include "butil/iobuf.h"
+#include "bthread/countdown_event.h"
 #include "grpc.pb.h"
 
 int main(int argc, char* argv[]) {
@@ -272,4 +274,420 @@ TEST_F(GrpcTest, GrpcTimeOut) {
     }
 }
 
+struct MultiplexedCall {
+    brpc::Controller cntl;
+    test::GrpcResponse res;
+};
+
+void OnMultiplexedCallDone(MultiplexedCall* call, bthread::CountdownEvent* ev) {
+    EXPECT_FALSE(call->cntl.Failed()) << call->cntl.ErrorText();
+    EXPECT_EQ(g_prefix + g_req, call->res.message());
+    ev->signal();
+}
+
+TEST_F(GrpcTest, multiplex_perf) {
+    test::GrpcRequest req;
+    req.set_message(g_req);
+    req.set_gzip(false);
+    req.set_return_error(false);
+    test::GrpcService_Stub stub(&_channel);
+    // All calls are multiplexed over one h2 connection.
+    const int concurrencies[] = { 1000, 10000 };
+    for (size_t i = 0; i < ARRAY_SIZE(concurrencies); ++i) {
+        const int n = concurrencies[i];
+        std::vector<MultiplexedCall> calls(n);
+        bthread::CountdownEvent ev(n);
+        const int64_t start_us = butil::gettimeofday_us();
+        for (int j = 0; j < n; ++j) {
+            calls[j].cntl.set_timeout_ms(10000);
+            stub.Method(&calls[j].cntl, &req, &calls[j].res,
+                        brpc::NewCallback(OnMultiplexedCallDone, &calls[j], &ev));
+        }
+        ev.wait();
+        const int64_t elapsed = butil::gettimeofday_us() - start_us;
+        LOG(INFO) << n << " concurrent streams: qps="
+                  << n * 1000000L / elapsed;
+    }
+}
+
+const std::string g_streaming_server_addr = "127.0.0.1:8012";
+const int g_streaming_count = 64;
+const size_t g_streaming_message_size = 64 * 1024;
+
+void MessageToIOBuf(const google::protobuf::Message& msg, butil::IOBuf* buf) {
+    butil::IOBufAsZeroCopyOutputStream wrapper(buf);
+    CHECK(msg.SerializeToZeroCopyStream(&wrapper));
+}
+
+int WriteRequest(brpc::ProgressiveAttachment* writer, const std::string& message) {
+    test::GrpcRequest req;
+    req.set_message(message);
+    req.set_gzip(false);
+    req.set_return_error(false);
+    butil::IOBuf buf;
+    MessageToIOBuf(req, &buf);
+    return writer->Write(buf);
+}
+
+int WriteResponse(brpc::ProgressiveAttachment* writer, const std::string& message) {
+    test::GrpcResponse res;
+    res.set_message(message);
+    butil::IOBuf buf;
+    MessageToIOBuf(res, &buf);
+    return writer->Write(buf);
+}
+
+// Write g_prefix + message of each request back.
+class EchoMessageReader : public brpc::GrpcMessageReader {
+public:
+    explicit EchoMessageReader(
+        const butil::intrusive_ptr<brpc::ProgressiveAttachment>& writer)
+        : _writer(writer) {}
+
+    butil::Status OnMessage(butil::IOBuf& message) override {
+        test::GrpcRequest req;
+        butil::IOBufAsZeroCopyInputStream wrapper(message);
+        if (!req.ParseFromZeroCopyStream(&wrapper)) {
+            return butil::Status(EINVAL, "Fail to parse GrpcRequest");
+        }
+        if (WriteResponse(_writer.get(), g_prefix + req.message()) != 0) {
+            return butil::Status(errno, "Fail to write response");
+        }
+        return butil::Status::OK();
+    }
+
+    void OnEndOfMessage(const butil::Status& st) override {
+        EXPECT_TRUE(st.ok()) << st;
+        EXPECT_FALSE(has_partial_message());
+        // Releasing the writer ends the response stream.
+        delete this;
+    }
+
+private:
+    butil::intrusive_ptr<brpc::ProgressiveAttachment> _writer;
+};
+
+// Concatenate messages of requests into the response.
+class ConcatMessageReader : public brpc::GrpcMessageReader {
+public:
+    ConcatMessageReader(brpc::Controller* cntl, test::GrpcResponse* res,
+                        google::protobuf::Closure* done)
+        : _cntl(cntl), _res(res), _done(done) {
+        _res->set_message("");
+    }
+
+    butil::Status OnMessage(butil::IOBuf& message) override {
+        test::GrpcRequest req;
+        butil::IOBufAsZeroCopyInputStream wrapper(message);
+        if (!req.ParseFromZeroCopyStream(&wrapper)) {
+            return butil::Status(EINVAL, "Fail to parse GrpcRequest");
+        }
+        _res->mutable_message()->append(req.message());
+        return butil::Status::OK();
+    }
+
+    void OnEndOfMessage(const butil::Status& st) override {
+        brpc::ClosureGuard done_guard(_done);
+        if (!st.ok()) {
+            _cntl->SetFailed(st.error_code(), "%s", st.error_cstr());
+        }
+        delete this;
+    }
+
+private:
+    brpc::Controller* _cntl;
+    test::GrpcResponse* _res;
+    google::protobuf::Closure* _done;
+};
+
+const std::string g_stop_text = "Stopped at 50% (by server)";
+
+struct StreamingArgs {
+    StreamingArgs() : return_error(false) {}
+    butil::intrusive_ptr<brpc::ProgressiveAttachment> writer;
+    std::string message;
+    bool return_error;
+};
+
+void* WriteResponses(void* void_args) {
+    std::unique_ptr<StreamingArgs> args(static_cast<StreamingArgs*>(void_args));
+    if (args->return_error) {
+        EXPECT_EQ(0, WriteResponse(args->writer.get(), args->message)) << berror();
+        EXPECT_EQ(0, args->writer->Stop(EPERM, g_stop_text));
+        // Stopped already.
+        EXPECT_EQ(-1, args->writer->Stop(EINVAL, g_stop_text));
+        EXPECT_EQ(-1, WriteResponse(args->writer.get(), args->message));
+        return NULL;
+    }
+    for (int i = 0; i < g_streaming_count; ++i) {
+        EXPECT_EQ(0, WriteResponse(args->writer.get(), args->message)) << berror();
+    }
+    return NULL;
+}
+
+class StreamingGrpcService : public ::test::GrpcStreamingService {
+public:
+    void BidiStreaming(::google::protobuf::RpcController* cntl_base,
+                       const ::test::GrpcRequest*,
+                       ::test::GrpcResponse*,
+                       ::google::protobuf::Closure* done) override {
+        brpc::ClosureGuard done_guard(done);
+        brpc::Controller* cntl = static_cast<brpc::Controller*>(cntl_base);
+        butil::intrusive_ptr<brpc::ProgressiveAttachment> writer =
+            cntl->CreateProgressiveAttachment();
+        ASSERT_TRUE(writer != NULL);
+        cntl->request_will_be_read_progressively();
+        cntl->ReadProgressiveAttachmentBy(new EchoMessageReader(writer));
+    }
+
+    void ClientStreaming(::google::protobuf::RpcController* cntl_base,
+                         const ::test::GrpcRequest*,
+                         ::test::GrpcResponse* res,
+                         ::google::protobuf::Closure* done) override {
+        brpc::Controller* cntl = static_cast<brpc::Controller*>(cntl_base);
+        cntl->request_will_be_read_progressively();
+        cntl->ReadProgressiveAttachmentBy(new ConcatMessageReader(cntl, res, done));
+    }
+
+    // Write g_streaming_count large responses repeating the message of the
+    // request, or stop the response stream with an error after one response
+    // if the request asks for that.
+    void ServerStreaming(::google::protobuf::RpcController* cntl_base,
+                         const ::test::GrpcRequest* req,
+                         ::test::GrpcResponse*,
+                         ::google::protobuf::Closure* done) override {
+        brpc::ClosureGuard done_guard(done);
+        brpc::Controller* cntl = static_cast<brpc::Controller*>(cntl_base);
+        // The request is not streamed, it's parsed as a whole even if the
+        // service enables progressive reading.
+        ASSERT_FALSE(req->message().empty());
+        std::unique_ptr<StreamingArgs> args(new StreamingArgs);
+        args->writer = cntl->CreateProgressiveAttachment();
+        ASSERT_TRUE(args->writer != NULL);
+        while (args->message.size() < g_streaming_message_size) {
+            args->message.append(req->message());
+        }
+        args->message.resize(g_streaming_message_size);
+        args->return_error = req->return_error();
+        // Write after the handler returns, as the one doing slow work.
+        bthread_t th;
+        ASSERT_EQ(0, bthread_start_background(&th, NULL, WriteResponses,
+                                              args.release()));
+    }
+};
+
+class ResponseCollector : public brpc::GrpcMessageReader {
+public:
+    explicit ResponseCollector(int64_t sleep_us = 0)
+        : truncated(false), _sleep_us(sleep_us), _ended(1) {}
+
+    butil::Status OnMessage(butil::IOBuf& message) override {
+        test::GrpcResponse res;
+        butil::IOBufAsZeroCopyInputStream wrapper(message);
+        if (!res.ParseFromZeroCopyStream(&wrapper)) {
+            return butil::Status(EINVAL, "Fail to parse GrpcResponse");
+        }
+        if (_sleep_us > 0) {
+            // Slow reader makes the peer run out of the stream-level window.
+            bthread_usleep(_sleep_us);
+        }
+        messages.push_back(res.message());
+        return butil::Status::OK();
+    }
+
+    void OnEndOfMessage(const butil::Status& st) override {
+        status = st;
+        truncated = has_partial_message();
+        _ended.signal();
+    }
+
+    void Wait() { _ended.wait(); }
+
+    std::vector<std::string> messages;
+    butil::Status status;
+    bool truncated;
+
+private:
+    int64_t _sleep_us;
+    bthread::CountdownEvent _ended;
+};
+
+class GrpcStreamingTest : public ::testing::Test {
+protected:
+    GrpcStreamingTest() {
+        brpc::ServiceOptions opt;
+        opt.enable_progressive_read = true;
+        opt.ownership = brpc::SERVER_DOESNT_OWN_SERVICE;
+        EXPECT_EQ(0, _server.AddService(&_svc, opt));
+        EXPECT_EQ(0, _server.Start(g_streaming_server_addr.c_str(), NULL));
+        brpc::ChannelOptions options;
+        options.protocol = g_protocol;
+        options.timeout_ms = g_timeout_ms;
+        EXPECT_EQ(0, _channel.Init(g_streaming_server_addr.c_str(), "", &options));
+    }
+
+    brpc::Server _server;
+    StreamingGrpcService _svc;
+    brpc::Channel _channel;
+};
+
+TEST_F(GrpcStreamingTest, bidi_streaming) {
+    test::GrpcRequest req;
+    test::GrpcResponse res;
+    brpc::Controller cntl;
+    butil::intrusive_ptr<brpc::ProgressiveAttachment> writer =
+        cntl.CreateProgressiveAttachment();
+    ASSERT_TRUE(writer != NULL);
+    cntl.response_will_be_read_progressively();
+    test::GrpcStreamingService_Stub stub(&_channel);
+    // Returns after receiving headers of the response.
+    stub.BidiStreaming(&cntl, &req, &res, NULL);
+    ASSERT_FALSE(cntl.Failed()) << cntl.ErrorText();
+    ResponseCollector collector;
+    cntl.ReadProgressiveAttachmentBy(&collector);
+    const int N = 10;
+    for (int i = 0; i < N; ++i) {
+        ASSERT_EQ(0, WriteRequest(writer.get(), std::to_string(i)));
+    }
+    // Empty message is valid in gRPC.
+    ASSERT_EQ(0, WriteRequest(writer.get(), ""));
+    writer.reset();  // end the request stream
+    collector.Wait();
+    ASSERT_TRUE(collector.status.ok()) << collector.status;
+    ASSERT_FALSE(collector.truncated);
+    ASSERT_EQ(N + 1, (int)collector.messages.size());
+    for (int i = 0; i < N; ++i) {
+        ASSERT_EQ(g_prefix + std::to_string(i), collector.messages[i]);
+    }
+    ASSERT_EQ(g_prefix, collector.messages[N]);
+}
+
+TEST_F(GrpcStreamingTest, client_streaming) {
+    test::GrpcRequest req;
+    test::GrpcResponse res;
+    brpc::Controller cntl;
+    cntl.set_timeout_ms(5000);
+    butil::intrusive_ptr<brpc::ProgressiveAttachment> writer =
+        cntl.CreateProgressiveAttachment();
+    ASSERT_TRUE(writer != NULL);
+    test::GrpcStreamingService_Stub stub(&_channel);
+    const brpc::CallId cid = cntl.call_id();
+    stub.ClientStreaming(&cntl, &req, &res, brpc::DoNothing());
+    // Written before the stream is created probably, which are flushed
+    // after sending the headers.
+    std::string expected;
+    for (int i = 0; i < 100; ++i) {
+        ASSERT_EQ(0, WriteRequest(writer.get(), std::to_string(i)));
+        expected.append(std::to_string(i));
+    }
+    writer.reset();
+    brpc::Join(cid);
+    ASSERT_FALSE(cntl.Failed()) << cntl.ErrorText();
+    ASSERT_EQ(expected, res.message());
+}
+
+TEST_F(GrpcStreamingTest, server_streaming_with_slow_reader) {
+    test::GrpcRequest req;
+    test::GrpcResponse res;
+    req.set_message(g_req);
+    req.set_gzip(false);
+    req.set_return_error(false);
+    brpc::Controller cntl;
+    cntl.response_will_be_read_progressively();
+    test::GrpcStreamingService_Stub stub(&_channel);
+    stub.ServerStreaming(&cntl, &req, &res, NULL);
+    ASSERT_FALSE(cntl.Failed()) << cntl.ErrorText();
+    // Responses are much larger than the windows, the server has to wait
+    // for WINDOW_UPDATE instead of failing or buffering.
+    ResponseCollector collector(2000);
+    cntl.ReadProgressiveAttachmentBy(&collector);
+    collector.Wait();
+    ASSERT_TRUE(collector.status.ok()) << collector.status;
+    ASSERT_EQ(g_streaming_count, (int)collector.messages.size());
+    for (size_t i = 0; i < collector.messages.size(); ++i) {
+        ASSERT_EQ(g_streaming_message_size, collector.messages[i].size());
+        ASSERT_EQ(0u, collector.messages[i].find(g_req));
+    }
+}
+
+TEST_F(GrpcStreamingTest, bidi_streaming_exceeding_windows) {
+    test::GrpcRequest req;
+    test::GrpcResponse res;
+    brpc::Controller cntl;
+    butil::intrusive_ptr<brpc::ProgressiveAttachment> writer =
+        cntl.CreateProgressiveAttachment();
+    ASSERT_TRUE(writer != NULL);
+    cntl.response_will_be_read_progressively();
+    test::GrpcStreamingService_Stub stub(&_channel);
+    stub.BidiStreaming(&cntl, &req, &res, NULL);
+    ASSERT_FALSE(cntl.Failed()) << cntl.ErrorText();
+    ResponseCollector collector;
+    cntl.ReadProgressiveAttachmentBy(&collector);
+    // Echoed messages are much larger than the stream-level window of the
+    // client, the reader at server-side has to wait for WINDOW_UPDATE from
+    // the client, which is received while the reader is blocked.
+    const int N = 16;
+    const std::string message(g_streaming_message_size, 'a');
+    for (int i = 0; i < N; ++i) {
+        ASSERT_EQ(0, WriteRequest(writer.get(), message)) << berror();
+    }
+    writer.reset();
+    collector.Wait();
+    ASSERT_TRUE(collector.status.ok()) << collector.status;
+    ASSERT_EQ(N, (int)collector.messages.size());
+    for (int i = 0; i < N; ++i) {
+        ASSERT_EQ(g_prefix + message, collector.messages[i]);
+    }
+}
+
+TEST_F(GrpcStreamingTest, server_streaming_stopped_with_status) {
+    test::GrpcRequest req;
+    test::GrpcResponse res;
+    req.set_message(g_req);
+    req.set_gzip(false);
+    req.set_return_error(true);
+    brpc::Controller cntl;
+    cntl.response_will_be_read_progressively();
+    test::GrpcStreamingService_Stub stub(&_channel);
+    stub.ServerStreaming(&cntl, &req, &res, NULL);
+    ASSERT_FALSE(cntl.Failed()) << cntl.ErrorText();
+    ResponseCollector collector;
+    cntl.ReadProgressiveAttachmentBy(&collector);
+    collector.Wait();
+    // Ended by grpc-status and grpc-message in trailers.
+    ASSERT_EQ(EPERM, collector.status.error_code()) << collector.status;
+    ASSERT_EQ(g_stop_text, collector.status.error_str());
+    ASSERT_FALSE(collector.truncated);
+    ASSERT_EQ(1u, collector.messages.size());
+    ASSERT_EQ(g_streaming_message_size, collector.messages[0].size());
+}
+
+TEST_F(GrpcStreamingTest, message_larger_than_max_body_size) {
+    ResponseCollector collector;
+    // The length-prefix declares a 4GB message.
+    const char prefix[] = { 0, '\xff', '\xff', '\xff', '\xff' };
+    butil::Status st = collector.OnReadOnePart(prefix, sizeof(prefix));
+    ASSERT_EQ(brpc::ELIMIT, st.error_code()) << st;
+    ASSERT_TRUE(collector.messages.empty());
+}
+
+TEST_F(GrpcStreamingTest, write_request_requires_h2) {
+    brpc::Channel channel;
+    brpc::ChannelOptions options;
+    options.protocol = "http";
+    ASSERT_EQ(0, channel.Init(g_streaming_server_addr.c_str(), "", &options));
+    test::GrpcRequest req;
+    test::GrpcResponse res;
+    brpc::Controller cntl;
+    butil::intrusive_ptr<brpc::ProgressiveAttachment> writer =
+        cntl.CreateProgressiveAttachment();
+    ASSERT_TRUE(writer != NULL);
+    test::GrpcStreamingService_Stub stub(&channel);
+    stub.BidiStreaming(&cntl, &req, &res, NULL);
+    ASSERT_EQ(EINVAL, cntl.ErrorCode());
+    // The writer is stopped when the controller is reset.
+    cntl.Reset();
+    ASSERT_EQ(-1, WriteRequest(writer.get(), g_req));
+}
+
 } // namespace 
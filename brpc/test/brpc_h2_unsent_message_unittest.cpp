@@ -86,3 +86,93 @@ TEST(H2UnsentMessage, request_throughput) {
         << (ntotal * 1000000L) / elapsed << "/s, data throughput="
         << dummy_buf.size() * 1000000L / elapsed << "/s";
 }
+
+struct StreamTableArgs {
+    brpc::policy::H2Context* ctx;
+    int first_stream_id;
+    int nstream;
+    int nframe;
+};
+
+// Insert `nstream' streams, find each of them `nframe' times as
+// HEADERS/DATA frames do, then remove them.
+void* ProcessStreams(void* arg) {
+    StreamTableArgs* a = static_cast<StreamTableArgs*>(arg);
+    std::vector<brpc::policy::H2StreamContext*> sctxs(a->nstream);
+    for (int i = 0; i < a->nstream; ++i) {
+        const int stream_id = a->first_stream_id + i * 2;
+        sctxs[i] = new brpc::policy::H2StreamContext(false);
+        sctxs[i]->Init(a->ctx, stream_id);
+        EXPECT_EQ(0, a->ctx->TryToInsertStream(stream_id, sctxs[i]));
+    }
+    for (int j = 0; j < a->nframe; ++j) {
+        for (int i = 0; i < a->nstream; ++i) {
+            EXPECT_EQ(sctxs[i], a->ctx->FindStream(a->first_stream_id + i * 2));
+        }
+    }
+    for (int i = 0; i < a->nstream; ++i) {
+        EXPECT_EQ(sctxs[i],
+                  a->ctx->RemoveStreamAndDeferWU(a->first_stream_id + i * 2));
+        delete sctxs[i];
+    }
+    return NULL;
+}
+
+TEST(H2UnsentMessage, concurrent_streams) {
+    brpc::SocketId id;
+    brpc::SocketUniquePtr h2_client_sock;
+    brpc::SocketOptions h2_client_options;
+    h2_client_options.user = brpc::get_client_side_messenger();
+    EXPECT_EQ(0, brpc::Socket::Create(h2_client_options, &id));
+    EXPECT_EQ(0, brpc::Socket::Address(id, &h2_client_sock));
+    brpc::policy::H2Context* ctx =
+        new brpc::policy::H2Context(h2_client_sock.get(), NULL);
+    CHECK_EQ(ctx->Init(), 0);
+    h2_client_sock->initialize_parsing_context(&ctx);
+
+    // Streams of one connection are processed by concurrent bthreads.
+    const int NTHREAD = 8;
+    const int NFRAME = 10;
+    const int nstreams[] = { 1000, 10000 };
+    for (size_t k = 0; k < ARRAY_SIZE(nstreams); ++k) {
+        StreamTableArgs args[NTHREAD];
+        bthread_t th[NTHREAD];
+        const int64_t start_us = butil::gettimeofday_us();
+        for (int i = 0; i < NTHREAD; ++i) {
+            args[i].ctx = ctx;
+            args[i].nstream = nstreams[k] / NTHREAD;
+            args[i].first_stream_id = 1 + i * args[i].nstream * 2;
+            args[i].nframe = NFRAME;
+            ASSERT_EQ(0, bthread_start_background(
+                          &th[i], NULL, ProcessStreams, &args[i]));
+        }
+        for (int i = 0; i < NTHREAD; ++i) {
+            bthread_join(th[i], NULL);
+        }
+        const int64_t elapsed = butil::gettimeofday_us() - start_us;
+        ASSERT_EQ(0u, ctx->VolatilePendingStreamSize());
+        LOG(INFO) << nstreams[k] << " concurrent streams: "
+                  << (int64_t)nstreams[k] * (NFRAME + 2) * 1000000L / elapsed
+                  << " stream lookups/s";
+    }
+
+    // Streams after the goaway stream are removed, new ones are rejected.
+    brpc::policy::H2StreamContext* sctxs[100];
+    for (int i = 0; i < 100; ++i) {
+        sctxs[i] = new brpc::policy::H2StreamContext(false);
+        sctxs[i]->Init(ctx, 1 + i * 2);
+        ASSERT_EQ(0, ctx->TryToInsertStream(1 + i * 2, sctxs[i]));
+    }
+    ASSERT_EQ(-1, ctx->TryToInsertStream(1, sctxs[0]));
+    std::vector<brpc::policy::H2StreamContext*> goaway_streams;
+    ctx->RemoveGoAwayStreams(99, &goaway_streams);
+    ASSERT_EQ(50u, goaway_streams.size());
+    ASSERT_EQ(50u, ctx->VolatilePendingStreamSize());
+    for (size_t i = 0; i < goaway_streams.size(); ++i) {
+        ASSERT_GT(goaway_streams[i]->stream_id(), 99);
+        delete goaway_streams[i];
+    }
+    brpc::policy::H2StreamContext* sctx = new brpc::policy::H2StreamContext(false);
+    ASSERT_EQ(1, ctx->TryToInsertStream(201, sctx));
+    delete sctx;
+}
@@ -22,6 +22,8 @@
 #include <gtest/gtest.h>
 #include "brpc/details/hpack.h"
 #include "butil/logging.h"
+#include "butil/fast_rand.h"
+#include "butil/time.h"
 
 class HPackTest : public testing::Test {
 };
@@ -548,3 +550,191 @@ TEST_F(HPackTest, responses_with_huffman) {
     }
     ASSERT_TRUE(buf.buf().empty());
 }
+
+TEST_F(HPackTest, huffman_round_trip) {
+    brpc::HPacker p1;
+    ASSERT_EQ(0, p1.Init(4096));
+    brpc::HPacker p2;
+    ASSERT_EQ(0, p2.Init(4096));
+    brpc::HPackOptions options;
+    options.encode_name = true;
+    options.encode_value = true;
+    options.index_policy = brpc::HPACK_NOT_INDEX_HEADER;
+    std::string all_bytes;
+    for (int i = 0; i < 256; ++i) {
+        all_bytes.push_back((char)i);
+    }
+    std::vector<std::string> values;
+    values.push_back(all_bytes);
+    values.push_back(std::string(all_bytes.rbegin(), all_bytes.rend()));
+    for (size_t len = 1; len < 64; ++len) {
+        std::string s;
+        for (size_t i = 0; i < len; ++i) {
+            s.push_back((char)butil::fast_rand_less_than(256));
+        }
+        values.push_back(s);
+    }
+    for (size_t i = 0; i < values.size(); ++i) {
+        brpc::HPacker::Header h("x-custom", values[i]);
+        butil::IOBufAppender buf;
+        p1.Encode(&buf, h, options);
+        const ssize_t nwrite = buf.buf().size();
+        brpc::HPacker::Header h2;
+        ASSERT_EQ(nwrite, p2.Decode(&buf.buf(), &h2));
+        ASSERT_EQ(h.name, h2.name);
+        ASSERT_EQ(h.value, h2.value);
+    }
+}
+
+TEST_F(HPackTest, invalid_huffman_padding) {
+    brpc::HPacker p;
+    ASSERT_EQ(0, p.Init(4096));
+    brpc::HPacker::Header h;
+    // "a" is 00011 and padded with 3 `1's
+    uint8_t valid[] = { 0x00, 0x81, 0x1f, 0x81, 0x1f };
+    butil::IOBuf buf;
+    buf.append(valid, sizeof(valid));
+    ASSERT_EQ((ssize_t)sizeof(valid), p.Decode(&buf, &h));
+    ASSERT_EQ("a", h.name);
+    ASSERT_EQ("a", h.value);
+    // Padding longer than 7 bits
+    uint8_t too_long_padding[] = { 0x00, 0x82, 0x1f, 0xff, 0x81, 0x1f };
+    buf.clear();
+    buf.append(too_long_padding, sizeof(too_long_padding));
+    ASSERT_EQ(-1, p.Decode(&buf, &h));
+    // Padding is not MSB of EOS
+    uint8_t zero_padding[] = { 0x00, 0x81, 0x18, 0x81, 0x1f };
+    buf.clear();
+    buf.append(zero_padding, sizeof(zero_padding));
+    ASSERT_EQ(-1, p.Decode(&buf, &h));
+    // EOS in the middle
+    uint8_t eos[] = { 0x00, 0x84, 0xff, 0xff, 0xff, 0xff, 0x81, 0x1f };
+    buf.clear();
+    buf.append(eos, sizeof(eos));
+    ASSERT_EQ(-1, p.Decode(&buf, &h));
+}
+
+TEST_F(HPackTest, encode_block_with_cache) {
+    // A small table to make entries evicted frequently.
+    brpc::HPacker p1;
+    ASSERT_EQ(0, p1.Init(128));
+    brpc::HPacker p2;
+    ASSERT_EQ(0, p2.Init(128));
+    brpc::HPacker p3;
+    ASSERT_EQ(0, p3.Init(128));
+    const std::string names[] = { ":status", "content-type", "x-extra" };
+    const std::string values[] = { "200", "application/grpc", "extra-value" };
+    brpc::HPacker::HeaderRef headers[3];
+    for (int i = 0; i < 3; ++i) {
+        headers[i].name = &names[i];
+        headers[i].value = &values[i];
+    }
+    brpc::HPackOptions options;
+    brpc::HPackBlockCache cache;
+    butil::IOBuf last_block;
+    for (int i = 0; i < 100; ++i) {
+        const bool evict = (i % 10 == 9);
+        butil::IOBuf block;
+        butil::IOBuf expected;
+        {
+            // Encode the same headers with p3 which is in the same state
+            // as p1 without caches.
+            butil::IOBufAppender appender;
+            for (int j = 0; j < 3; ++j) {
+                p3.Encode(&appender, brpc::HPacker::Header(names[j], values[j]),
+                          options);
+            }
+            appender.move_to(expected);
+        }
+        p1.EncodeBlock(&block, headers, 3, options, &cache);
+        ASSERT_EQ(expected, block);
+        if (i % 10 >= 2) {
+            // The same as the last block.
+            ASSERT_EQ(last_block, block);
+        }
+        last_block = block;
+        for (int j = 0; j < 3; ++j) {
+            brpc::HPacker::Header h;
+            ASSERT_GT(p2.Decode(&block, &h), 0);
+            ASSERT_EQ(names[j], h.name);
+            ASSERT_EQ(values[j], h.value);
+        }
+        ASSERT_TRUE(block.empty());
+        if (evict) {
+            // Other headers evict the cached entries from the dynamic table.
+            brpc::HPacker::Header other("x-other", std::string(64, 'a' + i / 10));
+            butil::IOBufAppender appender;
+            p1.Encode(&appender, other, options);
+            butil::IOBufAppender appender3;
+            p3.Encode(&appender3, other, options);
+            brpc::HPacker::Header h;
+            ASSERT_GT(p2.Decode(&appender.buf(), &h), 0);
+            ASSERT_EQ(other.value, h.value);
+        }
+    }
+}
+
+TEST_F(HPackTest, encode_block_perf) {
+    brpc::HPacker p;
+    ASSERT_EQ(0, p.Init(4096));
+    const std::string names[] = {
+        ":status", "content-type", "grpc-accept-encoding", "x-server-name" };
+    const std::string values[] = {
+        "200", "application/grpc", "identity,deflate,gzip", "brpc-server" };
+    const size_t N = ARRAY_SIZE(names);
+    brpc::HPacker::HeaderRef headers[N];
+    for (size_t i = 0; i < N; ++i) {
+        headers[i].name = &names[i];
+        headers[i].value = &values[i];
+    }
+    brpc::HPackOptions options;
+    const int ROUNDS = 100000;
+    butil::Timer tm;
+    tm.start();
+    for (int i = 0; i < ROUNDS; ++i) {
+        butil::IOBufAppender appender;
+        for (size_t j = 0; j < N; ++j) {
+            p.Encode(&appender, brpc::HPacker::Header(names[j], values[j]),
+                     options);
+        }
+        butil::IOBuf block;
+        appender.move_to(block);
+    }
+    tm.stop();
+    const int64_t encode_ns = tm.n_elapsed() / ROUNDS;
+    brpc::HPackBlockCache cache;
+    tm.start();
+    for (int i = 0; i < ROUNDS; ++i) {
+        butil::IOBuf block;
+        p.EncodeBlock(&block, headers, N, options, &cache);
+    }
+    tm.stop();
+    LOG(INFO) << "Encode " << N << " headers takes " << encode_ns
+              << "ns, EncodeBlock takes " << tm.n_elapsed() / ROUNDS << "ns";
+
+    options.encode_value = true;
+    std::string value(1024, '\0');
+    for (size_t i = 0; i < value.size(); ++i) {
+        value[i] = 'a' + butil::fast_rand_less_than(26);
+    }
+    brpc::HPacker::Header h("x-long-value", value);
+    options.index_policy = brpc::HPACK_NEVER_INDEX_HEADER;
+    butil::IOBufAppender appender;
+    tm.start();
+    for (int i = 0; i < 1000; ++i) {
+        p.Encode(&appender, h, options);
+    }
+    tm.stop();
+    const int64_t huffman_encode_ns = tm.n_elapsed() / 1000;
+    brpc::HPacker p2;
+    ASSERT_EQ(0, p2.Init(4096));
+    tm.start();
+    for (int i = 0; i < 1000; ++i) {
+        brpc::HPacker::Header h2;
+        ASSERT_GT(p2.Decode(&appender.buf(), &h2), 0);
+    }
+    tm.stop();
+    LOG(INFO) << "Huffman of " << value.size() << " bytes: encode takes "
+              << huffman_encode_ns << "ns, decode takes "
+              << tm.n_elapsed() / 1000 << "ns";
+}
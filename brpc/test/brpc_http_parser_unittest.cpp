@@ -17,10 +17,12 @@
 
 #include <gtest/gtest.h>
 #include <iostream>
+#include <sstream>
 
 #include "butil/time.h"
 #include "butil/logging.h"
 #include "brpc/details/http_parser.h"
+#include "brpc/details/http_message.h"
 #include "brpc/builtin/common.h"  // AppendFileName
 
 using brpc::http_parser;
@@ -169,3 +171,161 @@ TEST_F(HttpParserTest, append_filename) {
     brpc::AppendFileName(&dir, "..");
     ASSERT_EQ("/", dir);
 }
+
+// Headers of requests sent by browsers and RPC clients.
+const char* const g_realistic_requests[] = {
+    "GET /search/result/list?query=%E6%B5%8B%E8%AF%95&page=2&size=20"
+    "&sort=relevance#top HTTP/1.1\r\n"
+    "Host: www.example.com\r\n"
+    "Connection: keep-alive\r\n"
+    "Cache-Control: max-age=0\r\n"
+    "sec-ch-ua: \"Chromium\";v=\"118\", \"Google Chrome\";v=\"118\"\r\n"
+    "sec-ch-ua-mobile: ?0\r\n"
+    "sec-ch-ua-platform: \"Linux\"\r\n"
+    "Upgrade-Insecure-Requests: 1\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 "
+    "(KHTML, like Gecko) Chrome/118.0.0.0 Safari/537.36\r\n"
+    "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,"
+    "image/avif,image/webp,image/apng,*/*;q=0.8\r\n"
+    "Sec-Fetch-Site: same-origin\r\n"
+    "Sec-Fetch-Mode: navigate\r\n"
+    "Sec-Fetch-Dest: document\r\n"
+    "Referer: https://www.example.com/search/result/list?page=1\r\n"
+    "Accept-Encoding: gzip, deflate, br\r\n"
+    "Accept-Language: zh-CN,zh;q=0.9,en;q=0.8\r\n"
+    "Cookie: session_id=6f1c2a9e8b7d4c3fa2e1d0c9b8a7f6e5; theme=dark; "
+    "_ga=GA1.2.1234567890.1697000000; _gid=GA1.2.987654321.1697600000\r\n"
+    "\r\n",
+
+    "POST /EchoService/Echo HTTP/1.1\r\n"
+    "Host: 10.0.0.1:8010\r\n"
+    "Content-Type: application/json\r\n"
+    "Content-Length: 19\r\n"
+    "Accept: */*\r\n"
+    "User-Agent: brpc/1.0 curl/7.0\r\n"
+    "x-bd-trace-id: 3824871623847163\r\n"
+    "x-bd-span-id: 8791283747162\r\n"
+    "x-bd-parent-span-id: 1827364512\r\n"
+    "x-request-deadline-ms: 1697612345678\r\n"
+    "\r\n"
+    "{\"message\":\"hello\"}",
+};
+
+// Returns all headers, url and body of `msg' in text.
+std::string DescribeMessage(const brpc::HttpMessage& msg) {
+    std::ostringstream os;
+    const brpc::HttpHeader& h = msg.header();
+    os << h.method() << ' ';
+    h.uri().Print(os);
+    os << '\n';
+    for (brpc::HttpHeader::HeaderIterator it = h.HeaderBegin();
+         it != h.HeaderEnd(); ++it) {
+        os << it->first << ": " << it->second << '\n';
+    }
+    os << "Content-Type: " << h.content_type() << '\n'
+       << msg.body();
+    return os.str();
+}
+
+TEST_F(HttpParserTest, parse_in_parts) {
+    for (size_t i = 0; i < ARRAY_SIZE(g_realistic_requests); ++i) {
+        const std::string req = g_realistic_requests[i];
+        brpc::HttpMessage expected;
+        ASSERT_EQ((ssize_t)req.size(),
+                  expected.ParseFromArray(req.data(), req.size()));
+        ASSERT_TRUE(expected.Completed());
+        // Delimiters may be at any position of the parts.
+        for (size_t pos = 1; pos < req.size(); ++pos) {
+            brpc::HttpMessage msg;
+            ASSERT_EQ((ssize_t)pos, msg.ParseFromArray(req.data(), pos));
+            ASSERT_EQ((ssize_t)(req.size() - pos),
+                      msg.ParseFromArray(req.data() + pos, req.size() - pos));
+            ASSERT_TRUE(msg.Completed());
+            ASSERT_EQ(DescribeMessage(expected), DescribeMessage(msg));
+        }
+    }
+    brpc::HttpMessage msg;
+    const std::string req = g_realistic_requests[0];
+    ASSERT_EQ((ssize_t)req.size(), msg.ParseFromArray(req.data(), req.size()));
+    ASSERT_EQ("/search/result/list", msg.header().uri().path());
+    ASSERT_EQ("relevance", *msg.header().uri().GetQuery("sort"));
+    ASSERT_EQ("keep-alive", *msg.header().GetHeader("connection"));
+    ASSERT_EQ("\"Chromium\";v=\"118\", \"Google Chrome\";v=\"118\"",
+              *msg.header().GetHeader("sec-ch-ua"));
+}
+
+TEST_F(HttpParserTest, invalid_chars_after_plain_chars) {
+    const char* const invalid_requests[] = {
+        // Control characters in the middle of long url/field/value.
+        "GET /aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa\x01" "aaaaaaaaa HTTP/1.1\r\n\r\n",
+        "GET / HTTP/1.1\r\nHost: a\r\n"
+        "X-Long-Header-Name-Of-Many-Chars\x7f: v\r\n\r\n",
+        "GET / HTTP/1.1\r\nHost: a\r\n"
+        "X-Name: a very long header value with \x01 inside of it\r\n\r\n",
+        // Separators in header fields.
+        "GET / HTTP/1.1\r\nHost: a\r\n"
+        "X-Long-Header-Name-Of-Many/Chars: v\r\n\r\n",
+    };
+    for (size_t i = 0; i < ARRAY_SIZE(invalid_requests); ++i) {
+        brpc::HttpMessage msg;
+        ASSERT_EQ(-1, msg.ParseFromArray(invalid_requests[i],
+                                         strlen(invalid_requests[i])))
+            << invalid_requests[i];
+    }
+
+    // Header characters allowed by the state machine only.
+    const std::string req = "GET / HTTP/1.1\r\nHost: a\r\n"
+        "X-Long-Header-Name|With~Rare*Chars: v\tv\r\n\r\n";
+    brpc::HttpMessage msg;
+    ASSERT_EQ((ssize_t)req.size(), msg.ParseFromArray(req.data(), req.size()));
+    ASSERT_EQ("v\tv", *msg.header().GetHeader("X-Long-Header-Name|With~Rare*Chars"));
+
+    // Total size of headers is still limited.
+    std::string large = "GET / HTTP/1.1\r\nHost: a\r\nX-Large: ";
+    large.append(BRPC_HTTP_MAX_HEADER_SIZE, 'a');
+    large.append("\r\n\r\n");
+    http_parser parser;
+    http_parser_init(&parser, brpc::HTTP_REQUEST);
+    http_parser_settings settings;
+    memset(&settings, 0, sizeof(settings));
+    http_parser_execute(&parser, &settings, large.data(), large.size());
+    ASSERT_EQ(brpc::HPE_HEADER_OVERFLOW, (int)parser.http_errno);
+}
+
+int noop_data_cb(http_parser*, const char*, const size_t) { return 0; }
+
+TEST_F(HttpParserTest, parse_perf) {
+    http_parser_settings settings;
+    memset(&settings, 0, sizeof(settings));
+    settings.on_url = noop_data_cb;
+    settings.on_header_field = noop_data_cb;
+    settings.on_header_value = noop_data_cb;
+    settings.on_body = noop_data_cb;
+    const int loops = 200000;
+    for (size_t i = 0; i < ARRAY_SIZE(g_realistic_requests); ++i) {
+        const std::string req = g_realistic_requests[i];
+        butil::Timer timer;
+        timer.start();
+        for (int j = 0; j < loops; ++j) {
+            http_parser parser;
+            http_parser_init(&parser, brpc::HTTP_REQUEST);
+            ASSERT_EQ(req.size(), http_parser_execute(
+                          &parser, &settings, req.data(), req.size()));
+        }
+        timer.stop();
+        const int64_t parser_ns = timer.n_elapsed() / loops;
+
+        timer.start();
+        for (int j = 0; j < loops; ++j) {
+            brpc::HttpMessage msg;
+            ASSERT_EQ((ssize_t)req.size(),
+                      msg.ParseFromArray(req.data(), req.size()));
+        }
+        timer.stop();
+        const int64_t message_ns = timer.n_elapsed() / loops;
+        std::cout << "Parse request of " << req.size() << " bytes: "
+                  << parser_ns << "ns (" << req.size() * 1000 / parser_ns
+                  << "MB/s) by http_parser, " << message_ns
+                  << "ns by HttpMessage" << std::endl;
+    }
+}
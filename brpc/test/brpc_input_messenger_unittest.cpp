@@ -29,13 +29,30 @@
 #include "butil/fd_utility.h"
 #include "butil/fd_guard.h"
 #include "butil/unix_socket.h"
+#include "bvar/variable.h"
 #include "brpc/acceptor.h"
 #include "brpc/policy/hulu_pbrpc_protocol.h"
 
+namespace brpc {
+DECLARE_int32(batch_dispatch_max_messages);
+}
+
 void EmptyProcessHuluRequest(brpc::InputMessageBase* msg_base) {
     brpc::DestroyingPtr<brpc::InputMessageBase> a(msg_base);
 }
 
+pthread_mutex_t processed_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t processed_cond = PTHREAD_COND_INITIALIZER;
+size_t nprocessed = 0;
+
+void CountingProcessHuluRequest(brpc::InputMessageBase* msg_base) {
+    brpc::DestroyingPtr<brpc::InputMessageBase> a(msg_base);
+    pthread_mutex_lock(&processed_mutex);
+    ++nprocessed;
+    pthread_cond_signal(&processed_cond);
+    pthread_mutex_unlock(&processed_mutex);
+}
+
 int main(int argc, char* argv[]) {
     testing::InitGoogleTest(&argc, argv);
     brpc::Protocol dummy_protocol = 
@@ -46,6 +63,14 @@ int main(int argc, char* argv[]) {
                                NULL, NULL, NULL,
                                brpc::CONNECTION_TYPE_ALL, "dummy_hulu" };
     EXPECT_EQ(0,  RegisterProtocol((brpc::ProtocolType)30, dummy_protocol));
+    brpc::Protocol counting_protocol = 
+                             { brpc::policy::ParseHuluMessage,
+                               brpc::SerializeRequestDefault, 
+                               brpc::policy::PackHuluRequest,
+                               CountingProcessHuluRequest, CountingProcessHuluRequest,
+                               NULL, NULL, NULL,
+                               brpc::CONNECTION_TYPE_ALL, "counting_hulu" };
+    EXPECT_EQ(0,  RegisterProtocol((brpc::ProtocolType)31, counting_protocol));
     return RUN_ALL_TESTS();
 }
 
@@ -218,3 +243,72 @@ TEST_F(MessengerTest, dispatch_tasks) {
     sleep(1);
     LOG(WARNING) << "begin to exit!!!!";
 }
+
+// Send `depth' messages at once and wait for all of them to be processed,
+// returns number of messages processed per second.
+size_t RunPipeline(int fd, size_t depth) {
+    std::string buf;
+    for (size_t i = 0; i < depth; ++i) {
+        char msg[MESSAGE_SIZE] = "HULU";
+        // HULU use host byte order directly...
+        *(uint32_t*)(msg + 4) = MESSAGE_SIZE - 12;
+        *(uint32_t*)(msg + 8) = 4;
+        buf.append(msg, sizeof(msg));
+    }
+    size_t nsent = 0;
+    butil::Timer tm;
+    tm.start();
+    do {
+        pthread_mutex_lock(&processed_mutex);
+        nprocessed = 0;
+        pthread_mutex_unlock(&processed_mutex);
+        EXPECT_EQ((ssize_t)buf.size(), write(fd, buf.data(), buf.size()));
+        pthread_mutex_lock(&processed_mutex);
+        while (nprocessed < depth) {
+            pthread_cond_wait(&processed_cond, &processed_mutex);
+        }
+        EXPECT_EQ(depth, nprocessed);
+        pthread_mutex_unlock(&processed_mutex);
+        nsent += depth;
+        tm.stop();
+    } while (tm.m_elapsed() < 1000);
+    return nsent * 1000000L / tm.u_elapsed();
+}
+
+TEST_F(MessengerTest, batch_dispatch) {
+    const char* socket_name = "input_messenger.batch_socket";
+    brpc::Acceptor messenger;
+    const brpc::InputMessageHandler handler =
+        { brpc::policy::ParseHuluMessage,
+          CountingProcessHuluRequest, NULL, NULL, "counting_hulu" };
+    int listening_fd = butil::unix_socket_listen(socket_name);
+    ASSERT_TRUE(listening_fd > 0);
+    butil::make_non_blocking(listening_fd);
+    ASSERT_EQ(0, messenger.AddHandler(handler));
+    ASSERT_EQ(0, messenger.StartAccept(listening_fd, -1, NULL, false));
+    butil::fd_guard fd(butil::unix_socket_connect(socket_name));
+    ASSERT_GE(fd, 0);
+
+    const int saved_max_messages = brpc::FLAGS_batch_dispatch_max_messages;
+    const size_t depths[] = { 1, 16, 128 };
+    const int max_messages[] = { 1, 64 };
+    for (size_t i = 0; i < arraysize(depths); ++i) {
+        for (size_t j = 0; j < arraysize(max_messages); ++j) {
+            brpc::FLAGS_batch_dispatch_max_messages = max_messages[j];
+            const std::string batch0 =
+                bvar::Variable::describe_exposed("rpc_batch_dispatch_count");
+            const size_t qps = RunPipeline(fd, depths[i]);
+            const std::string batch1 =
+                bvar::Variable::describe_exposed("rpc_batch_dispatch_count");
+            if (max_messages[j] == 1) {
+                ASSERT_EQ(batch0, batch1);
+            }
+            LOG(INFO) << "depth=" << depths[i]
+                      << " batch_dispatch_max_messages=" << max_messages[j]
+                      << " qps=" << qps
+                      << " batches=" << batch0 << "->" << batch1;
+        }
+    }
+    brpc::FLAGS_batch_dispatch_max_messages = saved_max_messages;
+    messenger.StopAccept(0);
+}
@@ -18,11 +18,20 @@
 // Date: 2023/05/06 15:10:00
 
 #include <gtest/gtest.h>
+#include <gflags/gflags.h>
 
 #include "butil/strings/string_piece.h"
+#include "butil/string_printf.h"
 #include "butil/iobuf.h"
+#include "butil/time.h"
+#include "bvar/bvar.h"
+#include "bvar/multi_dimension.h"
 #include "brpc/builtin/prometheus_metrics_service.h"
 
+namespace brpc {
+DECLARE_bool(prometheus_histogram_collapse_buckets);
+}
+
 namespace {
 
 class PrometheusMetricsDumperTest : public testing::Test {
@@ -39,4 +48,221 @@ TEST_F(PrometheusMetricsDumperTest, GetMetricsName) {
   EXPECT_EQ("commit_count", brpc::GetMetricsName("commit_count{region=\"1000\"}"));
 }
 
+TEST_F(PrometheusMetricsDumperTest, DumpHistogram) {
+  bvar::Histogram h("prometheus_dumper_test_histogram");
+  h << 3 << 3 << 100;
+  butil::IOBuf buf;
+  ASSERT_EQ(0, brpc::DumpPrometheusMetricsToIOBuf(&buf));
+  const std::string out = buf.to_string();
+  EXPECT_NE(std::string::npos, out.find(
+      "# TYPE prometheus_dumper_test_histogram histogram\n"));
+  EXPECT_NE(std::string::npos, out.find(
+      "prometheus_dumper_test_histogram_bucket{le=\"2\"} 0\n"));
+  EXPECT_NE(std::string::npos, out.find(
+      "prometheus_dumper_test_histogram_bucket{le=\"3\"} 2\n"));
+  EXPECT_NE(std::string::npos, out.find(
+      "prometheus_dumper_test_histogram_bucket{le=\"103\"} 3\n"));
+  EXPECT_NE(std::string::npos, out.find(
+      "prometheus_dumper_test_histogram_bucket{le=\"+Inf\"} 3\n"));
+  EXPECT_NE(std::string::npos, out.find(
+      "prometheus_dumper_test_histogram_sum 106\n"));
+  EXPECT_NE(std::string::npos, out.find(
+      "prometheus_dumper_test_histogram_count 3\n"));
+  // All the fixed buckets are output by default.
+  EXPECT_NE(std::string::npos, out.find(
+      "prometheus_dumper_test_histogram_bucket{le=\"1\"} 0\n"));
+  EXPECT_NE(std::string::npos, out.find(
+      "prometheus_dumper_test_histogram_bucket{le=\"4\"} 2\n"));
+  EXPECT_NE(std::string::npos, out.find(
+      "prometheus_dumper_test_histogram_bucket{le=\"107\"} 3\n"));
+}
+
+TEST_F(PrometheusMetricsDumperTest, DumpHistogramClampedValues) {
+  bvar::Histogram h("prometheus_dumper_test_clamped_histogram");
+  h << 1 << (1LL << 40);
+  butil::IOBuf buf;
+  ASSERT_EQ(0, brpc::DumpPrometheusMetricsToIOBuf(&buf));
+  const std::string out = buf.to_string();
+  const std::string name = "prometheus_dumper_test_clamped_histogram";
+  EXPECT_NE(std::string::npos, out.find(name + "_bucket{le=\"1\"} 1\n"));
+  // The last bucket clamps values larger than its upper bound.
+  EXPECT_EQ(std::string::npos, out.find("le=\"4294967295\""));
+  EXPECT_NE(std::string::npos, out.find(name + "_bucket{le=\"+Inf\"} 2\n"));
+  EXPECT_NE(std::string::npos, out.find(name + "_count 2\n"));
+}
+
+TEST_F(PrometheusMetricsDumperTest, DumpHistogramCollapsedBuckets) {
+  bvar::Histogram h("prometheus_dumper_test_collapsed_histogram");
+  h << 3 << 3 << 100;
+  brpc::FLAGS_prometheus_histogram_collapse_buckets = true;
+  butil::IOBuf buf;
+  ASSERT_EQ(0, brpc::DumpPrometheusMetricsToIOBuf(&buf));
+  brpc::FLAGS_prometheus_histogram_collapse_buckets = false;
+  const std::string out = buf.to_string();
+  const std::string name = "prometheus_dumper_test_collapsed_histogram";
+  // Runs of unchanged cumulative counts are collapsed.
+  EXPECT_NE(std::string::npos, out.find(name + "_bucket{le=\"2\"} 0\n"));
+  EXPECT_NE(std::string::npos, out.find(name + "_bucket{le=\"3\"} 2\n"));
+  EXPECT_NE(std::string::npos, out.find(name + "_bucket{le=\"99\"} 2\n"));
+  EXPECT_NE(std::string::npos, out.find(name + "_bucket{le=\"103\"} 3\n"));
+  EXPECT_NE(std::string::npos, out.find(name + "_bucket{le=\"+Inf\"} 3\n"));
+  EXPECT_EQ(std::string::npos, out.find(name + "_bucket{le=\"1\"}"));
+  EXPECT_EQ(std::string::npos, out.find(name + "_bucket{le=\"4\"}"));
+  EXPECT_EQ(std::string::npos, out.find(name + "_bucket{le=\"107\"}"));
+  EXPECT_EQ(std::string::npos, out.find("le=\"4294967295\""));
+}
+
+TEST_F(PrometheusMetricsDumperTest, DumpSummary) {
+  bvar::LatencyRecorder rec("rpc_server_8000_prometheus_dumper_test");
+  rec << 10 << 20 << 30;
+  butil::IOBuf buf;
+  ASSERT_EQ(0, brpc::DumpPrometheusMetricsToIOBuf(&buf));
+  const std::string out = buf.to_string();
+  const std::string name = "rpc_server_8000_prometheus_dumper_test";
+  EXPECT_NE(std::string::npos, out.find("# TYPE " + name + " summary\n"));
+  EXPECT_NE(std::string::npos, out.find(name + "{quantile=\"0.8\"} "));
+  EXPECT_NE(std::string::npos, out.find(name + "{quantile=\"0.9999\"} "));
+  EXPECT_NE(std::string::npos, out.find(name + "{quantile=\"1\"} "));
+  EXPECT_NE(std::string::npos, out.find(name + "{quantile=\"avg\"} "));
+  EXPECT_NE(std::string::npos, out.find(name + "_count 3\n"));
+  // Swallowed by the summary.
+  EXPECT_EQ(std::string::npos, out.find(name + "_max_latency "));
+  EXPECT_EQ(std::string::npos, out.find(name + "_latency_80 "));
+  // Not part of the summary.
+  EXPECT_NE(std::string::npos, out.find(name + "_qps "));
+}
+
+TEST_F(PrometheusMetricsDumperTest, NormalizeName) {
+  bvar::Adder<int> a("9prometheus_dumper_test");
+  a << 5;
+  butil::IOBuf buf;
+  ASSERT_EQ(0, brpc::DumpPrometheusMetricsToIOBuf(&buf));
+  const std::string out = buf.to_string();
+  EXPECT_NE(std::string::npos, out.find(
+      "# TYPE _9prometheus_dumper_test gauge\n"
+      "_9prometheus_dumper_test 5\n"));
+  // Cached name is returned for the second scrape.
+  butil::IOBuf buf2;
+  ASSERT_EQ(0, brpc::DumpPrometheusMetricsToIOBuf(&buf2));
+  EXPECT_NE(std::string::npos, buf2.to_string().find(
+      "# TYPE _9prometheus_dumper_test gauge\n"
+      "_9prometheus_dumper_test 5\n"));
+}
+
+TEST_F(PrometheusMetricsDumperTest, MultiDimensionHeaderOnce) {
+  std::list<std::string> labels = {"method"};
+  bvar::MultiDimension<bvar::Adder<int> > md(
+      "prometheus_dumper_test_md", labels);
+  *md.get_stats({"echo"}) << 1;
+  *md.get_stats({"ping"}) << 2;
+  butil::IOBuf buf;
+  ASSERT_EQ(0, brpc::DumpPrometheusMetricsToIOBuf(&buf));
+  const std::string out = buf.to_string();
+  const std::string type = "# TYPE prometheus_dumper_test_md gauge\n";
+  const size_t pos = out.find(type);
+  ASSERT_NE(std::string::npos, pos);
+  EXPECT_EQ(std::string::npos, out.find(type, pos + 1));
+  EXPECT_NE(std::string::npos, out.find(
+      "prometheus_dumper_test_md{method=\"echo\"} 1\n"));
+  EXPECT_NE(std::string::npos, out.find(
+      "prometheus_dumper_test_md{method=\"ping\"} 2\n"));
+}
+
+TEST_F(PrometheusMetricsDumperTest, MultiDimensionLatencyRecorderFamilies) {
+  std::list<std::string> labels = {"method", "protocol"};
+  bvar::MultiDimension<bvar::LatencyRecorder> md(
+      "prometheus_dumper_test_md_rec", labels);
+  *md.get_stats({"echo", "baidu_std"}) << 10;
+  *md.get_stats({"ping", "http"}) << 20;
+  butil::IOBuf buf;
+  ASSERT_EQ(0, brpc::DumpPrometheusMetricsToIOBuf(&buf));
+  const std::string out = buf.to_string();
+  const std::string name = "prometheus_dumper_test_md_rec";
+  const char* const families[] = {
+      "_latency", "_max_latency", "_qps", "_count" };
+  size_t last_end = 0;
+  for (size_t i = 0; i < ARRAY_SIZE(families); ++i) {
+    const std::string family = name + families[i];
+    const std::string type = "# TYPE " + family + " ";
+    const size_t pos = out.find(type);
+    ASSERT_NE(std::string::npos, pos) << family;
+    EXPECT_EQ(std::string::npos, out.find(type, pos + 1)) << family;
+    // Families are not interleaved.
+    EXPECT_GE(pos, last_end) << family;
+    const std::string echo = family + "{method=\"echo\",protocol=\"baidu_std\"";
+    const std::string ping = family + "{method=\"ping\",protocol=\"http\"";
+    const size_t echo_pos = out.find(echo, pos);
+    const size_t ping_pos = out.find(ping, pos);
+    ASSERT_NE(std::string::npos, echo_pos) << family;
+    ASSERT_NE(std::string::npos, ping_pos) << family;
+    last_end = std::max(out.find('\n', echo_pos), out.find('\n', ping_pos));
+    // Both samples precede the next family.
+    const size_t next = out.find("# TYPE ", pos + 1);
+    if (next != std::string::npos) {
+      EXPECT_LT(last_end, next) << family;
+    }
+  }
+}
+
+TEST_F(PrometheusMetricsDumperTest, OpenMetrics) {
+  bvar::Adder<int> a("prometheus_dumper_test_om");
+  bvar::LatencyRecorder rec("rpc_server_8000_prometheus_dumper_test_om");
+  a << 1;
+  rec << 10;
+  butil::IOBuf buf;
+  ASSERT_EQ(0, brpc::DumpPrometheusMetricsToIOBuf(&buf, true));
+  const std::string out = buf.to_string();
+  ASSERT_GE(out.size(), 6u);
+  EXPECT_EQ("# EOF\n", out.substr(out.size() - 6));
+  EXPECT_EQ(std::string::npos, out.find("# HELP "));
+  EXPECT_EQ(std::string::npos, out.find("quantile=\"avg\""));
+  EXPECT_NE(std::string::npos, out.find(
+      "# TYPE prometheus_dumper_test_om gauge\n"
+      "prometheus_dumper_test_om 1\n"));
+  EXPECT_NE(std::string::npos, out.find(
+      "# TYPE rpc_server_8000_prometheus_dumper_test_om summary\n"));
+}
+
+static void ScrapeVariables(int n) {
+  std::vector<bvar::Adder<int>*> adders;
+  std::vector<bvar::LatencyRecorder*> recorders;
+  adders.reserve(n);
+  for (int i = 0; i < n; ++i) {
+    adders.push_back(new bvar::Adder<int>(
+        butil::string_printf("prometheus_dumper_bench_%d", i)));
+    *adders.back() << i;
+  }
+  // LatencyRecorder exposes 15 variables.
+  for (int i = 0; i < n / 1000; ++i) {
+    recorders.push_back(new bvar::LatencyRecorder(
+        butil::string_printf("rpc_server_8000_prometheus_dumper_bench_%d", i)));
+    *recorders.back() << i;
+  }
+  butil::IOBuf buf;
+  ASSERT_EQ(0, brpc::DumpPrometheusMetricsToIOBuf(&buf));
+  const int N = 5;
+  butil::Timer tm;
+  tm.start();
+  for (int i = 0; i < N; ++i) {
+    buf.clear();
+    ASSERT_EQ(0, brpc::DumpPrometheusMetricsToIOBuf(&buf));
+  }
+  tm.stop();
+  LOG(INFO) << "Scraped " << n << " adders and " << recorders.size()
+            << " latency recorders in " << tm.u_elapsed() / N
+            << "us, size=" << buf.size();
+  for (size_t i = 0; i < adders.size(); ++i) {
+    delete adders[i];
+  }
+  for (size_t i = 0; i < recorders.size(); ++i) {
+    delete recorders[i];
+  }
+}
+
+// Benchmark, run with --gtest_also_run_disabled_tests.
+TEST_F(PrometheusMetricsDumperTest, DISABLED_ScrapePerformance) {
+  ScrapeVariables(10000);
+  ScrapeVariables(100000);
+}
+
 }
@@ -15,6 +15,7 @@
 // specific language governing permissions and limitations
 // under the License.
 
+#include <inttypes.h>                  // PRId64
 #include <sys/time.h>
 #include <gtest/gtest.h>
 #include <iostream>
@@ -1452,6 +1453,93 @@ TEST_F(ProtobufJsonTest, pb_to_json_to_string_complex_perf_case) {
     printf("avg time to convert pb to json is %fus\n", avg_time2);
 }
 
+static void fill_complex_address(AddressComplex* address, int nfriend, int neducation) {
+    address->set_addr("baidu.com");
+    for (int i = 0; i < nfriend; ++i) {
+        AddressComplex::FriendEntry* entry = address->add_friends();
+        entry->set_key(butil::string_printf("friend_%d", i));
+        for (int j = 0; j < neducation; ++j) {
+            AddressComplex::FriendEntry::Education* edu = entry->add_value();
+            edu->set_school(butil::string_printf("school_%d_of_friend_%d", j, i));
+            edu->set_year(2000 + j);
+        }
+    }
+}
+
+static void fill_string_map(AddressStringMap* address, int ncontact) {
+    address->set_addr("baidu.com");
+    for (int i = 0; i < ncontact; ++i) {
+        AddressStringMap::MapFieldEntry* entry = address->add_contacts();
+        entry->set_key(butil::string_printf("contact_%d", i));
+        entry->set_value(butil::string_printf("contact_%d@baidu.com", i));
+    }
+}
+
+template <typename Message>
+static void transcode_perf(const char* name, const Message& msg, int times) {
+    json2pb::Pb2JsonOptions pb2json_opt;
+    pb2json_opt.bytes_to_base64 = false;
+    json2pb::Json2PbOptions json2pb_opt;
+    json2pb_opt.base64_to_bytes = false;
+    std::string error;
+    butil::IOBuf json;
+    ASSERT_TRUE(json2pb::ProtoMessageToJson(msg, &json, pb2json_opt, &error)) << error;
+    Message parsed;
+    butil::IOBufAsZeroCopyInputStream input(json);
+    ASSERT_TRUE(json2pb::JsonToProtoMessage(&input, &parsed, json2pb_opt, &error)) << error;
+    ASSERT_EQ(msg.SerializeAsString(), parsed.SerializeAsString());
+
+    butil::Timer timer;
+    timer.start();
+    for (int i = 0; i < times; ++i) {
+        Message data;
+        butil::IOBufAsZeroCopyInputStream stream(json);
+        ASSERT_TRUE(json2pb::JsonToProtoMessage(&stream, &data, json2pb_opt, &error));
+    }
+    timer.stop();
+    const int64_t json2pb_ns = timer.n_elapsed() / times;
+
+    timer.start();
+    for (int i = 0; i < times; ++i) {
+        butil::IOBuf buf;
+        ASSERT_TRUE(json2pb::ProtoMessageToJson(msg, &buf, pb2json_opt, &error));
+    }
+    timer.stop();
+    const int64_t pb2json_ns = timer.n_elapsed() / times;
+    printf("%s(%zu bytes): json->pb %" PRId64 "ns (%.1fMB/s)"
+           ", pb->json %" PRId64 "ns (%.1fMB/s)\n",
+           name, json.size(), json2pb_ns, json.size() * 1000.0 / json2pb_ns,
+           pb2json_ns, json.size() * 1000.0 / pb2json_ns);
+}
+
+TEST_F(ProtobufJsonTest, transcode_nested_repeated_map_perf_case) {
+    std::ifstream in("jsonout", std::ios::in);
+    std::ostringstream tmp;
+    tmp << in.rdbuf();
+    in.close();
+    gss::message::gss_us_res_t nested;
+    json2pb::Json2PbOptions option;
+    option.base64_to_bytes = false;
+    std::string error;
+    ASSERT_TRUE(json2pb::JsonToProtoMessage(tmp.str(), &nested, option, &error)) << error;
+
+    haha repeated;
+    for (int i = 0; i < 4096; ++i) {
+        repeated.add_a(i * 7919);
+    }
+    AddressComplex complex_map;
+    fill_complex_address(&complex_map, 64, 8);
+    AddressStringMap string_map;
+    fill_string_map(&string_map, 1024);
+
+    ProfilerStart("transcode_perf.prof");
+    transcode_perf("nested", nested, 2000);
+    transcode_perf("repeated", repeated, 2000);
+    transcode_perf("map_of_repeated", complex_map, 2000);
+    transcode_perf("string_map", string_map, 2000);
+    ProfilerStop();
+}
+
 TEST_F(ProtobufJsonTest, encode_decode_case) {
       
     std::string json_key = "abcdek123lske_slkejfl_l1kdle";
@@ -21,6 +21,8 @@
 
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/resource.h>
+#include <dirent.h>
 #include <fstream>
 #include <gtest/gtest.h>
 #include <google/protobuf/descriptor.h>
@@ -51,6 +53,7 @@
 #include "brpc/restful.h"
 #include "brpc/channel.h"
 #include "brpc/socket_map.h"
+#include "brpc/acceptor.h"
 #include "brpc/controller.h"
 #include "brpc/compress.h"
 #include "echo.pb.h"
@@ -1978,4 +1981,195 @@ TEST_F(ServerTest, auth) {
     ASSERT_EQ(0, server.Join());
 }
 
+struct ConnectArg {
+    butil::EndPoint ep;
+    int64_t end_us;
+    int64_t nconnect;
+    int64_t total_latency_us;
+};
+
+static void* ConnectAndRequest(void* arg) {
+    ConnectArg* a = (ConnectArg*)arg;
+    const char req[] = "GET /health HTTP/1.0\r\n\r\n";
+    char buf[256];
+    while (butil::gettimeofday_us() < a->end_us) {
+        const int64_t start_us = butil::gettimeofday_us();
+        butil::fd_guard cfd(tcp_connect(a->ep, NULL));
+        if (cfd < 0) {
+            continue;
+        }
+        if (write(cfd, req, sizeof(req) - 1) != (ssize_t)(sizeof(req) - 1)) {
+            continue;
+        }
+        // The response of /health fits in one read. Server does not close
+        // HTTP/1.0 connections, clients do.
+        if (read(cfd, buf, sizeof(buf)) <= 0) {
+            continue;
+        }
+        a->total_latency_us += butil::gettimeofday_us() - start_us;
+        ++a->nconnect;
+    }
+    return NULL;
+}
+
+TEST_F(ServerTest, reuse_port_listeners) {
+    const int nlisteners[] = { 1, 4, 16 };
+    const int NTHREAD = 8;
+    for (size_t i = 0; i < arraysize(nlisteners); ++i) {
+        brpc::Server server;
+        brpc::ServerOptions opt;
+        opt.num_listeners = nlisteners[i];
+        ASSERT_EQ(0, server.Start("127.0.0.1:0", &opt));
+        ASSERT_EQ((size_t)nlisteners[i], server._am->listened_fd_count());
+
+        ConnectArg args[NTHREAD];
+        pthread_t th[NTHREAD];
+        const int64_t end_us = butil::gettimeofday_us() + 1000000L;
+        for (int j = 0; j < NTHREAD; ++j) {
+            args[j].ep = server.listen_address();
+            args[j].end_us = end_us;
+            args[j].nconnect = 0;
+            args[j].total_latency_us = 0;
+            ASSERT_EQ(0, pthread_create(&th[j], NULL, ConnectAndRequest, &args[j]));
+        }
+        int64_t nconnect = 0;
+        int64_t total_latency_us = 0;
+        for (int j = 0; j < NTHREAD; ++j) {
+            pthread_join(th[j], NULL);
+            nconnect += args[j].nconnect;
+            total_latency_us += args[j].total_latency_us;
+        }
+        ASSERT_GT(nconnect, 0);
+        LOG(INFO) << "num_listeners=" << nlisteners[i]
+                  << " connections/s=" << nconnect
+                  << " avg_latency=" << total_latency_us / nconnect << "us";
+
+        ASSERT_EQ(0, server.Stop(0));
+        ASSERT_EQ(0, server.Join());
+    }
+}
+
+TEST_F(ServerTest, reuse_port_listeners_in_port_range) {
+    // Occupy the first port of the range without SO_REUSEPORT, listeners
+    // should move to the next port altogether.
+    butil::fd_guard occupied;
+    int port = 0;
+    for (int i = 0; i < 100 && port == 0; ++i) {
+        butil::EndPoint ep;
+        ASSERT_EQ(0, butil::str2endpoint("127.0.0.1:0", &ep));
+        occupied.reset(butil::tcp_listen(ep));
+        ASSERT_GE(occupied, 0);
+        ASSERT_EQ(0, butil::get_local_side(occupied, &ep));
+        // The next port should be available.
+        ++ep.port;
+        butil::fd_guard next(butil::tcp_listen(ep, true));
+        if (next >= 0) {
+            port = ep.port - 1;
+        }
+    }
+    ASSERT_NE(0, port);
+    brpc::Server server;
+    brpc::ServerOptions opt;
+    opt.num_listeners = 4;
+    ASSERT_EQ(0, server.Start("127.0.0.1", brpc::PortRange(port, port + 1), &opt));
+    ASSERT_EQ(port + 1, server.listen_address().port);
+    ASSERT_EQ(4u, server._am->listened_fd_count());
+    ASSERT_EQ(0, server.Stop(0));
+    ASSERT_EQ(0, server.Join());
+}
+
+// Returns the largest fd opened by this process.
+static int GetMaxOpenedFd() {
+    int max_fd = -1;
+    DIR* dir = opendir("/proc/self/fd");
+    if (dir == NULL) {
+        return -1;
+    }
+    for (struct dirent* ent = readdir(dir); ent != NULL; ent = readdir(dir)) {
+        max_fd = std::max(max_fd, atoi(ent->d_name));
+    }
+    closedir(dir);
+    return max_fd;
+}
+
+TEST_F(ServerTest, reuse_port_listeners_fail_after_first_one) {
+    // Find two consecutive free ports.
+    int port = 0;
+    for (int i = 0; i < 100 && port == 0; ++i) {
+        butil::EndPoint ep;
+        ASSERT_EQ(0, butil::str2endpoint("127.0.0.1:0", &ep));
+        butil::fd_guard first(butil::tcp_listen(ep, true));
+        ASSERT_GE(first, 0);
+        ASSERT_EQ(0, butil::get_local_side(first, &ep));
+        ++ep.port;
+        butil::fd_guard next(butil::tcp_listen(ep, true));
+        if (next >= 0) {
+            port = ep.port - 1;
+        }
+    }
+    ASSERT_NE(0, port);
+
+    // Make sure that global resources are initialized before limiting fds.
+    {
+        brpc::Server server;
+        ASSERT_EQ(0, server.Start("127.0.0.1:0", NULL));
+        ASSERT_EQ(0, server.Stop(0));
+        ASSERT_EQ(0, server.Join());
+    }
+
+    // Occupy all free fds below the largest opened one and limit fds so
+    // that only the first listener of each port can be created.
+    const int max_fd = GetMaxOpenedFd();
+    ASSERT_GE(max_fd, 0);
+    std::vector<int> fillers;
+    while (true) {
+        const int fd = dup(STDIN_FILENO);
+        ASSERT_GE(fd, 0);
+        if (fd > max_fd) {
+            close(fd);
+            break;
+        }
+        fillers.push_back(fd);
+    }
+    struct rlimit old_limit;
+    ASSERT_EQ(0, getrlimit(RLIMIT_NOFILE, &old_limit));
+    struct rlimit limit = old_limit;
+    limit.rlim_cur = max_fd + 2;
+    ASSERT_EQ(0, setrlimit(RLIMIT_NOFILE, &limit));
+
+#if !BRPC_WITH_GLOG
+    logging::StringSink log_str;
+    logging::LogSink* old_sink = logging::SetLogSink(&log_str);
+#endif
+    brpc::Server server;
+    brpc::ServerOptions opt;
+    opt.num_listeners = 4;
+    const int rc = server.Start("127.0.0.1",
+                                brpc::PortRange(port, port + 1), &opt);
+#if !BRPC_WITH_GLOG
+    ASSERT_EQ(&log_str, logging::SetLogSink(old_sink));
+#endif
+
+    ASSERT_EQ(0, setrlimit(RLIMIT_NOFILE, &old_limit));
+    for (size_t i = 0; i < fillers.size(); ++i) {
+        close(fillers[i]);
+    }
+    ASSERT_EQ(-1, rc);
+#if !BRPC_WITH_GLOG
+    // The first port was given up and the next one was tried.
+    std::ostringstream expected_log;
+    expected_log << "Fail to listen 127.0.0.1:" << port + 1
+                 << " with SO_REUSEPORT";
+    ASSERT_NE(std::string::npos, log_str.find(expected_log.str())) << log_str;
+#endif
+    // All listeners of both ports were closed, so the ports can be bound
+    // without SO_REUSEPORT again.
+    for (int i = 0; i < 2; ++i) {
+        butil::EndPoint ep;
+        ASSERT_EQ(0, butil::str2endpoint("127.0.0.1", port + i, &ep));
+        butil::fd_guard fd(butil::tcp_listen(ep));
+        ASSERT_GE(fd, 0) << "port=" << port + i;
+    }
+}
+
 } //namespace
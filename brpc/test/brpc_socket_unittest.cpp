@@ -60,6 +60,10 @@ DECLARE_int32(socket_keepalive_idle_s);
 DECLARE_int32(socket_keepalive_interval_s);
 DECLARE_int32(socket_keepalive_count);
 DECLARE_int32(socket_tcp_user_timeout_ms);
+DECLARE_int64(socket_max_buffered_bytes);
+DECLARE_int64(socket_write_coalesce_max_bytes);
+DECLARE_int32(socket_max_write_coalesce_delay_us);
+extern SocketVarsCollector* g_vars;
 }
 
 void EchoProcessHuluRequest(brpc::InputMessageBase* msg_base);
@@ -1437,6 +1441,176 @@ TEST_F(SocketTest, tcp_user_timeout) {
 }
 #endif
 
+#if defined(OS_LINUX)
+struct ZeroCopyReaderArg {
+    int fd;
+    size_t expected;
+    std::string received;
+};
+
+void* ReadUntilExpected(void* void_arg) {
+    ZeroCopyReaderArg* arg = static_cast<ZeroCopyReaderArg*>(void_arg);
+    char buf[65536];
+    while (arg->received.size() < arg->expected) {
+        const ssize_t nr = read(arg->fd, buf, sizeof(buf));
+        if (nr <= 0) {
+            break;
+        }
+        arg->received.append(buf, nr);
+    }
+    return NULL;
+}
+
+TEST_F(SocketTest, zerocopy_write) {
+    butil::EndPoint point(butil::IP_ANY, 0);
+    butil::fd_guard listening_fd(tcp_listen(point));
+    ASSERT_GT(listening_fd, 0);
+    ASSERT_EQ(0, butil::get_local_side(listening_fd, &point));
+    point.ip = butil::my_ip();
+    const int sockfd = tcp_connect(point, NULL);
+    ASSERT_GT(sockfd, 0);
+    butil::fd_guard peer_fd(accept(listening_fd, NULL, NULL));
+    ASSERT_GT(peer_fd, 0);
+
+    brpc::SocketOptions options;
+    options.fd = sockfd;
+    options.zerocopy_threshold = 64 * 1024;
+    brpc::SocketId id;
+    ASSERT_EQ(0, brpc::Socket::Create(options, &id));
+    brpc::SocketUniquePtr s;
+    ASSERT_EQ(0, brpc::Socket::Address(id, &s));
+    if (s->_zerocopy == NULL) {
+        LOG(WARNING) << "Kernel does not support SO_ZEROCOPY, skip";
+        return;
+    }
+
+    const int64_t nzerocopy_before = brpc::g_vars->nzerocopy.get_value();
+    const int64_t ncopied_before = brpc::g_vars->nzerocopy_copied.get_value();
+    std::string expected;
+    ZeroCopyReaderArg arg;
+    arg.fd = peer_fd;
+    for (size_t i = 0; i < 16; ++i) {
+        // Interleave large writes with small ones that are copied.
+        expected.append(i % 2 ? 100 : 1024 * 1024, 'a' + i);
+    }
+    arg.expected = expected.size();
+    pthread_t th;
+    ASSERT_EQ(0, pthread_create(&th, NULL, ReadUntilExpected, &arg));
+    size_t offset = 0;
+    for (size_t i = 0; i < 16; ++i) {
+        const size_t len = (i % 2 ? 100 : 1024 * 1024);
+        butil::IOBuf src;
+        src.append(expected.data() + offset, len);
+        offset += len;
+        ASSERT_EQ(0, s->Write(&src));
+    }
+    pthread_join(th, NULL);
+    ASSERT_EQ(expected.size(), arg.received.size());
+    ASSERT_TRUE(expected == arg.received);
+    ASSERT_LT(nzerocopy_before, brpc::g_vars->nzerocopy.get_value());
+
+    // All written blocks are released after completions are reaped.
+    const int64_t start_time = butil::gettimeofday_us();
+    while (s->ReapZeroCopyCompletions() != 0) {
+        ASSERT_LT(butil::gettimeofday_us(), start_time + 1000000L) << "Too long!";
+        bthread_usleep(1000);
+    }
+    // The kernel always copies data sent over loopback and reports
+    // SO_EE_CODE_ZEROCOPY_COPIED, so this test only checks completions and
+    // releasing of the blocks, not sending from pinned pages.
+    const int64_t nzerocopy = brpc::g_vars->nzerocopy.get_value() - nzerocopy_before;
+    const int64_t ncopied = brpc::g_vars->nzerocopy_copied.get_value() - ncopied_before;
+    LOG(INFO) << "nzerocopy=" << nzerocopy << " nzerocopy_copied=" << ncopied;
+    ASSERT_GE(ncopied, nzerocopy);
+    ASSERT_EQ(0, s->SetFailed());
+}
+
+static butil::atomic<bool> g_zerocopy_data_released(false);
+
+static void ReleaseZeroCopyData(void* data) {
+    free(data);
+    g_zerocopy_data_released.store(true);
+}
+
+TEST_F(SocketTest, close_with_zerocopy_writes_in_flight) {
+    butil::EndPoint point(butil::IP_ANY, 0);
+    butil::fd_guard listening_fd(tcp_listen(point));
+    ASSERT_GT(listening_fd, 0);
+    // Keep the window small so that most data stays in the send queue.
+    int rcvbuf = 64 * 1024;
+    ASSERT_EQ(0, setsockopt(listening_fd, SOL_SOCKET, SO_RCVBUF,
+                            &rcvbuf, sizeof(rcvbuf)));
+    ASSERT_EQ(0, butil::get_local_side(listening_fd, &point));
+    point.ip = butil::my_ip();
+    const int sockfd = tcp_connect(point, NULL);
+    ASSERT_GT(sockfd, 0);
+    // Large enough to queue all the data, so that the write completes and
+    // the socket can be recycled while the peer does not read.
+    int sndbuf = 1024 * 1024;
+    ASSERT_EQ(0, setsockopt(sockfd, SOL_SOCKET, SO_SNDBUF,
+                            &sndbuf, sizeof(sndbuf)));
+    butil::fd_guard peer_fd(accept(listening_fd, NULL, NULL));
+    ASSERT_GT(peer_fd, 0);
+
+    brpc::SocketOptions options;
+    options.fd = sockfd;
+    options.zerocopy_threshold = 64 * 1024;
+    brpc::SocketId id;
+    ASSERT_EQ(0, brpc::Socket::Create(options, &id));
+    brpc::SocketUniquePtr s;
+    ASSERT_EQ(0, brpc::Socket::Address(id, &s));
+    if (s->_zerocopy == NULL) {
+        LOG(WARNING) << "Kernel does not support SO_ZEROCOPY, skip";
+        s->SetFailed();
+        return;
+    }
+
+    const size_t len = 256 * 1024;
+    char* data = (char*)malloc(len);
+    for (size_t i = 0; i < len; ++i) {
+        data[i] = (char)(i % 251);
+    }
+    butil::IOBuf src;
+    g_zerocopy_data_released.store(false);
+    ASSERT_EQ(0, src.append_user_data(data, len, ReleaseZeroCopyData));
+    const int64_t nzerocopy_before = brpc::g_vars->nzerocopy.get_value();
+    ASSERT_EQ(0, s->Write(&src));
+    ASSERT_LT(nzerocopy_before, brpc::g_vars->nzerocopy.get_value());
+
+    // Close the connection while the peer does not read.
+    ASSERT_EQ(0, s->SetFailed());
+    s.reset();
+    int64_t start_time = butil::gettimeofday_us();
+    while (brpc::Socket::Status(id) != -1) {
+        ASSERT_LT(butil::gettimeofday_us(), start_time + 5000000L) << "Too long!";
+        bthread_usleep(1000);
+    }
+    // The kernel is still sending the blocks.
+    ASSERT_FALSE(g_zerocopy_data_released.load());
+
+    // The written data is intact and followed by EOF.
+    char buf[65536];
+    size_t nread = 0;
+    while (true) {
+        const ssize_t nr = read(peer_fd, buf, sizeof(buf));
+        if (nr == 0) {
+            break;
+        }
+        ASSERT_GT(nr, 0) << berror();
+        for (ssize_t i = 0; i < nr; ++i) {
+            ASSERT_EQ((char)((nread + i) % 251), buf[i]);
+        }
+        nread += nr;
+    }
+    ASSERT_EQ(len, nread);
+    start_time = butil::gettimeofday_us();
+    while (!g_zerocopy_data_released.load()) {
+        ASSERT_LT(butil::gettimeofday_us(), start_time + 5000000L) << "Too long!";
+        bthread_usleep(1000);
+    }
+}
+#endif
+
 int HandleSocketSuccessWrite(bthread_id_t id, void* data, int error_code,
     const std::string& error_text) {
     auto success_count = static_cast<size_t*>(data);
@@ -1447,6 +1621,81 @@ int HandleSocketSuccessWrite(bthread_id_t id, void* data, int error_code,
     return 0;
 }
 
+// Returns syscalls per written request when `n' small requests are
+// written with `coalesce_delay_us'.
+double WriteSmallRequests(int coalesce_delay_us, size_t n) {
+    int fds[2];
+    EXPECT_EQ(0, socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+    butil::fd_guard peer_fd(fds[0]);
+    brpc::SocketOptions options;
+    options.fd = fds[1];
+    brpc::SocketId id;
+    EXPECT_EQ(0, brpc::Socket::Create(options, &id));
+    brpc::SocketUniquePtr s;
+    EXPECT_EQ(0, brpc::Socket::Address(id, &s));
+
+    const int64_t nsyscall0 = brpc::g_vars->nwrite_syscall.get_value();
+    const int64_t nrequest0 = brpc::g_vars->nwritten_request.get_value();
+    brpc::Socket::WriteOptions wopt;
+    wopt.coalesce_delay_us = coalesce_delay_us;
+    std::string expected;
+    for (size_t i = 0; i < n; ++i) {
+        char buf[32];
+        const int len = snprintf(buf, sizeof(buf), "%015zu,", i);
+        butil::IOBuf src;
+        src.append(buf, len);
+        expected.append(buf, len);
+        EXPECT_EQ(0, s->Write(&src, &wopt));
+    }
+    std::string received;
+    while (received.size() < expected.size()) {
+        char buf[4096];
+        const ssize_t nr = read(peer_fd, buf, sizeof(buf));
+        EXPECT_GT(nr, 0);
+        if (nr <= 0) {
+            break;
+        }
+        received.append(buf, nr);
+    }
+    EXPECT_TRUE(expected == received);
+    // Wait for the last requests to be returned.
+    const int64_t start_time = butil::gettimeofday_us();
+    while (brpc::g_vars->nwritten_request.get_value() - nrequest0 < (int64_t)n
+           && butil::gettimeofday_us() < start_time + 1000000L) {
+        bthread_usleep(1000);
+    }
+    const int64_t nsyscall = brpc::g_vars->nwrite_syscall.get_value() - nsyscall0;
+    const int64_t nrequest = brpc::g_vars->nwritten_request.get_value() - nrequest0;
+    EXPECT_EQ((int64_t)n, nrequest);
+    EXPECT_EQ(0, s->SetFailed());
+    return (double)nsyscall / nrequest;
+}
+
+TEST_F(SocketTest, write_coalescing) {
+    const size_t N = 1000;
+    const double no_delay = WriteSmallRequests(0, N);
+    const double delay = WriteSmallRequests(500, N);
+    LOG(INFO) << "syscalls per request: no_delay=" << no_delay
+              << " delay_500us=" << delay;
+    ASSERT_LT(delay, no_delay);
+
+    // The delay is bounded by -socket_max_write_coalesce_delay_us.
+    const int saved_max_delay = brpc::FLAGS_socket_max_write_coalesce_delay_us;
+    brpc::FLAGS_socket_max_write_coalesce_delay_us = 0;
+    const double disabled = WriteSmallRequests(500, N);
+    brpc::FLAGS_socket_max_write_coalesce_delay_us = saved_max_delay;
+    ASSERT_GT(disabled, delay);
+
+    // Requests beyond the byte budget are written in later rounds.
+    const int64_t saved_max_bytes = brpc::FLAGS_socket_write_coalesce_max_bytes;
+    brpc::FLAGS_socket_write_coalesce_max_bytes = 1;
+    const double one_by_one = WriteSmallRequests(500, N);
+    brpc::FLAGS_socket_write_coalesce_max_bytes = saved_max_bytes;
+    LOG(INFO) << "syscalls per request: max_delay=0 " << disabled
+              << " max_bytes=1 " << one_by_one;
+    ASSERT_GE(one_by_one, 1.0);
+}
+
 TEST_F(SocketTest, notify_on_success) {
     const size_t REP = 10000;
     int fds[2];
@@ -1617,6 +1866,103 @@ void TestShutdownWrite() {
     EXPECT_EQ((size_t)1, success_count);
 }
 
+struct DrainArg {
+    int fd;
+    size_t expected;
+    size_t nread;
+};
+
+void* DrainUntilExpected(void* void_arg) {
+    DrainArg* arg = static_cast<DrainArg*>(void_arg);
+    char buf[65536];
+    while (arg->nread < arg->expected) {
+        const ssize_t nr = read(arg->fd, buf, sizeof(buf));
+        if (nr <= 0) {
+            break;
+        }
+        arg->nread += nr;
+    }
+    return NULL;
+}
+
+TEST_F(SocketTest, max_buffered_bytes) {
+    butil::EndPoint point(butil::IP_ANY, 0);
+    butil::fd_guard listening_fd(tcp_listen(point));
+    ASSERT_GT(listening_fd, 0);
+    ASSERT_EQ(0, butil::get_local_side(listening_fd, &point));
+    point.ip = butil::my_ip();
+    brpc::SocketUniquePtr s[2];
+    butil::fd_guard peer_fd[2];
+    for (int i = 0; i < 2; ++i) {
+        brpc::SocketOptions options;
+        options.fd = tcp_connect(point, NULL);
+        ASSERT_GT(options.fd, 0);
+        peer_fd[i].reset(accept(listening_fd, NULL, NULL));
+        ASSERT_GT(peer_fd[i], 0);
+        brpc::SocketId id;
+        ASSERT_EQ(0, brpc::Socket::Create(options, &id));
+        ASSERT_EQ(0, brpc::Socket::Address(id, &s[i]));
+    }
+    const int64_t read_buf_bytes0 = brpc::g_vars->read_buf_bytes.get_value();
+    const int64_t unwritten_bytes0 = brpc::g_vars->unwritten_bytes.get_value();
+    const int64_t nthrottled_write0 = brpc::g_vars->nthrottled_write.get_value();
+
+    // Nobody reads the peer, so most of the data can't be written out.
+    const size_t WRITTEN = 32 * 1024 * 1024;
+    std::string data(WRITTEN, 'a');
+    butil::IOBuf src;
+    src.append(data);
+    ASSERT_EQ(0, s[0]->Write(&src));
+    ASSERT_GT(s[0]->unwritten_bytes(), 0);
+    ASSERT_EQ(unwritten_bytes0 + s[0]->unwritten_bytes(),
+              brpc::g_vars->unwritten_bytes.get_value());
+    s[0]->_read_buf.append(std::string(1000, 'b'));
+    s[0]->UpdateReadBufBytes();
+    s[1]->_read_buf.append(std::string(100, 'b'));
+    s[1]->UpdateReadBufBytes();
+    ASSERT_EQ(1000, s[0]->read_buf_bytes());
+    ASSERT_EQ(read_buf_bytes0 + 1100, brpc::g_vars->read_buf_bytes.get_value());
+    ASSERT_FALSE(s[0]->ShouldThrottleRead());
+    ASSERT_FALSE(s[0]->ShouldThrottleWrite());
+
+    brpc::FLAGS_socket_max_buffered_bytes = 1;
+    bthread_usleep(20000);  // wait for refreshing of the memory pressure
+    // Only sockets holding more bytes than average are throttled.
+    ASSERT_TRUE(s[0]->ShouldThrottleRead());
+    ASSERT_FALSE(s[1]->ShouldThrottleRead());
+    src.append("hello");
+    ASSERT_EQ(-1, s[0]->Write(&src));
+    ASSERT_EQ(brpc::EOVERCROWDED, errno);
+    ASSERT_EQ(nthrottled_write0 + 1, brpc::g_vars->nthrottled_write.get_value());
+    ASSERT_EQ(0, s[1]->Write(&src));
+    brpc::FLAGS_socket_max_buffered_bytes = 0;
+    ASSERT_FALSE(s[0]->ShouldThrottleRead());
+    butil::IOBuf src2;
+    src2.append("world");
+    ASSERT_EQ(0, s[0]->Write(&src2));
+
+    // Counters go back after buffers are drained.
+    DrainArg arg = { peer_fd[0], WRITTEN + 5, 0 };
+    pthread_t th;
+    ASSERT_EQ(0, pthread_create(&th, NULL, DrainUntilExpected, &arg));
+    pthread_join(th, NULL);
+    ASSERT_EQ(WRITTEN + 5, arg.nread);
+    char buf[16];
+    ASSERT_EQ(5, read(peer_fd[1], buf, sizeof(buf)));
+    const int64_t start_time = butil::gettimeofday_us();
+    while (s[0]->unwritten_bytes() != 0) {
+        ASSERT_LT(butil::gettimeofday_us(), start_time + 1000000L) << "Too long!";
+        bthread_usleep(1000);
+    }
+    for (int i = 0; i < 2; ++i) {
+        s[i]->_read_buf.clear();
+        s[i]->UpdateReadBufBytes();
+        ASSERT_EQ(0, s[i]->SetFailed());
+    }
+    ASSERT_EQ(read_buf_bytes0, brpc::g_vars->read_buf_bytes.get_value());
+    ASSERT_EQ(unwritten_bytes0, brpc::g_vars->unwritten_bytes.get_value());
+}
+
 TEST_F(SocketTest, shutdown_write) {
     for (int i = 0; i < 100; ++i) {
         TestShutdownWrite();
@@ -40,6 +40,7 @@
 namespace brpc {
 
 void ExtractHostnames(X509* x, std::vector<std::string>* hostnames);
+extern SocketVarsCollector* g_vars;
 } // namespace brpc
 
 
@@ -228,6 +229,130 @@ TEST_F(SSLTest, force_ssl) {
     ASSERT_EQ(0, server.Join());
 }
 
+// Returns MB/s of sending requests with `attachment_size' bytes attachment
+// over SSL.
+double SendLargeRPC(int port, bool enable_ktls, size_t attachment_size) {
+    brpc::Channel channel;
+    brpc::ChannelOptions coptions;
+    coptions.mutable_ssl_options()->sni_name = "localhost";
+    coptions.mutable_ssl_options()->enable_ktls = enable_ktls;
+    coptions.timeout_ms = 10000;
+    EXPECT_EQ(0, channel.Init("127.0.0.1", port, &coptions));
+    test::EchoService_Stub stub(&channel);
+    const std::string attachment(attachment_size, 'a');
+    const int COUNT = 100;
+    butil::Timer tm;
+    tm.start();
+    for (int i = 0; i < COUNT; ++i) {
+        brpc::Controller cntl;
+        test::EchoRequest req;
+        test::EchoResponse res;
+        req.set_message(EXP_REQUEST);
+        cntl.request_attachment().append(attachment);
+        stub.Echo(&cntl, &req, &res, NULL);
+        EXPECT_EQ(EXP_RESPONSE, res.message()) << cntl.ErrorText();
+    }
+    tm.stop();
+    return (double)attachment_size * COUNT / tm.u_elapsed();
+}
+
+TEST_F(SSLTest, ktls) {
+    const int port = 8613;
+    brpc::Server server;
+    brpc::ServerOptions options;
+    brpc::CertInfo cert;
+    cert.certificate = "cert1.crt";
+    cert.private_key = "cert1.key";
+    options.mutable_ssl_options()->default_cert = cert;
+    options.mutable_ssl_options()->enable_ktls = true;
+    EchoServiceImpl echo_svc;
+    ASSERT_EQ(0, server.AddService(
+        &echo_svc, brpc::SERVER_DOESNT_OWN_SERVICE));
+    ASSERT_EQ(0, server.Start(port, &options));
+
+    // Connections fall back to OpenSSL when the kernel doesn't support kTLS.
+    const int64_t nktls0 = brpc::g_vars->nktls.get_value();
+    const size_t sizes[] = { 4096, 1024 * 1024 };
+    for (size_t i = 0; i < ARRAY_SIZE(sizes); ++i) {
+        const double bio_tp = SendLargeRPC(port, false, sizes[i]);
+        const double ktls_tp = SendLargeRPC(port, true, sizes[i]);
+        LOG(INFO) << "attachment=" << sizes[i] << " bio=" << bio_tp
+                  << "MB/s ktls=" << ktls_tp << "MB/s";
+    }
+    LOG(INFO) << "Connections using kTLS: "
+              << brpc::g_vars->nktls.get_value() - nktls0;
+
+    ASSERT_EQ(0, server.Stop(0));
+    ASSERT_EQ(0, server.Join());
+}
+
+// Returns microseconds per RPC over short connections.
+int64_t SendShortRPC(int port, int session_cache_size, int count) {
+    brpc::Channel channel;
+    brpc::ChannelOptions coptions;
+    coptions.mutable_ssl_options()->sni_name = "localhost";
+    coptions.mutable_ssl_options()->session_cache_size = session_cache_size;
+    coptions.connection_type = "short";
+    EXPECT_EQ(0, channel.Init("127.0.0.1", port, &coptions));
+    butil::Timer tm;
+    tm.start();
+    SendMultipleRPC(&channel, count);
+    tm.stop();
+    return tm.u_elapsed() / count;
+}
+
+TEST_F(SSLTest, session_resumption) {
+    const int port = 8613;
+    brpc::Server server;
+    brpc::ServerOptions options;
+    brpc::CertInfo cert;
+    cert.certificate = "cert1.crt";
+    cert.private_key = "cert1.key";
+    options.mutable_ssl_options()->default_cert = cert;
+    options.mutable_ssl_options()->session_ticket_key_rotation_s = 1;
+    EchoServiceImpl echo_svc;
+    ASSERT_EQ(0, server.AddService(
+        &echo_svc, brpc::SERVER_DOESNT_OWN_SERVICE));
+    ASSERT_EQ(0, server.Start(port, &options));
+
+    const int COUNT = 50;
+    // Both sides of a resumed handshake are counted.
+    int64_t nresumed0 = brpc::g_vars->nssl_resumed.get_value();
+    const int64_t full_us = SendShortRPC(port, 0, COUNT);
+    ASSERT_EQ(nresumed0, brpc::g_vars->nssl_resumed.get_value());
+
+    const int64_t resumed_us = SendShortRPC(port, 16, COUNT);
+    // The first connection can't be resumed.
+    ASSERT_EQ(2 * (COUNT - 1),
+              brpc::g_vars->nssl_resumed.get_value() - nresumed0);
+    LOG(INFO) << "full_handshake=" << full_us << "us/rpc"
+              << " resumed_handshake=" << resumed_us << "us/rpc";
+
+    // Tickets encrypted with the previous key are still accepted after
+    // rotation and renewed with the current key.
+    brpc::Channel channel;
+    brpc::ChannelOptions coptions;
+    coptions.mutable_ssl_options()->sni_name = "localhost";
+    coptions.mutable_ssl_options()->session_cache_size = 16;
+    coptions.connection_type = "short";
+    ASSERT_EQ(0, channel.Init("127.0.0.1", port, &coptions));
+    SendMultipleRPC(&channel, 1);
+    for (int i = 0; i < 2; ++i) {
+        bthread_usleep(1100000);
+        nresumed0 = brpc::g_vars->nssl_resumed.get_value();
+        SendMultipleRPC(&channel, 1);
+        ASSERT_EQ(2, brpc::g_vars->nssl_resumed.get_value() - nresumed0);
+    }
+    // Tickets encrypted with a key older than the previous one are rejected.
+    bthread_usleep(2100000);
+    nresumed0 = brpc::g_vars->nssl_resumed.get_value();
+    SendMultipleRPC(&channel, 1);
+    ASSERT_EQ(nresumed0, brpc::g_vars->nssl_resumed.get_value());
+
+    ASSERT_EQ(0, server.Stop(0));
+    ASSERT_EQ(0, server.Join());
+}
+
 void ProcessResponse(brpc::InputMessageBase* msg_base) {
     brpc::DestroyingPtr<brpc::policy::MostCommonMessage> msg(
         static_cast<brpc::policy::MostCommonMessage*>(msg_base));
@@ -16,6 +16,7 @@
 // under the License.
 
 #include <gtest/gtest.h>
+#include <gflags/gflags.h>
 #include "butil/compat.h"
 #include "butil/time.h"
 #include "butil/macros.h"
@@ -26,6 +27,11 @@
 #include "bthread/task_control.h"
 #include "bthread/mutex.h"
 #include "butil/gperftools_profiler.h"
+#include "bvar/variable.h"
+
+namespace bthread {
+DECLARE_int32(bthread_butex_max_spin);
+}
 
 namespace {
 inline unsigned* get_butex(bthread_mutex_t & m) {
@@ -240,6 +246,23 @@ TEST(MutexTest, performance) {
     PerfTest(&bth_mutex, (bthread_t*)NULL, thread_num, bthread_start_background, bthread_join);
 }
 
+TEST(MutexTest, performance_with_butex_spin) {
+    const int thread_num = 12;
+    const int max_spins[] = { 0, 1000 };
+    for (size_t i = 0; i < arraysize(max_spins); ++i) {
+        bthread::FLAGS_bthread_butex_max_spin = max_spins[i];
+        LOG(INFO) << "bthread_butex_max_spin=" << max_spins[i];
+        bthread::Mutex bth_mutex;
+        PerfTest(&bth_mutex, (pthread_t*)NULL, thread_num, pthread_create, pthread_join);
+        PerfTest(&bth_mutex, (bthread_t*)NULL, thread_num, bthread_start_background, bthread_join);
+        LOG(INFO) << "spin_success="
+                  << bvar::Variable::describe_exposed("bthread_butex_spin_success")
+                  << " spin_failure="
+                  << bvar::Variable::describe_exposed("bthread_butex_spin_failure");
+    }
+    bthread::FLAGS_bthread_butex_max_spin = 0;
+}
+
 template <typename Mutex>
 void* loop_until_stopped(void* arg) {
     auto m = (Mutex*)arg;
@@ -0,0 +1,157 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+#include <signal.h>
+#include <sys/wait.h>
+#include <fstream>
+#include <gflags/gflags.h>
+#include <gtest/gtest.h>
+#include "butil/time.h"
+#include "butil/logging.h"
+#include "bthread/bthread.h"
+#include "bthread/stack.h"
+
+DECLARE_bool(stack_pool);
+DECLARE_bool(stack_pool_huge_page);
+DECLARE_int32(guard_page_size);
+
+int main(int argc, char* argv[]) {
+    // Stacks of bthreads in this test are all from the pool.
+    FLAGS_stack_pool = true;
+    testing::InitGoogleTest(&argc, argv);
+    GFLAGS_NAMESPACE::ParseCommandLineFlags(&argc, &argv, true);
+    return RUN_ALL_TESTS();
+}
+
+namespace {
+
+int count_vmas() {
+    std::ifstream maps("/proc/self/maps");
+    std::string line;
+    int n = 0;
+    while (std::getline(maps, line)) {
+        ++n;
+    }
+    return n;
+}
+
+void allocate_stacks(bool pooled, bool huge_page, int guardsize) {
+    const int N = 10000;
+    const int STACK_SIZE = 32768;
+    FLAGS_stack_pool = pooled;
+    FLAGS_stack_pool_huge_page = huge_page;
+    std::vector<bthread::StackStorage> stacks(N);
+    const int vmas_before = count_vmas();
+    butil::Timer tm;
+    tm.start();
+    for (int i = 0; i < N; ++i) {
+        ASSERT_EQ(0, bthread::allocate_stack_storage(
+                      &stacks[i], STACK_SIZE, guardsize));
+        ASSERT_EQ(pooled, stacks[i].pooled);
+    }
+    tm.stop();
+    const int vmas_after = count_vmas();
+    for (int i = 0; i < N; ++i) {
+        // Stacks are writable.
+        memset((char*)stacks[i].bottom - stacks[i].stacksize, 0, 4096);
+    }
+    LOG(INFO) << (pooled ? (huge_page ? "stack pool(huge page)" : "stack pool")
+                  : "mmap") << " guardsize=" << guardsize
+              << ": allocated " << N << " stacks in " << tm.n_elapsed() / N
+              << "ns each, vma_count " << vmas_before << " -> " << vmas_after;
+    for (int i = 0; i < N; ++i) {
+        bthread::deallocate_stack_storage(&stacks[i]);
+    }
+    FLAGS_stack_pool = true;
+    FLAGS_stack_pool_huge_page = false;
+}
+
+TEST(StackTest, vma_count_and_allocation_latency) {
+    allocate_stacks(false, false, 4096);
+    allocate_stacks(true, false, 4096);
+    allocate_stacks(false, false, 0);
+    allocate_stacks(true, false, 0);
+    allocate_stacks(true, true, 0);
+}
+
+TEST(StackTest, pooled_stacks_are_reused) {
+    bthread::StackStorage s1;
+    ASSERT_EQ(0, bthread::allocate_stack_storage(&s1, 65536, 4096));
+    ASSERT_TRUE(s1.pooled);
+    void* const bottom = s1.bottom;
+    bthread::deallocate_stack_storage(&s1);
+    bthread::StackStorage s2;
+    ASSERT_EQ(0, bthread::allocate_stack_storage(&s2, 65536, 4096));
+    ASSERT_EQ(bottom, s2.bottom);
+    // The memory was given back and is zero-filled.
+    ASSERT_EQ(0, *((char*)s2.bottom - 1));
+    bthread::deallocate_stack_storage(&s2);
+}
+
+TEST(StackTest, guard_page_of_pooled_stack) {
+    bthread::StackStorage s;
+    ASSERT_EQ(0, bthread::allocate_stack_storage(&s, 65536, 4096));
+    ASSERT_EQ(4096, s.guardsize);
+    char* const guard = (char*)s.bottom - s.stacksize - s.guardsize;
+    pid_t pid = fork();
+    ASSERT_GE(pid, 0);
+    if (pid == 0) {
+        // Overflowing the stack.
+        *(volatile char*)(guard + 100) = 1;
+        _exit(0);
+    }
+    int status = 0;
+    ASSERT_EQ(pid, waitpid(pid, &status, 0));
+    ASSERT_TRUE(WIFSIGNALED(status));
+    ASSERT_EQ(SIGSEGV, WTERMSIG(status));
+    bthread::deallocate_stack_storage(&s);
+}
+
+int recurse(int depth) {
+    char buf[256];
+    memset(buf, depth, sizeof(buf));
+    if (depth == 0) {
+        return buf[0];
+    }
+    return recurse(depth - 1) + buf[depth % sizeof(buf)];
+}
+
+void* use_stack(void* arg) {
+    *(int*)arg = recurse(50);
+    bthread_usleep(1000);
+    return NULL;
+}
+
+TEST(StackTest, run_bthreads_on_pooled_stacks) {
+    const int N = 2000;
+    std::vector<bthread_t> tids(N);
+    std::vector<int> results(N, -1);
+    butil::Timer tm;
+    tm.start();
+    for (int i = 0; i < N; ++i) {
+        ASSERT_EQ(0, bthread_start_background(
+                      &tids[i], &BTHREAD_ATTR_SMALL, use_stack, &results[i]));
+    }
+    tm.stop();
+    for (int i = 0; i < N; ++i) {
+        ASSERT_EQ(0, bthread_join(tids[i], NULL));
+        ASSERT_EQ(recurse(50), results[i]);
+    }
+    LOG(INFO) << "Created " << N << " bthreads in " << tm.u_elapsed() << "us";
+}
+
+} // namespace
@@ -0,0 +1,117 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+#include <sched.h>
+#include <gflags/gflags.h>
+#include <gtest/gtest.h>
+#include "butil/atomicops.h"
+#include "butil/time.h"
+#include "bthread/bthread.h"
+#include "bthread/task_control.h"
+#include "bthread/task_group.h"
+
+DECLARE_bool(task_group_cpu_affinity);
+DECLARE_bool(task_group_numa_aware);
+
+namespace bthread {
+extern TaskControl* g_task_control;
+}
+
+int main(int argc, char* argv[]) {
+    FLAGS_task_group_cpu_affinity = true;
+    FLAGS_task_group_numa_aware = true;
+    testing::InitGoogleTest(&argc, argv);
+    GFLAGS_NAMESPACE::ParseCommandLineFlags(&argc, &argv, true);
+    return RUN_ALL_TESTS();
+}
+
+namespace {
+
+butil::atomic<int> nrun(0);
+
+void* add_one(void*) {
+    nrun.fetch_add(1, butil::memory_order_relaxed);
+    return NULL;
+}
+
+void* spawn_many(void* arg) {
+    const int n = *static_cast<int*>(arg);
+    std::vector<bthread_t> tids(n);
+    for (int i = 0; i < n; ++i) {
+        EXPECT_EQ(0, bthread_start_background(&tids[i], NULL, add_one, NULL));
+    }
+    for (int i = 0; i < n; ++i) {
+        bthread_join(tids[i], NULL);
+    }
+    return NULL;
+}
+
+TEST(TaskControlTest, workers_are_pinned_to_numa_nodes) {
+    // Start bthread.
+    bthread_t th;
+    ASSERT_EQ(0, bthread_start_background(&th, NULL, add_one, NULL));
+    ASSERT_EQ(0, bthread_join(th, NULL));
+
+    bthread::TaskControl* c = bthread::g_task_control;
+    ASSERT_TRUE(c != NULL);
+    const int nnode = c->numa_node_num();
+    ASSERT_GE(nnode, 1);
+    ASSERT_FALSE(c->_worker_cpus.empty());
+
+    const size_t ngroup = c->tag_ngroup(BTHREAD_TAG_DEFAULT).load();
+    ASSERT_GT(ngroup, 0u);
+    auto& groups = c->tag_group(BTHREAD_TAG_DEFAULT);
+    for (size_t i = 0; i < ngroup; ++i) {
+        bthread::TaskGroup* g = groups[i];
+        ASSERT_TRUE(g != NULL);
+        ASSERT_GE(g->numa_node(), 0);
+        ASSERT_LT(g->numa_node(), nnode);
+        cpu_set_t cs;
+        CPU_ZERO(&cs);
+        ASSERT_EQ(0, sched_getaffinity(g->tid(), sizeof(cs), &cs));
+        ASSERT_EQ(1, CPU_COUNT(&cs)) << "worker=" << g->tid();
+        for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+            if (CPU_ISSET(cpu, &cs)) {
+                // Node of the group is the node of the cpu it is pinned to.
+                ASSERT_EQ(nnode > 1 ? c->_cpu_nodes[cpu] : 0, g->numa_node());
+            }
+        }
+    }
+}
+
+TEST(TaskControlTest, run_tasks_with_pinned_workers) {
+    const int N = 16;
+    int per_spawner = 1000;
+    std::vector<bthread_t> tids(N);
+    nrun.store(0);
+    butil::Timer tm;
+    tm.start();
+    for (int i = 0; i < N; ++i) {
+        ASSERT_EQ(0, bthread_start_background(
+                      &tids[i], NULL, spawn_many, &per_spawner));
+    }
+    for (int i = 0; i < N; ++i) {
+        ASSERT_EQ(0, bthread_join(tids[i], NULL));
+    }
+    tm.stop();
+    ASSERT_EQ(N * per_spawner, nrun.load());
+    LOG(INFO) << "Ran " << N * per_spawner << " bthreads in "
+              << tm.m_elapsed() << "ms with "
+              << bthread::g_task_control->numa_node_num() << " NUMA node(s)";
+}
+
+} // namespace
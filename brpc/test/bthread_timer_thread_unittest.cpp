@@ -21,6 +21,7 @@
 #include "bthread/timer_thread.h"
 #include "bthread/bthread.h"
 #include "butil/logging.h"
+#include "butil/fast_rand.h"
 
 namespace {
 
@@ -254,4 +255,141 @@ TEST(TimerThreadTest, schedule_and_unschedule_in_task) {
     keeper5.expect_first_run();
 }
 
+struct WheelTask {
+    int64_t expected_run_time;
+    int64_t run_time;
+    bthread::TimerThread::TaskId task_id;
+    bool unscheduled;
+
+    static void routine(void* arg) {
+        static_cast<WheelTask*>(arg)->run_time = butil::gettimeofday_us();
+    }
+};
+
+TEST(TimerThreadTest, timing_wheel_runs_tasks_in_time) {
+    bthread::TimerThreadOptions options;
+    options.use_timing_wheel = true;
+    // A small tick to cascade through several levels of the wheel.
+    options.timing_wheel_tick_us = 10;
+    bthread::TimerThread timer_thread;
+    ASSERT_EQ(0, timer_thread.start(&options));
+
+    const size_t N = 2000;
+    std::vector<WheelTask> tasks(N);
+    const int64_t start_us = butil::gettimeofday_us();
+    for (size_t i = 0; i < N; ++i) {
+        WheelTask& t = tasks[i];
+        t.expected_run_time = start_us + butil::fast_rand_less_than(1500000);
+        t.run_time = 0;
+        t.unscheduled = false;
+        t.task_id = timer_thread.schedule(
+            WheelTask::routine, &t,
+            butil::microseconds_to_timespec(t.expected_run_time));
+        ASSERT_NE(bthread::TimerThread::INVALID_TASK_ID, t.task_id);
+    }
+    // Beyond the range of the wheel.
+    WheelTask far_task = { 0, 0, 0, true };
+    const timespec future_time = { std::numeric_limits<int>::max(), 0 };
+    far_task.task_id = timer_thread.schedule(
+        WheelTask::routine, &far_task, future_time);
+    ASSERT_NE(bthread::TimerThread::INVALID_TASK_ID, far_task.task_id);
+    for (size_t i = 0; i < N; i += 3) {
+        if (timer_thread.unschedule(tasks[i].task_id) == 0) {
+            tasks[i].unscheduled = true;
+        }
+    }
+    usleep(2000000);
+    ASSERT_EQ(0, timer_thread.unschedule(far_task.task_id));
+    timer_thread.stop_and_join();
+
+    for (size_t i = 0; i < N; ++i) {
+        const WheelTask& t = tasks[i];
+        if (t.unscheduled) {
+            ASSERT_EQ(0, t.run_time) << "i=" << i;
+        } else {
+            ASSERT_GE(t.run_time, t.expected_run_time) << "i=" << i;
+            ASSERT_LE(t.run_time - t.expected_run_time, 50000) << "i=" << i;
+        }
+    }
+    ASSERT_EQ(0, far_task.run_time);
+}
+
+struct ChurnArgs {
+    bthread::TimerThread* timer_thread;
+    butil::atomic<bool>* stop;
+    size_t window;
+    size_t nop;
+};
+
+static void dummy_timer_fn(void*) {}
+
+// Keep `window' tasks pending, each new task cancels the oldest one, just
+// like timeouts of RPC which mostly succeed.
+static void* schedule_and_unschedule(void* void_arg) {
+    ChurnArgs* args = static_cast<ChurnArgs*>(void_arg);
+    std::vector<bthread::TimerThread::TaskId> ids(args->window, 0);
+    size_t i = 0;
+    for (; !args->stop->load(butil::memory_order_relaxed); ++i) {
+        bthread::TimerThread::TaskId& id = ids[i % ids.size()];
+        if (id != 0) {
+            args->timer_thread->unschedule(id);
+        }
+        id = args->timer_thread->schedule(
+            dummy_timer_fn, NULL, butil::milliseconds_from_now(
+                500 + butil::fast_rand_less_than(500)));
+    }
+    for (size_t j = 0; j < ids.size(); ++j) {
+        if (ids[j] != 0) {
+            args->timer_thread->unschedule(ids[j]);
+        }
+    }
+    args->nop = i;
+    return NULL;
+}
+
+TEST(TimerThreadTest, schedule_unschedule_churn) {
+    const int NTHREAD = 4;
+    const size_t WINDOW = 100000;
+    for (int use_wheel = 0; use_wheel < 2; ++use_wheel) {
+        bthread::TimerThreadOptions options;
+        options.use_timing_wheel = use_wheel;
+        bthread::TimerThread timer_thread;
+        ASSERT_EQ(0, timer_thread.start(&options));
+        clockid_t cid;
+        ASSERT_EQ(0, pthread_getcpuclockid(timer_thread.thread_id(), &cid));
+        timespec cpu_start;
+        ASSERT_EQ(0, clock_gettime(cid, &cpu_start));
+
+        butil::atomic<bool> stop(false);
+        pthread_t th[NTHREAD];
+        ChurnArgs args[NTHREAD];
+        butil::Timer tm;
+        tm.start();
+        for (int i = 0; i < NTHREAD; ++i) {
+            args[i].timer_thread = &timer_thread;
+            args[i].stop = &stop;
+            args[i].window = WINDOW;
+            args[i].nop = 0;
+            ASSERT_EQ(0, pthread_create(&th[i], NULL,
+                                        schedule_and_unschedule, &args[i]));
+        }
+        usleep(1000000);
+        stop.store(true);
+        size_t nop = 0;
+        for (int i = 0; i < NTHREAD; ++i) {
+            pthread_join(th[i], NULL);
+            nop += args[i].nop;
+        }
+        tm.stop();
+        timespec cpu_end;
+        ASSERT_EQ(0, clock_gettime(cid, &cpu_end));
+        timer_thread.stop_and_join();
+        LOG(INFO) << (use_wheel ? "timing wheel" : "heap")
+                  << ": pending=" << NTHREAD * WINDOW
+                  << " schedule+unschedule=" << nop * 1000 / tm.m_elapsed()
+                  << "/s timer_thread_cpu="
+                  << timespec_diff_us(cpu_end, cpu_start) / 1000 << "ms";
+    }
+}
+
 } // end namespace
@@ -419,6 +419,128 @@ TEST_F(BthreadTest, start_latency_when_high_idle) {
               << elp2 / REP << "ns";
 }
 
+void* add_to_counter(void* arg) {
+    static_cast<butil::atomic<int>*>(arg)->fetch_add(1, butil::memory_order_relaxed);
+    return NULL;
+}
+
+void* record_arg(void* arg) {
+    int* p = static_cast<int*>(arg);
+    *p = -*p;
+    return NULL;
+}
+
+TEST_F(BthreadTest, start_batch) {
+    const size_t N = 100;
+    bthread_t tids[N];
+    int values[N];
+    void* args[N];
+    for (size_t i = 0; i < N; ++i) {
+        values[i] = (int)i + 1;
+        args[i] = &values[i];
+    }
+    ASSERT_EQ(0, bthread_start_batch(tids, 0, NULL, record_arg, args));
+    ASSERT_EQ(EINVAL, bthread_start_batch(tids, N, NULL, NULL, args));
+    ASSERT_EQ(EINVAL, bthread_start_batch(NULL, N, NULL, record_arg, args));
+    ASSERT_EQ(0, bthread_start_batch(tids, N, NULL, record_arg, args));
+    for (size_t i = 0; i < N; ++i) {
+        ASSERT_NE(INVALID_BTHREAD, tids[i]);
+        ASSERT_EQ(0, bthread_join(tids[i], NULL));
+        ASSERT_EQ(-(int)i - 1, values[i]);
+    }
+
+    // NOSIGNAL batch is flushed by bthread_flush().
+    const bthread_attr_t attr = BTHREAD_ATTR_NORMAL | BTHREAD_NOSIGNAL;
+    ASSERT_EQ(0, bthread_start_batch(tids, N, &attr, record_arg, args));
+    bthread_flush();
+    for (size_t i = 0; i < N; ++i) {
+        ASSERT_EQ(0, bthread_join(tids[i], NULL));
+        ASSERT_EQ((int)i + 1, values[i]);
+    }
+}
+
+void* start_batch_in_bthread(void*) {
+    const size_t N = 64;
+    bthread_t tids[N];
+    int values[N];
+    void* args[N];
+    for (size_t i = 0; i < N; ++i) {
+        values[i] = (int)i + 1;
+        args[i] = &values[i];
+    }
+    EXPECT_EQ(0, bthread_start_batch(tids, N, NULL, record_arg, args));
+    for (size_t i = 0; i < N; ++i) {
+        EXPECT_EQ(0, bthread_join(tids[i], NULL));
+        EXPECT_EQ(-(int)i - 1, values[i]);
+    }
+    return NULL;
+}
+
+TEST_F(BthreadTest, start_batch_in_bthread) {
+    bthread_t th;
+    ASSERT_EQ(0, bthread_start_urgent(&th, NULL, start_batch_in_bthread, NULL));
+    ASSERT_EQ(0, bthread_join(th, NULL));
+}
+
+struct StartBatchPerfArgs {
+    size_t batch;
+    long loop_ns;
+    long batch_ns;
+};
+
+void* run_start_batch_perf(void* void_arg) {
+    StartBatchPerfArgs* a = static_cast<StartBatchPerfArgs*>(void_arg);
+    const int REP = 200;
+    const size_t N = a->batch;
+    std::vector<bthread_t> tids(N);
+    butil::atomic<int> counter(0);
+    std::vector<void*> args(N, &counter);
+    a->loop_ns = 0;
+    a->batch_ns = 0;
+    for (int r = 0; r < REP; ++r) {
+        butil::Timer tm;
+        tm.start();
+        for (size_t i = 0; i < N; ++i) {
+            bthread_start_background(&tids[i], NULL, add_to_counter, &counter);
+        }
+        tm.stop();
+        a->loop_ns += tm.n_elapsed();
+        for (size_t i = 0; i < N; ++i) {
+            bthread_join(tids[i], NULL);
+        }
+
+        tm.start();
+        bthread_start_batch(&tids[0], N, NULL, add_to_counter, &args[0]);
+        tm.stop();
+        a->batch_ns += tm.n_elapsed();
+        for (size_t i = 0; i < N; ++i) {
+            bthread_join(tids[i], NULL);
+        }
+    }
+    EXPECT_EQ(2 * REP * (int)N, counter.load());
+    a->loop_ns /= REP * N;
+    a->batch_ns /= REP * N;
+    return NULL;
+}
+
+TEST_F(BthreadTest, start_batch_performance) {
+    const size_t batches[] = { 8, 64, 512 };
+    for (size_t i = 0; i < ARRAY_SIZE(batches); ++i) {
+        StartBatchPerfArgs a = { batches[i], 0, 0 };
+        run_start_batch_perf(&a);
+        LOG(INFO) << "From pthread, batch=" << a.batch
+                  << " start_background=" << a.loop_ns
+                  << "ns start_batch=" << a.batch_ns << "ns";
+
+        bthread_t th;
+        ASSERT_EQ(0, bthread_start_urgent(&th, NULL, run_start_batch_perf, &a));
+        ASSERT_EQ(0, bthread_join(th, NULL));
+        LOG(INFO) << "From bthread, batch=" << a.batch
+                  << " start_background=" << a.loop_ns
+                  << "ns start_batch=" << a.batch_ns << "ns";
+    }
+}
+
 void* sleep_for_awhile_with_sleep(void* arg) {
     bthread_usleep((intptr_t)arg);
     return NULL;
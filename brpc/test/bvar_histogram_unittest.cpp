@@ -0,0 +1,260 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+#include <pthread.h>
+#include <sstream>
+#include <gtest/gtest.h>
+#include <gflags/gflags.h>
+#include "butil/time.h"
+#include "butil/fast_rand.h"
+#include "butil/logging.h"
+#include "bvar/bvar.h"
+
+namespace bvar {
+DECLARE_bool(bvar_latency_use_histogram);
+}
+
+namespace {
+
+using bvar::detail::HistogramSamples;
+using bvar::detail::HISTOGRAM_NUM_BUCKETS;
+using bvar::detail::histogram_bucket_index;
+using bvar::detail::histogram_bucket_lower_bound;
+using bvar::detail::histogram_bucket_upper_bound;
+
+class HistogramTest : public testing::Test {
+protected:
+    void SetUp() {}
+    void TearDown() {}
+};
+
+TEST_F(HistogramTest, bucket_layout) {
+    for (size_t i = 0; i < HISTOGRAM_NUM_BUCKETS; ++i) {
+        const int64_t lower = histogram_bucket_lower_bound(i);
+        const int64_t upper = histogram_bucket_upper_bound(i);
+        ASSERT_LE(lower, upper);
+        ASSERT_EQ(i, histogram_bucket_index(lower));
+        ASSERT_EQ(i, histogram_bucket_index(upper));
+        if (i + 1 < HISTOGRAM_NUM_BUCKETS) {
+            ASSERT_EQ(upper + 1, histogram_bucket_lower_bound(i + 1));
+            // Width of a bucket is at most 1/16 of its lower bound.
+            ASSERT_LE((upper - lower + 1) * 16, std::max(lower, (int64_t)16));
+        }
+    }
+    ASSERT_EQ(0UL, histogram_bucket_index(-1));
+    ASSERT_EQ(0xFFFFFFFFLL,
+              histogram_bucket_upper_bound(HISTOGRAM_NUM_BUCKETS - 1));
+    ASSERT_EQ(HISTOGRAM_NUM_BUCKETS - 1, histogram_bucket_index(1LL << 40));
+}
+
+TEST_F(HistogramTest, bounded_error) {
+    HistogramSamples s;
+    const int N = 100000;
+    for (int i = 1; i <= N; ++i) {
+        s.add(i);
+    }
+    ASSERT_EQ((uint64_t)N, s.count());
+    ASSERT_EQ((int64_t)N * (N + 1) / 2, s.sum());
+    const double ratios[] = { 0.1, 0.5, 0.8, 0.9, 0.99, 0.999, 0.9999, 1 };
+    for (size_t i = 0; i < ARRAY_SIZE(ratios); ++i) {
+        const double exact = ratios[i] * N;
+        const int64_t v = s.get_number(ratios[i]);
+        EXPECT_LE(fabs(v - exact), exact / 32 + 1) << "ratio=" << ratios[i];
+    }
+    ASSERT_EQ(0, HistogramSamples().get_number(0.99));
+}
+
+TEST_F(HistogramTest, merge_is_exact) {
+    HistogramSamples s1;
+    HistogramSamples s2;
+    HistogramSamples all;
+    for (int i = 0; i < 10000; ++i) {
+        const int64_t v = butil::fast_rand_less_than(1000000);
+        (i % 3 ? s1 : s2).add(v);
+        all.add(v);
+    }
+    HistogramSamples merged = s1;
+    merged.merge(s2);
+    ASSERT_TRUE(merged == all);
+    merged.remove(s2);
+    ASSERT_TRUE(merged == s1);
+}
+
+TEST_F(HistogramTest, describe_and_parse) {
+    HistogramSamples s;
+    s.add(0);
+    s.add(3);
+    s.add(3);
+    s.add(100);
+    s.add(1LL << 33);
+    std::ostringstream oss;
+    oss << s;
+    ASSERT_EQ("{\"count\":5,\"sum\":" + std::to_string(106 + (1LL << 33)) +
+              ",\"buckets\":[[0,1],[3,2],[103,1],[4294967295,1]]}", oss.str());
+    HistogramSamples s2;
+    ASSERT_EQ(0, s2.parse(oss.str()));
+    ASSERT_TRUE(s == s2);
+    // Histograms exported by different processes are mergeable.
+    s2.merge(s);
+    ASSERT_EQ(10UL, s2.count());
+    ASSERT_EQ(4UL, s2.bucket_count(histogram_bucket_index(3)));
+
+    HistogramSamples empty;
+    oss.str("");
+    oss << empty;
+    ASSERT_EQ("{\"count\":0,\"sum\":0,\"buckets\":[]}", oss.str());
+    ASSERT_EQ(0, s2.parse(oss.str()));
+    ASSERT_TRUE(s2 == empty);
+
+    ASSERT_EQ(-1, s2.parse(""));
+    ASSERT_EQ(-1, s2.parse("{\"count\":1,\"sum\":32,\"buckets\":[[32,1]]}"));
+    ASSERT_EQ(-1, s2.parse("{\"count\":2,\"sum\":3,\"buckets\":[[3,1]]}"));
+    ASSERT_EQ(-1, s2.parse("{\"count\":1,\"sum\":3,\"buckets\":[[3,1]]}x"));
+}
+
+struct AddArgs {
+    bvar::Histogram* h;
+    int n;
+};
+
+static void* add_values(void* arg) {
+    AddArgs* a = static_cast<AddArgs*>(arg);
+    for (int i = 1; i <= a->n; ++i) {
+        *a->h << i;
+    }
+    return NULL;
+}
+
+TEST_F(HistogramTest, histogram_variable) {
+    bvar::Histogram h("histogram_test_variable");
+    ASSERT_TRUE(h.valid());
+    const int N = 10000;
+    AddArgs args = { &h, N };
+    pthread_t th[8];
+    for (size_t i = 0; i < ARRAY_SIZE(th); ++i) {
+        ASSERT_EQ(0, pthread_create(&th[i], NULL, add_values, &args));
+    }
+    for (size_t i = 0; i < ARRAY_SIZE(th); ++i) {
+        ASSERT_EQ(0, pthread_join(th[i], NULL));
+    }
+    h << -1;  // dropped
+    HistogramSamples s = h.get_value();
+    ASSERT_EQ(ARRAY_SIZE(th) * N, s.count());
+    ASSERT_EQ((int64_t)ARRAY_SIZE(th) * N * (N + 1) / 2, s.sum());
+    ASSERT_LE(labs(h.get_number(0.5) - N / 2), N / 2 / 32 + 1);
+
+    // Exposed value is parsable.
+    const std::string desc =
+        bvar::Variable::describe_exposed("histogram_test_variable");
+    HistogramSamples parsed;
+    ASSERT_EQ(0, parsed.parse(desc));
+    ASSERT_TRUE(parsed == s);
+
+    HistogramSamples prev = h.reset();
+    ASSERT_TRUE(prev == s);
+    ASSERT_EQ(0UL, h.get_value().count());
+}
+
+TEST_F(HistogramTest, window) {
+    bvar::Histogram h;
+    bvar::Window<bvar::Histogram> w(&h, 2);
+    for (int i = 0; i < 1000; ++i) {
+        h << 10;
+    }
+    usleep(2200000);
+    for (int i = 0; i < 1000; ++i) {
+        h << 1000;
+    }
+    usleep(1100000);
+    // Values added 2 seconds ago are out of the window.
+    HistogramSamples s = w.get_value();
+    ASSERT_EQ(1000UL, s.count());
+    ASSERT_EQ(1000 * 1000, s.sum());
+    ASSERT_EQ(2000UL, h.get_value().count());
+}
+
+TEST_F(HistogramTest, latency_recorder) {
+    bvar::FLAGS_bvar_latency_use_histogram = true;
+    bvar::LatencyRecorder rec("histogram_test_recorder", 2);
+    bvar::FLAGS_bvar_latency_use_histogram = false;
+    for (int i = 1; i <= 10000; ++i) {
+        rec << i;
+    }
+    usleep(1100000);
+    ASSERT_LE(labs(rec.latency_percentile(0.9999) - 9999), 9999 / 32 + 1);
+    bvar::Vector<int64_t, 4> v = rec.latency_percentiles();
+    ASSERT_LE(labs(v[3] - 9990), 9990 / 32 + 1);
+    const std::string desc = bvar::Variable::describe_exposed(
+        "histogram_test_recorder_latency_histogram");
+    HistogramSamples parsed;
+    ASSERT_EQ(0, parsed.parse(desc));
+    ASSERT_EQ(10000UL, parsed.count());
+    rec.hide();
+    ASSERT_EQ("", bvar::Variable::describe_exposed(
+                  "histogram_test_recorder_latency_histogram"));
+}
+
+template <typename T>
+struct PerfArgs {
+    T* recorder;
+    int64_t cost_ns;
+};
+
+template <typename T>
+static void* record_for_perf(void* void_arg) {
+    PerfArgs<T>* a = static_cast<PerfArgs<T>*>(void_arg);
+    const int N = 1000000;
+    butil::Timer tm;
+    tm.start();
+    for (int i = 0; i < N; ++i) {
+        *a->recorder << (i & 0xFFFF);
+    }
+    tm.stop();
+    a->cost_ns = tm.n_elapsed() / N;
+    return NULL;
+}
+
+template <typename T>
+static int64_t perf_record(T* recorder, size_t nthread) {
+    std::vector<pthread_t> th(nthread);
+    std::vector<PerfArgs<T> > args(nthread);
+    for (size_t i = 0; i < nthread; ++i) {
+        args[i].recorder = recorder;
+        EXPECT_EQ(0, pthread_create(&th[i], NULL, record_for_perf<T>, &args[i]));
+    }
+    int64_t cost_ns = 0;
+    for (size_t i = 0; i < nthread; ++i) {
+        pthread_join(th[i], NULL);
+        cost_ns += args[i].cost_ns;
+    }
+    return cost_ns / nthread;
+}
+
+TEST_F(HistogramTest, performance) {
+    const size_t nthreads[] = { 1, 4, 8 };
+    for (size_t i = 0; i < ARRAY_SIZE(nthreads); ++i) {
+        bvar::detail::Percentile p;
+        bvar::Histogram h;
+        const int64_t percentile_ns = perf_record(&p, nthreads[i]);
+        const int64_t histogram_ns = perf_record(&h, nthreads[i]);
+        LOG(INFO) << "nthread=" << nthreads[i]
+                  << " Percentile=" << percentile_ns
+                  << "ns Histogram=" << histogram_ns << "ns";
+    }
+}
+
+}  // namespace
@@ -0,0 +1,171 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+#include <inttypes.h>                  // PRId64
+#include <pthread.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <gtest/gtest.h>
+#include "butil/iobuf.h"
+#include "butil/iobuf_arena.h"
+#include "butil/logging.h"
+#include "butil/time.h"
+
+namespace butil {
+namespace iobuf {
+extern void* (*blockmem_allocate)(size_t);
+extern void (*blockmem_deallocate)(void*);
+extern void remove_tls_block_chain();
+}
+}
+
+namespace {
+
+// The arena can't be disabled once enabled, which affects other tests in
+// the same process, so each test runs in a forked process.
+
+void* free_blocks(void* arg) {
+    std::vector<void*>* blocks = (std::vector<void*>*)arg;
+    for (size_t i = 0; i < blocks->size(); ++i) {
+        butil::iobuf::blockmem_deallocate((*blocks)[i]);
+    }
+    return NULL;
+}
+
+void run_sanity() {
+    // Allocated by malloc before enabling the arena.
+    void* malloced = butil::iobuf::blockmem_allocate(butil::IOBuf::DEFAULT_BLOCK_SIZE);
+    CHECK(malloced);
+
+    CHECK_EQ(0, butil::iobuf::enable_arena_allocator());
+    CHECK(butil::iobuf::is_arena_allocator_enabled());
+    CHECK_EQ(0, butil::iobuf::enable_arena_allocator());
+    CHECK_GE(butil::iobuf::arena_node_count(), 1);
+    butil::iobuf::blockmem_deallocate(malloced);
+
+    butil::iobuf::ArenaStat stat0;
+    butil::iobuf::get_arena_stat(-1, &stat0);
+    {
+        butil::IOBuf buf;
+        std::string data(1024 * 1024, 'x');
+        buf.append(data);
+        butil::iobuf::ArenaStat stat;
+        butil::iobuf::get_arena_stat(-1, &stat);
+        CHECK_GE(stat.carved_bytes, data.size());
+        CHECK_GE(stat.used_bytes, stat0.used_bytes + data.size());
+        CHECK_EQ(stat0.fallback_count, stat.fallback_count);
+        CHECK_EQ(data, buf.to_string());
+    }
+
+    // Freed blocks are reused.
+    void* b1 = butil::iobuf::blockmem_allocate(butil::IOBuf::LARGE_BLOCK_SIZE);
+    butil::iobuf::blockmem_deallocate(b1);
+    void* b2 = butil::iobuf::blockmem_allocate(butil::IOBuf::LARGE_BLOCK_SIZE);
+    CHECK_EQ(b1, b2);
+    butil::iobuf::blockmem_deallocate(b2);
+
+    // Sizes out of classes are allocated by malloc.
+    void* b3 = butil::iobuf::blockmem_allocate(4000);
+    CHECK(b3);
+    butil::iobuf::ArenaStat stat;
+    butil::iobuf::get_arena_stat(-1, &stat);
+    CHECK_EQ(stat0.fallback_count + 1, stat.fallback_count);
+    butil::iobuf::blockmem_deallocate(b3);
+
+    // Blocks freed by other threads go back to the arena.
+    std::vector<void*> blocks;
+    for (int i = 0; i < 1000; ++i) {
+        blocks.push_back(butil::iobuf::blockmem_allocate(
+                             butil::IOBuf::SMALL_BLOCK_SIZE));
+        memset(blocks.back(), 0, butil::IOBuf::SMALL_BLOCK_SIZE);
+    }
+    pthread_t th;
+    CHECK_EQ(0, pthread_create(&th, NULL, free_blocks, &blocks));
+    CHECK_EQ(0, pthread_join(th, NULL));
+    butil::iobuf::remove_tls_block_chain();
+    butil::iobuf::get_arena_stat(-1, &stat);
+    // Only blocks cached by this thread are counted as used.
+    CHECK_LE(stat.used_bytes, 64 * butil::IOBuf::LARGE_BLOCK_SIZE);
+    exit(0);
+}
+
+TEST(IOBufArenaTest, sanity) {
+    EXPECT_EXIT(run_sanity(), ::testing::ExitedWithCode(0), "");
+}
+
+struct PerfArgs {
+    size_t block_size;
+    int rounds;
+    int64_t elapsed_ns;
+};
+
+void* alloc_and_free(void* arg) {
+    PerfArgs* args = (PerfArgs*)arg;
+    const int BATCH = 32;
+    void* blocks[BATCH];
+    butil::Timer tm;
+    tm.start();
+    for (int i = 0; i < args->rounds; ++i) {
+        for (int j = 0; j < BATCH; ++j) {
+            blocks[j] = butil::iobuf::blockmem_allocate(args->block_size);
+            *(char*)blocks[j] = 0;
+        }
+        for (int j = 0; j < BATCH; ++j) {
+            butil::iobuf::blockmem_deallocate(blocks[j]);
+        }
+    }
+    tm.stop();
+    args->elapsed_ns = tm.n_elapsed();
+    return NULL;
+}
+
+void run_perf(const char* name) {
+    const int NTHREAD = 4;
+    const int ROUNDS = 20000;
+    const size_t sizes[] = { butil::IOBuf::DEFAULT_BLOCK_SIZE,
+                             butil::IOBuf::LARGE_BLOCK_SIZE };
+    for (size_t i = 0; i < arraysize(sizes); ++i) {
+        PerfArgs args[NTHREAD];
+        pthread_t th[NTHREAD];
+        for (int j = 0; j < NTHREAD; ++j) {
+            args[j].block_size = sizes[i];
+            args[j].rounds = ROUNDS;
+            CHECK_EQ(0, pthread_create(&th[j], NULL, alloc_and_free, &args[j]));
+        }
+        int64_t elapsed_ns = 0;
+        for (int j = 0; j < NTHREAD; ++j) {
+            CHECK_EQ(0, pthread_join(th[j], NULL));
+            elapsed_ns += args[j].elapsed_ns;
+        }
+        printf("%s: alloc+free of %zu-byte blocks takes %" PRId64 "ns\n",
+               name, sizes[i], elapsed_ns / NTHREAD / ROUNDS / 32);
+    }
+    exit(0);
+}
+
+void run_arena_perf() {
+    CHECK_EQ(0, butil::iobuf::enable_arena_allocator());
+    run_perf("arena");
+}
+
+TEST(IOBufArenaTest, performance) {
+    EXPECT_EXIT(run_perf("malloc"), ::testing::ExitedWithCode(0), "");
+    EXPECT_EXIT(run_arena_perf(), ::testing::ExitedWithCode(0), "");
+}
+
+}  // namespace
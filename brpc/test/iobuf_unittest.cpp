@@ -22,6 +22,7 @@
 #include <fcntl.h>                     // O_RDONLY
 #include <stdlib.h>
 #include <memory>
+#include <gflags/gflags.h>
 #include <butil/files/temp_file.h>      // TempFile
 #include <butil/containers/flat_map.h>
 #include <butil/macros.h>
@@ -39,6 +40,9 @@
 #endif   // BAZEL_TEST
 
 namespace butil {
+DECLARE_int32(iobuf_max_blocks_per_thread);
+DECLARE_bool(iobuf_portal_adaptive_block_size);
+DECLARE_int32(iobuf_portal_max_recycled_blocks);
 namespace iobuf {
 extern void* (*blockmem_allocate)(size_t);
 extern void (*blockmem_deallocate)(void*);
@@ -1341,6 +1345,271 @@ TEST_F(IOBufTest, append_from_fd_with_offset) {
 
 }
 
+// Write `size' bytes into pipe `fds' and read them back with `portal'.
+static void read_message_from_pipe(int fds[2], butil::IOPortal* portal,
+                                   const char* data, size_t size,
+                                   butil::IOBuf* msg) {
+    ASSERT_EQ((ssize_t)size, write(fds[1], data, size));
+    size_t nr = 0;
+    while (nr < size) {
+        const ssize_t rc = portal->append_from_file_descriptor(fds[0], size - nr);
+        ASSERT_GT(rc, 0) << berror();
+        nr += rc;
+    }
+    portal->cutn(msg, size);
+    // Like InputMessenger after cutting all messages.
+    portal->return_cached_blocks();
+}
+
+TEST_F(IOBufTest, adaptive_block_size_of_portal) {
+    int fds[2];
+    ASSERT_EQ(0, pipe(fds));
+    butil::FLAGS_iobuf_portal_adaptive_block_size = true;
+    char data[48 * 1024];
+    memset(data, 'a', sizeof(data));
+    {
+        butil::IOPortal portal;
+        butil::IOBuf msg;
+        for (int i = 0; i < 64; ++i) {
+            msg.clear();
+            read_message_from_pipe(fds, &portal, data, 100, &msg);
+        }
+        ASSERT_EQ(butil::IOBuf::SMALL_BLOCK_SIZE - BLOCK_OVERHEAD,
+                  butil::iobuf::block_cap(msg._front_ref().block));
+        for (int i = 0; i < 64; ++i) {
+            msg.clear();
+            read_message_from_pipe(fds, &portal, data, sizeof(data), &msg);
+        }
+        ASSERT_EQ(butil::IOBuf::LARGE_BLOCK_SIZE - BLOCK_OVERHEAD,
+                  butil::iobuf::block_cap(msg._back_ref().block));
+        for (int i = 0; i < 64; ++i) {
+            msg.clear();
+            read_message_from_pipe(fds, &portal, data, 4096, &msg);
+        }
+        ASSERT_EQ(DEFAULT_PAYLOAD, butil::iobuf::block_cap(msg._back_ref().block));
+    }
+    butil::FLAGS_iobuf_portal_adaptive_block_size = false;
+    // Not mixed with blocks of other classes.
+    for (butil::IOBuf::Block* p = butil::iobuf::get_tls_block_head();
+         p != NULL; p = butil::iobuf::get_portal_next(p)) {
+        ASSERT_EQ(DEFAULT_PAYLOAD, butil::iobuf::block_cap(p));
+    }
+    butil::iobuf::remove_tls_block_chain();
+    close(fds[0]);
+    close(fds[1]);
+}
+
+TEST_F(IOBufTest, tls_block_hit_and_max_blocks_per_thread) {
+    butil::iobuf::remove_tls_block_chain();
+    const size_t nmiss0 = butil::IOBuf::tls_block_miss_count();
+    const size_t nhit0 = butil::IOBuf::tls_block_hit_count();
+    const int32_t saved_max_blocks = butil::FLAGS_iobuf_max_blocks_per_thread;
+    butil::FLAGS_iobuf_max_blocks_per_thread = 2;
+    const size_t nthreshold0 = butil::IOBuf::block_count_hit_tls_threshold();
+    butil::IOBuf::Block* b[4];
+    for (size_t i = 0; i < arraysize(b); ++i) {
+        b[i] = butil::iobuf::acquire_tls_block();
+        ASSERT_TRUE(b[i]);
+    }
+    for (size_t i = 0; i < arraysize(b); ++i) {
+        butil::iobuf::release_tls_block_chain(b[i]);
+    }
+    ASSERT_EQ(2, butil::iobuf::get_tls_block_count());
+    ASSERT_EQ(nthreshold0 + 2, butil::IOBuf::block_count_hit_tls_threshold());
+    for (int i = 0; i < 200; ++i) {
+        butil::IOBuf::Block* p = butil::iobuf::acquire_tls_block();
+        butil::iobuf::release_tls_block_chain(p);
+    }
+    butil::FLAGS_iobuf_max_blocks_per_thread = saved_max_blocks;
+    // Counters are flushed from TLS periodically.
+    butil::iobuf::remove_tls_block_chain();
+    ASSERT_EQ(nmiss0 + 4, butil::IOBuf::tls_block_miss_count());
+    ASSERT_EQ(nhit0 + 200, butil::IOBuf::tls_block_hit_count());
+}
+
+TEST_F(IOBufTest, adaptive_block_size_perf) {
+    butil::iobuf::reset_blockmem_allocate_and_deallocate();
+    int fds[2];
+    ASSERT_EQ(0, pipe(fds));
+    static char data[60 * 1024];
+    const struct {
+        const char* name;
+        size_t min_size;
+        size_t max_size;
+    } dists[] = {
+        { "small", 64, 900 },
+        { "medium", 2048, 8192 },
+        { "large", 40 * 1024, sizeof(data) },
+        { "mixed", 64, sizeof(data) },
+    };
+    const int N = 10000;
+    for (size_t i = 0; i < arraysize(dists); ++i) {
+        for (int adaptive = 0; adaptive < 2; ++adaptive) {
+            butil::FLAGS_iobuf_portal_adaptive_block_size = adaptive;
+            const size_t nhit0 = butil::IOBuf::tls_block_hit_count();
+            const size_t nmiss0 = butil::IOBuf::tls_block_miss_count();
+            butil::IOPortal portal;
+            butil::IOBuf msg;
+            size_t nblock = 0;
+            size_t nbytes = 0;
+            butil::Timer tm;
+            tm.start();
+            for (int j = 0; j < N; ++j) {
+                const size_t size = dists[i].min_size + butil::fast_rand_less_than(
+                    dists[i].max_size - dists[i].min_size + 1);
+                msg.clear();
+                read_message_from_pipe(fds, &portal, data, size, &msg);
+                nblock += msg.backing_block_num();
+                nbytes += size;
+            }
+            tm.stop();
+            portal.clear();
+            butil::iobuf::remove_tls_block_chain();
+            const size_t nhit = butil::IOBuf::tls_block_hit_count() - nhit0;
+            const size_t nmiss = butil::IOBuf::tls_block_miss_count() - nmiss0;
+            LOG(INFO) << dists[i].name << " adaptive=" << adaptive
+                      << ": " << tm.n_elapsed() / N << "ns/msg "
+                      << (double)nbytes / tm.n_elapsed() * 1000 << "MB/s "
+                      << (double)nblock / N << " blocks/msg"
+                      << " tls_hit_ratio=" << (double)nhit / (nhit + nmiss);
+        }
+    }
+    butil::FLAGS_iobuf_portal_adaptive_block_size = false;
+    close(fds[0]);
+    close(fds[1]);
+}
+
+TEST_F(IOBufTest, read_budget_of_portal) {
+    int fds[2];
+    ASSERT_EQ(0, pipe(fds));
+    static char data[64 * 1024];
+    butil::IOPortal portal;
+    ASSERT_EQ((ssize_t)sizeof(data), write(fds[1], data, sizeof(data)));
+    // The budget doubles when reads fill it.
+    const ssize_t expected[] = { 4096, 8192, 16384, 32768, 4096 };
+    for (size_t i = 0; i < arraysize(expected); ++i) {
+        ASSERT_EQ(expected[i], portal.append_from_socket(
+                      fds[0], 1024 * 1024));
+    }
+    ASSERT_EQ(sizeof(data), portal.size());
+    portal.clear();
+    // And shrinks after short reads.
+    for (int i = 0; i < 8; ++i) {
+        ASSERT_EQ(100, write(fds[1], data, 100));
+        ASSERT_EQ(100, portal.append_from_socket(fds[0], 1024 * 1024));
+    }
+    portal.clear();
+    ASSERT_EQ((ssize_t)sizeof(data), write(fds[1], data, sizeof(data)));
+    ASSERT_EQ((ssize_t)butil::IOBuf::SMALL_BLOCK_SIZE,
+              portal.append_from_socket(fds[0], 1024 * 1024));
+    // Never exceeds `max_count'.
+    ASSERT_EQ(10, portal.append_from_socket(fds[0], 10));
+    close(fds[0]);
+    close(fds[1]);
+}
+
+TEST_F(IOBufTest, read_whole_file_without_budget) {
+    butil::TempFile file;
+    char data[64 * 1024];
+    for (size_t i = 0; i < sizeof(data); ++i) {
+        data[i] = 'a' + i % 26;
+    }
+    ASSERT_EQ(0, file.save_bin(data, sizeof(data)));
+    butil::fd_guard fd(open(file.fname(), O_RDONLY));
+    ASSERT_TRUE(fd >= 0) << file.fname() << ' ' << berror();
+    // Budgets of sockets don't apply to append_from_file_descriptor(), which
+    // reads the file in one call like what /pprof/profile does.
+    butil::IOPortal portal;
+    ASSERT_EQ((ssize_t)sizeof(data),
+              portal.append_from_file_descriptor(fd, ULONG_MAX));
+    ASSERT_EQ(0, portal.append_from_file_descriptor(fd, ULONG_MAX));
+    ASSERT_EQ(std::string(data, sizeof(data)), portal.to_string());
+}
+
+TEST_F(IOBufTest, recycled_blocks_of_portal) {
+    int fds[2];
+    ASSERT_EQ(0, pipe(fds));
+    static char data[5000];
+    const int32_t saved_max_recycled = butil::FLAGS_iobuf_portal_max_recycled_blocks;
+    for (int max_recycled = 0; max_recycled <= 4; max_recycled += 4) {
+        butil::FLAGS_iobuf_portal_max_recycled_blocks = max_recycled;
+        butil::iobuf::remove_tls_block_chain();
+        const size_t nmiss0 = butil::IOBuf::tls_block_miss_count();
+        butil::IOPortal portal;
+        // A byte is always left in the portal, so that cached blocks are
+        // not returned to TLS like what happens to pipelined messages.
+        portal.append("x", 1);
+        const int N = 1000;
+        for (int i = 0; i < N; ++i) {
+            ASSERT_EQ((ssize_t)sizeof(data), write(fds[1], data, sizeof(data)));
+            size_t nr = 0;
+            while (nr < sizeof(data)) {
+                const ssize_t rc = portal.append_from_file_descriptor(
+                    fds[0], sizeof(data) - nr);
+                ASSERT_GT(rc, 0) << berror();
+                nr += rc;
+            }
+            butil::IOBuf msg;
+            portal.cutn(&msg, sizeof(data));
+        }
+        portal.clear();
+        butil::iobuf::remove_tls_block_chain();
+        const size_t nmiss = butil::IOBuf::tls_block_miss_count() - nmiss0;
+        LOG(INFO) << "max_recycled=" << max_recycled << ": " << nmiss
+                  << " blocks allocated for " << N << " messages";
+        if (max_recycled == 0) {
+            ASSERT_GT(nmiss, (size_t)N / 2);
+        } else {
+            // Full blocks are reused after messages inside are destroyed.
+            ASSERT_LE(nmiss, (size_t)max_recycled + 1);
+        }
+    }
+    butil::FLAGS_iobuf_portal_max_recycled_blocks = saved_max_recycled;
+    close(fds[0]);
+    close(fds[1]);
+}
+
+TEST_F(IOBufTest, memory_of_idle_portals) {
+    butil::iobuf::remove_tls_block_chain();
+    const int N = 400;
+    std::vector<int> fds(N * 2);
+    for (int i = 0; i < N; ++i) {
+        ASSERT_EQ(0, pipe(&fds[i * 2]));
+        ASSERT_EQ(0, butil::make_non_blocking(fds[i * 2]));
+    }
+    char data[100];
+    memset(data, 'a', sizeof(data));
+    std::vector<butil::IOPortal> portals(N);
+    for (int return_on_idle = 0; return_on_idle < 2; ++return_on_idle) {
+        const size_t mem0 = butil::IOBuf::block_memory();
+        for (int i = 0; i < N; ++i) {
+            // Half of a message arrives and the connection becomes idle.
+            ASSERT_EQ(100, write(fds[i * 2 + 1], data, sizeof(data)));
+            ASSERT_EQ(100, portals[i].append_from_socket(
+                          fds[i * 2], 1024 * 1024));
+            ASSERT_EQ(-1, portals[i].append_from_socket(
+                          fds[i * 2], 1024 * 1024));
+            ASSERT_EQ(EAGAIN, errno);
+            if (return_on_idle) {
+                portals[i].return_cached_blocks();
+            }
+        }
+        const size_t mem = butil::IOBuf::block_memory() - mem0;
+        LOG(INFO) << "return_on_idle=" << return_on_idle << ": "
+                  << mem / N << " bytes of blocks per idle portal";
+        if (return_on_idle) {
+            ASSERT_LT(mem / N, (size_t)butil::IOBuf::SMALL_BLOCK_SIZE);
+        }
+        for (int i = 0; i < N; ++i) {
+            portals[i].clear();
+        }
+        butil::iobuf::remove_tls_block_chain();
+    }
+    for (int i = 0; i < N * 2; ++i) {
+        close(fds[i]);
+    }
+}
+
 static butil::atomic<int> s_nthread(0);
 static long number_per_thread = 1024;
 
@@ -0,0 +1,259 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+#include <pthread.h>
+#include <gtest/gtest.h>
+#include "butil/containers/mpmc_bounded_queue.h"
+#include "butil/containers/bounded_queue.h"
+#include "butil/synchronization/lock.h"
+#include "butil/scoped_lock.h"
+#include "butil/time.h"
+#include "butil/logging.h"
+
+namespace {
+
+TEST(MPMCBoundedQueueTest, sanity) {
+    butil::MPMCBoundedQueue<int> q;
+    ASSERT_EQ(0ul, q.capacity());
+    ASSERT_EQ(0, q.init(30));
+    ASSERT_EQ(-1, q.init(30));
+    ASSERT_EQ(32ul, q.capacity());
+    ASSERT_TRUE(q.empty());
+    int v = 0;
+    ASSERT_FALSE(q.pop(&v));
+    for (int round = 0; round < 3; ++round) {
+        for (int i = 0; i < 32; ++i) {
+            ASSERT_TRUE(q.push(i));
+        }
+        ASSERT_FALSE(q.push(32));
+        ASSERT_EQ(32ul, q.size());
+        for (int i = 0; i < 32; ++i) {
+            ASSERT_TRUE(q.pop(&v));
+            ASSERT_EQ(i, v);
+        }
+        ASSERT_FALSE(q.pop(&v));
+        ASSERT_TRUE(q.empty());
+    }
+}
+
+struct Counted {
+    static int nalive;
+    Counted() { ++nalive; }
+    Counted(const Counted&) { ++nalive; }
+    Counted& operator=(const Counted&) { return *this; }
+    ~Counted() { --nalive; }
+};
+int Counted::nalive = 0;
+
+TEST(MPMCBoundedQueueTest, destroy_remaining_elements) {
+    {
+        butil::MPMCBoundedQueue<Counted> q;
+        ASSERT_EQ(0, q.init(8));
+        Counted c;
+        for (int i = 0; i < 5; ++i) {
+            ASSERT_TRUE(q.push(c));
+        }
+        ASSERT_TRUE(q.pop(&c));
+        ASSERT_EQ(5, Counted::nalive);
+    }
+    ASSERT_EQ(0, Counted::nalive);
+}
+
+const size_t PER_PRODUCER = 200000;
+
+struct MPMCArgs {
+    butil::MPMCBoundedQueue<uint64_t>* q;
+    butil::atomic<size_t>* npopped;
+    size_t total;
+    uint64_t id;
+    uint64_t sum;
+};
+
+void* mpmc_produce(void* void_arg) {
+    MPMCArgs* args = (MPMCArgs*)void_arg;
+    for (uint64_t i = 1; i <= PER_PRODUCER; ++i) {
+        while (!args->q->push((args->id << 32) | i)) {
+            sched_yield();
+        }
+    }
+    return NULL;
+}
+
+void* mpmc_consume(void* void_arg) {
+    MPMCArgs* args = (MPMCArgs*)void_arg;
+    args->sum = 0;
+    uint64_t v;
+    while (args->npopped->load(butil::memory_order_relaxed) < args->total) {
+        if (args->q->pop(&v)) {
+            args->sum += (v & 0xFFFFFFFF);
+            args->npopped->fetch_add(1, butil::memory_order_relaxed);
+        } else {
+            sched_yield();
+        }
+    }
+    return NULL;
+}
+
+TEST(MPMCBoundedQueueTest, mpmc_multi_thread) {
+    const int NPRODUCER = 4;
+    const int NCONSUMER = 4;
+    butil::MPMCBoundedQueue<uint64_t> q;
+    ASSERT_EQ(0, q.init(1024));
+    butil::atomic<size_t> npopped(0);
+    MPMCArgs pargs[NPRODUCER];
+    MPMCArgs cargs[NCONSUMER];
+    pthread_t producers[NPRODUCER];
+    pthread_t consumers[NCONSUMER];
+    for (int i = 0; i < NCONSUMER; ++i) {
+        cargs[i].q = &q;
+        cargs[i].npopped = &npopped;
+        cargs[i].total = NPRODUCER * PER_PRODUCER;
+        ASSERT_EQ(0, pthread_create(&consumers[i], NULL, mpmc_consume, &cargs[i]));
+    }
+    for (int i = 0; i < NPRODUCER; ++i) {
+        pargs[i].q = &q;
+        pargs[i].id = i;
+        ASSERT_EQ(0, pthread_create(&producers[i], NULL, mpmc_produce, &pargs[i]));
+    }
+    uint64_t sum = 0;
+    for (int i = 0; i < NPRODUCER; ++i) {
+        pthread_join(producers[i], NULL);
+    }
+    for (int i = 0; i < NCONSUMER; ++i) {
+        pthread_join(consumers[i], NULL);
+        sum += cargs[i].sum;
+    }
+    ASSERT_EQ(NPRODUCER * PER_PRODUCER, npopped.load());
+    ASSERT_EQ(NPRODUCER * PER_PRODUCER * (PER_PRODUCER + 1) / 2, sum);
+    ASSERT_TRUE(q.empty());
+}
+
+// The queue used by RemoteTaskQueue before, for comparison.
+class LockedBoundedQueue {
+public:
+    int init(size_t cap) {
+        const size_t memsize = sizeof(uint64_t) * cap;
+        void* mem = malloc(memsize);
+        if (mem == NULL) {
+            return -1;
+        }
+        butil::BoundedQueue<uint64_t> q(mem, memsize, butil::OWNS_STORAGE);
+        _q.swap(q);
+        return 0;
+    }
+    bool push(uint64_t v) {
+        BAIDU_SCOPED_LOCK(_mutex);
+        return _q.push(v);
+    }
+    bool pop(uint64_t* v) {
+        if (_q.empty()) {
+            return false;
+        }
+        BAIDU_SCOPED_LOCK(_mutex);
+        return _q.pop(v);
+    }
+private:
+    butil::BoundedQueue<uint64_t> _q;
+    butil::Mutex _mutex;
+};
+
+template <typename Queue>
+struct BenchArgs {
+    Queue* q;
+    butil::atomic<bool>* stop;
+    size_t nop;
+};
+
+template <typename Queue>
+void* bench_produce(void* void_arg) {
+    BenchArgs<Queue>* args = (BenchArgs<Queue>*)void_arg;
+    size_t n = 0;
+    while (!args->stop->load(butil::memory_order_relaxed)) {
+        if (args->q->push(n)) {
+            ++n;
+        } else {
+            sched_yield();
+        }
+    }
+    args->nop = n;
+    return NULL;
+}
+
+template <typename Queue>
+void* bench_consume(void* void_arg) {
+    BenchArgs<Queue>* args = (BenchArgs<Queue>*)void_arg;
+    size_t n = 0;
+    uint64_t v;
+    while (!args->stop->load(butil::memory_order_relaxed)) {
+        if (args->q->pop(&v)) {
+            ++n;
+        } else {
+            sched_yield();
+        }
+    }
+    args->nop = n;
+    return NULL;
+}
+
+// Pushed items per second with `nproducer' threads pushing and 2 threads
+// popping, like pthreads starting bthreads to a TaskGroup whose worker and
+// a stealing worker pop concurrently.
+template <typename Queue>
+size_t bench_contention(int nproducer) {
+    const int NCONSUMER = 2;
+    Queue q;
+    EXPECT_EQ(0, q.init(2048));
+    butil::atomic<bool> stop(false);
+    std::vector<BenchArgs<Queue> > args(nproducer + NCONSUMER);
+    std::vector<pthread_t> threads(nproducer + NCONSUMER);
+    for (int i = 0; i < nproducer + NCONSUMER; ++i) {
+        args[i].q = &q;
+        args[i].stop = &stop;
+        args[i].nop = 0;
+        EXPECT_EQ(0, pthread_create(&threads[i], NULL,
+                                    i < nproducer ? bench_produce<Queue>
+                                    : bench_consume<Queue>, &args[i]));
+    }
+    butil::Timer tm;
+    tm.start();
+    usleep(300000);
+    stop.store(true);
+    size_t npushed = 0;
+    for (int i = 0; i < nproducer + NCONSUMER; ++i) {
+        pthread_join(threads[i], NULL);
+        if (i < nproducer) {
+            npushed += args[i].nop;
+        }
+    }
+    tm.stop();
+    return npushed * 1000000 / tm.u_elapsed();
+}
+
+TEST(MPMCBoundedQueueTest, contention_against_locked_queue) {
+    const int nproducers[] = { 1, 2, 4, 8, 16 };
+    for (size_t i = 0; i < arraysize(nproducers); ++i) {
+        const size_t lockfree_qps =
+            bench_contention<butil::MPMCBoundedQueue<uint64_t> >(nproducers[i]);
+        const size_t locked_qps =
+            bench_contention<LockedBoundedQueue>(nproducers[i]);
+        LOG(INFO) << "nproducer=" << nproducers[i]
+                  << " lock-free=" << lockfree_qps << "/s"
+                  << " mutex+BoundedQueue=" << locked_qps << "/s";
+    }
+}
+
+} // namespace
@@ -38,8 +38,8 @@ DEFINE_string(connection_type, "", "Type of connections: single, pooled, short")
 DEFINE_int32(timeout_ms, 1000, "RPC timeout in milliseconds");
 DEFINE_int32(connection_timeout_ms, 500, " connection timeout in milliseconds");
 DEFINE_int32(max_retry, 3, "Maximum retry times by RPC framework");
-DEFINE_int32(request_compress_type, 0, "Snappy:1 Gzip:2 Zlib:3 LZ4:4 None:0");
-DEFINE_int32(response_compress_type, 0, "Snappy:1 Gzip:2 Zlib:3 LZ4:4 None:0");
+DEFINE_int32(request_compress_type, 0, "Snappy:1 Gzip:2 Zlib:3 LZ4:4 Zstd:5 None:0");
+DEFINE_int32(response_compress_type, 0, "Snappy:1 Gzip:2 Zlib:3 LZ4:4 Zstd:5 None:0");
 DEFINE_int32(attachment_size, 0, "Carry so many byte attachment along with requests"); 
 DEFINE_int32(duration, 0, "how many seconds the press keep");
 DEFINE_int32(qps, 100 , "how many calls  per seconds");
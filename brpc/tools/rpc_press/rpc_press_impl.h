@@ -48,8 +48,8 @@ struct PressOptions {
     int timeout_ms; // RPC timeout in milliseconds
     int max_retry; // Maximum retry times by RPC framework
     std::string protocol;
-    int request_compress_type; // Snappy:1 Gzip:2 Zlib:3 LZ4:4 None:0
-    int response_compress_type; // Snappy:1 Gzip:2 Zlib:3 LZ4:4 None:0
+    int request_compress_type; // Snappy:1 Gzip:2 Zlib:3 LZ4:4 Zstd:5 None:0
+    int response_compress_type; // Snappy:1 Gzip:2 Zlib:3 LZ4:4 Zstd:5 None:0
     int attachment_size; // Snappy:1 Gzip:2 Zlib:3 LZ4:4 None:0
     bool auth;// Enable Giano authentication
     std::string auth_group;